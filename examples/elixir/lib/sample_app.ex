@@ -7,7 +7,7 @@ defmodule SampleApp do
   - Opens the native port driver (`SampleApp.Port`)
   - Starts BLE scanning on the native side
   - Polls for the latest merged SwitchBot frame
-  - Decodes the frame in Elixir (`SampleApp.SwitchBot`)
+  - Decodes the frame in Elixir (`SampleApp.SwitchBot.decode_frame/1`)
   - Prints a compact one-line summary
 
   ## Why polling?
@@ -57,10 +57,10 @@ defmodule SampleApp do
   @spec loop(port()) :: no_return()
   defp loop(port) do
     case fetch_frame(port) do
-      {:ok, payload} ->
-        frame = SampleApp.SwitchBot.parse_frame!(payload)
-        decoded = SampleApp.SwitchBot.decode(frame)
-        print_decoded(decoded)
+      {:ok, <<addr::binary-6, _::binary>> = payload} ->
+        payload
+        |> SampleApp.SwitchBot.decode_frame()
+        |> print_reading(mac(addr))
 
       {:error, {:driver_error, 0x41}} ->
         # Driver error 0x41: "no data yet"
@@ -82,53 +82,33 @@ defmodule SampleApp do
     end
   end
 
-  defp print_decoded({:meter, data}), do: print_common("METER", data)
-  defp print_decoded({:motion, data}), do: print_common("MOTION", data)
-  defp print_decoded({:contact, data}), do: print_common("CONTACT", data)
-  defp print_decoded({:meter_raw, data}), do: print_common("METER(raw)", data)
-  defp print_decoded({:motion_raw, data}), do: print_common("MOTION(raw)", data)
-  defp print_decoded({:contact_raw, data}), do: print_common("CONTACT(raw)", data)
-  defp print_decoded({:unknown, data}), do: print_common("UNKNOWN", data)
-
-  defp print_common(kind, data) when is_map(data) do
-    device_id =
-      case Map.get(data, :device_id) do
-        nil -> "----"
-        id -> hex4(id)
-      end
-
-    addr = mac(data.addr)
-    rssi = data.rssi
-
-    battery =
-      case Map.fetch(data, :battery) do
-        {:ok, b} -> "#{b}%"
-        :error -> "-"
-      end
-
-    temp =
-      case Map.fetch(data, :temperature_c) do
-        {:ok, t} -> "#{format_1dp(t)}C"
-        :error -> "-"
-      end
-
-    hum =
-      case Map.fetch(data, :humidity_percent) do
-        {:ok, h} -> "#{h}%"
-        :error -> "-"
-      end
-
-    pir =
-      case Map.fetch(data, :pir) do
-        {:ok, p} -> "#{p}"
-        :error -> "-"
-      end
+  # Prints a `SampleApp.SwitchBot.flat_reading()` of the device at `addr`.
+  defp print_reading({:meter, id, rssi, battery, temp_dc, humidity}, addr) do
+    IO.puts(
+      "[METER] id=#{hex4(id)} addr=#{addr} rssi=#{rssi} batt=#{battery}% " <>
+        "temp=#{format_dc(temp_dc)}C hum=#{humidity}%"
+    )
+  end
 
+  defp print_reading({:contact, id, rssi, battery, pir, door, _, _, _, _, _}, addr) do
     IO.puts(
-      "[#{kind}] id=#{device_id} addr=#{addr} rssi=#{rssi} batt=#{battery} temp=#{temp} hum=#{hum} pir=#{pir}"
+      "[CONTACT] id=#{hex4_or_dash(id)} addr=#{addr} rssi=#{rssi} batt=#{battery}% pir=#{pir} door=#{door}"
     )
   end
 
+  defp print_reading({:motion, id, rssi, battery, pir, _, _}, addr) do
+    IO.puts("[MOTION] id=#{hex4_or_dash(id)} addr=#{addr} rssi=#{rssi} batt=#{battery}% pir=#{pir}")
+  end
+
+  defp print_reading({:meter_raw, id, rssi}, addr), do: print_short("METER(raw)", id, addr, rssi)
+  defp print_reading({:contact_raw, id, rssi}, addr), do: print_short("CONTACT(raw)", id, addr, rssi)
+  defp print_reading({:motion_raw, id, rssi}, addr), do: print_short("MOTION(raw)", id, addr, rssi)
+  defp print_reading({:unknown, id, rssi}, addr), do: print_short("UNKNOWN", id, addr, rssi)
+
+  defp print_short(kind, id, addr, rssi) do
+    IO.puts("[#{kind}] id=#{hex4_or_dash(id)} addr=#{addr} rssi=#{rssi}")
+  end
+
   # Format a 6-byte BLE address as `aa:bb:cc:dd:ee:ff`.
   #
   # We use `:io_lib.format/2` to avoid pulling in heavier formatting helpers.
@@ -146,12 +126,11 @@ defmodule SampleApp do
     :io_lib.format(~c"~4.16.0b", [n]) |> :erlang.iolist_to_binary()
   end
 
-  @spec format_1dp(number()) :: binary()
-  defp format_1dp(f) when is_float(f) do
-    :io_lib.format("~.1f", [f]) |> IO.iodata_to_binary()
-  end
+  defp hex4_or_dash(nil), do: "----"
+  defp hex4_or_dash(id), do: hex4(id)
 
-  defp format_1dp(i) when is_integer(i) do
-    format_1dp(i * 1.0)
-  end
+  # Tenths of a degree, without going through a float.
+  @spec format_dc(integer()) :: binary()
+  defp format_dc(dc) when dc < 0, do: "-" <> format_dc(-dc)
+  defp format_dc(dc), do: "#{div(dc, 10)}.#{rem(dc, 10)}"
 end
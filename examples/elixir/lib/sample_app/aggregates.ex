@@ -0,0 +1,83 @@
+defmodule SampleApp.Aggregates do
+  @moduledoc """
+  Parser for the rolling aggregate replies of the native port.
+
+  The driver keeps per-device temperature/humidity statistics that are updated
+  on every merged meter advertisement, so Elixir does not need to poll and
+  accumulate each reading itself.
+  """
+
+  @typedoc "Statistics for one metric over one window."
+  @type stat :: %{count: non_neg_integer(), min: integer(), max: integer(), sum: integer()}
+
+  @typedoc """
+  Statistics for one window.
+
+  Temperature values are in deci-degrees Celsius, humidity in percent.
+  """
+  @type window :: %{
+          mode: :tumbling | :sliding,
+          window_s: non_neg_integer(),
+          temperature_dc: stat(),
+          humidity_percent: stat()
+        }
+
+  @type entry :: %{
+          device_id: 0..0xFFFF,
+          addr: <<_::48>>,
+          model: 0..255,
+          windows: [window()]
+        }
+
+  @doc """
+  Parse an aggregate reply payload.
+
+  The port returns:
+
+      <<windows::8, count::8, entries::binary>>
+
+  where each entry is:
+
+      <<device_id::16, addr::binary-6, model::8,
+        windows x <<mode::8, window_s::32,
+          temp::binary-10, humidity::binary-10>>>>
+
+  and each stat is `<<count::16, min::signed-16, max::signed-16, sum::signed-32>>`.
+  """
+  @spec parse!(binary()) :: [entry()]
+  def parse!(<<windows, count, rest::binary>>) do
+    parse_entries(rest, windows, count, [])
+  end
+
+  @doc """
+  Mean of a stat, or `nil` when it has no samples.
+  """
+  @spec mean(stat()) :: float() | nil
+  def mean(%{count: 0}), do: nil
+  def mean(%{count: count, sum: sum}), do: sum / count
+
+  defp parse_entries(<<>>, _windows, 0, acc), do: :lists.reverse(acc)
+
+  defp parse_entries(<<id::16, addr::binary-6, model, rest::binary>>, windows, n, acc) do
+    {wins, rest} = parse_windows(rest, windows, [])
+    entry = %{device_id: id, addr: addr, model: model, windows: wins}
+    parse_entries(rest, windows, n - 1, [entry | acc])
+  end
+
+  defp parse_windows(rest, 0, acc), do: {:lists.reverse(acc), rest}
+
+  defp parse_windows(<<mode, secs::32, t::binary-10, h::binary-10, rest::binary>>, n, acc) do
+    win = %{
+      mode: if(mode == 1, do: :sliding, else: :tumbling),
+      window_s: secs,
+      temperature_dc: stat(t),
+      humidity_percent: stat(h)
+    }
+
+    parse_windows(rest, n - 1, [win | acc])
+  end
+
+  defp stat(<<count::16, min::signed-16, max::signed-16, sum::signed-32>>) do
+    %{count: count, min: min, max: max, sum: sum}
+  end
+end
@@ -0,0 +1,131 @@
+defmodule SampleApp.Bench.Decode do
+  @moduledoc """
+  Cost per decoded reading of the two Elixir decode paths:
+
+  - `:map`  - `SampleApp.SwitchBot.parse_frame!/1` then `decode/1`
+  - `:flat` - `SampleApp.SwitchBot.decode_frame/1`
+
+  Needs no BLE, so it runs on the generic_unix AtomVM build. Set `start:` to
+  this module in `atomvm/0` of mix.exs, then:
+
+      mix atomvm.packbeam
+      AtomVM sample_app.avm
+
+  Each path decodes the same frame `@rounds` times in a fresh process and
+  keeps every result, so nothing is collected in between. Per reading it
+  prints:
+
+  - `reds` - reductions, `n/a` where the VM does not count them
+  - `words` - heap words. BEAM reports what was allocated, garbage
+    included. AtomVM reports what the process grew by with the
+    `:minimum` heap growth strategy, i.e. the words each kept result
+    holds on to.
+  - `us` - wall time
+  """
+
+  @rounds 200
+
+  # Large enough that BEAM does not collect during a run.
+  @min_heap_words 64 * 1024
+
+  @spec start() :: :ok
+  def start() do
+    IO.puts("frame    path   reds   words  us")
+
+    for {name, frame} <- frames(), path <- [:map, :flat] do
+      {reds, words, us} = measure(path, frame)
+      IO.puts("#{pad(name, 8)} #{pad(path, 6)} #{pad(reds, 6)} #{pad(words, 6)} #{us}")
+    end
+
+    :ok
+  end
+
+  defp frames() do
+    addr = <<0xAA, 0xBB, 0xCC, 0xDD, 0xEE, 0xFF>>
+    # device id 0x8006, 22.5C, 55%
+    mfg = <<0x69, 0x09, 1, 2, 3, 4, 0x80, 0x06, 0, 0, 0x05, 0x96, 0x37>>
+
+    [
+      meter: frame(addr, -60, <<0x54, 0x00, 0x5A>>, mfg),
+      contact: frame(addr, -71, <<0x64, 0x40, 0x5A, 0x02, 0, 10, 0, 20, 0x03>>, mfg),
+      motion: frame(addr, -80, <<0x73, 0x40, 0x5A, 0, 30, 0x02>>, mfg)
+    ]
+  end
+
+  defp frame(addr, rssi, svc, mfg) do
+    <<addr::binary, rssi::signed-8, byte_size(svc), svc::binary, byte_size(mfg), mfg::binary>>
+  end
+
+  defp measure(path, frame) do
+    parent = self()
+    atomvm? = :erlang.system_info(:machine) == ~c"ATOM"
+
+    opts =
+      if atomvm?,
+        do: [atomvm_heap_growth: :minimum],
+        else: [min_heap_size: @min_heap_words]
+
+    :erlang.spawn_opt(
+      fn ->
+        :erlang.garbage_collect()
+        r0 = reductions()
+        w0 = heap_words(atomvm?)
+        t0 = :erlang.monotonic_time(:microsecond)
+
+        kept = run(path, frame, @rounds, [])
+
+        t1 = :erlang.monotonic_time(:microsecond)
+        w1 = heap_words(atomvm?)
+        r1 = reductions()
+        send(parent, {:bench, per(r0, r1), per(w0, w1), per(t0, t1), length(kept)})
+      end,
+      opts
+    )
+
+    receive do
+      {:bench, reds, words, us, @rounds} -> {reds, words, us}
+    end
+  end
+
+  defp run(_path, _frame, 0, acc), do: acc
+
+  defp run(:map, frame, n, acc) do
+    r = frame |> SampleApp.SwitchBot.parse_frame!() |> SampleApp.SwitchBot.decode()
+    run(:map, frame, n - 1, [r | acc])
+  end
+
+  defp run(:flat, frame, n, acc) do
+    r = SampleApp.SwitchBot.decode_frame(frame)
+    run(:flat, frame, n - 1, [r | acc])
+  end
+
+  defp per(nil, _), do: "n/a"
+  defp per(_, nil), do: "n/a"
+  defp per(a, b), do: div(b - a, @rounds)
+
+  defp reductions() do
+    case :erlang.process_info(self(), :reductions) do
+      {:reductions, r} -> r
+      _ -> nil
+    end
+  rescue
+    _ -> nil
+  end
+
+  # Used words of the young heap on BEAM; heap size on AtomVM, where the
+  # :minimum growth strategy keeps it at what is live.
+  defp heap_words(true) do
+    {:heap_size, w} = :erlang.process_info(self(), :heap_size)
+    w
+  end
+
+  defp heap_words(false) do
+    {:garbage_collection_info, info} = :erlang.process_info(self(), :garbage_collection_info)
+    Keyword.fetch!(info, :heap_size)
+  end
+
+  defp pad(v, n) when is_atom(v), do: pad(:erlang.atom_to_binary(v, :latin1), n)
+  defp pad(v, n) when is_integer(v), do: pad(:erlang.integer_to_binary(v), n)
+  defp pad(s, n) when byte_size(s) < n, do: pad(s <> " ", n)
+  defp pad(s, _), do: s
+end
@@ -0,0 +1,119 @@
+defmodule SampleApp.Bench.PortCall do
+  @moduledoc """
+  Fixed cost of a `:port.call/2` into the driver, measured with PING and
+  ECHO, for choosing between polling, batching and push.
+
+  Neither opcode touches BLE, so `start/0` leaves the radio off and only the
+  call path is measured. To see what scanning costs the calls, pass a port
+  with BLE started to `run/1` instead. Set `start:` to this module in
+  `atomvm/0` of mix.exs, then flash as usual:
+
+      mix atomvm.packbeam
+      mix atomvm.esp32.flash --port /dev/ttyUSB0
+
+  For every payload (`ping`, or ECHO with 0 bytes to 4 kB) and number of
+  calling processes, `@calls` calls are split across the processes. Each
+  line prints:
+
+  - `calls/s` - completed calls over the wall time of the whole case
+  - `p50` `p90` `p99` `max` - per-call latency in microseconds
+  - `heap` - growth of the port's context heap in words, from
+    `SampleApp.Port.parse_port_info!/1`
+  """
+
+  @sizes [:ping, 0, 16, 256, 1024, 4096]
+  @procs [1, 4, 16]
+  @calls 800
+  @warmup 50
+
+  @spec start() :: :ok
+  def start() do
+    port = SampleApp.Port.open()
+    run(port)
+    SampleApp.Port.close(port)
+    :ok
+  end
+
+  @doc """
+  Run every case against an open port.
+  """
+  @spec run(SampleApp.Port.avm_port()) :: :ok
+  def run(port) do
+    IO.puts("payload procs calls/s p50   p90   p99   max   heap")
+
+    for size <- @sizes, procs <- @procs do
+      r = bench(port, size, procs)
+
+      IO.puts(
+        "#{pad(size, 7)} #{pad(procs, 5)} #{pad(r.rate, 7)} #{pad(r.p50, 5)} #{pad(r.p90, 5)} " <>
+          "#{pad(r.p99, 5)} #{pad(r.max, 5)} #{r.heap}"
+      )
+    end
+
+    :ok
+  end
+
+  defp bench(port, size, procs) do
+    payload = :erlang.list_to_binary(:lists.duplicate(if(size == :ping, do: 0, else: size), 0x55))
+    _ = call_n(port, size, payload, @warmup, [])
+
+    parent = self()
+    per_proc = div(@calls, procs)
+    h0 = heap_words(port)
+    t0 = now_us()
+
+    for _ <- 1..procs do
+      spawn(fn -> send(parent, {:latencies, call_n(port, size, payload, per_proc, [])}) end)
+    end
+
+    latencies = collect(procs, [])
+    t1 = now_us()
+    h1 = heap_words(port)
+
+    sorted = :lists.sort(latencies)
+    n = length(sorted)
+
+    %{
+      rate: div(n * 1_000_000, max(t1 - t0, 1)),
+      p50: percentile(sorted, n, 50),
+      p90: percentile(sorted, n, 90),
+      p99: percentile(sorted, n, 99),
+      max: :lists.last(sorted),
+      heap: h1 - h0
+    }
+  end
+
+  defp call_n(_port, _size, _payload, 0, acc), do: acc
+
+  defp call_n(port, size, payload, n, acc) do
+    t0 = now_us()
+    {:ok, _} = call(port, size, payload)
+    call_n(port, size, payload, n - 1, [now_us() - t0 | acc])
+  end
+
+  defp call(port, :ping, _payload), do: SampleApp.Port.ping(port)
+  defp call(port, _size, payload), do: SampleApp.Port.echo(port, payload)
+
+  defp collect(0, acc), do: acc
+
+  defp collect(n, acc) do
+    receive do
+      {:latencies, l} -> collect(n - 1, l ++ acc)
+    end
+  end
+
+  # Nearest-rank percentile of a sorted list.
+  defp percentile(sorted, n, p), do: :lists.nth(max(div(n * p + 99, 100), 1), sorted)
+
+  defp heap_words(port) do
+    {:ok, info} = SampleApp.Port.port_info(port)
+    SampleApp.Port.parse_port_info!(info).heap_words
+  end
+
+  defp now_us(), do: :erlang.monotonic_time(:microsecond)
+
+  defp pad(v, n) when is_atom(v), do: pad(:erlang.atom_to_binary(v, :latin1), n)
+  defp pad(v, n) when is_integer(v), do: pad(:erlang.integer_to_binary(v), n)
+  defp pad(s, n) when byte_size(s) < n, do: pad(s <> " ", n)
+  defp pad(s, _), do: s
+end
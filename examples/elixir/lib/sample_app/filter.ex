@@ -0,0 +1,94 @@
+defmodule SampleApp.Filter do
+  @moduledoc """
+  Assembler for the advert filter programs run natively by the scanner.
+
+  A program is a list of BPF-style instructions with an accumulator `A`
+  and an index register `X`, evaluated on the raw advertising data before
+  it is parsed or cached. Jumps are relative to the next instruction and
+  can only go forward; the last instruction must be a `:ret`.
+
+      {:ld_len}                 A = data length
+      {:ld_b, k} / {:ld_h, k}   A = byte / big-endian half-word at k
+      {:ld_ad, type}            X = value offset of the first AD structure of type,
+                                A = its value length (0 if there is none)
+      {:ld_bx, k} / {:ld_hx, k} same as :ld_b / :ld_h at X + k
+      {:and, k}                 A = A &&& k
+      {:jeq | :jgt | :jge | :jset, k, jt, jf}
+      {:ret, :accept | :reject}
+
+  Upload with `SampleApp.Port.filter_load/2`; `[]` accepts everything.
+  """
+
+  @type insn ::
+          {:ld_len}
+          | {:ld_b | :ld_h | :ld_ad | :ld_bx | :ld_hx | :and, 0..0xFFFF}
+          | {:jeq | :jgt | :jge | :jset, 0..0xFFFF, 0..255, 0..255}
+          | {:ret, :accept | :reject}
+
+  @type stats :: %{
+          insns: non_neg_integer(),
+          seen: non_neg_integer(),
+          rejected: non_neg_integer(),
+          filter_cycles: non_neg_integer(),
+          extract_cycles: non_neg_integer()
+        }
+
+  @doc """
+  Encode a program for `SampleApp.Port.filter_load/2`.
+  """
+  @spec encode([insn()]) :: binary()
+  def encode(program) when is_list(program), do: encode(program, <<>>)
+
+  defp encode([], acc), do: acc
+  defp encode([insn | rest], acc), do: encode(rest, <<acc::binary, encode_insn(insn)::binary>>)
+
+  defp encode_insn({:ld_len}), do: <<0x01, 0, 0, 0::16>>
+  defp encode_insn({:ld_b, k}), do: <<0x02, 0, 0, k::16>>
+  defp encode_insn({:ld_h, k}), do: <<0x03, 0, 0, k::16>>
+  defp encode_insn({:ld_ad, type}), do: <<0x04, 0, 0, type::16>>
+  defp encode_insn({:ld_bx, k}), do: <<0x05, 0, 0, k::16>>
+  defp encode_insn({:ld_hx, k}), do: <<0x06, 0, 0, k::16>>
+  defp encode_insn({:and, k}), do: <<0x10, 0, 0, k::16>>
+  defp encode_insn({:jeq, k, jt, jf}), do: <<0x20, jt, jf, k::16>>
+  defp encode_insn({:jgt, k, jt, jf}), do: <<0x21, jt, jf, k::16>>
+  defp encode_insn({:jge, k, jt, jf}), do: <<0x22, jt, jf, k::16>>
+  defp encode_insn({:jset, k, jt, jf}), do: <<0x23, jt, jf, k::16>>
+  defp encode_insn({:ret, :accept}), do: <<0x30, 0, 0, 1::16>>
+  defp encode_insn({:ret, :reject}), do: <<0x30, 0, 0, 0::16>>
+
+  @doc """
+  Program keeping only SwitchBot adverts: manufacturer data with company
+  id 0x0969 or service data with UUID 0xFD3D (both little-endian on air).
+  """
+  @spec switchbot() :: [insn()]
+  def switchbot do
+    [
+      {:ld_ad, 0xFF},
+      {:jge, 2, 0, 2},
+      {:ld_hx, 0},
+      {:jeq, 0x6909, 4, 0},
+      {:ld_ad, 0x16},
+      {:jge, 2, 0, 3},
+      {:ld_hx, 0},
+      {:jeq, 0x3DFD, 0, 1},
+      {:ret, :accept},
+      {:ret, :reject}
+    ]
+  end
+
+  @doc """
+  Parse the reply of `SampleApp.Port.filter_stats/1`. Cycle counts are
+  averages per advert, for the filter program and for the built-in
+  parse + vendor identification it runs in front of.
+  """
+  @spec parse_stats!(binary()) :: stats()
+  def parse_stats!(<<insns, seen::32, rejected::32, filter_cycles::32, extract_cycles::32>>) do
+    %{
+      insns: insns,
+      seen: seen,
+      rejected: rejected,
+      filter_cycles: filter_cycles,
+      extract_cycles: extract_cycles
+    }
+  end
+end
@@ -0,0 +1,90 @@
+defmodule SampleApp.Gatt do
+  @moduledoc """
+  SwitchBot Bot/Curtain commands sent over GATT by the native port.
+
+  `SampleApp.Port.gatt_send/3` queues a command and returns its sequence
+  number right away. The driver keeps recently used connections open and
+  caches the command characteristic handle (also across reboots), so a
+  repeated press is a single write. Completion is reported to the
+  subscribed process as a `{:switchbot_event, binary}` event.
+  """
+
+  @type event :: %{
+          gatt: :done | :failed,
+          addr: <<_::48>>,
+          seq: 0..0xFFFF,
+          status: :ok | :connect_failed | :no_characteristic | :write_failed | :disconnected,
+          latency_ms: non_neg_integer()
+        }
+
+  @event_gatt 0x03
+
+  @doc "Bot: press (press mode) or toggle."
+  @spec bot_press() :: binary()
+  def bot_press, do: <<0x57, 0x01, 0x00>>
+
+  @doc "Bot: turn on (switch mode)."
+  @spec bot_on() :: binary()
+  def bot_on, do: <<0x57, 0x01, 0x01>>
+
+  @doc "Bot: turn off (switch mode)."
+  @spec bot_off() :: binary()
+  def bot_off, do: <<0x57, 0x01, 0x02>>
+
+  @doc "Curtain: move to `percent` (0 open, 100 closed)."
+  @spec curtain_position(0..100) :: binary()
+  def curtain_position(percent) when percent in 0..100,
+    do: <<0x57, 0x0F, 0x45, 0x01, 0x05, 0xFF, percent>>
+
+  @doc "Curtain: stop moving."
+  @spec curtain_pause() :: binary()
+  def curtain_pause, do: <<0x57, 0x0F, 0x45, 0x01, 0x00, 0x01>>
+
+  @doc """
+  Parse a `{:switchbot_event, binary}` GATT completion event.
+  """
+  @spec parse_event(binary()) :: {:ok, event()} | :error
+  def parse_event(<<@event_gatt, addr::binary-6, seq::16, status, latency::32>>) do
+    {:ok,
+     %{
+       gatt: if(status == 0, do: :done, else: :failed),
+       addr: addr,
+       seq: seq,
+       status: status(status),
+       latency_ms: latency
+     }}
+  end
+
+  def parse_event(_), do: :error
+
+  @doc """
+  Parse the reply of `SampleApp.Port.gatt_stats/1`. `reused` counts
+  commands sent on an already open connection and `handle_hits` connects
+  that skipped discovery thanks to the handle cache.
+  """
+  @spec parse_stats!(binary()) :: %{atom() => non_neg_integer()}
+  def parse_stats!(
+        <<open, submitted::32, completed::32, failed::32, connects::32, reused::32,
+          discoveries::32, handle_hits::32, evictions::32, avg_latency::32, max_latency::32>>
+      ) do
+    %{
+      open: open,
+      submitted: submitted,
+      completed: completed,
+      failed: failed,
+      connects: connects,
+      reused: reused,
+      discoveries: discoveries,
+      handle_hits: handle_hits,
+      evictions: evictions,
+      avg_latency_ms: avg_latency,
+      max_latency_ms: max_latency
+    }
+  end
+
+  defp status(0), do: :ok
+  defp status(1), do: :connect_failed
+  defp status(2), do: :no_characteristic
+  defp status(3), do: :write_failed
+  defp status(_), do: :disconnected
+end
@@ -0,0 +1,97 @@
+defmodule SampleApp.History do
+  @moduledoc """
+  Access to the delta-compressed meter history kept by the native port.
+
+  The driver stores at most one meter sample per device per minute, encoded as
+  small deltas in fixed-size blocks. Timestamps are seconds since the gateway
+  booted; each reply carries the current uptime so callers can map them to
+  wall-clock time.
+  """
+
+  @typedoc "Temperature in deci-degrees Celsius, humidity and battery in percent."
+  @type sample :: %{
+          t_s: non_neg_integer(),
+          temperature_dc: integer(),
+          humidity_percent: 0..255,
+          battery: 0..255
+        }
+
+  @type page :: %{now_s: non_neg_integer(), more: boolean(), samples: [sample()]}
+
+  @type stats :: %{
+          blocks_total: non_neg_integer(),
+          blocks_used: non_neg_integer(),
+          block_bytes: non_neg_integer(),
+          samples: non_neg_integer(),
+          encoded_bytes: non_neg_integer(),
+          raw_bytes: non_neg_integer(),
+          cycles_per_sample: non_neg_integer()
+        }
+
+  @doc """
+  Parse a history reply:
+
+      <<now_s::32, count::16, more::8,
+        count x <<t_s::32, temp_dc::signed-16, humidity::8, battery::8>>>>
+  """
+  @spec parse!(binary()) :: page()
+  def parse!(<<now_s::32, _count::16, more, rest::binary>>) do
+    %{now_s: now_s, more: more == 1, samples: parse_samples(rest, [])}
+  end
+
+  @doc """
+  Read every sample of `device_id` in `[since_s, until_s]`, one page per call.
+  """
+  @spec stream(port(), 0..0xFFFF, non_neg_integer(), non_neg_integer()) ::
+          {:ok, [sample()]} | {:error, term()}
+  def stream(port, id, since_s, until_s), do: stream(port, id, since_s, until_s, [])
+
+  defp stream(port, id, since_s, until_s, acc) do
+    case SampleApp.Port.history(port, id, since_s, until_s) do
+      {:ok, reply} ->
+        case parse!(reply) do
+          %{more: true, samples: samples} ->
+            %{t_s: last} = :lists.last(samples)
+            stream(port, id, last + 1, until_s, [samples | acc])
+
+          %{samples: samples} ->
+            {:ok, :lists.append(:lists.reverse([samples | acc]))}
+        end
+
+      error ->
+        error
+    end
+  end
+
+  @doc """
+  Parse the reply of `SampleApp.Port.history_stats/1`.
+  """
+  @spec parse_stats!(binary()) :: stats()
+  def parse_stats!(
+        <<total::16, used::16, block_bytes::16, samples::32, encoded::32, raw::32, cycles::32>>
+      ) do
+    %{
+      blocks_total: total,
+      blocks_used: used,
+      block_bytes: block_bytes,
+      samples: samples,
+      encoded_bytes: encoded,
+      raw_bytes: raw,
+      cycles_per_sample: cycles
+    }
+  end
+
+  @doc """
+  Compression ratio of stored samples versus raw merged frames.
+  """
+  @spec compression_ratio(stats()) :: float() | nil
+  def compression_ratio(%{encoded_bytes: 0}), do: nil
+  def compression_ratio(%{encoded_bytes: enc, raw_bytes: raw}), do: raw / enc
+
+  defp parse_samples(<<>>, acc), do: :lists.reverse(acc)
+
+  defp parse_samples(<<t::32, temp::signed-16, hum, batt, rest::binary>>, acc) do
+    sample = %{t_s: t, temperature_dc: temp, humidity_percent: hum, battery: batt}
+    parse_samples(rest, [sample | acc])
+  end
+end
@@ -0,0 +1,110 @@
+defmodule SampleApp.Log do
+  @moduledoc """
+  Reader for the flash-backed log of decoded readings.
+
+  The driver appends at most one record per device per minute to a
+  dedicated flash partition (see the `HELLO_ATOMVM_BLE_SWITCHBOT_FLASH_LOG`
+  Kconfig option). Records are addressed by a cursor that only grows, so
+  a consumer can store the last `next_cursor` and resume after a restart
+  of either side.
+  """
+
+  import Bitwise
+
+  @type record :: %{
+          boot: 0..0xFFFF,
+          t_s: non_neg_integer(),
+          device_id: 0..0xFFFF,
+          vendor: 0..255,
+          temp_c: float() | nil,
+          humidity: 0..100 | nil,
+          battery: 0..100 | nil
+        }
+
+  @type page :: %{next_cursor: non_neg_integer(), records: [record()]}
+
+  @has_battery 0x01
+  @has_temp 0x02
+  @has_humidity 0x04
+
+  @doc """
+  Parse the reply of `SampleApp.Port.log_read/3`:
+
+      <<next_cursor::32, count::8, count x <<boot::16, t_s::32, device_id::16, vendor::8,
+        fields::8, temp_dc::signed-16, humidity::8, battery::8>>>>
+
+  `t_s` counts seconds since boot number `boot`.
+  """
+  @spec parse!(binary()) :: page()
+  def parse!(<<next::32, _count, rest::binary>>) do
+    %{next_cursor: next, records: parse_records(rest, [])}
+  end
+
+  @doc """
+  Read every record from `cursor` on, one page per call. Returns the
+  records and the cursor to continue from later.
+  """
+  @spec stream(port(), non_neg_integer()) ::
+          {:ok, [record()], non_neg_integer()} | {:error, term()}
+  def stream(port, cursor), do: stream(port, cursor, [])
+
+  defp stream(port, cursor, acc) do
+    case SampleApp.Port.log_read(port, cursor) do
+      {:ok, reply} ->
+        case parse!(reply) do
+          %{records: [], next_cursor: next} ->
+            {:ok, :lists.append(:lists.reverse(acc)), next}
+
+          %{records: records, next_cursor: next} ->
+            stream(port, next, [records | acc])
+        end
+
+      error ->
+        error
+    end
+  end
+
+  @doc """
+  Parse the reply of `SampleApp.Port.log_stats/1`. `write_amplification`
+  is flash bytes programmed per record byte.
+  """
+  @spec parse_stats!(binary()) :: map()
+  def parse_stats!(
+        <<total::16, used::16, boot::16, records::32, dropped::32, pages::32, erases::32,
+          written::32, payload::32, write_us::32>>
+      ) do
+    %{
+      pages_total: total,
+      pages_used: used,
+      boot: boot,
+      records: records,
+      dropped: dropped,
+      pages_written: pages,
+      erases: erases,
+      bytes_written: written,
+      payload_bytes: payload,
+      write_amplification: if(payload > 0, do: written / payload, else: 0.0),
+      write_us_per_page: write_us
+    }
+  end
+
+  defp parse_records(<<>>, acc), do: :lists.reverse(acc)
+
+  defp parse_records(
+         <<boot::16, t::32, id::16, vendor, fields, temp_dc::signed-16, hum, batt,
+           rest::binary>>,
+         acc
+       ) do
+    record = %{
+      boot: boot,
+      t_s: t,
+      device_id: id,
+      vendor: vendor,
+      temp_c: if((fields &&& @has_temp) != 0, do: temp_dc / 10, else: nil),
+      humidity: if((fields &&& @has_humidity) != 0, do: hum, else: nil),
+      battery: if((fields &&& @has_battery) != 0, do: batt, else: nil)
+    }
+
+    parse_records(rest, [record | acc])
+  end
+end
@@ -23,6 +23,9 @@ defmodule SampleApp.Port do
   - Uses `{:spawn_driver, 'sample_app_port'}` so AtomVM loads the registered
     port driver from the firmware image (not an external OS process).
   - Keep this API minimal for v1; decoding happens in `SampleApp.SwitchBot`.
+  - Firmware built with a smaller footprint profile (Kconfig) leaves out
+    analytics, history, decryption or GATT; their calls then return
+    `{:error, {:driver_error, 0x12}}` (unknown opcode).
   """
 
   @compile {:no_warn_undefined, :port}
@@ -39,6 +42,55 @@ defmodule SampleApp.Port do
   @opcode_latest 0x12
   @opcode_latest_for_id 0x13
 
+  @opcode_subscribe 0x14
+  @opcode_unsubscribe 0x15
+
+  @opcode_agg 0x20
+  @opcode_agg_config 0x21
+
+  @opcode_rules_load 0x22
+  @opcode_rules_stats 0x23
+
+  @opcode_history 0x24
+  @opcode_history_stats 0x25
+  @opcode_history_downsample 0x26
+
+  @opcode_presence 0x27
+  @opcode_presence_config 0x28
+
+  @opcode_rx_stats 0x29
+  @opcode_nearest 0x2A
+  @opcode_query 0x2B
+
+  @opcode_key_set 0x2C
+  @opcode_key_clear 0x2D
+  @opcode_latest_decrypted 0x2E
+
+  @opcode_readings 0x2F
+
+  @opcode_filter_load 0x30
+  @opcode_filter_stats 0x31
+
+  @opcode_gatt_send 0x32
+  @opcode_gatt_stats 0x33
+
+  @opcode_cache_stats 0x34
+
+  @opcode_log_read 0x35
+  @opcode_log_stats 0x36
+
+  @opcode_export_start 0x37
+  @opcode_export_stats 0x38
+
+  @opcode_close 0x39
+  @opcode_ble_stats 0x3A
+  @opcode_port_info 0x3B
+  @opcode_scan_burst 0x3C
+  @opcode_idle_config 0x3D
+  @opcode_idle_stats 0x3E
+  @opcode_mem_config 0x3F
+  @opcode_mem_stats 0x40
+
   # --- response tags (first byte of response) ---
   @reply_ok 0x00
   @reply_error 0x01
@@ -55,14 +107,87 @@ defmodule SampleApp.Port do
   @typedoc "Result returned by port calls."
   @type result :: {:ok, binary()} | {:error, driver_error() | {:bad_reply, term()}}
 
+  @typedoc "Options for `open/1`."
+  @type open_option ::
+          {:cache_size, 1..64}
+          | {:history_blocks, 1..512}
+          | {:event_queue, 1..256}
+          | {:gatt_queue, 1..16}
+          | {:scan, :fast | :balanced | :low_power}
+          | {:reply, :frame | :reading}
+
   @doc """
   Open the native port driver.
+
+  Each port has its own latest frame, subscriber and advert filter; the
+  scanner and device cache are shared. Up to four ports can be open at a
+  time. Release one with `close/1`.
+
+  Options:
+
+  - `:cache_size` - devices the cache holds (profile default, see Kconfig)
+  - `:history_blocks` - blocks in the history pool (profile default)
+  - `:event_queue` - subscriber events one scan callback or tick can queue;
+    the rest are dropped and counted in `ble_stats/1` (default: one per
+    cached device plus room for one advert's or one GATT dispatch's events)
+  - `:gatt_queue` - `gatt_send/3` commands queued per device (default 4);
+    driver error `0x5E` once full
+  - `:scan` - scan duty cycle this port asks for, `:fast` (default),
+    `:balanced` or `:low_power`; the scanner runs the fastest one asked for
+  - `:reply` - what `latest/1` returns: the merged `:frame` (default) or a
+    decoded `:reading`, as in `readings/1`
+
+  The first port opened sizes the shared memory from `:cache_size`,
+  `:history_blocks`, `:event_queue` and `:gatt_queue`; a later port giving
+  other sizes fails to open, as does a bad option value.
   """
-  @spec open() :: avm_port()
-  def open() do
-    :erlang.open_port({:spawn_driver, @driver}, [:binary])
+  @spec open([open_option()]) :: avm_port()
+  def open(opts \\ []) do
+    :erlang.open_port({:spawn_driver, @driver}, [:binary | opts])
   end
 
+  @doc """
+  Return this port's slot, the shared memory sizes and its options. See
+  `parse_port_info!/1`.
+  """
+  @spec port_info(avm_port()) :: result()
+  def port_info(port), do: call(port, @opcode_port_info)
+
+  @doc """
+  Parse the reply of `port_info/1`:
+
+      <<slot::8, cache_size::8, history_blocks::16, arena_bytes::32,
+        reply_bytes::16, scan::8, reply::8, heap_words::32, event_queue::16,
+        gatt_queue::8>>
+
+  `heap_words` is the size of this port's own heap, where replies are built.
+  """
+  @spec parse_port_info!(binary()) :: %{atom() => non_neg_integer() | atom()}
+  def parse_port_info!(
+        <<slot, cache_size, history_blocks::16, arena_bytes::32, reply_bytes::16, scan,
+          reply, heap_words::32, event_queue::16, gatt_queue>>
+      ) do
+    %{
+      slot: slot,
+      cache_size: cache_size,
+      history_blocks: history_blocks,
+      arena_bytes: arena_bytes,
+      reply_bytes: reply_bytes,
+      scan: Enum.at([:fast, :balanced, :low_power], scan),
+      reply: Enum.at([:frame, :reading], reply),
+      heap_words: heap_words,
+      event_queue: event_queue,
+      gatt_queue: gatt_queue
+    }
+  end
+
+  @doc """
+  Close a port opened with `open/1`, releasing its hold on the scanner and
+  its subscription.
+  """
+  @spec close(avm_port()) :: result()
+  def close(port), do: call(port, @opcode_close)
+
   @doc """
   Simple liveness check.
 
@@ -90,16 +215,67 @@ defmodule SampleApp.Port do
   def ble_start(port), do: call(port, @opcode_ble_start)
 
   @doc """
-  Stop BLE scanning (does not deinitialize NimBLE).
+  Stop BLE scanning for this port. The scanner keeps running while another
+  port still wants it.
+
+  `mode` is one of:
+
+    * `:scan` (default) - stop scanning, keep NimBLE initialized
+    * `:deep` - also deinitialize NimBLE and free its memory; `ble_start/1`
+      brings it back with the device cache intact
+    * `:release` - `:deep`, then give the controller's memory to the heap
+      for good (driver error `0x63` on any later start)
+
+  The deep modes need this to be the only open port (driver error `0x64`).
+  Driver error `0x6B` means NimBLE did not stop and BLE is still running.
+  See `ble_stats/1` for the heap reclaimed and the restart time.
   """
-  @spec ble_stop(avm_port()) :: result()
-  def ble_stop(port), do: call(port, @opcode_ble_stop)
+  @spec ble_stop(avm_port(), :scan | :deep | :release) :: result()
+  def ble_stop(port, mode \\ :scan)
+  def ble_stop(port, :scan), do: call(port, @opcode_ble_stop)
+  def ble_stop(port, :deep), do: call(port, @opcode_ble_stop, <<1>>)
+  def ble_stop(port, :release), do: call(port, @opcode_ble_stop, <<2>>)
 
   @doc """
-  Return the latest merged SwitchBot frame seen by the scanner.
+  Return BLE start/stop counters. See `parse_ble_stats!/1`.
+  """
+  @spec ble_stats(avm_port()) :: result()
+  def ble_stats(port), do: call(port, @opcode_ble_stats)
+
+  @doc """
+  Parse the reply of `ble_stats/1`:
+
+      <<started::8, released::8, inits::16, deep_stops::16, heap_free::32,
+        reclaimed::32, init_us::32, sync_us::32, events_dropped::32>>
+
+  `reclaimed` is the heap the last deep stop gave back; `sync_us` is the
+  time from the last (re)start until the stack was ready to scan.
+  `events_dropped` counts subscriber events lost to a full event queue.
+  """
+  @spec parse_ble_stats!(binary()) :: %{atom() => non_neg_integer() | boolean()}
+  def parse_ble_stats!(
+        <<started, released, inits::16, stops::16, free::32, reclaimed::32, init_us::32,
+          sync_us::32, events_dropped::32>>
+      ) do
+    %{
+      started: started == 1,
+      released: released == 1,
+      inits: inits,
+      deep_stops: stops,
+      heap_free: free,
+      reclaimed: reclaimed,
+      init_us: init_us,
+      sync_us: sync_us,
+      events_dropped: events_dropped
+    }
+  end
+
+  @doc """
+  Return the latest merged SwitchBot frame this port's filter accepted.
 
   On success, the payload is the merged frame binary (without the `0x00` status byte).
   The payload format is documented in `SampleApp.SwitchBot.parse_frame!/1`.
+  A port opened with `reply: :reading` gets one `readings/1` entry instead.
 
   Driver error `0x41` means "no data yet".
   """
@@ -116,14 +292,502 @@ defmodule SampleApp.Port do
     call(port, @opcode_latest_for_id, <<id::16-big>>)
   end
 
+  @doc """
+  Subscribe the calling process to driver events.
+
+  Events arrive as `{:switchbot_event, binary}` messages; see
+  `SampleApp.Rules.parse_event/1` and `SampleApp.Presence.parse_event/1`.
+  Only one process per port is subscribed at a time, and it only gets
+  events for devices the port's filter accepts.
+  """
+  @spec subscribe(avm_port()) :: result()
+  def subscribe(port), do: call(port, @opcode_subscribe)
+
+  @doc """
+  Stop sending driver events.
+  """
+  @spec unsubscribe(avm_port()) :: result()
+  def unsubscribe(port), do: call(port, @opcode_unsubscribe)
+
+  @doc """
+  Return rolling temperature/humidity aggregates for every meter seen so far.
+
+  The payload format is documented in `SampleApp.Aggregates.parse!/1`.
+  """
+  @spec aggregates(avm_port()) :: result()
+  def aggregates(port), do: call(port, @opcode_agg)
+
+  @doc """
+  Return rolling aggregates for a single SwitchBot `device_id`.
+
+  Driver error `0x43` means the device has no aggregates yet.
+  """
+  @spec aggregates_for_id(avm_port(), 0..0xFFFF) :: result()
+  def aggregates_for_id(port, id) when is_integer(id) and id in 0..0xFFFF do
+    call(port, @opcode_agg, <<id::16-big>>)
+  end
+
+  @doc """
+  Configure the aggregate windows as `[{mode, window_s}, {mode, window_s}]`.
+
+  `mode` is `:tumbling` (last completed window) or `:sliding` (trailing window).
+  A `window_s` of `0` disables that window. All aggregates are reset.
+  """
+  @spec configure_aggregates(avm_port(), [{:tumbling | :sliding, non_neg_integer()}]) :: result()
+  def configure_aggregates(port, [{_, _}, {_, _}] = windows) do
+    payload = for {mode, secs} <- windows, into: <<>>, do: <<agg_mode(mode), secs::32-big>>
+    call(port, @opcode_agg_config, payload)
+  end
+
+  defp agg_mode(:tumbling), do: 0
+  defp agg_mode(:sliding), do: 1
+
+  @doc """
+  Replace the native rule table.
+
+  Rules are evaluated on every merged frame; only condition changes are sent
+  to the subscriber. See `SampleApp.Rules.encode/1`.
+  """
+  @spec load_rules(avm_port(), [SampleApp.Rules.rule()]) :: result()
+  def load_rules(port, rules) when is_list(rules) do
+    call(port, @opcode_rules_load, SampleApp.Rules.encode(rules))
+  end
+
+  @doc """
+  Return per-rule counters. See `SampleApp.Rules.parse_stats!/1`.
+  """
+  @spec rule_stats(avm_port()) :: result()
+  def rule_stats(port), do: call(port, @opcode_rules_stats)
+
+  @doc """
+  Read stored meter history for `device_id` between `since_s` and `until_s`
+  (seconds since boot, inclusive), at most `max` samples per call.
+
+  See `SampleApp.History.parse!/1`; use `SampleApp.History.stream/4` to page
+  through a whole range.
+  """
+  @spec history(avm_port(), 0..0xFFFF, non_neg_integer(), non_neg_integer(), 1..0xFFFF) ::
+          result()
+  def history(port, id, since_s, until_s, max \\ 64)
+      when is_integer(id) and id in 0..0xFFFF do
+    call(port, @opcode_history, <<id::16-big, since_s::32-big, until_s::32-big, max::16-big>>)
+  end
+
+  @doc """
+  Read a downsampled series of at most `points` samples for `device_id`.
+
+  `method` is `:minmax` (min and max sample per bucket) or `:lttb`
+  (largest-triangle-three-buckets); `metric` picks the series the selection
+  is based on, `:temperature` or `:humidity`. `points` is 3 to 256. The
+  reply has the same format as `history/5`, see `SampleApp.History.parse!/1`.
+  """
+  @spec history_downsample(
+          avm_port(),
+          0..0xFFFF,
+          non_neg_integer(),
+          non_neg_integer(),
+          3..256,
+          :minmax | :lttb,
+          :temperature | :humidity
+        ) :: result()
+  def history_downsample(port, id, since_s, until_s, points, method \\ :lttb, metric \\ :temperature)
+      when is_integer(id) and id in 0..0xFFFF and is_integer(points) and points in 3..256 do
+    m = if method == :lttb, do: 1, else: 0
+    k = if metric == :humidity, do: 1, else: 0
+
+    call(
+      port,
+      @opcode_history_downsample,
+      <<id::16-big, since_s::32-big, until_s::32-big, points::16-big, m, k>>
+    )
+  end
+
+  @doc """
+  Return history store usage and compression counters.
+  See `SampleApp.History.parse_stats!/1`.
+  """
+  @spec history_stats(avm_port()) :: result()
+  def history_stats(port), do: call(port, @opcode_history_stats)
+
+  @doc """
+  Return a presence snapshot of every device that has arrived at least once.
+  See `SampleApp.Presence.parse!/1`.
+  """
+  @spec presence(avm_port()) :: result()
+  def presence(port), do: call(port, @opcode_presence)
+
+  @doc """
+  Configure presence tracking.
+
+  A device arrives once its smoothed RSSI reaches `arrive_rssi` and departs
+  after `timeout_ms` without an advert at or above `depart_rssi`.
+  """
+  @spec configure_presence(avm_port(), pos_integer(), integer(), integer()) :: result()
+  def configure_presence(port, timeout_ms, arrive_rssi, depart_rssi)
+      when depart_rssi <= arrive_rssi do
+    call(
+      port,
+      @opcode_presence_config,
+      <<timeout_ms::32-big, arrive_rssi::signed-8, depart_rssi::signed-8>>
+    )
+  end
+
+  @doc """
+  Return reception statistics for every cached device.
+  See `SampleApp.RxStats.parse!/1`.
+  """
+  @spec rx_stats(avm_port()) :: result()
+  def rx_stats(port), do: call(port, @opcode_rx_stats)
+
+  @doc """
+  Return reception statistics for a single SwitchBot `device_id`.
+  """
+  @spec rx_stats_for_id(avm_port(), 0..0xFFFF) :: result()
+  def rx_stats_for_id(port, id) when is_integer(id) and id in 0..0xFFFF do
+    call(port, @opcode_rx_stats, <<id::16-big>>)
+  end
+
+  @doc """
+  Return the `k` strongest devices (by smoothed RSSI) merged within the last
+  `max_age_ms`, strongest first. See `parse_nearest!/1`.
+  """
+  @spec nearest(avm_port(), 0..255, non_neg_integer()) :: result()
+  def nearest(port, k, max_age_ms \\ 10_000) when k in 0..255 do
+    call(port, @opcode_nearest, <<k, max_age_ms::32-big>>)
+  end
+
+  @doc """
+  Parse the reply of `nearest/3`:
+
+      <<count::8, count x <<device_id::16, addr::binary-6, rssi::signed-8, age_ms::32, model::8>>>>
+  """
+  @spec parse_nearest!(binary()) :: [
+          %{
+            device_id: 0..0xFFFF,
+            addr: <<_::48>>,
+            rssi: integer(),
+            age_ms: non_neg_integer(),
+            model: 0..255
+          }
+        ]
+  def parse_nearest!(<<_count, rest::binary>>), do: parse_nearest(rest, [])
+
+  defp parse_nearest(<<>>, acc), do: :lists.reverse(acc)
+
+  defp parse_nearest(
+         <<id::16, addr::binary-6, rssi::signed-8, age::32, model, rest::binary>>,
+         acc
+       ) do
+    entry = %{device_id: id, addr: addr, rssi: rssi, age_ms: age, model: model}
+    parse_nearest(rest, [entry | acc])
+  end
+
+  @doc """
+  Return every merged frame matching a predicate, evaluated in one pass
+  inside the port. See `SampleApp.Query` for building predicates and
+  parsing the reply.
+  """
+  @spec query(avm_port(), SampleApp.Query.predicate()) :: result()
+  def query(port, predicate) when is_list(predicate) do
+    call(port, @opcode_query, SampleApp.Query.encode(predicate))
+  end
+
+  @doc """
+  Install an AES-128-CCM key for the device at `addr` (6 bytes, display order).
+
+  `source` selects which payload is encrypted (`:svc` or `:mfg`) and
+  `offset` how many leading bytes of it are sent in clear. `:svc` is BTHome
+  v2 encryption and takes offset `1` (the device-info byte); `:mfg` uses
+  the driver's own nonce, see `switchbot_crypto.h`. Payloads are
+  decrypted natively whenever their content changes; read the result with
+  `latest_decrypted/2`. Driver error `0x59` means the key store is full.
+  """
+  @spec set_key(avm_port(), <<_::48>>, :svc | :mfg, 0..31, <<_::128>>) :: result()
+  def set_key(port, <<_::binary-6>> = addr, source, offset, <<_::binary-16>> = key) do
+    src = if source == :mfg, do: 1, else: 0
+    call(port, @opcode_key_set, <<addr::binary, src, offset, key::binary>>)
+  end
+
+  @doc """
+  Remove the key of the device at `addr` (6 bytes, display order).
+  """
+  @spec clear_key(avm_port(), <<_::48>>) :: result()
+  def clear_key(port, <<_::binary-6>> = addr), do: call(port, @opcode_key_clear, addr)
+
+  @doc """
+  Return the last decrypted payload of `device_id` next to its merged frame.
+  See `SampleApp.SwitchBot.parse_decrypted!/1`.
+
+  Driver error `0x5B` means there is no key or nothing authenticated yet.
+  """
+  @spec latest_decrypted(avm_port(), 0..0xFFFF) :: result()
+  def latest_decrypted(port, id) when is_integer(id) and id in 0..0xFFFF do
+    call(port, @opcode_latest_decrypted, <<id::16-big>>)
+  end
+
+  @doc """
+  Return the decoded reading of every merged device, whatever its vendor
+  (SwitchBot, BTHome, Xiaomi, Govee, Inkbird). See `SampleApp.Readings`.
+  """
+  @spec readings(avm_port()) :: result()
+  def readings(port), do: call(port, @opcode_readings)
+
+  @doc """
+  Scan once for `duration_ms` at the fastest interval, then leave the radio
+  idle. Replies when the window closes with the readings of every device
+  `filter` (a `SampleApp.Filter` program, `[]` for all) accepted meanwhile.
+  See `SampleApp.Readings.parse_burst!/1`.
+
+  Starts BLE if needed. Driver error `0x66` means the continuous scan,
+  another burst or a GATT command (`gatt_send/3`) is running, `0x67` that
+  the discovery could not be started.
+  """
+  @spec scan_burst(avm_port(), 1..0xFFFF, list()) :: result()
+  def scan_burst(port, duration_ms, filter \\ [])
+      when is_integer(duration_ms) and duration_ms in 1..0xFFFF and is_list(filter) do
+    payload = <<duration_ms::16-big, SampleApp.Filter.encode(filter)::binary>>
+    call(port, @opcode_scan_burst, payload, duration_ms + 5_000)
+  end
+
+  @doc """
+  Configure auto-idle. When no port has been called for `idle_after_ms` and
+  no subscriber process is alive, the scanner drops to `action` until the
+  next call of any kind:
+
+    * `:low_duty` - keep scanning with the `:low_power` profile, the cache
+      stays fresh (default)
+    * `:pause` - stop scanning; NimBLE and the cache stay up
+
+  `idle_after_ms` `0` never idles. The default is 10 minutes, `:low_duty`.
+  """
+  @spec idle_config(avm_port(), 0..0xFFFFFFFF, :low_duty | :pause) :: result()
+  def idle_config(port, idle_after_ms, action \\ :low_duty)
+      when is_integer(idle_after_ms) and idle_after_ms in 0..0xFFFFFFFF do
+    action_code =
+      case action do
+        :low_duty -> 1
+        :pause -> 2
+      end
+
+    call(port, @opcode_idle_config, <<idle_after_ms::32-big, action_code>>)
+  end
+
+  @doc """
+  Return auto-idle counters. See `parse_idle_stats!/1`.
+  """
+  @spec idle_stats(avm_port()) :: result()
+  def idle_stats(port), do: call(port, @opcode_idle_stats)
+
+  @doc """
+  Parse the reply of `idle_stats/1`:
+
+      <<state::8, action::8, idle_after_ms::32, idles::16, resumes::16,
+        idle_total_ms::32, last_idle_ms::32>>
+
+  Asking resumes the scanner, so `state` reads `:active`; `idles` and
+  `resumes` tell what happened since boot.
+  """
+  @spec parse_idle_stats!(binary()) :: %{atom() => non_neg_integer() | atom()}
+  def parse_idle_stats!(
+        <<state, action, after_ms::32, idles::16, resumes::16, total_ms::32, last_ms::32>>
+      ) do
+    %{
+      state: Enum.at([:active, :low_duty, :pause], state),
+      action: Enum.at([:active, :low_duty, :pause], action),
+      idle_after_ms: after_ms,
+      idles: idles,
+      resumes: resumes,
+      idle_total_ms: total_ms,
+      last_idle_ms: last_ms
+    }
+  end
+
+  @doc """
+  Set the free-heap watermarks, in bytes, below which the driver sheds load.
+  Each level adds to the ones before it:
+
+    1. raw frames are not copied into replies (`latest/1` with reply
+       format `:frame`, `latest_for_id/2`, `latest_decrypted/2`,
+       `query/2`)
+    2. `history/5` returns at most a quarter page, `history_downsample/7`
+       at most 64 points
+    3. devices silent for a minute are evicted from the cache
+    4. `export_start/5` and `log_read/3` are refused; a running export
+       drops its frames
+
+  Refused calls return driver error `0x69`. A level is left once free heap
+  is 4 kB above its watermark again. Watermarks must not increase; the
+  defaults are 48, 40, 32 and 24 kB.
+  """
+  @spec mem_config(avm_port(), [non_neg_integer()]) :: result()
+  def mem_config(port, [_, _, _, _] = watermarks) do
+    call(port, @opcode_mem_config, for(w <- watermarks, into: <<>>, do: <<w::32-big>>))
+  end
+
+  @doc """
+  Return the memory pressure level and counters. See `parse_mem_stats!/1`.
+  """
+  @spec mem_stats(avm_port()) :: result()
+  def mem_stats(port), do: call(port, @opcode_mem_stats)
+
+  @doc """
+  Parse the reply of `mem_stats/1`:
+
+      <<level::8, max_level::8, free::32, min_free::32, 4 x watermark::32,
+        changes::16, shed::32, evicted::32>>
+
+  `shed` counts calls refused or trimmed because of the level.
+  """
+  @spec parse_mem_stats!(binary()) :: %{atom() => non_neg_integer() | [non_neg_integer()]}
+  def parse_mem_stats!(
+        <<level, max_level, free::32, min_free::32, w1::32, w2::32, w3::32, w4::32,
+          changes::16, shed::32, evicted::32>>
+      ) do
+    %{
+      level: level,
+      max_level: max_level,
+      free: free,
+      min_free: min_free,
+      watermarks: [w1, w2, w3, w4],
+      changes: changes,
+      shed: shed,
+      evicted: evicted
+    }
+  end
+
+  @doc """
+  Replace this port's advert filter program, see `SampleApp.Filter`.
+  Adverts no open port accepts are dropped before they are parsed or
+  cached. `[]` accepts everything. Driver error `0x5C` means the program did not verify.
+  """
+  @spec filter_load(avm_port(), [SampleApp.Filter.insn()]) :: result()
+  def filter_load(port, program) when is_list(program) do
+    call(port, @opcode_filter_load, SampleApp.Filter.encode(program))
+  end
+
+  @doc """
+  Return filter counters and per-advert cycle costs.
+  See `SampleApp.Filter.parse_stats!/1`.
+  """
+  @spec filter_stats(avm_port()) :: result()
+  def filter_stats(port), do: call(port, @opcode_filter_stats)
+
+  @doc """
+  Queue a SwitchBot command (see `SampleApp.Gatt`) for the device at `addr`
+  (6 bytes, display order). Returns `{:ok, <<seq::16>>}`; the result arrives
+  later as an event. Driver error `0x5E` means the device queue is full,
+  `0x5F` that every connection slot is busy and `0x66` that a
+  `scan_burst/3` is running.
+  """
+  @spec gatt_send(avm_port(), <<_::48>>, binary()) :: result()
+  def gatt_send(port, <<_::binary-6>> = addr, command)
+      when byte_size(command) in 1..20 do
+    call(port, @opcode_gatt_send, <<addr::binary, command::binary>>)
+  end
+
+  @doc """
+  Return GATT client counters. See `SampleApp.Gatt.parse_stats!/1`.
+  """
+  @spec gatt_stats(avm_port()) :: result()
+  def gatt_stats(port), do: call(port, @opcode_gatt_stats)
+
+  @doc """
+  Return warm-start cache counters. See `parse_cache_stats!/1`.
+  """
+  @spec cache_stats(avm_port()) :: result()
+  def cache_stats(port), do: call(port, @opcode_cache_stats)
+
+  @doc """
+  Parse the reply of `cache_stats/1`:
+
+      <<restored::8, stale::8, snapshots_written::32, snapshots_skipped::32,
+        snapshot_bytes::16, first_answer_ms::32, first_answer_stale::8>>
+
+  `first_answer_ms` is the time from boot to the first `latest/1` answer.
+  """
+  @spec parse_cache_stats!(binary()) :: %{atom() => non_neg_integer() | boolean()}
+  def parse_cache_stats!(
+        <<restored, stale, written::32, skipped::32, bytes::16, first_ms::32, first_stale>>
+      ) do
+    %{
+      restored: restored,
+      stale: stale,
+      snapshots_written: written,
+      snapshots_skipped: skipped,
+      snapshot_bytes: bytes,
+      first_answer_ms: first_ms,
+      first_answer_stale: first_stale == 1
+    }
+  end
+
+  @doc """
+  Read up to `max` (1..32) flash log records from `cursor`. See
+  `SampleApp.Log`. Driver error `0x60` means the log is not available
+  (compiled out or no partition).
+  """
+  @spec log_read(avm_port(), non_neg_integer(), 1..32) :: result()
+  def log_read(port, cursor, max \\ 32) when cursor >= 0 and max in 1..32 do
+    call(port, @opcode_log_read, <<cursor::32-big, max>>)
+  end
+
+  @doc """
+  Return flash log counters. See `SampleApp.Log.parse_stats!/1`.
+  """
+  @spec log_stats(avm_port()) :: result()
+  def log_stats(port), do: call(port, @opcode_log_stats)
+
+  @doc """
+  Stream readings to a UART as binary frames, bypassing the VM. `mode` is
+  `:all` (every new sample), `:changes` (only changed values) or `:off`.
+  Pass `tx_pin: n` to move the UART's TX pin. Frames are read on the host
+  with `tools/sbexport.c`.
+
+  Driver error `0x61` means bad arguments, `0x62` that the UART driver
+  refused them (e.g. the UART is already in use).
+  """
+  @spec export_start(avm_port(), :off | :all | :changes, 0..2, pos_integer(), keyword()) ::
+          result()
+  def export_start(port, mode, uart \\ 1, baud \\ 921_600, opts \\ []) do
+    mode_byte =
+      case mode do
+        :off -> 0
+        :all -> 1
+        :changes -> 2
+      end
+
+    tx_pin = Keyword.get(opts, :tx_pin, 0xFF)
+    call(port, @opcode_export_start, <<mode_byte, uart, baud::32-big, tx_pin>>)
+  end
+
+  @doc """
+  Return serial export counters. See `parse_export_stats!/1`.
+  """
+  @spec export_stats(avm_port()) :: result()
+  def export_stats(port), do: call(port, @opcode_export_stats)
+
+  @doc """
+  Parse the reply of `export_stats/1`:
+
+      <<mode::8, uart::8, next_seq::16, frames::32, bytes::32, dropped::32>>
+
+  `dropped` counts frames that did not fit in the UART's TX buffer; the
+  reader sees them as gaps in the sequence numbers.
+  """
+  @spec parse_export_stats!(binary()) :: %{atom() => non_neg_integer()}
+  def parse_export_stats!(<<mode, uart, seq::16, frames::32, bytes::32, dropped::32>>) do
+    %{mode: mode, uart: uart, next_seq: seq, frames: frames, bytes: bytes, dropped: dropped}
+  end
+
   @spec call(avm_port(), opcode(), binary()) :: result()
   defp call(port, opcode, payload \\ <<>>) do
-    req = <<opcode, payload::binary>>
+    reply(:port.call(port, <<opcode, payload::binary>>))
+  end
 
-    case :port.call(port, req) do
-      <<@reply_ok, rest::binary>> -> {:ok, rest}
-      <<@reply_error, code>> -> {:error, {:driver_error, code}}
-      other -> {:error, {:bad_reply, other}}
-    end
+  defp call(port, opcode, payload, timeout) do
+    reply(:port.call(port, <<opcode, payload::binary>>, timeout))
   end
+
+  defp reply(<<@reply_ok, rest::binary>>), do: {:ok, rest}
+  defp reply(<<@reply_error, code>>), do: {:error, {:driver_error, code}}
+  defp reply(other), do: {:error, {:bad_reply, other}}
 end
@@ -0,0 +1,73 @@
+defmodule SampleApp.Presence do
+  @moduledoc """
+  Presence (asset tag) tracking done by the native port.
+
+  The driver tracks when each SwitchBot device appears and disappears and
+  pushes arrival/departure events to the subscribed process (see
+  `SampleApp.Port.subscribe/1`), so Elixir never has to poll for absence.
+  """
+
+  @type entry :: %{
+          device_id: 0..0xFFFF,
+          addr: <<_::48>>,
+          present: boolean(),
+          rssi: integer(),
+          age_ms: non_neg_integer(),
+          arrivals: non_neg_integer(),
+          departures: non_neg_integer()
+        }
+
+  @type event :: %{
+          presence: :arrived | :departed,
+          device_id: 0..0xFFFF,
+          addr: <<_::48>>,
+          rssi: integer()
+        }
+
+  @event_presence 0x02
+
+  @doc """
+  Parse the reply of `SampleApp.Port.presence/1`:
+
+      <<count::8, count x <<device_id::16, addr::binary-6, present::8, rssi::signed-8,
+        age_ms::32, arrivals::16, departures::16>>>>
+  """
+  @spec parse!(binary()) :: [entry()]
+  def parse!(<<_count, rest::binary>>), do: parse_entries(rest, [])
+
+  @doc """
+  Parse a `{:switchbot_event, binary}` presence event.
+  """
+  @spec parse_event(binary()) :: {:ok, event()} | :error
+  def parse_event(<<@event_presence, arrived, device_id::16, addr::binary-6, rssi::signed-8>>) do
+    {:ok,
+     %{
+       presence: if(arrived == 1, do: :arrived, else: :departed),
+       device_id: device_id,
+       addr: addr,
+       rssi: rssi
+     }}
+  end
+
+  def parse_event(_), do: :error
+
+  defp parse_entries(<<>>, acc), do: :lists.reverse(acc)
+
+  defp parse_entries(
+         <<id::16, addr::binary-6, present, rssi::signed-8, age::32, arr::16, dep::16,
+           rest::binary>>,
+         acc
+       ) do
+    entry = %{
+      device_id: id,
+      addr: addr,
+      present: present == 1,
+      rssi: rssi,
+      age_ms: age,
+      arrivals: arr,
+      departures: dep
+    }
+
+    parse_entries(rest, [entry | acc])
+  end
+end
@@ -0,0 +1,65 @@
+defmodule SampleApp.Query do
+  @moduledoc """
+  Predicates for `SampleApp.Port.query/2`.
+
+  All given clauses must match; an empty predicate matches every merged
+  device:
+
+      SampleApp.Port.query(port, models: [0x54, 0x77], min_rssi: -80, max_age_ms: 60_000)
+      SampleApp.Port.query(port, battery_below: 20)
+      SampleApp.Port.query(port, addr_prefix: <<0xC1, 0x2B>>, ids: [0x8006])
+  """
+
+  @type clause ::
+          {:models, [0..255]}
+          | {:min_rssi, integer()}
+          | {:max_age_ms, non_neg_integer()}
+          | {:addr_prefix, binary()}
+          | {:ids, [0..0xFFFF]}
+          | {:battery_below, 0..255}
+
+  @type predicate :: [clause()]
+
+  @type match :: %{age_ms: non_neg_integer(), frame: SampleApp.SwitchBot.frame()}
+
+  @doc """
+  Encode a predicate as `<<tag::8, len::8, value::binary>>` clauses.
+
+  `:addr_prefix` is given in display order (first byte of `aa:bb:...`).
+  """
+  @spec encode(predicate()) :: binary()
+  def encode(predicate), do: encode(predicate, <<>>)
+
+  @doc """
+  Parse a query reply into matches, decoding each frame with
+  `SampleApp.SwitchBot.parse_frame!/1`:
+
+      <<count::8, count x <<age_ms::32, frame_len::8, frame::binary-size(frame_len)>>>>
+  """
+  @spec parse!(binary()) :: [match()]
+  def parse!(<<_count, rest::binary>>), do: parse_matches(rest, [])
+
+  defp encode([], acc), do: acc
+
+  defp encode([clause | rest], acc) do
+    {tag, value} = clause(clause)
+    encode(rest, <<acc::binary, tag, byte_size(value), value::binary>>)
+  end
+
+  defp clause({:models, models}), do: {0x01, :erlang.list_to_binary(models)}
+  defp clause({:min_rssi, rssi}), do: {0x02, <<rssi::signed-8>>}
+  defp clause({:max_age_ms, ms}), do: {0x03, <<ms::32-big>>}
+  defp clause({:addr_prefix, prefix}) when byte_size(prefix) in 1..6, do: {0x04, prefix}
+  defp clause({:ids, ids}), do: {0x05, ids_to_binary(ids, <<>>)}
+  defp clause({:battery_below, pct}), do: {0x06, <<pct>>}
+
+  defp ids_to_binary([], acc), do: acc
+  defp ids_to_binary([id | rest], acc), do: ids_to_binary(rest, <<acc::binary, id::16-big>>)
+
+  defp parse_matches(<<>>, acc), do: :lists.reverse(acc)
+
+  defp parse_matches(<<age::32, len, frame::binary-size(len), rest::binary>>, acc) do
+    match = %{age_ms: age, frame: SampleApp.SwitchBot.parse_frame!(frame)}
+    parse_matches(rest, [match | acc])
+  end
+end
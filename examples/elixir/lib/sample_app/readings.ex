@@ -0,0 +1,107 @@
+defmodule SampleApp.Readings do
+  @moduledoc """
+  Vendor-independent sensor readings decoded by the native port.
+
+  Each device is recognized by a vendor profile inside the driver, which
+  decodes its adverts into the same fixed-point form. Values the device
+  does not report are left out of the map. `stale: true` marks readings
+  restored from the warm-start snapshot that were not heard since boot.
+  """
+
+  import Bitwise
+
+  @type vendor :: :switchbot | :bthome | :xiaomi | :govee | :inkbird | :unknown
+
+  @type reading :: %{
+          required(:device_id) => 0..0xFFFF,
+          required(:addr) => <<_::48>>,
+          required(:vendor) => vendor(),
+          required(:model) => 0..255,
+          required(:rssi) => integer(),
+          required(:age_ms) => non_neg_integer(),
+          required(:stale) => boolean(),
+          optional(:battery) => 0..100,
+          optional(:temp_c) => float(),
+          optional(:humidity) => 0..100,
+          optional(:motion) => boolean(),
+          optional(:contact) => :open | :closed
+        }
+
+  @has_battery 0x01
+  @has_temp 0x02
+  @has_humidity 0x04
+  @has_pir 0x08
+  @has_door 0x10
+  @stale 0x80
+
+  @doc """
+  Parse the reply of `SampleApp.Port.readings/1`:
+
+      <<count::8, count x <<device_id::16, addr::binary-6, vendor::8, model::8, fields::8,
+        battery::8, temp_dc::signed-16, humidity::8, pir::8, door::8, rssi::signed-8,
+        age_ms::32>>>>
+  """
+  @spec parse!(binary()) :: [reading()]
+  def parse!(<<_count, rest::binary>>), do: parse_entries(rest, [])
+
+  @doc """
+  Parse the reply of `SampleApp.Port.scan_burst/3`:
+
+      <<radio_on_ms::32, adverts::32, last_new_ms::32, seen::8, missed::8,
+        count::8, count x readings entry>>
+
+  `seen` devices passed the filter during the burst, `count` of them had a
+  reading and `missed` cached devices were not heard. `last_new_ms` is when
+  the last seen device first showed up, a hint for the burst length.
+  """
+  @spec parse_burst!(binary()) :: %{atom() => non_neg_integer() | [reading()]}
+  def parse_burst!(
+        <<radio_on_ms::32, adverts::32, last_new_ms::32, seen, missed, _count, rest::binary>>
+      ) do
+    %{
+      radio_on_ms: radio_on_ms,
+      adverts: adverts,
+      last_new_ms: last_new_ms,
+      seen: seen,
+      missed: missed,
+      readings: parse_entries(rest, [])
+    }
+  end
+
+  defp parse_entries(<<>>, acc), do: :lists.reverse(acc)
+
+  defp parse_entries(
+         <<id::16, addr::binary-6, vendor, model, fields, battery, temp_dc::signed-16, humidity,
+           pir, door, rssi::signed-8, age::32, rest::binary>>,
+         acc
+       ) do
+    entry =
+      %{
+        device_id: id,
+        addr: addr,
+        vendor: vendor(vendor),
+        model: model,
+        rssi: rssi,
+        age_ms: age,
+        stale: (fields &&& @stale) != 0
+      }
+      |> put_if(fields, @has_battery, :battery, battery)
+      |> put_if(fields, @has_temp, :temp_c, temp_dc / 10)
+      |> put_if(fields, @has_humidity, :humidity, humidity)
+      |> put_if(fields, @has_pir, :motion, pir == 1)
+      |> put_if(fields, @has_door, :contact, if(door == 1, do: :open, else: :closed))
+
+    parse_entries(rest, [entry | acc])
+  end
+
+  defp put_if(map, fields, bit, key, value) do
+    if (fields &&& bit) != 0, do: Map.put(map, key, value), else: map
+  end
+
+  defp vendor(1), do: :switchbot
+  defp vendor(2), do: :bthome
+  defp vendor(3), do: :xiaomi
+  defp vendor(4), do: :govee
+  defp vendor(5), do: :inkbird
+  defp vendor(_), do: :unknown
+end
@@ -0,0 +1,127 @@
+defmodule SampleApp.Rules do
+  @moduledoc """
+  Threshold / edge-trigger rules evaluated inside the native port.
+
+  A rule watches one decoded field and is "active" while its condition holds.
+  To leave the active state the value has to move `:hysteresis` past the
+  threshold. The driver only sends an event when a rule changes state, so the
+  subscriber wakes for real events rather than for every advertisement.
+
+  ## Example
+
+      rules = [
+        %{id: 1, field: :door, op: :equal, threshold: 1, notify: [:rise]},
+        %{id: 2, field: :temperature_dc, op: :above, threshold: 300, hysteresis: 5},
+        %{id: 3, field: :battery, op: :below, threshold: 20, device_id: 0x8006}
+      ]
+
+      SampleApp.Port.load_rules(port, rules)
+  """
+
+  import Bitwise
+
+  @type field :: :temperature_dc | :humidity_percent | :battery | :pir | :door
+  @type op :: :above | :below | :equal
+
+  @typedoc """
+  A rule. `:device_id` defaults to any device and `:notify` to `[:rise, :fall]`.
+  Temperature thresholds are in deci-degrees Celsius.
+  """
+  @type rule :: %{
+          required(:id) => 0..255,
+          required(:field) => field(),
+          required(:op) => op(),
+          required(:threshold) => integer(),
+          optional(:hysteresis) => non_neg_integer(),
+          optional(:device_id) => 0..0xFFFF,
+          optional(:notify) => [:rise | :fall]
+        }
+
+  @type event :: %{
+          rule_id: 0..255,
+          edge: :rise | :fall,
+          device_id: 0..0xFFFF,
+          addr: <<_::48>>,
+          value: integer(),
+          count: non_neg_integer()
+        }
+
+  @event_rule 0x01
+
+  @flag_any_device 0x01
+  @flag_notify_rise 0x02
+  @flag_notify_fall 0x04
+
+  @doc """
+  Encode rules into the wire format expected by the driver.
+  """
+  @spec encode([rule()]) :: binary()
+  def encode(rules), do: encode(rules, <<>>)
+
+  defp encode([], acc), do: acc
+
+  defp encode([rule | rest], acc) do
+    {flags, device_id} =
+      case Map.get(rule, :device_id) do
+        nil -> {@flag_any_device, 0}
+        id -> {0, id}
+      end
+
+    flags = flags ||| notify_flags(Map.get(rule, :notify, [:rise, :fall]), 0)
+
+    bin =
+      <<rule.id, flags, device_id::16, field(rule.field), op(rule.op),
+        rule.threshold::signed-16, Map.get(rule, :hysteresis, 0)::signed-16>>
+
+    encode(rest, <<acc::binary, bin::binary>>)
+  end
+
+  @doc """
+  Parse a `{:switchbot_event, binary}` rule event.
+  """
+  @spec parse_event(binary()) :: {:ok, event()} | :error
+  def parse_event(
+        <<@event_rule, rule_id, rising, device_id::16, addr::binary-6, value::signed-16,
+          count::32>>
+      ) do
+    {:ok,
+     %{
+       rule_id: rule_id,
+       edge: if(rising == 1, do: :rise, else: :fall),
+       device_id: device_id,
+       addr: addr,
+       value: value,
+       count: count
+     }}
+  end
+
+  def parse_event(_), do: :error
+
+  @doc """
+  Parse the reply of `SampleApp.Port.rule_stats/1`.
+  """
+  @spec parse_stats!(binary()) :: [
+          %{id: 0..255, rises: non_neg_integer(), falls: non_neg_integer(), active: non_neg_integer()}
+        ]
+  def parse_stats!(<<_count, rest::binary>>), do: parse_stats(rest, [])
+
+  defp parse_stats(<<>>, acc), do: :lists.reverse(acc)
+
+  defp parse_stats(<<id, rises::32, falls::32, active, rest::binary>>, acc) do
+    parse_stats(rest, [%{id: id, rises: rises, falls: falls, active: active} | acc])
+  end
+
+  defp notify_flags([], acc), do: acc
+  defp notify_flags([:rise | rest], acc), do: notify_flags(rest, acc ||| @flag_notify_rise)
+  defp notify_flags([:fall | rest], acc), do: notify_flags(rest, acc ||| @flag_notify_fall)
+
+  defp field(:temperature_dc), do: 0
+  defp field(:humidity_percent), do: 1
+  defp field(:battery), do: 2
+  defp field(:pir), do: 3
+  defp field(:door), do: 4
+
+  defp op(:above), do: 0
+  defp op(:below), do: 1
+  defp op(:equal), do: 2
+end
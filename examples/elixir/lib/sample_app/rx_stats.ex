@@ -0,0 +1,77 @@
+defmodule SampleApp.RxStats do
+  @moduledoc """
+  Per-device reception statistics collected by the native port.
+
+  Useful to tell apart a sensor that advertises less, one that is out of
+  range, and one whose scan responses get lost:
+
+  - `:adv_ind` / `:scan_rsp` / `:other` count received PDUs by type
+  - `:merged` counts adverts after which a complete frame was available
+  - `:inter_arrival` is a histogram of the time between advertising PDUs
+  - `:rssi_avg` is an EWMA of the RSSI, next to its min and max
+  """
+
+  # Upper bounds (ms) of the inter-arrival buckets; the last one is open-ended.
+  @bucket_bounds_ms [100, 250, 500, 1000, 2000, 5000, 10000, :infinity]
+
+  @type entry :: %{
+          addr: <<_::48>>,
+          device_id: 0..0xFFFF | nil,
+          adv_ind: non_neg_integer(),
+          scan_rsp: non_neg_integer(),
+          other: non_neg_integer(),
+          merged: non_neg_integer(),
+          rssi_avg: integer(),
+          rssi_min: integer(),
+          rssi_max: integer(),
+          inter_arrival: [{pos_integer() | :infinity, non_neg_integer()}]
+        }
+
+  @doc """
+  Parse the reply of `SampleApp.Port.rx_stats/1`:
+
+      <<count::8, count x <<addr::binary-6, device_id::16, has_id::8,
+        adv_ind::32, scan_rsp::32, other::32, merged::32,
+        rssi_avg::signed-8, rssi_min::signed-8, rssi_max::signed-8,
+        hist::binary-16>>>>
+  """
+  @spec parse!(binary()) :: [entry()]
+  def parse!(<<_count, rest::binary>>), do: parse_entries(rest, [])
+
+  @doc """
+  Fraction of received PDUs after which a merged frame was available.
+  """
+  @spec merge_ratio(entry()) :: float() | nil
+  def merge_ratio(%{adv_ind: a, scan_rsp: s, other: o, merged: m}) do
+    case a + s + o do
+      0 -> nil
+      total -> m / total
+    end
+  end
+
+  defp parse_entries(<<>>, acc), do: :lists.reverse(acc)
+
+  defp parse_entries(
+         <<addr::binary-6, id::16, has_id, adv::32, rsp::32, other::32, merged::32,
+           avg::signed-8, min::signed-8, max::signed-8, hist::binary-16, rest::binary>>,
+         acc
+       ) do
+    entry = %{
+      addr: addr,
+      device_id: if(has_id == 1, do: id, else: nil),
+      adv_ind: adv,
+      scan_rsp: rsp,
+      other: other,
+      merged: merged,
+      rssi_avg: avg,
+      rssi_min: min,
+      rssi_max: max,
+      inter_arrival: :lists.zip(@bucket_bounds_ms, counts(hist, []))
+    }
+
+    parse_entries(rest, [entry | acc])
+  end
+
+  defp counts(<<>>, acc), do: :lists.reverse(acc)
+  defp counts(<<n::16, rest::binary>>, acc), do: counts(rest, [n | acc])
+end
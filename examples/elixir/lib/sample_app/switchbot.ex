@@ -9,6 +9,9 @@ defmodule SampleApp.SwitchBot do
 
   - `parse_frame!/1` parses the port payload into a map.
   - `decode/1` converts the map into a typed reading tuple.
+  - `decode_frame/1` does both in one pass over the payload and returns a
+    flat tuple of integers, for loops that poll often. See
+    `SampleApp.Bench.Decode` for what that saves.
   """
 
   import Bitwise
@@ -65,6 +68,24 @@ defmodule SampleApp.SwitchBot do
           | {:motion_raw, frame()}
           | {:unknown, frame()}
 
+  @typedoc """
+  Reading from `decode_frame/1`. Temperatures are in tenths of a degree
+  Celsius; `device_id` is `nil` if `mfg` is too short to carry one. `*_raw`
+  is a recognized model with a payload too short to decode.
+  """
+  @type flat_reading ::
+          {:meter, device_id :: 0..0xFFFF, rssi :: integer(), battery :: 0..127,
+           temp_dc :: integer(), humidity :: 0..127}
+          | {:contact, device_id :: 0..0xFFFF | nil, rssi :: integer(), battery :: 0..127,
+             pir :: pir_flag(), door :: 0 | 1, door_timeout :: 0 | 1,
+             illuminance_flag :: 0 | 1, button_count :: 0..15, time01 :: 0..0xFFFF,
+             time02 :: 0..0xFFFF}
+          | {:motion, device_id :: 0..0xFFFF | nil, rssi :: integer(), battery :: 0..127,
+             pir :: pir_flag(), time01 :: 0..0xFFFF, illuminance :: -1..2}
+          | {:meter_raw | :contact_raw | :motion_raw, device_id :: 0..0xFFFF | nil,
+             rssi :: integer()}
+          | {:unknown, device_id :: 0..0xFFFF | nil, rssi :: integer()}
+
   # Minimum payload lengths for decoding.
   @min_meter_svc_len 3
   @min_meter_mfg_len 13
@@ -96,6 +117,21 @@ defmodule SampleApp.SwitchBot do
     }
   end
 
+  @doc """
+  Parse the reply of `SampleApp.Port.latest_decrypted/2`:
+
+      <<counter::32, plain_len::8, plain::binary-size(plain_len), frame::binary>>
+
+  Returns the frame (see `parse_frame!/1`) with `:plain` and `:counter` added.
+  """
+  @spec parse_decrypted!(binary()) :: map()
+  def parse_decrypted!(<<counter::32, len, plain::binary-size(len), frame::binary>>) do
+    frame
+    |> parse_frame!()
+    |> Map.put(:plain, plain)
+    |> Map.put(:counter, counter)
+  end
+
   @doc """
   Decode a parsed `t:frame/0` into a typed SwitchBot reading.
 
@@ -115,6 +151,67 @@ defmodule SampleApp.SwitchBot do
     end
   end
 
+  @doc """
+  Decode a merged frame from the native port (see `parse_frame!/1`) straight
+  into a `t:flat_reading/0`.
+
+  Each model is one binary match over the whole payload, with no
+  intermediate maps and no float math. Frames too short for their model come
+  back as `*_raw`, models this module does not know as `:unknown`.
+  """
+  @spec decode_frame(binary()) :: flat_reading()
+  def decode_frame(
+        <<_addr::binary-6, rssi::signed-8, svc_len, model, _, _::1, battery::7,
+          _::binary-size(svc_len - 3), mfg_len, _::binary-6, id::16, _::binary-2, _::4,
+          frac::4, above::1, deg::7, _::1, humidity::7, _::binary-size(mfg_len - 13)>>
+      )
+      when model in [@model_meter, @model_outdoor_meter] do
+    temp_dc = deg * 10 + frac
+    temp_dc = if above == 1, do: temp_dc, else: -temp_dc
+    {:meter, id, rssi, battery, temp_dc, humidity}
+  end
+
+  def decode_frame(
+        <<_addr::binary-6, rssi::signed-8, svc_len, @model_contact, _::1, pir::1, _::6, _::1,
+          battery::7, _::5, door_timeout::1, door::1, illuminance_flag::1, time01::16,
+          time02::16, _::4, button_count::4, _::binary-size(svc_len - 9), mfg_len,
+          mfg::binary-size(mfg_len)>>
+      ) do
+    {:contact, mfg_device_id(mfg), rssi, battery, pir, door, door_timeout, illuminance_flag,
+     button_count, time01, time02}
+  end
+
+  def decode_frame(
+        <<_addr::binary-6, rssi::signed-8, svc_len, @model_motion, _::1, pir::1, _::6, _::1,
+          battery::7, time01::16, _::6, light::2, _::binary-size(svc_len - 6), mfg_len,
+          mfg::binary-size(mfg_len)>>
+      ) do
+    {:motion, mfg_device_id(mfg), rssi, battery, pir, time01, light - 1}
+  end
+
+  def decode_frame(
+        <<_addr::binary-6, rssi::signed-8, svc_len, model, _::binary-size(svc_len - 1), mfg_len,
+          mfg::binary-size(mfg_len)>>
+      )
+      when model in [@model_meter, @model_outdoor_meter, @model_contact, @model_motion] do
+    {raw_kind(model), mfg_device_id(mfg), rssi}
+  end
+
+  def decode_frame(
+        <<_addr::binary-6, rssi::signed-8, svc_len, _::binary-size(svc_len), mfg_len,
+          mfg::binary-size(mfg_len)>>
+      ) do
+    {:unknown, mfg_device_id(mfg), rssi}
+  end
+
+  defp raw_kind(@model_contact), do: :contact_raw
+  defp raw_kind(@model_motion), do: :motion_raw
+  defp raw_kind(_meter), do: :meter_raw
+
+  # Same convention as device_id/1, for decode_frame/1.
+  defp mfg_device_id(<<_::binary-6, id::16, _::binary>>), do: id
+  defp mfg_device_id(_), do: nil
+
   # Best-effort device id extraction from manufacturer data.
   # Convention: device_id = (mfg[6] << 8) | mfg[7]
   @spec device_id(binary()) :: non_neg_integer() | nil
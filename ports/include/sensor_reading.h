@@ -0,0 +1,37 @@
+#ifndef __SENSOR_READING_H__
+#define __SENSOR_READING_H__
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Bits in sensor_reading_t.fields telling which values were decoded.
+#define READING_HAS_BATTERY 0x01
+#define READING_HAS_TEMP 0x02
+#define READING_HAS_HUMIDITY 0x04
+#define READING_HAS_PIR 0x08
+#define READING_HAS_DOOR 0x10
+#define READING_STALE 0x80 // set by the device cache for warm-start entries, never by decoders
+
+// Decoded reading in a vendor-independent, fixed-point form, so it can be
+// produced in the scan callback without floats.
+typedef struct
+{
+    uint8_t vendor; // VENDOR_*, see vendor_profiles.h
+    uint8_t model; // vendor specific (SwitchBot: first service data byte)
+    uint8_t fields;
+
+    uint8_t battery; // percent
+    int16_t temp_dc; // deci-degrees Celsius
+    uint8_t humidity; // percent
+    uint8_t pir; // 0 | 1
+    uint8_t door; // 0 closed | 1 open
+} sensor_reading_t;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
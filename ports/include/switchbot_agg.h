@@ -0,0 +1,93 @@
+#ifndef __SWITCHBOT_AGG_H__
+#define __SWITCHBOT_AGG_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "sensor_reading.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Incremental per-device temperature/humidity statistics.
+//
+// Each device keeps AGG_MAX_WINDOWS independent windows. A window is either
+// tumbling (stats of the last completed, aligned window) or sliding (stats of
+// the trailing window, approximated with AGG_SLOTS sub-buckets).
+
+#define AGG_MAX_WINDOWS 2
+#define AGG_SLOTS 6
+
+enum
+{
+    AGG_METRIC_TEMP = 0, // deci-degrees Celsius
+    AGG_METRIC_HUMIDITY = 1, // percent
+    AGG_METRIC_COUNT
+};
+
+enum
+{
+    AGG_MODE_TUMBLING = 0,
+    AGG_MODE_SLIDING = 1
+};
+
+typedef struct
+{
+    uint16_t count;
+    int16_t min;
+    int16_t max;
+    int32_t sum;
+} agg_stat_t;
+
+typedef struct
+{
+    uint8_t mode;
+    uint32_t window_s; // 0 disables the window
+} agg_window_cfg_t;
+
+typedef struct
+{
+    agg_window_cfg_t win[AGG_MAX_WINDOWS];
+} agg_config_t;
+
+typedef struct
+{
+    uint32_t epoch; // index of the open window (tumbling)
+    union
+    {
+        struct
+        {
+            agg_stat_t open[AGG_METRIC_COUNT];
+            agg_stat_t closed[AGG_METRIC_COUNT];
+        } tumbling;
+        struct
+        {
+            uint32_t epoch[AGG_SLOTS];
+            agg_stat_t stat[AGG_SLOTS][AGG_METRIC_COUNT];
+        } sliding;
+    } u;
+} agg_window_t;
+
+typedef struct
+{
+    bool active; // at least one sample was aggregated
+    agg_window_t win[AGG_MAX_WINDOWS];
+} agg_device_t;
+
+// Default windows: tumbling 5 minutes and tumbling 1 hour.
+void agg_config_init(agg_config_t *cfg);
+
+void agg_reset(agg_device_t *a);
+
+// Adds the temperature/humidity of `r` (if decoded) at time `now_s`.
+void agg_update(agg_device_t *a, const agg_config_t *cfg, uint32_t now_s, const sensor_reading_t *r);
+
+// Reads the stats of window `w` as of `now_s` into `out[AGG_METRIC_COUNT]`.
+void agg_read(const agg_device_t *a, const agg_config_t *cfg, int w, uint32_t now_s, agg_stat_t *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
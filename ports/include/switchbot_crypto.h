@@ -0,0 +1,82 @@
+#ifndef __SWITCHBOT_CRYPTO_H__
+#define __SWITCHBOT_CRYPTO_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "mbedtls/ccm.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Per-device AES-128-CCM keys for encrypted advertisement payloads.
+//
+// An encrypted payload (service or manufacturer data, as stored in the
+// cache) is laid out as:
+//
+//   <<header:offset, ciphertext, counter:4, tag:4>>
+//
+// Service data is BTHome v2: the cache holds it without its UUID16, the
+// header is the one device-info byte (offset 1) and the counter is
+// little-endian. The 13-byte nonce is
+//
+//   <<mac:6 (display order), 0xD2, 0xFC (UUID16 little-endian), device_info:8, counter:4>>
+//
+// Manufacturer data has no standard scheme; this driver uses
+//
+//   <<mac:6 (display order), header:3 (first bytes, zero padded), counter:4>>
+//
+// with a big-endian counter. Either way the header is authenticated as
+// part of the nonce and left in clear.
+
+#define CRYPTO_MAX_KEYS 8
+#define CRYPTO_KEY_LEN 16
+#define CRYPTO_COUNTER_LEN 4
+#define CRYPTO_TAG_LEN 4
+#define CRYPTO_NONCE_LEN 13
+#define CRYPTO_BTHOME_UUID 0xFCD2
+
+enum
+{
+    CRYPTO_SOURCE_SVC = 0,
+    CRYPTO_SOURCE_MFG = 1
+};
+
+typedef struct
+{
+    bool in_use;
+    uint8_t addr[6]; // little-endian, as received
+    uint8_t source;
+    uint8_t offset;
+    mbedtls_ccm_context ccm; // key schedule set up once in crypto_set_key
+} crypto_key_t;
+
+typedef struct
+{
+    crypto_key_t keys[CRYPTO_MAX_KEYS];
+    uint32_t decrypt_ok;
+    uint32_t decrypt_fail;
+} crypto_store_t;
+
+void crypto_init(crypto_store_t *s);
+
+// Adds or replaces the key for `addr`. Returns false if the store is full or
+// the key is rejected. Service data keys need offset 1, see above.
+bool crypto_set_key(crypto_store_t *s, const uint8_t addr[6], uint8_t source, uint8_t offset,
+    const uint8_t key[CRYPTO_KEY_LEN]);
+
+bool crypto_clear_key(crypto_store_t *s, const uint8_t addr[6]);
+
+crypto_key_t *crypto_find(crypto_store_t *s, const uint8_t addr[6]);
+
+// Decrypts and authenticates `payload` into `out` (at least `len` bytes).
+// Returns false on a short payload or a tag mismatch.
+bool crypto_decrypt(crypto_store_t *s, crypto_key_t *k, const uint8_t *payload, uint8_t len, uint8_t *out,
+    uint8_t *out_len, uint32_t *counter);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,30 @@
+#ifndef __SWITCHBOT_DECODE_H__
+#define __SWITCHBOT_DECODE_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "sensor_reading.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// SwitchBot model identifiers (first byte of the service data payload).
+#define SWITCHBOT_MODEL_METER 0x54
+#define SWITCHBOT_MODEL_OUTDOOR_METER 0x77
+#define SWITCHBOT_MODEL_CONTACT 0x64
+#define SWITCHBOT_MODEL_MOTION 0x73
+
+// Native counterpart of SampleApp.SwitchBot.decode/1.
+//
+// Decodes the merged service/manufacturer data. Returns false when the model is
+// unknown or the payload is too short; `out->model` is set either way.
+bool switchbot_decode(const uint8_t *svc, uint8_t svc_len, const uint8_t *mfg, uint8_t mfg_len,
+    sensor_reading_t *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
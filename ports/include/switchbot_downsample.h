@@ -0,0 +1,58 @@
+#ifndef __SWITCHBOT_DOWNSAMPLE_H__
+#define __SWITCHBOT_DOWNSAMPLE_H__
+
+#include <stdint.h>
+
+#include "switchbot_history.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Downsampling of stored history for dashboard queries.
+//
+// Both methods split the queried range into time buckets and keep real
+// samples, so the result never holds more than `points` samples no matter how
+// many are stored:
+//
+// - DS_METHOD_MINMAX keeps the min and max sample of points / 2 buckets.
+// - DS_METHOD_LTTB ("largest triangle three buckets") keeps the first and
+//   last sample plus, for each of points - 2 buckets, the sample forming the
+//   largest triangle with the previously kept sample and the next bucket's
+//   average.
+//
+// If the range holds no more than `points` samples they are returned as is.
+
+#define DS_MAX_POINTS 256
+
+enum
+{
+    DS_METHOD_MINMAX = 0,
+    DS_METHOD_LTTB = 1
+};
+
+enum
+{
+    DS_METRIC_TEMP = 0,
+    DS_METRIC_HUMIDITY = 1
+};
+
+typedef struct
+{
+    int64_t t_sum; // relative to the first sample
+    int32_t v_sum;
+    uint16_t count;
+} ds_bucket_t;
+
+// `scratch` must hold DS_MAX_POINTS buckets and `out` DS_MAX_POINTS samples.
+// `points` must be at least 3 (0 is returned otherwise) and is capped at
+// DS_MAX_POINTS. Returns the number of samples written to `out`, at most
+// `points`, oldest first.
+int ds_query(const hist_store_t *h, uint8_t owner, uint32_t since_s, uint32_t until_s, int points,
+    uint8_t method, uint8_t metric, ds_bucket_t *scratch, hist_sample_t *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
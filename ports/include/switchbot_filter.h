@@ -0,0 +1,77 @@
+#ifndef __SWITCHBOT_FILTER_H__
+#define __SWITCHBOT_FILTER_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Small BPF-style filter over the raw advertising data, run before an
+// advert is parsed or cached. Instructions are <<op:8, jt:8, jf:8, k:16>>
+// on the wire, with one accumulator A and one index register X:
+//
+//   FILTER_LD_LEN   A = data length
+//   FILTER_LD_B     A = data[k]
+//   FILTER_LD_H     A = data[k] << 8 | data[k + 1]
+//   FILTER_LD_AD    X = value offset of the first AD structure of type k,
+//                   A = its value length (0 if there is none)
+//   FILTER_LD_BX    A = data[X + k]
+//   FILTER_LD_HX    A = data[X + k] << 8 | data[X + k + 1]
+//   FILTER_AND      A = A & k
+//   FILTER_JEQ      pc += (A == k) ? jt : jf
+//   FILTER_JGT      pc += (A > k) ? jt : jf
+//   FILTER_JGE      pc += (A >= k) ? jt : jf
+//   FILTER_JSET     pc += (A & k) ? jt : jf
+//   FILTER_RET      accept if k != 0
+//
+// Jumps are relative to the next instruction and only go forward, so every
+// program terminates. A load past the end of the data rejects the advert.
+// The empty program accepts everything.
+
+#define FILTER_MAX_INSNS 32
+#define FILTER_INSN_WIRE_LEN 5
+
+enum
+{
+    FILTER_LD_LEN = 0x01,
+    FILTER_LD_B = 0x02,
+    FILTER_LD_H = 0x03,
+    FILTER_LD_AD = 0x04,
+    FILTER_LD_BX = 0x05,
+    FILTER_LD_HX = 0x06,
+    FILTER_AND = 0x10,
+    FILTER_JEQ = 0x20,
+    FILTER_JGT = 0x21,
+    FILTER_JGE = 0x22,
+    FILTER_JSET = 0x23,
+    FILTER_RET = 0x30
+};
+
+typedef struct
+{
+    uint8_t op;
+    uint8_t jt;
+    uint8_t jf;
+    uint16_t k;
+} filter_insn_t;
+
+typedef struct
+{
+    uint8_t count;
+    filter_insn_t insn[FILTER_MAX_INSNS];
+} filter_prog_t;
+
+// Parses and verifies a program: known opcodes, in-range jumps and a
+// FILTER_RET as the last instruction.
+bool filter_load(filter_prog_t *prog, const uint8_t *data, size_t len);
+
+bool filter_run(const filter_prog_t *prog, const uint8_t *data, uint8_t data_len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,111 @@
+#ifndef __SWITCHBOT_FLASHLOG_H__
+#define __SWITCHBOT_FLASHLOG_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Append-only log of decoded readings in a raw flash partition.
+//
+// Records are collected in a RAM page and written one page at a time. The
+// partition is used as a ring of pages; a sector is erased when the write
+// head enters it, dropping the oldest pages, so every sector wears evenly.
+// Each page carries a sequence number, the boot it was written in and a
+// CRC, which is all flog_mount needs to find head and tail again.
+//
+// Readers address records with a cursor (page seq * FLOG_RECS_PER_PAGE +
+// index) that only grows, so a client can resume where it stopped.
+//
+// Locking is the caller's: flog_append / flog_take_page / flog_read_ram
+// share the RAM pages with the scan callback; flog_write_page / flog_read
+// touch flash only and must not run concurrently with each other.
+
+#define FLOG_PAGE_SIZE 256
+#define FLOG_SECTOR_SIZE 4096
+#define FLOG_HDR_LEN 10 // <<magic:16, seq:32, boot:16, count:8, crc:8>>
+#define FLOG_REC_LEN 12 // <<t_s:32, device_id:16, vendor:8, fields:8, temp_dc:s16, humidity:8, battery:8>>
+#define FLOG_RECS_PER_PAGE ((FLOG_PAGE_SIZE - FLOG_HDR_LEN) / FLOG_REC_LEN)
+#define FLOG_PAGES_PER_SECTOR (FLOG_SECTOR_SIZE / FLOG_PAGE_SIZE)
+
+typedef struct
+{
+    int (*read)(void *arg, uint32_t offset, void *dst, size_t len);
+    int (*write)(void *arg, uint32_t offset, const void *src, size_t len);
+    int (*erase)(void *arg, uint32_t offset, size_t len);
+    void *arg;
+    uint32_t size; // bytes, a multiple of FLOG_SECTOR_SIZE
+} flog_flash_t;
+
+typedef struct
+{
+    uint16_t boot;
+    uint32_t t_s; // seconds since that boot
+    uint16_t device_id;
+    uint8_t vendor;
+    uint8_t fields; // READING_HAS_*
+    int16_t temp_dc;
+    uint8_t humidity;
+    uint8_t battery;
+} flog_record_t;
+
+typedef struct
+{
+    uint32_t records; // appended
+    uint32_t dropped; // RAM full while a page waited for flash
+    uint32_t pages_written;
+    uint32_t erases;
+    uint32_t bytes_written; // page bytes programmed
+    uint32_t payload_bytes; // record bytes in those pages
+} flog_stats_t;
+
+typedef struct
+{
+    flog_flash_t flash;
+    uint32_t pages;
+    uint16_t boot;
+
+    uint32_t tail_seq; // oldest page still on flash
+    uint32_t flash_seq; // next page seq to be written to flash
+
+    // RAM side
+    uint8_t fill[FLOG_PAGE_SIZE];
+    uint8_t fill_count;
+    uint32_t fill_seq;
+    uint8_t pending[FLOG_PAGE_SIZE];
+    uint8_t pending_count;
+    uint32_t pending_seq;
+    bool have_pending;
+
+    flog_stats_t stats;
+} flog_t;
+
+// Scans the partition for the newest and oldest valid pages.
+bool flog_mount(flog_t *l, const flog_flash_t *flash);
+
+// Adds a record to the RAM page. Returns false if it had to be dropped.
+bool flog_append(flog_t *l, const flog_record_t *r);
+
+// Hands the next page to write to the flusher: a full page, or with
+// `partial` the page being filled. Returns false if there is none.
+bool flog_take_page(flog_t *l, bool partial, uint8_t *page, uint32_t *seq);
+
+bool flog_write_page(flog_t *l, uint32_t seq, const uint8_t *page);
+
+// Reads up to `max` records at *cursor from flash, advancing *cursor.
+// Stops at the first page not on flash yet.
+int flog_read(const flog_t *l, uint32_t *cursor, flog_record_t *out, int max);
+
+// Same for the pages still in RAM; call after flog_read.
+int flog_read_ram(const flog_t *l, uint32_t *cursor, flog_record_t *out, int max);
+
+uint32_t flog_pages_used(const flog_t *l);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
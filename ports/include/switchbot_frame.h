@@ -0,0 +1,96 @@
+#ifndef __SWITCHBOT_FRAME_H__
+#define __SWITCHBOT_FRAME_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Framing for the binary serial export, shared by the driver and host tools.
+//
+// <<0xA5, 0x5A, len:8, seq:16, type:8, payload:len, crc:16>>
+//
+// The CRC (CRC-16/CCITT-FALSE) covers len through payload. seq grows by one
+// per frame sent, so a reader can tell lost frames from a quiet link.
+
+#define FRAME_SYNC0 0xA5
+#define FRAME_SYNC1 0x5A
+#define FRAME_HDR_LEN 6
+#define FRAME_CRC_LEN 2
+#define FRAME_MAX_PAYLOAD 64
+#define FRAME_MAX_LEN (FRAME_HDR_LEN + FRAME_MAX_PAYLOAD + FRAME_CRC_LEN)
+
+enum
+{
+    FRAME_TYPE_READING = 0x01
+};
+
+// FRAME_TYPE_READING payload:
+// <<t_ms:32, addr:6, rssi:s8, vendor:8, adv_seq:8, device_id:16, fields:8,
+//   temp_dc:s16, humidity:8, battery:8>>
+// If fields has FRAME_READING_HAS_SEQ, adv_seq is the per-packet counter of
+// the advert (see vendor_adv_seq), otherwise it is 0.
+#define FRAME_READING_LEN 20
+#define FRAME_READING_HAS_SEQ 0x40 // in fields, next to the READING_HAS_* bits
+
+typedef struct
+{
+    uint32_t t_ms; // sender uptime
+    uint8_t addr[6];
+    int8_t rssi;
+    uint8_t vendor;
+    uint8_t adv_seq;
+    uint16_t device_id;
+    uint8_t fields; // READING_HAS_*
+    int16_t temp_dc;
+    uint8_t humidity;
+    uint8_t battery;
+} frame_reading_t;
+
+typedef struct
+{
+    uint16_t seq;
+    uint8_t type;
+    uint8_t len;
+    const uint8_t *payload; // valid until the next frame_parser_push
+} frame_t;
+
+typedef struct
+{
+    uint32_t frames;
+    uint32_t crc_errors;
+    uint32_t skipped; // bytes dropped while hunting for a sync
+    uint32_t lost; // frames missing according to seq
+} frame_rx_stats_t;
+
+typedef struct
+{
+    uint8_t buf[FRAME_MAX_LEN];
+    uint16_t pos;
+    bool have_seq;
+    uint16_t next_seq;
+    frame_rx_stats_t stats;
+} frame_parser_t;
+
+uint16_t frame_crc16(uint16_t crc, const uint8_t *p, size_t n);
+
+// Writes one frame to `out` (at least FRAME_HDR_LEN + len + FRAME_CRC_LEN
+// bytes). Returns its length, or 0 if the payload is too long.
+size_t frame_encode(uint8_t *out, uint16_t seq, uint8_t type, const uint8_t *payload, uint8_t len);
+
+void frame_reading_encode(uint8_t out[FRAME_READING_LEN], const frame_reading_t *r);
+bool frame_reading_decode(const frame_t *f, frame_reading_t *r);
+
+void frame_parser_init(frame_parser_t *p);
+
+// Feeds one received byte. Returns true when it completed a valid frame.
+bool frame_parser_push(frame_parser_t *p, uint8_t byte, frame_t *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,169 @@
+#ifndef __SWITCHBOT_GATT_H__
+#define __SWITCHBOT_GATT_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Command client for SwitchBot Bot/Curtain over GATT.
+//
+// Commands are queued per device and written to the device's command
+// characteristic one at a time. Up to GATT_CONN_MAX connections stay open
+// after use, so further commands skip the connect; the least recently used
+// idle one is closed when a new device needs a slot. Discovered
+// characteristic handles are cached by address (and persisted by the
+// caller), so a reconnect skips discovery too.
+//
+// The stack is reached through gatt_ops_t only; the client itself is plain
+// state and is driven by the gatt_on_* calls. The caller provides the
+// command storage, GATT_CONN_MAX queues of `queue_len` commands. Every entry
+// point returns the commands it finished in `done`, which must hold
+// gatt_done_max() results.
+
+#define GATT_CONN_MAX 3
+#define GATT_QUEUE_DEFAULT 4 // commands per device
+#define GATT_QUEUE_MAX 16
+#define GATT_CMD_MAX 20
+#define GATT_HANDLE_CACHE 8
+#define GATT_HANDLE_WIRE_LEN 8 // <<addr:6, handle:16>>
+
+#define GATT_NO_CONN 0xFFFF
+
+enum
+{
+    GATT_OK = 0,
+    GATT_EQUEUE_FULL = 1,
+    GATT_EBUSY = 2 // every connection slot has pending work
+};
+
+// gatt_result_t.status
+enum
+{
+    GATT_STATUS_OK = 0,
+    GATT_STATUS_CONNECT_FAILED = 1,
+    GATT_STATUS_NO_CHARACTERISTIC = 2,
+    GATT_STATUS_WRITE_FAILED = 3,
+    GATT_STATUS_DISCONNECTED = 4
+};
+
+enum
+{
+    GATT_SLOT_FREE = 0,
+    GATT_SLOT_PENDING, // waiting for its turn to connect
+    GATT_SLOT_CONNECTING,
+    GATT_SLOT_DISCOVERING,
+    GATT_SLOT_READY,
+    GATT_SLOT_WRITING
+};
+
+typedef struct
+{
+    // Each returns 0 when the request was started.
+    int (*connect)(void *arg, const uint8_t addr[6], uint8_t addr_type);
+    int (*disconnect)(void *arg, uint16_t conn);
+    int (*discover)(void *arg, uint16_t conn);
+    int (*write)(void *arg, uint16_t conn, uint16_t handle, const uint8_t *data, uint8_t len);
+    void *arg;
+} gatt_ops_t;
+
+typedef struct
+{
+    uint16_t seq;
+    uint8_t len;
+    uint8_t data[GATT_CMD_MAX];
+    uint32_t submitted_ms;
+} gatt_cmd_t;
+
+typedef struct
+{
+    uint8_t state; // GATT_SLOT_*
+    uint8_t addr[6];
+    uint8_t addr_type;
+    uint16_t conn;
+    uint16_t write_handle;
+    bool handle_cached; // write_handle came from the cache, not discovery
+    uint32_t last_used_ms;
+
+    uint8_t head;
+    uint8_t count;
+    gatt_cmd_t *q; // queue_len commands of the caller's storage
+} gatt_slot_t;
+
+typedef struct
+{
+    uint8_t addr[6];
+    uint16_t handle;
+} gatt_handle_entry_t;
+
+typedef struct
+{
+    uint8_t addr[6];
+    uint16_t seq;
+    uint8_t status; // GATT_STATUS_*
+    uint32_t latency_ms; // submit to completion
+} gatt_result_t;
+
+typedef struct
+{
+    uint32_t submitted;
+    uint32_t completed;
+    uint32_t failed;
+    uint32_t connects;
+    uint32_t reused; // commands written on an already open connection
+    uint32_t discoveries;
+    uint32_t handle_hits; // connects that skipped discovery
+    uint32_t evictions;
+    uint64_t latency_ms_sum;
+    uint32_t latency_ms_max;
+} gatt_stats_t;
+
+typedef struct
+{
+    gatt_ops_t ops;
+    gatt_slot_t slot[GATT_CONN_MAX];
+    uint8_t queue_len;
+
+    uint8_t n_handles;
+    gatt_handle_entry_t handles[GATT_HANDLE_CACHE];
+    bool handles_dirty; // set when the cache changed; cleared by the caller
+
+    uint16_t next_seq;
+    gatt_stats_t stats;
+} gatt_client_t;
+
+// `cmds` holds GATT_CONN_MAX * queue_len commands (1..GATT_QUEUE_MAX).
+void gatt_init(gatt_client_t *c, const gatt_ops_t *ops, gatt_cmd_t *cmds, uint8_t queue_len);
+
+static inline int gatt_done_max(const gatt_client_t *c)
+{
+    return GATT_CONN_MAX * c->queue_len;
+}
+
+int gatt_submit(gatt_client_t *c, const uint8_t addr[6], uint8_t addr_type, const uint8_t *data, uint8_t len,
+    uint32_t now_ms, uint16_t *seq, gatt_result_t *done, int *n_done);
+
+// Stack callbacks. gatt_on_connect applies to the slot in GATT_SLOT_CONNECTING.
+void gatt_on_connect(gatt_client_t *c, bool ok, uint16_t conn, uint32_t now_ms, gatt_result_t *done, int *n_done);
+void gatt_on_discovered(gatt_client_t *c, uint16_t conn, uint16_t handle, uint32_t now_ms, gatt_result_t *done,
+    int *n_done);
+void gatt_on_write(gatt_client_t *c, uint16_t conn, bool ok, uint32_t now_ms, gatt_result_t *done, int *n_done);
+void gatt_on_disconnect(gatt_client_t *c, uint16_t conn, uint32_t now_ms, gatt_result_t *done, int *n_done);
+
+// Closes connections idle for longer than idle_ms.
+void gatt_tick(gatt_client_t *c, uint32_t now_ms, uint32_t idle_ms);
+
+uint8_t gatt_open_connections(const gatt_client_t *c);
+
+// Handle cache as <<addr:6, handle:16>> records, for persisting.
+size_t gatt_handles_export(const gatt_client_t *c, uint8_t *out, size_t cap);
+void gatt_handles_import(gatt_client_t *c, const uint8_t *data, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,102 @@
+#ifndef __SWITCHBOT_HISTORY_H__
+#define __SWITCHBOT_HISTORY_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Delta-compressed meter history.
+//
+// Samples are stored in fixed-size blocks taken from a shared pool. The first
+// sample of a block is a keyframe:
+//
+//   <<t_s:32, temp_dc:s16, humidity:8, battery:8>>
+//
+// and every following sample is a head byte plus optional varints:
+//
+//   head = gap_code:5 | battery_changed:1 | humidity_changed:1 | temp_changed:1
+//
+// gap_code is the zigzag-encoded change of the time gap against the previous
+// gap, or HIST_GAP_ESCAPE followed by that value as a varint when it does not
+// fit. Changed fields follow as zigzag varints of their delta. A steady meter
+// sampled at a regular interval costs one byte per sample.
+//
+// When the pool is full the oldest block (of any device) is recycled. The
+// pool is supplied by the caller, HIST_POOL_BLOCKS by default and at most
+// HIST_MAX_BLOCKS.
+
+#define HIST_BLOCK_DATA 60
+#define HIST_POOL_BLOCKS 96
+#define HIST_MAX_BLOCKS 512
+#define HIST_NO_OWNER 0xFF
+#define HIST_GAP_ESCAPE 0x1F
+
+// Keep at most one sample per device per interval.
+#define HIST_MIN_INTERVAL_S 60
+
+typedef struct
+{
+    uint32_t t_s;
+    int16_t temp_dc;
+    uint8_t humidity;
+    uint8_t battery;
+} hist_sample_t;
+
+typedef struct
+{
+    uint8_t owner; // device slot or HIST_NO_OWNER
+    uint8_t used; // bytes of data in use
+    uint16_t samples;
+    uint32_t seq; // allocation order
+    uint8_t data[HIST_BLOCK_DATA];
+} hist_block_t;
+
+// Per-device encoder state.
+typedef struct
+{
+    int16_t block; // block being appended to, -1 if none
+    bool have_last;
+    hist_sample_t last;
+    uint32_t last_gap;
+} hist_device_t;
+
+typedef struct
+{
+    hist_block_t *blocks;
+    uint16_t n_blocks;
+    uint32_t next_seq;
+    uint16_t used_blocks;
+
+    // Totals since boot, for compression reporting.
+    uint32_t samples;
+    uint32_t encoded_bytes;
+} hist_store_t;
+
+void hist_init(hist_store_t *h, hist_block_t *blocks, uint16_t n_blocks);
+
+// Frees every block owned by `owner` and resets its encoder state.
+void hist_device_reset(hist_store_t *h, hist_device_t *dev, uint8_t owner);
+
+// Appends a sample. `s->t_s` must not go backwards for a device.
+void hist_append(hist_store_t *h, hist_device_t *dev, uint8_t owner, const hist_sample_t *s);
+
+// Decodes the samples of `owner` with since_s <= t_s <= until_s, oldest first,
+// into at most `max` entries. `*more` is set when matching samples were left
+// out. Returns the number of samples written.
+int hist_read(const hist_store_t *h, uint8_t owner, uint32_t since_s, uint32_t until_s,
+    hist_sample_t *out, int max, bool *more);
+
+// Calls `fn` for every sample of `owner` with since_s <= t_s <= until_s,
+// oldest first.
+typedef void (*hist_visit_fn)(const hist_sample_t *s, void *arg);
+void hist_visit(const hist_store_t *h, uint8_t owner, uint32_t since_s, uint32_t until_s,
+    hist_visit_fn fn, void *arg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,62 @@
+#ifndef __SWITCHBOT_PRESENCE_H__
+#define __SWITCHBOT_PRESENCE_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Per-device presence (asset tag) tracking.
+//
+// A device arrives once its smoothed RSSI reaches `arrive_rssi`. While present,
+// any advert at or above `depart_rssi` keeps it alive, and it departs after
+// `timeout_ms` without one. The gap between the two thresholds keeps a device
+// at the edge of range from flapping.
+
+typedef struct
+{
+    uint32_t timeout_ms;
+    int8_t arrive_rssi;
+    int8_t depart_rssi;
+} presence_config_t;
+
+typedef struct
+{
+    bool present;
+    bool have_rssi;
+    int16_t rssi_x16; // EWMA of RSSI, scaled by 16
+    uint32_t last_seen_ms; // last advert at or above depart_rssi
+    uint16_t arrivals;
+    uint16_t departures;
+} presence_t;
+
+enum
+{
+    PRESENCE_NONE = 0,
+    PRESENCE_ARRIVED = 1,
+    PRESENCE_DEPARTED = 2
+};
+
+// Defaults: 30 s timeout, arrive at -85 dBm, stay alive down to -95 dBm.
+void presence_config_init(presence_config_t *cfg);
+
+void presence_reset(presence_t *p);
+
+// Feeds one advert. Returns PRESENCE_ARRIVED on a transition.
+int presence_on_advert(presence_t *p, const presence_config_t *cfg, uint32_t now_ms, int8_t rssi);
+
+// Checks for a timeout. Returns PRESENCE_DEPARTED on a transition.
+int presence_check(presence_t *p, const presence_config_t *cfg, uint32_t now_ms);
+
+static inline int8_t presence_rssi(const presence_t *p)
+{
+    return (int8_t) (p->rssi_x16 / 16);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,73 @@
+#ifndef __SWITCHBOT_QUERY_H__
+#define __SWITCHBOT_QUERY_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Compact predicate over cached devices. A predicate is a sequence of
+// <<tag:8, len:8, value:len>> clauses, all of which must match:
+//
+//   QUERY_TAG_MODELS        model bytes (any of)
+//   QUERY_TAG_MIN_RSSI      s8
+//   QUERY_TAG_MAX_AGE_MS    u32, time since the frame was last merged
+//   QUERY_TAG_ADDR_PREFIX   1..6 bytes, in display order (aa:bb:.. first)
+//   QUERY_TAG_IDS           u16 device ids (any of)
+//   QUERY_TAG_BATTERY_BELOW u8, percent; devices without battery never match
+//
+// An empty predicate matches every merged device.
+
+#define QUERY_MAX_MODELS 8
+#define QUERY_MAX_IDS 16
+
+enum
+{
+    QUERY_TAG_MODELS = 0x01,
+    QUERY_TAG_MIN_RSSI = 0x02,
+    QUERY_TAG_MAX_AGE_MS = 0x03,
+    QUERY_TAG_ADDR_PREFIX = 0x04,
+    QUERY_TAG_IDS = 0x05,
+    QUERY_TAG_BATTERY_BELOW = 0x06
+};
+
+typedef struct
+{
+    uint8_t present; // bit (1 << tag) for every clause given
+
+    uint8_t n_models;
+    uint8_t models[QUERY_MAX_MODELS];
+    int8_t min_rssi;
+    uint32_t max_age_ms;
+    uint8_t prefix_len;
+    uint8_t prefix[6];
+    uint8_t n_ids;
+    uint16_t ids[QUERY_MAX_IDS];
+    uint8_t battery_below;
+} query_t;
+
+// What a predicate is evaluated against.
+typedef struct
+{
+    const uint8_t *addr; // 6 bytes, little-endian as received
+    int8_t rssi;
+    uint32_t age_ms;
+    uint8_t model;
+    bool have_id;
+    uint16_t id;
+    bool have_battery;
+    uint8_t battery;
+} query_subject_t;
+
+bool query_parse(query_t *q, const uint8_t *data, size_t len);
+
+bool query_match(const query_t *q, const query_subject_t *s);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,95 @@
+#ifndef __SWITCHBOT_RULES_H__
+#define __SWITCHBOT_RULES_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sensor_reading.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Threshold / edge-trigger rules evaluated against decoded readings.
+//
+// A rule is "active" for a device while its condition holds. Leaving the
+// active state needs the value to move `hysteresis` past the threshold, so a
+// reading hovering around it does not flap. Only transitions are reported.
+
+#define RULES_MAX 16
+
+enum
+{
+    RULE_FIELD_TEMP = 0, // deci-degrees Celsius
+    RULE_FIELD_HUMIDITY = 1,
+    RULE_FIELD_BATTERY = 2,
+    RULE_FIELD_PIR = 3,
+    RULE_FIELD_DOOR = 4
+};
+
+enum
+{
+    RULE_OP_ABOVE = 0, // value > threshold
+    RULE_OP_BELOW = 1, // value < threshold
+    RULE_OP_EQUAL = 2 // value == threshold (hysteresis ignored)
+};
+
+// rule_t.flags
+#define RULE_FLAG_ANY_DEVICE 0x01
+#define RULE_FLAG_NOTIFY_RISE 0x02
+#define RULE_FLAG_NOTIFY_FALL 0x04
+
+// Wire size of one rule:
+// <<id:8, flags:8, device_id:16, field:8, op:8, threshold:s16, hysteresis:s16>>
+#define RULE_WIRE_LEN 10
+
+typedef struct
+{
+    uint8_t id;
+    uint8_t flags;
+    uint16_t device_id;
+    uint8_t field;
+    uint8_t op;
+    int16_t threshold;
+    int16_t hysteresis;
+} rule_t;
+
+typedef struct
+{
+    uint8_t count;
+    rule_t rules[RULES_MAX];
+    uint32_t rises[RULES_MAX];
+    uint32_t falls[RULES_MAX];
+} rules_table_t;
+
+// Per-device rule state: bit N set while rule N is active.
+typedef struct
+{
+    uint16_t active;
+} rules_device_t;
+
+typedef struct
+{
+    uint8_t rule_id;
+    uint8_t rising;
+    int16_t value;
+    uint32_t count; // rises or falls so far, including this one
+} rule_event_t;
+
+void rules_init(rules_table_t *t);
+
+// Parses `n` wire-encoded rules. Returns false (leaving `t` untouched) if any
+// rule is malformed.
+bool rules_load(rules_table_t *t, const uint8_t *data, size_t len);
+
+// Evaluates every rule against `r` and writes at most `max_events` events to
+// notify. Returns the number of events written.
+int rules_eval(rules_table_t *t, rules_device_t *dev, uint16_t device_id, const sensor_reading_t *r,
+    rule_event_t *events, int max_events);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,57 @@
+#ifndef __SWITCHBOT_RXSTATS_H__
+#define __SWITCHBOT_RXSTATS_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Per-device reception statistics, updated for every advert of a cached
+// device (merged or not).
+
+// Inter-arrival histogram of advertising PDUs (everything but SCAN_RSP, which
+// follows its ADV_IND immediately). Upper bounds in ms; the last bucket is
+// open-ended.
+#define RX_HIST_BUCKETS 8
+#define RX_HIST_BOUNDS_MS { 100, 250, 500, 1000, 2000, 5000, 10000 }
+
+enum
+{
+    RX_PDU_ADV_IND = 0,
+    RX_PDU_SCAN_RSP = 1,
+    RX_PDU_OTHER = 2
+};
+
+typedef struct
+{
+    uint32_t adv_ind;
+    uint32_t scan_rsp;
+    uint32_t other;
+    uint32_t merged; // adverts after which the frame was merged
+
+    bool have_last;
+    uint32_t last_adv_ms;
+    uint16_t inter_hist[RX_HIST_BUCKETS];
+
+    bool have_rssi;
+    int16_t rssi_x16; // EWMA, alpha = 1/8, scaled by 16
+    int8_t rssi_min;
+    int8_t rssi_max;
+} rxstats_t;
+
+void rxstats_reset(rxstats_t *s);
+
+void rxstats_on_advert(rxstats_t *s, uint32_t now_ms, uint8_t pdu, int8_t rssi, bool merged);
+
+static inline int8_t rxstats_rssi(const rxstats_t *s)
+{
+    return (int8_t) (s->rssi_x16 / 16);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
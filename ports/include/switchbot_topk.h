@@ -0,0 +1,44 @@
+#ifndef __SWITCHBOT_TOPK_H__
+#define __SWITCHBOT_TOPK_H__
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Incrementally maintained ranking of cache slots, strongest key first.
+//
+// Each update moves one entry to its new position (O(TOPK_CAPACITY)). When
+// the ranking is full, the entry updated longest ago makes room if it is
+// older than TOPK_MAX_AGE_MS, so devices that went quiet do not hold their
+// place. Otherwise an entry whose key is below the weakest one is dropped;
+// it re-enters on a later update with a stronger key.
+
+#define TOPK_CAPACITY 16
+#define TOPK_MAX_AGE_MS (30 * 1000)
+
+typedef struct
+{
+    uint8_t slot;
+    int16_t key;
+    uint32_t t_ms; // time of the last update
+} topk_entry_t;
+
+typedef struct
+{
+    uint8_t count;
+    topk_entry_t e[TOPK_CAPACITY];
+} topk_t;
+
+void topk_init(topk_t *t);
+
+void topk_update(topk_t *t, uint8_t slot, int16_t key, uint32_t now_ms);
+
+void topk_remove(topk_t *t, uint8_t slot);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
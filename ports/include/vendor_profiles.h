@@ -0,0 +1,97 @@
+#ifndef __VENDOR_PROFILES_H__
+#define __VENDOR_PROFILES_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "sensor_reading.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Table of supported BLE sensor vendors.
+//
+// Each profile knows how to recognize a device from one advertising PDU
+// (signature), which parts of the advert make a complete frame (merge rule)
+// and how to decode that frame into a sensor_reading_t. Profiles other than
+// SwitchBot can be compiled out through Kconfig.
+
+enum
+{
+    VENDOR_NONE = 0,
+    VENDOR_SWITCHBOT = 1,
+    VENDOR_BTHOME = 2,
+    VENDOR_XIAOMI = 3, // ATC1441 / pvvx custom firmware (UUID 0x181A)
+    VENDOR_GOVEE = 4, // H5072 / H5075 family
+    VENDOR_INKBIRD = 5, // IBS-TH1 / IBS-TH2
+    VENDOR_COUNT
+};
+
+// vendor_profile_t.needs: parts that make a complete frame
+#define VENDOR_NEEDS_MFG 0x01
+#define VENDOR_NEEDS_SVC 0x02
+
+// Fields of interest extracted from one advertising PDU.
+typedef struct
+{
+    const uint8_t *mfg; // manufacturer data, including the company id
+    uint8_t mfg_len;
+
+    const uint8_t *svc; // service data payload after UUID16
+    uint8_t svc_len;
+    uint16_t svc_uuid;
+
+    const uint8_t *name; // local name, not NUL terminated
+    uint8_t name_len;
+
+    bool has_mfg;
+    bool has_svc;
+} adv_extract_t;
+
+typedef struct
+{
+    uint8_t id;
+    const char *name;
+    uint8_t needs;
+    uint16_t svc_uuid; // service data UUID kept by adv_extract, 0 if none
+
+    bool (*match)(const adv_extract_t *ex);
+    bool (*complete)(const uint8_t *svc, uint8_t svc_len, const uint8_t *mfg, uint8_t mfg_len);
+    bool (*decode)(const uint8_t *svc, uint8_t svc_len, const uint8_t *mfg, uint8_t mfg_len,
+        sensor_reading_t *out);
+} vendor_profile_t;
+
+// Parses AD structures: [len][type][value...]. Service data is only kept for
+// UUIDs used by an enabled profile.
+void adv_extract(const uint8_t *data, uint8_t data_len, adv_extract_t *out);
+
+// Returns the profile whose signature matches this PDU, or NULL.
+const vendor_profile_t *vendor_identify(const adv_extract_t *ex);
+
+// Returns the profile for VENDOR_*, or NULL if unknown or compiled out.
+const vendor_profile_t *vendor_profile(uint8_t id);
+
+// True once the stored parts form a frame that can be decoded.
+bool vendor_frame_complete(uint8_t vendor, bool have_svc, const uint8_t *svc, uint8_t svc_len, bool have_mfg,
+    const uint8_t *mfg, uint8_t mfg_len);
+
+bool vendor_decode(uint8_t vendor, const uint8_t *svc, uint8_t svc_len, const uint8_t *mfg, uint8_t mfg_len,
+    sensor_reading_t *out);
+
+// 16-bit device id: SwitchBot uses mfg[6..7], the other vendors the two
+// low-order bytes of the address.
+bool vendor_device_id(uint8_t vendor, const uint8_t addr[6], const uint8_t *mfg, uint8_t mfg_len,
+    uint16_t *out);
+
+// Counter the device bumps with every new reading: the SwitchBot sequence
+// byte mfg[8], the BTHome packet id (object 0x00) or the ATC1441 / pvvx
+// frame counter. False if the vendor or this frame has none.
+bool vendor_adv_seq(uint8_t vendor, const uint8_t *svc, uint8_t svc_len, const uint8_t *mfg, uint8_t mfg_len,
+    uint8_t *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,12 +1,38 @@
 #include "sample_app_port.h"
+#include "switchbot_agg.h"
+#include "switchbot_crypto.h"
+#include "switchbot_downsample.h"
+#include "switchbot_filter.h"
+#include "switchbot_flashlog.h"
+#include "switchbot_frame.h"
+#include "switchbot_gatt.h"
+#include "switchbot_history.h"
+#include "switchbot_presence.h"
+#include "switchbot_query.h"
+#include "switchbot_rules.h"
+#include "switchbot_rxstats.h"
+#include "switchbot_topk.h"
+#include "vendor_profiles.h"
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 
+#include "sdkconfig.h"
+
+// Without instrumentation, ESP_LOGI / ESP_LOGD and their strings are left
+// out of the image.
+#ifndef CONFIG_HELLO_ATOMVM_BLE_SWITCHBOT_INSTRUMENTATION
+#define LOG_LOCAL_LEVEL ESP_LOG_WARN
+#endif
+
+#include <atom.h>
 #include <context.h>
 #include <globalcontext.h>
+#include <interop.h>
 #include <mailbox.h>
+#include <memory.h>
 #include <port.h>
 #include <portnifloader.h>
 #include <term.h>
@@ -16,8 +42,16 @@
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/semphr.h"
+#include "freertos/task.h"
 
+#include "driver/uart.h"
+#include "esp_bt.h"
+#include "esp_cpu.h"
 #include "esp_log.h"
+#include "esp_partition.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "nvs.h"
 #include "nvs_flash.h"
 
 #include "host/ble_gap.h"
@@ -28,14 +62,12 @@
 
 #define TAG "sample_app_port"
 
-// SwitchBot constants:
-// - Company ID in Manufacturer Data = 0x0969
-// - Service Data UUID (16-bit) = 0xFD3D
-// SwitchBot often splits Manufacturer Data (ADV_IND) and Service Data (SCAN_RSP).
-#define SWITCHBOT_COMPANY_ID_LE0 0x69
-#define SWITCHBOT_COMPANY_ID_LE1 0x09
-#define SWITCHBOT_SVC_UUID16_LE0 0x3d
-#define SWITCHBOT_SVC_UUID16_LE1 0xfd
+// For the *_cycles statistics; reads 0 without instrumentation.
+#ifdef CONFIG_HELLO_ATOMVM_BLE_SWITCHBOT_INSTRUMENTATION
+#define CYCLE_COUNT() esp_cpu_get_cycle_count()
+#else
+#define CYCLE_COUNT() 0u
+#endif
 
 enum
 {
@@ -46,9 +78,69 @@ enum
     OPCODE_BLE_STOP = 0x11,
 
     OPCODE_LATEST = 0x12,
-    OPCODE_LATEST_FOR = 0x13
+    OPCODE_LATEST_FOR = 0x13,
+
+    OPCODE_SUBSCRIBE = 0x14,
+    OPCODE_UNSUBSCRIBE = 0x15,
+
+    OPCODE_AGG = 0x20,
+    OPCODE_AGG_CONFIG = 0x21,
+
+    OPCODE_RULES_LOAD = 0x22,
+    OPCODE_RULES_STATS = 0x23,
+
+    OPCODE_HISTORY = 0x24,
+    OPCODE_HISTORY_STATS = 0x25,
+    OPCODE_HISTORY_DOWNSAMPLE = 0x26,
+
+    OPCODE_PRESENCE = 0x27,
+    OPCODE_PRESENCE_CONFIG = 0x28,
+
+    OPCODE_RX_STATS = 0x29,
+    OPCODE_NEAREST = 0x2A,
+    OPCODE_QUERY = 0x2B,
+
+    OPCODE_KEY_SET = 0x2C,
+    OPCODE_KEY_CLEAR = 0x2D,
+    OPCODE_LATEST_DECRYPTED = 0x2E,
+
+    OPCODE_READINGS = 0x2F,
+
+    OPCODE_FILTER_LOAD = 0x30,
+    OPCODE_FILTER_STATS = 0x31,
+
+    OPCODE_GATT_SEND = 0x32,
+    OPCODE_GATT_STATS = 0x33,
+
+    OPCODE_CACHE_STATS = 0x34,
+
+    OPCODE_LOG_READ = 0x35,
+    OPCODE_LOG_STATS = 0x36,
+
+    OPCODE_EXPORT_START = 0x37,
+    OPCODE_EXPORT_STATS = 0x38,
+
+    OPCODE_CLOSE = 0x39,
+    OPCODE_BLE_STATS = 0x3A,
+    OPCODE_PORT_INFO = 0x3B,
+    OPCODE_SCAN_BURST = 0x3C,
+    OPCODE_IDLE_CONFIG = 0x3D,
+    OPCODE_IDLE_STATS = 0x3E,
+    OPCODE_MEM_CONFIG = 0x3F,
+    OPCODE_MEM_STATS = 0x40
 };
 
+// Asynchronous events sent to the subscribed process as
+// {switchbot_event, <<kind:8, ...>>}
+enum
+{
+    EVENT_RULE = 0x01,
+    EVENT_PRESENCE = 0x02,
+    EVENT_GATT = 0x03
+};
+
+static const char *const switchbot_event_atom = ATOM_STR("\xF", "switchbot_event");
+
 static term make_error(Context *ctx, uint8_t code)
 {
     uint8_t out[2] = { 0x01, code };
@@ -69,439 +161,3880 @@ static term make_ok_with_payload(Context *ctx, const uint8_t *payload, size_t pa
     return bin;
 }
 
-// ----- Minimal ADV parser (no ble_hs_adv_parse_fields dependency) -----
+// ----- Cache (merge ADV_IND + SCAN_RSP) -----
+
+// The cache and the per-device tables below live in g_arena, sized by the
+// first port opened (see arena_create); MAX_DEVICES is the ceiling.
+#define DEFAULT_CACHE_SIZE CONFIG_HELLO_ATOMVM_BLE_SWITCHBOT_CACHE_SIZE
+#define MAX_DEVICES 64
+#define MAX_BLE_DATA 31
 
 typedef struct
 {
-    const uint8_t *mfg;
+    uint8_t addr[6];
+    bool in_use;
+
+    int8_t rssi;
+    uint8_t addr_type; // BLE_ADDR_*, needed to connect
+
+    uint8_t vendor; // VENDOR_*, from the first advert that identified the device
+
+    bool have_mfg;
     uint8_t mfg_len;
+    uint8_t mfg[MAX_BLE_DATA];
 
-    const uint8_t *svc; // service data payload after UUID16
+    bool have_svc;
     uint8_t svc_len;
+    uint8_t svc[MAX_BLE_DATA];
 
-    bool has_mfg;
-    bool has_svc;
-} adv_extract_t;
+    uint16_t device_id; // see vendor_device_id
+    bool have_device_id;
 
-static void adv_extract_init(adv_extract_t *e)
-{
-    memset(e, 0, sizeof(*e));
-}
+    uint8_t ports; // bit per g_ports slot whose filter accepted an advert of this device
+
+    uint32_t merged_ms; // last time a DISC event left the frame merged
+    bool stale; // restored from the warm-start snapshot, not heard since boot
+    bool burst_seen; // accepted by the running OPCODE_SCAN_BURST
+
+#ifdef CONFIG_HELLO_ATOMVM_BLE_SWITCHBOT_CRYPTO
+    // Decrypted payload, for devices with a key in g_crypto
+    bool have_plain;
+    uint8_t plain_len;
+    uint8_t plain[MAX_BLE_DATA];
+    uint32_t plain_counter;
+#endif
+} device_cache_t;
+
+static device_cache_t *g_devices;
+static uint8_t g_cache_size; // slots in g_devices and the tables indexed like it
+static int g_latest_index = -1; // index into g_devices, across all ports
+static SemaphoreHandle_t g_lock;
+
+#ifdef CONFIG_HELLO_ATOMVM_BLE_SWITCHBOT_ANALYTICS
+// Rolling aggregates, indexed like g_devices
+static agg_device_t *g_agg;
+static agg_config_t g_agg_cfg;
+
+// Rule table and per-device rule state, indexed like g_devices
+static rules_table_t g_rules;
+static rules_device_t *g_rule_state;
+#endif
+
+#ifdef CONFIG_HELLO_ATOMVM_BLE_SWITCHBOT_HISTORY
+// Delta-compressed meter history, encoder state indexed like g_devices
+static hist_store_t g_hist;
+static hist_device_t *g_hist_dev;
+static uint32_t g_hist_raw_bytes; // size the same samples take as raw frames
+static uint64_t g_hist_cycles; // CPU cycles spent in hist_append
+
+// Downsampling scratch space, used with g_lock held
+static ds_bucket_t g_ds_buckets[DS_MAX_POINTS];
+static hist_sample_t g_ds_out[DS_MAX_POINTS];
+#endif
+
+// Periodic work (presence timeouts, snapshots, log flushes) runs on g_presence_timer
+static esp_timer_handle_t g_presence_timer;
+
+#define PRESENCE_TICK_MS 1000
 
-// Parses AD structures: [len][type][value...]
-static void adv_extract(const uint8_t *data, uint8_t data_len, adv_extract_t *out)
+#ifdef CONFIG_HELLO_ATOMVM_BLE_SWITCHBOT_ANALYTICS
+// Presence state, indexed like g_devices
+static presence_t *g_presence;
+static presence_config_t g_presence_cfg;
+
+// Reception statistics, indexed like g_devices
+static rxstats_t *g_rxstats;
+
+// Merged devices ranked by smoothed RSSI (strongest first)
+static topk_t g_nearest;
+#endif
+
+#ifdef CONFIG_HELLO_ATOMVM_BLE_SWITCHBOT_CRYPTO
+// AES-CCM keys for encrypted adverts
+static crypto_store_t g_crypto;
+#endif
+
+// Per-port state. Each port opened on the driver takes a slot and gets its
+// own latest pointer, subscriber and advert filter; the scanner and the
+// device cache are shared. A port's bit in the masks below is its slot index.
+// Slots are taken in sample_app_port_create_port and given back by
+// OPCODE_CLOSE, both under g_port_lock.
+#define PORT_MAX 4
+
+typedef struct
 {
-    adv_extract_init(out);
+    bool allocated; // owned by a Context, under g_port_lock
+    bool active; // visible to the scan callback, see filter_pass
+    bool scanning; // holds a reference on the scanner, under g_port_lock
 
-    uint8_t i = 0;
-    while (i < data_len) {
-        uint8_t len = data[i];
-        if (len == 0) {
-            break;
-        }
+    int latest_index; // index into g_devices, under g_lock
+    uint8_t scan_profile; // SCAN_*, see start_scan
+    uint8_t reply_format; // REPLY_*, see OPCODE_LATEST
+    uint8_t *reply; // g_reply_len bytes in g_arena, for per-device listings
+    bool have_subscriber; // under g_lock
+    int32_t subscriber_pid;
+    int32_t process_id; // of the port's Context, to wake it from other tasks
 
-        // Need i + 1 + len <= data_len; otherwise malformed.
-        if ((uint16_t) i + (uint16_t) len >= (uint16_t) data_len) {
-            break;
-        }
+    // Advert filter, see OPCODE_FILTER_LOAD. The scan callback runs
+    // filters[filter_active] without taking g_lock; a load writes the other
+    // slot, publishes it and waits until the callback is out of the old one.
+    filter_prog_t filters[2];
+    uint32_t filter_active;
 
-        uint8_t type = data[i + 1];
-        const uint8_t *val = &data[i + 2];
-        uint8_t val_len = (uint8_t) (len - 1);
+    // Written by the NimBLE host task only
+    uint32_t filter_seen;
+    uint32_t filter_rejected;
+    uint64_t filter_cycles;
+} port_instance_t;
 
-        // Manufacturer Specific Data
-        if (type == 0xFF && val_len >= 2) {
-            out->mfg = val;
-            out->mfg_len = val_len;
-            out->has_mfg = true;
-        }
+static port_instance_t g_ports[PORT_MAX];
+static SemaphoreHandle_t g_port_lock;
+static uint8_t g_scan_refs; // ports that asked for scanning, under g_port_lock
 
-        // Service Data - 16-bit UUID
-        if (type == 0x16 && val_len >= 2) {
-            // UUID is little-endian in the payload
-            if (val[0] == SWITCHBOT_SVC_UUID16_LE0 && val[1] == SWITCHBOT_SVC_UUID16_LE1) {
-                out->svc = val + 2;
-                out->svc_len = (uint8_t) (val_len - 2);
-                out->has_svc = true;
-            }
-        }
+#define PORT_BIT(port) ((uint8_t) (1u << ((port) - g_ports)))
 
-        i = (uint8_t) (i + 1 + len);
-    }
-}
+// Port open options
+enum
+{
+    SCAN_FAST = 0, // scan continuously (default)
+    SCAN_BALANCED = 1,
+    SCAN_LOW_POWER = 2
+};
 
-// ----- Cache (merge ADV_IND + SCAN_RSP) -----
+enum
+{
+    REPLY_FRAME = 0, // OPCODE_LATEST answers with the raw merged frame (default)
+    REPLY_READING = 1 // ... or with a decoded OPCODE_READINGS entry
+};
 
-#define MAX_DEVICES 12
-#define MAX_BLE_DATA 31
+typedef struct
+{
+    uint8_t cache_size; // 0 = not given
+    uint16_t history_blocks; // 0 = not given
+    uint16_t event_queue; // 0 = not given
+    uint8_t gatt_queue; // 0 = not given
+    uint8_t scan_profile;
+    uint8_t reply_format;
+} port_options_t;
+#define ALL_PORTS ((uint8_t) ((1u << PORT_MAX) - 1))
+
+// Set while the scan callback runs the port filters
+static uint32_t g_filter_running;
 
+// Cost of the hard-coded adv_extract + vendor_identify path, next to the
+// port filters. Written by the NimBLE host task only.
+static uint32_t g_extract_runs;
+static uint64_t g_extract_cycles;
+
+// Timed scan burst, see OPCODE_SCAN_BURST. One runs at a time; the port
+// that started it is woken by burst_complete and sends the reply then.
 typedef struct
 {
-    uint8_t addr[6];
-    bool in_use;
+    uint32_t active; // discovery running or waiting for sync; read unlocked by the scan callback
+    bool done; // results wait for the port, under g_lock
+    uint8_t err; // with done: reply this error instead of the results
+    port_instance_t *port; // under g_lock; cleared if the port closes
+    int32_t pid;
+    uint64_t ref_ticks;
+    filter_prog_t filter;
+    uint16_t duration_ms;
+    int64_t start_us;
+    uint32_t radio_on_ms;
+    uint32_t adverts; // accepted by the filter
+    uint32_t last_new_ms; // into the burst, when the last device was first heard
+} scan_burst_t;
 
-    int8_t rssi;
+static scan_burst_t g_burst;
+static const char *const scan_burst_atom = ATOM_STR("\xA", "scan_burst");
 
-    bool have_mfg;
-    uint8_t mfg_len;
-    uint8_t mfg[MAX_BLE_DATA];
+#ifdef CONFIG_HELLO_ATOMVM_BLE_SWITCHBOT_GATT
+// GATT command client (SwitchBot Bot/Curtain), see OPCODE_GATT_SEND. Its
+// queues and completion buffers are in g_arena.
+static gatt_client_t g_gatt;
+static gatt_cmd_t *g_gatt_cmds;
+static gatt_result_t *g_gatt_done; // under g_lock
 
-    bool have_svc;
-    uint8_t svc_len;
-    uint8_t svc[MAX_BLE_DATA];
+#define GATT_IDLE_MS 30000
+#define GATT_CONNECT_TIMEOUT_MS 5000
+#endif
 
-    uint16_t device_id; // derived from mfg[6..7] if available
-    bool have_device_id;
-} device_cache_t;
+#define NVS_NAMESPACE "switchbot"
+#define NVS_KEY_GATT_HANDLES "gatt_handles"
+#define NVS_KEY_SNAPSHOT "cache_snap"
 
-static device_cache_t g_devices[MAX_DEVICES];
-static int g_latest_index = -1; // index into g_devices
-static SemaphoreHandle_t g_lock;
+// Warm-start snapshot of the merged cache, see snapshot_build
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_INTERVAL_MS (10 * 60 * 1000)
+#define SNAPSHOT_RECORD_MAX (6 + 1 + 1 + 1 + 4 + 1 + MAX_BLE_DATA + 1 + MAX_BLE_DATA)
+
+static uint8_t *g_snapshot_buf; // esp_timer task only
+static size_t g_snapshot_buf_len;
+static uint32_t g_snapshot_last_ms;
+static uint32_t g_snapshot_hash; // of the last blob written, ages excluded
+static uint32_t g_snapshot_written;
+static uint32_t g_snapshot_skipped;
+static uint16_t g_snapshot_bytes;
+static uint8_t g_snapshot_restored;
+
+// Time from boot to the first OPCODE_LATEST answer, for warm-start tuning
+static uint32_t g_first_answer_ms;
+static bool g_first_answer_stale;
+
+// Flash log of decoded readings, see OPCODE_LOG_READ. g_log_lock serializes
+// flash access (flusher and readers); the RAM pages are under g_lock.
+#ifdef CONFIG_HELLO_ATOMVM_BLE_SWITCHBOT_FLASH_LOG
+static flog_t g_log;
+static bool g_log_ready = false;
+static SemaphoreHandle_t g_log_lock;
+static const esp_partition_t *g_log_part;
+static uint32_t *g_log_last_s;
+static uint32_t g_log_flush_ms;
+static uint64_t g_log_write_us;
+
+#define LOG_MIN_INTERVAL_S 60
+#define LOG_MAX_BUFFER_MS (5 * 60 * 1000)
+#define LOG_READ_MAX 32
+#define LOG_RECORD_LEN 14
+#endif
+
+// Binary serial export of readings, see OPCODE_EXPORT_START. Frames go to
+// the UART driver's TX buffer with g_lock held, so stopping the export
+// under g_lock is enough to delete the driver safely.
+enum
+{
+    EXPORT_OFF = 0,
+    EXPORT_ALL = 1, // every new sample
+    EXPORT_CHANGES = 2 // only samples whose decoded values changed
+};
+
+#define EXPORT_TX_BUFFER 2048
+#define EXPORT_RX_BUFFER 256 // the driver requires one
+
+static uint8_t g_export_mode = EXPORT_OFF;
+static bool g_export_installed = false;
+static uart_port_t g_export_uart;
+static uint16_t g_export_seq;
+static uint32_t g_export_frames;
+static uint32_t g_export_bytes;
+static uint32_t g_export_dropped; // TX buffer full; seq still advances
+static sensor_reading_t *g_export_last; // EXPORT_CHANGES
+static bool *g_export_have_last;
+
+static GlobalContext *g_global;
 
 // NimBLE state
 static bool g_ble_started = false;
+static bool g_ble_released = false; // controller memory given back to the heap for good
+static bool g_scan_wanted = false; // cleared by OPCODE_BLE_STOP
 static uint8_t g_own_addr_type;
 
-// Find existing entry by address or allocate a new one
-static int cache_find_or_alloc(const uint8_t addr[6])
+// Start/stop accounting, see OPCODE_BLE_STATS
+static uint16_t g_ble_inits;
+static uint16_t g_ble_deep_stops;
+static int64_t g_ble_init_start_us;
+static uint32_t g_ble_init_us; // BLE_START init path
+static uint32_t g_ble_sync_us; // init start to host synced
+static uint32_t g_ble_reclaimed; // heap freed by the last deep stop
+
+// Set while presence_tick runs, see ble_deep_stop
+static uint32_t g_tick_running;
+
+// Auto-idle, see OPCODE_IDLE_CONFIG. With no port called for g_idle_after_ms
+// and no subscriber alive, the scan drops to g_idle_action until the next
+// call. State changes happen under g_port_lock.
+enum
+{
+    IDLE_ACTIVE = 0,
+    IDLE_LOW_DUTY = 1, // scan with SCAN_LOW_POWER
+    IDLE_PAUSED = 2 // no scanning; NimBLE and the cache stay up
+};
+
+#define IDLE_DEFAULT_MS (10 * 60 * 1000)
+
+static uint32_t g_idle_after_ms = IDLE_DEFAULT_MS; // 0 = never
+static uint8_t g_idle_action = IDLE_LOW_DUTY;
+static uint8_t g_idle_state = IDLE_ACTIVE;
+static uint32_t g_last_call_ms; // any port call, written without a lock
+static uint32_t g_idle_since_ms;
+static uint16_t g_idle_entered;
+static uint16_t g_idle_resumed;
+static uint32_t g_idle_total_ms;
+static uint32_t g_idle_last_ms; // length of the last idle period
+
+// Memory pressure, see mem_tick. Each level below a free-heap watermark
+// adds to the ones above it.
+enum
+{
+    MEM_NORMAL = 0,
+    MEM_NO_RAW = 1, // no raw frames copied into replies
+    MEM_SHORT_HISTORY = 2, // history replies cut to a quarter
+    MEM_EVICT = 3, // devices silent for MEM_EVICT_IDLE_MS leave the cache
+    MEM_NO_EXPORT = 4 // no serial export or flash log reads
+};
+
+#define MEM_LEVELS 4
+#define MEM_HYSTERESIS (4 * 1024) // free heap above a watermark before leaving its level
+#define MEM_EVICT_IDLE_MS (60 * 1000)
+
+static uint32_t g_mem_watermark[MEM_LEVELS] = { 48 * 1024, 40 * 1024, 32 * 1024, 24 * 1024 };
+static uint8_t g_mem_level = MEM_NORMAL; // esp_timer task writes, others read
+static uint8_t g_mem_max_level;
+static uint32_t g_mem_free; // last sample
+static uint16_t g_mem_changes;
+static uint32_t g_mem_shed; // calls refused or trimmed
+static uint32_t g_mem_evicted;
+
+static int cache_find(const uint8_t addr[6])
 {
-    for (int i = 0; i < MAX_DEVICES; i++) {
+    for (int i = 0; i < g_cache_size; i++) {
         if (g_devices[i].in_use && memcmp(g_devices[i].addr, addr, 6) == 0) {
             return i;
         }
     }
-    for (int i = 0; i < MAX_DEVICES; i++) {
+    return -1;
+}
+
+// Find existing entry by address or allocate a new one
+static int cache_find_or_alloc(const uint8_t addr[6])
+{
+    int found = cache_find(addr);
+    if (found >= 0) {
+        return found;
+    }
+    for (int i = 0; i < g_cache_size; i++) {
         if (!g_devices[i].in_use) {
             memset(&g_devices[i], 0, sizeof(g_devices[i]));
             g_devices[i].in_use = true;
             memcpy(g_devices[i].addr, addr, 6);
+#ifdef CONFIG_HELLO_ATOMVM_BLE_SWITCHBOT_ANALYTICS
+            agg_reset(&g_agg[i]);
+            memset(&g_rule_state[i], 0, sizeof(g_rule_state[i]));
+            presence_reset(&g_presence[i]);
+            rxstats_reset(&g_rxstats[i]);
+            topk_remove(&g_nearest, (uint8_t) i);
+#endif
+#ifdef CONFIG_HELLO_ATOMVM_BLE_SWITCHBOT_HISTORY
+            hist_device_reset(&g_hist, &g_hist_dev[i], (uint8_t) i);
+#endif
+#ifdef CONFIG_HELLO_ATOMVM_BLE_SWITCHBOT_FLASH_LOG
+            g_log_last_s[i] = 0;
+#endif
+            g_export_have_last[i] = false;
             return i;
         }
     }
     return -1;
 }
 
-// SwitchBot sanity checks (company ID in mfg data, etc.)
-static bool is_switchbot_mfg(const uint8_t *mfg, uint8_t mfg_len)
+// True once the cached parts form a frame the device's profile can decode
+static bool is_merged(const device_cache_t *d)
 {
-    if (mfg_len < 2) {
-        return false;
-    }
-    return (mfg[0] == SWITCHBOT_COMPANY_ID_LE0 && mfg[1] == SWITCHBOT_COMPANY_ID_LE1);
+    return vendor_frame_complete(d->vendor, d->have_svc, d->svc, d->svc_len, d->have_mfg, d->mfg, d->mfg_len);
 }
 
 static void update_device_id(device_cache_t *d)
 {
-    // Your reference code uses manufacturerData[6]*256 + manufacturerData[7]
-    // (big-endian). Only set if we have enough bytes.
-    if (d->have_mfg && d->mfg_len >= 8) {
-        d->device_id = (uint16_t) ((uint16_t) d->mfg[6] << 8) | (uint16_t) d->mfg[7];
+    if (vendor_device_id(d->vendor, d->addr, d->mfg, d->have_mfg ? d->mfg_len : 0, &d->device_id)) {
         d->have_device_id = true;
     }
 }
 
-static bool maybe_mark_latest(int idx)
+static bool maybe_mark_latest(int idx, uint8_t ports)
 {
-    // Consider a frame "merged" when we have both pieces and it looks like SwitchBot.
+    // Consider a frame "merged" when we have every piece its vendor needs.
+    // OPCODE_LATEST returns raw SwitchBot frames, so only those become latest,
+    // and only for the ports whose filter accepted this advert.
     device_cache_t *d = &g_devices[idx];
-    if (d->have_mfg && d->have_svc && is_switchbot_mfg(d->mfg, d->mfg_len)) {
-        update_device_id(d);
+    if (!is_merged(d)) {
+        return false;
+    }
+    update_device_id(d);
+    if (d->vendor == VENDOR_SWITCHBOT) {
         g_latest_index = idx;
-        return true;
+        for (int i = 0; i < PORT_MAX; i++) {
+            if (ports & (1u << i)) {
+                g_ports[i].latest_index = idx;
+            }
+        }
     }
-    return false;
+    return true;
 }
 
-// ----- NimBLE gap callback -----
-
-static int gap_event_cb(struct ble_gap_event *event, void *arg);
-
-static void start_scan(void)
+static uint32_t now_s(void)
 {
-    struct ble_gap_disc_params params;
-    memset(&params, 0, sizeof(params));
-
-    params.passive = 0; // active scan
-    params.itvl = 0x0010;
-    params.window = 0x0010;
-    params.filter_duplicates = 0;
-
-    ESP_LOGI(TAG,
-        "scan params passive=%u itvl=%u window=%u filter_duplicates=%u",
-        (unsigned) params.passive,
-        (unsigned) params.itvl,
-        (unsigned) params.window,
-        (unsigned) params.filter_duplicates);
-
-    int rc = ble_gap_disc(g_own_addr_type, BLE_HS_FOREVER, &params, gap_event_cb, NULL);
-    ESP_LOGI(TAG, "ble_gap_disc rc=%d", rc);
+    return (uint32_t) (esp_timer_get_time() / 1000000);
 }
 
-static void stop_scan(void)
+static uint32_t now_ms(void)
 {
-    int rc = ble_gap_disc_cancel();
-    ESP_LOGI(TAG, "ble_gap_disc_cancel rc=%d", rc);
+    return (uint32_t) (esp_timer_get_time() / 1000);
 }
 
-static void on_sync(void)
+static uint8_t *put_u16be(uint8_t *p, uint16_t v)
 {
-    int rc = ble_hs_id_infer_auto(0, &g_own_addr_type);
-    ESP_LOGI(TAG, "ble_hs_id_infer_auto rc=%d, addr_type=%u", rc, g_own_addr_type);
-    start_scan();
+    *p++ = (uint8_t) (v >> 8);
+    *p++ = (uint8_t) v;
+    return p;
 }
 
-static void host_task(void *param)
+static uint8_t *put_u32be(uint8_t *p, uint32_t v)
 {
-    (void) param;
-    nimble_port_run();
-    nimble_port_freertos_deinit();
+    *p++ = (uint8_t) (v >> 24);
+    *p++ = (uint8_t) (v >> 16);
+    *p++ = (uint8_t) (v >> 8);
+    *p++ = (uint8_t) v;
+    return p;
 }
 
-static int gap_event_cb(struct ble_gap_event *event, void *arg)
+static uint32_t get_u32be(const uint8_t *p)
 {
-    (void) arg;
-
-    switch (event->type) {
-        case BLE_GAP_EVENT_DISC: {
-            const struct ble_gap_disc_desc *desc = &event->disc;
+    return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | (uint32_t) p[3];
+}
 
-            adv_extract_t ex;
-            adv_extract(desc->data, desc->length_data, &ex);
+#define EVENT_MAX_LEN 32
+// Default room beyond one event per cached device: the arrival and rule
+// events of one advert, or the GATT completions of one dispatch (see
+// port_acquire).
+#define EVENT_QUEUE_EXTRA 17
+#define EVENT_QUEUE_MAX 256
 
-            // Debug: confirm we are actually seeing adv/scan-rsp data
-            ESP_LOGD(
-                TAG,
-                "DISC evtype=%u rssi=%d len=%u has_mfg=%d(mfg_len=%u) has_svc=%d(svc_len=%u)",
-                (unsigned) desc->event_type,
-                (int) desc->rssi,
-                (unsigned) desc->length_data,
-                (int) ex.has_mfg,
-                (unsigned) ex.mfg_len,
-                (int) ex.has_svc,
-                (unsigned) ex.svc_len);
+typedef struct
+{
+    uint8_t ports;
+    uint8_t len;
+    uint8_t data[EVENT_MAX_LEN];
+} event_t;
 
-            if (!ex.has_mfg && !ex.has_svc) {
-                return 0;
-            }
+// Events are built while g_lock is held and sent once it is released. Each
+// event goes to the subscribed ports in its mask.
+typedef struct
+{
+    uint8_t subscribed; // port mask, see batch_begin
+    int32_t subscriber_pid[PORT_MAX];
+    int count;
+    int cap;
+    event_t *ev;
+} event_batch_t;
 
-            uint8_t addr[6];
-            memcpy(addr, desc->addr.val, 6);
+// Event storage in the arena, one queue per task that builds batches, each
+// g_event_queue_len long (see arena_layout).
+enum
+{
+    EVENT_QUEUE_HOST = 0, // NimBLE host task
+    EVENT_QUEUE_TIMER = 1, // esp_timer task
+    EVENT_QUEUES
+};
 
-            if (g_lock) {
-                xSemaphoreTake(g_lock, portMAX_DELAY);
-            }
+static event_t *g_event_queue[EVENT_QUEUES];
+static int g_event_queue_len;
+#ifdef CONFIG_HELLO_ATOMVM_BLE_SWITCHBOT_GATT
+static event_t *g_gatt_events[PORT_MAX]; // OPCODE_GATT_SEND completions, gatt_done_max() per port
+#endif
+static uint32_t g_events_dropped; // queue full, see OPCODE_BLE_STATS
 
-            int idx = cache_find_or_alloc(addr);
-            if (idx >= 0) {
-                device_cache_t *d = &g_devices[idx];
+// Caller holds g_lock. Takes a copy of the subscribers; events go to `ev`,
+// which holds `cap` of them.
+static void batch_begin(event_batch_t *batch, event_t *ev, int cap)
+{
+    batch->ev = ev;
+    batch->cap = ev ? cap : 0;
+    batch->count = 0;
+    batch->subscribed = 0;
+    for (int i = 0; i < PORT_MAX; i++) {
+        if (g_ports[i].allocated && g_ports[i].have_subscriber) {
+            batch->subscribed |= (uint8_t) (1u << i);
+            batch->subscriber_pid[i] = g_ports[i].subscriber_pid;
+        }
+    }
+}
 
-                bool was_merged = d->have_mfg && d->have_svc && is_switchbot_mfg(d->mfg, d->mfg_len);
+// Reserves an event slot for `ports`, or returns NULL if nobody listens.
+static uint8_t *batch_push(event_batch_t *batch, uint8_t ports)
+{
+    if ((batch->subscribed & ports) == 0) {
+        return NULL;
+    }
+    if (batch->count >= batch->cap) {
+        __atomic_add_fetch(&g_events_dropped, 1, __ATOMIC_SEQ_CST);
+        return NULL;
+    }
+    batch->ev[batch->count].ports = ports;
+    return batch->ev[batch->count].data;
+}
 
-                d->rssi = desc->rssi;
+// Runs on the NimBLE host task, outside of the AtomVM scheduler.
+static void send_event(int32_t pid, const uint8_t *data, size_t data_len)
+{
+    BEGIN_WITH_STACK_HEAP(TUPLE_SIZE(2) + term_binary_heap_size(data_len), heap);
 
-                if (ex.has_mfg && ex.mfg_len <= MAX_BLE_DATA) {
-                    d->have_mfg = true;
-                    d->mfg_len = ex.mfg_len;
-                    memcpy(d->mfg, ex.mfg, ex.mfg_len);
-                }
-                if (ex.has_svc && ex.svc_len <= MAX_BLE_DATA) {
-                    d->have_svc = true;
-                    d->svc_len = ex.svc_len;
-                    memcpy(d->svc, ex.svc, ex.svc_len);
-                }
+    term bin = term_from_literal_binary(data, data_len, &heap, g_global);
+    term msg = term_alloc_tuple(2, &heap);
+    term_put_tuple_element(msg, 0, globalcontext_make_atom(g_global, switchbot_event_atom));
+    term_put_tuple_element(msg, 1, bin);
 
-                bool merged_now = maybe_mark_latest(idx);
+    port_send_message_from_task(g_global, term_from_local_process_id(pid), msg);
 
-                // Log only when we transition into a valid merged SwitchBot frame.
-                if (!was_merged && merged_now) {
-                    ESP_LOGI(
-                        TAG,
-                        "MERGED addr=%02x:%02x:%02x:%02x:%02x:%02x rssi=%d mfg_len=%u svc_len=%u",
-                        d->addr[5], d->addr[4], d->addr[3], d->addr[2], d->addr[1], d->addr[0],
-                        (int) d->rssi,
-                        (unsigned) d->mfg_len,
-                        (unsigned) d->svc_len);
-                }
-            }
+    END_WITH_STACK_HEAP(heap, g_global);
+}
 
-            if (g_lock) {
-                xSemaphoreGive(g_lock);
+static void send_events(const event_batch_t *batch)
+{
+    for (int i = 0; i < batch->count; i++) {
+        const event_t *ev = &batch->ev[i];
+        uint8_t to = ev->ports & batch->subscribed;
+        for (int j = 0; j < PORT_MAX; j++) {
+            if (to & (1u << j)) {
+                send_event(batch->subscriber_pid[j], ev->data, ev->len);
             }
-
-            return 0;
         }
-
-        case BLE_GAP_EVENT_DISC_COMPLETE:
-            // Restart scan automatically
-            start_scan();
-            return 0;
-
-        default:
-            return 0;
     }
 }
 
-// ----- Port call handling -----
-
-static term reply_latest(Context *ctx, const device_cache_t *d)
+#ifdef CONFIG_HELLO_ATOMVM_BLE_SWITCHBOT_ANALYTICS
+// Rule event:
+// <<EVENT_RULE, rule_id:8, rising:8, device_id:16, addr:6, value:s16, count:32>>
+static void push_rule_event(event_batch_t *batch, const device_cache_t *d, const rule_event_t *ev)
 {
-    // payload:
-    // <<addr:6, rssi:s8, svc_len:u8, svc:svc_len, mfg_len:u8, mfg:mfg_len>>
-    size_t payload_len = 6 + 1 + 1 + d->svc_len + 1 + d->mfg_len;
+    uint8_t *p = batch_push(batch, d->ports);
+    if (!p) {
+        return;
+    }
+    uint8_t *start = p;
 
-    term bin = term_create_uninitialized_binary(1 + payload_len, &ctx->heap, ctx->global);
-    uint8_t *out = (uint8_t *) term_binary_data(bin);
+    *p++ = EVENT_RULE;
+    *p++ = ev->rule_id;
+    *p++ = ev->rising;
+    *p++ = (uint8_t) (d->device_id >> 8);
+    *p++ = (uint8_t) d->device_id;
+    memcpy(p, d->addr, 6);
+    p += 6;
+    *p++ = (uint8_t) ((uint16_t) ev->value >> 8);
+    *p++ = (uint8_t) ev->value;
+    *p++ = (uint8_t) (ev->count >> 24);
+    *p++ = (uint8_t) (ev->count >> 16);
+    *p++ = (uint8_t) (ev->count >> 8);
+    *p++ = (uint8_t) ev->count;
 
-    out[0] = 0x00;
+    batch->ev[batch->count++].len = (uint8_t) (p - start);
+}
+
+// Presence event:
+// <<EVENT_PRESENCE, arrived:8, device_id:16, addr:6, rssi:s8>>
+static void push_presence_event(event_batch_t *batch, const device_cache_t *d, bool arrived, int8_t rssi)
+{
+    uint8_t *p = batch_push(batch, d->ports);
+    if (!p) {
+        return;
+    }
+    uint8_t *start = p;
 
-    uint8_t *p = out + 1;
+    *p++ = EVENT_PRESENCE;
+    *p++ = arrived ? 1 : 0;
+    *p++ = (uint8_t) (d->device_id >> 8);
+    *p++ = (uint8_t) d->device_id;
     memcpy(p, d->addr, 6);
     p += 6;
-    *p++ = (uint8_t) d->rssi;
+    *p++ = (uint8_t) rssi;
 
-    *p++ = d->svc_len;
-    memcpy(p, d->svc, d->svc_len);
+    batch->ev[batch->count++].len = (uint8_t) (p - start);
+}
+#endif
+
+#ifdef CONFIG_HELLO_ATOMVM_BLE_SWITCHBOT_GATT
+// GATT command completion, to every subscribed port:
+// <<EVENT_GATT, addr:6, seq:16, status:8, latency_ms:32>>
+static void push_gatt_event(event_batch_t *batch, const gatt_result_t *r)
+{
+    uint8_t *p = batch_push(batch, ALL_PORTS);
+    if (!p) {
+        return;
+    }
+    uint8_t *start = p;
+
+    *p++ = EVENT_GATT;
+    memcpy(p, r->addr, 6);
+    p += 6;
+    *p++ = (uint8_t) (r->seq >> 8);
+    *p++ = (uint8_t) r->seq;
+    *p++ = r->status;
+    *p++ = (uint8_t) (r->latency_ms >> 24);
+    *p++ = (uint8_t) (r->latency_ms >> 16);
+    *p++ = (uint8_t) (r->latency_ms >> 8);
+    *p++ = (uint8_t) r->latency_ms;
+
+    batch->ev[batch->count++].len = (uint8_t) (p - start);
+}
+#endif
+
+// ----- NVS -----
+
+static bool g_nvs_ready = false;
+
+static bool nvs_ready(void)
+{
+    if (g_nvs_ready) {
+        return true;
+    }
+
+    esp_err_t err = nvs_flash_init();
+    if (err == ESP_ERR_NVS_NO_FREE_PAGES || err == ESP_ERR_NVS_NEW_VERSION_FOUND) {
+        nvs_flash_erase();
+        err = nvs_flash_init();
+    }
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "nvs_flash_init failed: %d", (int) err);
+        return false;
+    }
+    g_nvs_ready = true;
+    return true;
+}
+
+// ----- Warm-start snapshot -----
+
+#ifdef CONFIG_HELLO_ATOMVM_BLE_SWITCHBOT_WARM_START
+
+static uint32_t fnv1a(uint32_t h, const uint8_t *p, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        h = (h ^ p[i]) * 16777619u;
+    }
+    return h;
+}
+
+// Caller holds g_lock. Serializes every merged device:
+// <<SNAPSHOT_VERSION:8, count:8, count x <<addr:6, addr_type:8, vendor:8, rssi:s8, age_ms:32,
+//   svc_len:8, svc:svc_len, mfg_len:8, mfg:mfg_len>>>>
+// `hash` covers everything but the ages, so an unchanged cache is not rewritten.
+static size_t snapshot_build(uint8_t *out, uint32_t now, uint32_t *hash)
+{
+    uint8_t *p = out + 2;
+    uint8_t count = 0;
+    uint32_t h = 2166136261u;
+
+    for (int i = 0; i < g_cache_size; i++) {
+        const device_cache_t *d = &g_devices[i];
+        if (!d->in_use || !is_merged(d)) {
+            continue;
+        }
+        uint8_t *rec = p;
+        memcpy(p, d->addr, 6);
+        p += 6;
+        *p++ = d->addr_type;
+        *p++ = d->vendor;
+        *p++ = (uint8_t) d->rssi;
+        h = fnv1a(h, rec, (size_t) (p - rec));
+
+        p = put_u32be(p, now - d->merged_ms);
+
+        rec = p;
+        *p++ = d->have_svc ? d->svc_len : 0;
+        memcpy(p, d->svc, d->have_svc ? d->svc_len : 0);
+        p += d->have_svc ? d->svc_len : 0;
+        *p++ = d->have_mfg ? d->mfg_len : 0;
+        memcpy(p, d->mfg, d->have_mfg ? d->mfg_len : 0);
+        p += d->have_mfg ? d->mfg_len : 0;
+        h = fnv1a(h, rec, (size_t) (p - rec));
+
+        count++;
+    }
+
+    out[0] = SNAPSHOT_VERSION;
+    out[1] = count;
+    *hash = fnv1a(h, out, 2);
+    return (size_t) (p - out);
+}
+
+// Runs once at init, before scanning. Restored devices are served as usual
+// but flagged stale until they advertise again. Their age continues from
+// the snapshot; the time the board was off is not known.
+static void snapshot_restore(void)
+{
+    if (!nvs_ready()) {
+        return;
+    }
+
+    nvs_handle_t h;
+    if (nvs_open(NVS_NAMESPACE, NVS_READONLY, &h) != ESP_OK) {
+        return;
+    }
+    // A snapshot of a larger cache does not fit and is skipped.
+    size_t len = g_snapshot_buf_len;
+    esp_err_t err = nvs_get_blob(h, NVS_KEY_SNAPSHOT, g_snapshot_buf, &len);
+    nvs_close(h);
+    if (err != ESP_OK || len < 2 || g_snapshot_buf[0] != SNAPSHOT_VERSION) {
+        return;
+    }
+
+    const uint8_t *p = g_snapshot_buf + 2;
+    const uint8_t *end = g_snapshot_buf + len;
+    uint32_t now = now_ms();
+    uint32_t newest_age = UINT32_MAX;
+
+    for (uint8_t n = g_snapshot_buf[1]; n > 0; n--) {
+        if (end - p < 6 + 1 + 1 + 1 + 4 + 1) {
+            break;
+        }
+        const uint8_t *addr = p;
+        uint8_t addr_type = p[6];
+        uint8_t vendor = p[7];
+        int8_t rssi = (int8_t) p[8];
+        uint32_t age = get_u32be(p + 9);
+        p += 13;
+
+        uint8_t svc_len = *p++;
+        if (svc_len > MAX_BLE_DATA || end - p < svc_len + 1) {
+            break;
+        }
+        const uint8_t *svc = p;
+        p += svc_len;
+        uint8_t mfg_len = *p++;
+        if (mfg_len > MAX_BLE_DATA || end - p < mfg_len) {
+            break;
+        }
+        const uint8_t *mfg = p;
+        p += mfg_len;
+
+        int idx = cache_find_or_alloc(addr);
+        if (idx < 0) {
+            break;
+        }
+        device_cache_t *d = &g_devices[idx];
+        d->addr_type = addr_type;
+        d->vendor = vendor;
+        d->rssi = rssi;
+        d->have_svc = svc_len > 0;
+        d->svc_len = svc_len;
+        memcpy(d->svc, svc, svc_len);
+        d->have_mfg = mfg_len > 0;
+        d->mfg_len = mfg_len;
+        memcpy(d->mfg, mfg, mfg_len);
+        d->merged_ms = now - age;
+        d->stale = true;
+        update_device_id(d);
+
+        if (vendor == VENDOR_SWITCHBOT && is_merged(d) && age < newest_age) {
+            newest_age = age;
+            g_latest_index = idx;
+        }
+        g_snapshot_restored++;
+    }
+
+    snapshot_build(g_snapshot_buf, now, &g_snapshot_hash);
+    ESP_LOGI(TAG, "warm start: restored %u devices", (unsigned) g_snapshot_restored);
+}
+
+// Caller holds g_lock. Builds the next snapshot into g_snapshot_buf at most
+// every SNAPSHOT_INTERVAL_MS, and only if the cache changed since the last
+// write, to keep flash wear low. Returns the length to save, or 0.
+static size_t snapshot_due(uint32_t now)
+{
+    if (now - g_snapshot_last_ms < SNAPSHOT_INTERVAL_MS) {
+        return 0;
+    }
+    g_snapshot_last_ms = now;
+
+    uint32_t hash;
+    size_t len = snapshot_build(g_snapshot_buf, now, &hash);
+    if (g_snapshot_buf[1] == 0 || hash == g_snapshot_hash) {
+        g_snapshot_skipped++;
+        return 0;
+    }
+    g_snapshot_hash = hash;
+    return len;
+}
+
+// One blob per snapshot; NVS spreads the writes over its pages.
+static void snapshot_save(size_t len)
+{
+    nvs_handle_t h;
+    if (!nvs_ready() || nvs_open(NVS_NAMESPACE, NVS_READWRITE, &h) != ESP_OK) {
+        return;
+    }
+    if (nvs_set_blob(h, NVS_KEY_SNAPSHOT, g_snapshot_buf, len) == ESP_OK && nvs_commit(h) == ESP_OK) {
+        g_snapshot_written++;
+        g_snapshot_bytes = (uint16_t) len;
+    }
+    nvs_close(h);
+}
+
+#endif
+
+// ----- Flash log -----
+
+#ifdef CONFIG_HELLO_ATOMVM_BLE_SWITCHBOT_FLASH_LOG
+
+static int log_flash_read(void *arg, uint32_t offset, void *dst, size_t len)
+{
+    return esp_partition_read((const esp_partition_t *) arg, offset, dst, len) == ESP_OK ? 0 : -1;
+}
+
+static int log_flash_write(void *arg, uint32_t offset, const void *src, size_t len)
+{
+    return esp_partition_write((const esp_partition_t *) arg, offset, src, len) == ESP_OK ? 0 : -1;
+}
+
+static int log_flash_erase(void *arg, uint32_t offset, size_t len)
+{
+    return esp_partition_erase_range((const esp_partition_t *) arg, offset, len) == ESP_OK ? 0 : -1;
+}
+
+// Once; the log stays mounted across deep stops.
+static void log_mount(void)
+{
+    if (g_log_lock) {
+        return;
+    }
+    g_log_part = esp_partition_find_first(
+        ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, CONFIG_HELLO_ATOMVM_BLE_SWITCHBOT_FLASH_LOG_PARTITION);
+    if (!g_log_part) {
+        ESP_LOGW(TAG, "flash log: no partition \"%s\"", CONFIG_HELLO_ATOMVM_BLE_SWITCHBOT_FLASH_LOG_PARTITION);
+        return;
+    }
+
+    const flog_flash_t flash = {
+        .read = log_flash_read,
+        .write = log_flash_write,
+        .erase = log_flash_erase,
+        .arg = (void *) g_log_part,
+        .size = g_log_part->size - g_log_part->size % FLOG_SECTOR_SIZE,
+    };
+    g_log_lock = xSemaphoreCreateMutex();
+    g_log_ready = flog_mount(&g_log, &flash);
+    ESP_LOGI(TAG, "flash log: mounted=%d boot=%u pages=%u", (int) g_log_ready, (unsigned) g_log.boot,
+        (unsigned) flog_pages_used(&g_log));
+}
+
+// Caller holds g_lock. At most one record per device every LOG_MIN_INTERVAL_S.
+static void log_reading(int idx, uint32_t now, const sensor_reading_t *r)
+{
+    if (!g_log_ready || (g_log_last_s[idx] != 0 && now - g_log_last_s[idx] < LOG_MIN_INTERVAL_S)) {
+        return;
+    }
+    g_log_last_s[idx] = now;
+
+    const flog_record_t rec = {
+        .t_s = now,
+        .device_id = g_devices[idx].device_id,
+        .vendor = r->vendor,
+        .fields = r->fields,
+        .temp_dc = r->temp_dc,
+        .humidity = r->humidity,
+        .battery = r->battery,
+    };
+    flog_append(&g_log, &rec);
+}
+
+// esp_timer task. Writes full pages, and a partial one once records have
+// waited LOG_MAX_BUFFER_MS (or with `force`). Flash is written without
+// holding g_lock.
+static void log_flush(uint32_t now, bool force)
+{
+    if (!g_log_ready) {
+        return;
+    }
+
+    uint8_t page[FLOG_PAGE_SIZE];
+    uint32_t seq;
+
+    xSemaphoreTake(g_log_lock, portMAX_DELAY);
+    for (;;) {
+        xSemaphoreTake(g_lock, portMAX_DELAY);
+        bool have = flog_take_page(&g_log, force || now - g_log_flush_ms >= LOG_MAX_BUFFER_MS, page, &seq);
+        xSemaphoreGive(g_lock);
+        if (!have) {
+            break;
+        }
+
+        int64_t start = esp_timer_get_time();
+        flog_write_page(&g_log, seq, page);
+        g_log_write_us += (uint64_t) (esp_timer_get_time() - start);
+        g_log_flush_ms = now;
+    }
+    xSemaphoreGive(g_log_lock);
+}
+
+#endif
+
+// ----- Serial export -----
+
+static bool same_reading(const sensor_reading_t *a, const sensor_reading_t *b)
+{
+    return a->fields == b->fields && a->temp_dc == b->temp_dc && a->humidity == b->humidity
+        && a->battery == b->battery && a->pir == b->pir && a->door == b->door;
+}
+
+// Caller holds g_lock. Never blocks: a frame that does not fit in the TX
+// buffer is dropped, and the gap in seq tells the reader.
+static void export_reading(int idx, const sensor_reading_t *r)
+{
+    if (g_export_mode == EXPORT_OFF) {
+        return;
+    }
+    if (__atomic_load_n(&g_mem_level, __ATOMIC_SEQ_CST) >= MEM_NO_EXPORT) {
+        g_export_dropped++;
+        return;
+    }
+    if (g_export_mode == EXPORT_CHANGES && g_export_have_last[idx] && same_reading(&g_export_last[idx], r)) {
+        return;
+    }
+
+    const device_cache_t *d = &g_devices[idx];
+    uint8_t adv_seq = 0;
+    bool have_seq = vendor_adv_seq(d->vendor, d->svc, d->svc_len, d->mfg, d->mfg_len, &adv_seq);
+    frame_reading_t fr = {
+        .t_ms = now_ms(),
+        .rssi = d->rssi,
+        .vendor = r->vendor,
+        .adv_seq = adv_seq,
+        .device_id = d->device_id,
+        .fields = (uint8_t) (r->fields | (have_seq ? FRAME_READING_HAS_SEQ : 0)),
+        .temp_dc = r->temp_dc,
+        .humidity = r->humidity,
+        .battery = r->battery,
+    };
+    memcpy(fr.addr, d->addr, 6);
+
+    uint8_t payload[FRAME_READING_LEN];
+    uint8_t frame[FRAME_MAX_LEN];
+    frame_reading_encode(payload, &fr);
+    size_t n = frame_encode(frame, g_export_seq++, FRAME_TYPE_READING, payload, sizeof(payload));
+
+    size_t room;
+    if (uart_get_tx_buffer_free_size(g_export_uart, &room) != ESP_OK || room < n) {
+        g_export_dropped++;
+        return;
+    }
+    uart_write_bytes(g_export_uart, frame, n);
+    g_export_frames++;
+    g_export_bytes += n;
+    g_export_last[idx] = *r;
+    g_export_have_last[idx] = true;
+}
+
+static void export_stop(void)
+{
+    if (g_lock) {
+        xSemaphoreTake(g_lock, portMAX_DELAY);
+    }
+    g_export_mode = EXPORT_OFF;
+    if (g_lock) {
+        xSemaphoreGive(g_lock);
+    }
+
+    if (g_export_installed) {
+        uart_driver_delete(g_export_uart);
+        g_export_installed = false;
+    }
+}
+
+static bool export_start(uint8_t mode, uart_port_t uart, uint32_t baud, int tx_pin)
+{
+    const uart_config_t cfg = {
+        .baud_rate = (int) baud,
+        .data_bits = UART_DATA_8_BITS,
+        .parity = UART_PARITY_DISABLE,
+        .stop_bits = UART_STOP_BITS_1,
+        .flow_ctrl = UART_HW_FLOWCTRL_DISABLE,
+        .source_clk = UART_SCLK_DEFAULT,
+    };
+    if (uart_driver_install(uart, EXPORT_RX_BUFFER, EXPORT_TX_BUFFER, 0, NULL, 0) != ESP_OK) {
+        return false;
+    }
+    g_export_uart = uart;
+    g_export_installed = true;
+    if (uart_param_config(uart, &cfg) != ESP_OK
+        || uart_set_pin(uart, tx_pin, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE) != ESP_OK) {
+        export_stop();
+        return false;
+    }
+
+    if (g_lock) {
+        xSemaphoreTake(g_lock, portMAX_DELAY);
+    }
+    memset(g_export_have_last, 0, g_cache_size * sizeof(*g_export_have_last));
+    g_export_mode = mode;
+    if (g_lock) {
+        xSemaphoreGive(g_lock);
+    }
+    ESP_LOGI(TAG, "export: uart%d %u baud mode=%u", (int) uart, (unsigned) baud, (unsigned) mode);
+    return true;
+}
+
+static void idle_tick(uint32_t now);
+static void mem_tick(uint32_t now);
+
+// esp_timer task: reports devices that stopped advertising.
+static void presence_tick(void *arg)
+{
+    (void) arg;
+
+    __atomic_store_n(&g_tick_running, 1, __ATOMIC_SEQ_CST);
+
+    event_batch_t batch;
+
+    xSemaphoreTake(g_lock, portMAX_DELAY);
+
+    batch_begin(&batch, g_event_queue[EVENT_QUEUE_TIMER], g_event_queue_len);
+
+    uint32_t now = now_ms();
+#ifdef CONFIG_HELLO_ATOMVM_BLE_SWITCHBOT_ANALYTICS
+    for (int i = 0; i < g_cache_size; i++) {
+        if (!g_devices[i].in_use) {
+            continue;
+        }
+        if (presence_check(&g_presence[i], &g_presence_cfg, now) == PRESENCE_DEPARTED) {
+            ESP_LOGI(TAG, "DEPARTED id=%04x", (unsigned) g_devices[i].device_id);
+            push_presence_event(&batch, &g_devices[i], false, g_devices[i].rssi);
+        }
+    }
+#endif
+#ifdef CONFIG_HELLO_ATOMVM_BLE_SWITCHBOT_GATT
+    gatt_tick(&g_gatt, now, GATT_IDLE_MS);
+#endif
+#ifdef CONFIG_HELLO_ATOMVM_BLE_SWITCHBOT_WARM_START
+    size_t snapshot_len = snapshot_due(now);
+#endif
+
+    xSemaphoreGive(g_lock);
+
+    send_events(&batch);
+#ifdef CONFIG_HELLO_ATOMVM_BLE_SWITCHBOT_WARM_START
+    if (snapshot_len > 0) {
+        snapshot_save(snapshot_len);
+    }
+#endif
+#ifdef CONFIG_HELLO_ATOMVM_BLE_SWITCHBOT_FLASH_LOG
+    log_flush(now, false);
+#endif
+    idle_tick(now);
+    mem_tick(now);
+
+    __atomic_store_n(&g_tick_running, 0, __ATOMIC_SEQ_CST);
+}
+
+#ifdef CONFIG_HELLO_ATOMVM_BLE_SWITCHBOT_HISTORY
+// Appends a meter reading to the history, at most once per HIST_MIN_INTERVAL_S.
+static void record_history(int idx, uint32_t now, const sensor_reading_t *r)
+{
+    const uint8_t need = READING_HAS_TEMP | READING_HAS_HUMIDITY | READING_HAS_BATTERY;
+    if ((r->fields & need) != need) {
+        return;
+    }
+
+    hist_device_t *hd = &g_hist_dev[idx];
+    if (hd->have_last && now - hd->last.t_s < HIST_MIN_INTERVAL_S) {
+        return;
+    }
+
+    hist_sample_t s = { now, r->temp_dc, r->humidity, r->battery };
+
+    uint32_t start = CYCLE_COUNT();
+    hist_append(&g_hist, hd, (uint8_t) idx, &s);
+    g_hist_cycles += CYCLE_COUNT() - start;
+
+    // Same layout as reply_latest
+    const device_cache_t *d = &g_devices[idx];
+    g_hist_raw_bytes += 6 + 1 + 1 + d->svc_len + 1 + d->mfg_len;
+}
+#endif
+
+// Called with g_lock held whenever a DISC event leaves `idx` merged.
+static void on_merged(int idx, bool sample_updated, event_batch_t *batch)
+{
+    device_cache_t *d = &g_devices[idx];
+
+    d->merged_ms = now_ms();
+    d->stale = false;
+#ifdef CONFIG_HELLO_ATOMVM_BLE_SWITCHBOT_ANALYTICS
+    topk_update(&g_nearest, (uint8_t) idx, g_rxstats[idx].rssi_x16, d->merged_ms);
+
+    if (presence_on_advert(&g_presence[idx], &g_presence_cfg, now_ms(), d->rssi) == PRESENCE_ARRIVED) {
+        ESP_LOGI(TAG, "ARRIVED id=%04x rssi=%d", (unsigned) d->device_id, (int) d->rssi);
+        push_presence_event(batch, d, true, presence_rssi(&g_presence[idx]));
+    }
+#endif
+
+    sensor_reading_t r;
+    if (!vendor_decode(d->vendor, d->svc, d->svc_len, d->mfg, d->mfg_len, &r)) {
+        return;
+    }
+
+#ifdef CONFIG_HELLO_ATOMVM_BLE_SWITCHBOT_ANALYTICS
+    rule_event_t evs[RULES_MAX];
+    int n = rules_eval(&g_rules, &g_rule_state[idx], d->device_id, &r, evs, RULES_MAX);
+    for (int i = 0; i < n; i++) {
+        push_rule_event(batch, d, &evs[i]);
+    }
+#else
+    (void) batch;
+#endif
+
+    // Only a fresh copy of the part carrying the reading counts as a new
+    // sample (mfg for SwitchBot meters). This keeps the matching SCAN_RSP from
+    // counting the same reading twice.
+    if (sample_updated) {
+        uint32_t now = now_s();
+        (void) now; // not every profile keeps per-sample state
+#ifdef CONFIG_HELLO_ATOMVM_BLE_SWITCHBOT_ANALYTICS
+        agg_update(&g_agg[idx], &g_agg_cfg, now, &r);
+#endif
+#ifdef CONFIG_HELLO_ATOMVM_BLE_SWITCHBOT_HISTORY
+        record_history(idx, now, &r);
+#endif
+        export_reading(idx, &r);
+#ifdef CONFIG_HELLO_ATOMVM_BLE_SWITCHBOT_FLASH_LOG
+        log_reading(idx, now, &r);
+#endif
+    }
+}
+
+#ifdef CONFIG_HELLO_ATOMVM_BLE_SWITCHBOT_CRYPTO
+// Caller holds g_lock. Runs only when the encrypted part of the payload
+// changed, so repeated adverts of the same reading are not decrypted again.
+static void maybe_decrypt(device_cache_t *d, bool mfg_changed, bool svc_changed)
+{
+    crypto_key_t *k = crypto_find(&g_crypto, d->addr);
+    if (!k) {
+        return;
+    }
+
+    const uint8_t *payload;
+    uint8_t payload_len;
+    if (k->source == CRYPTO_SOURCE_MFG) {
+        if (!mfg_changed) {
+            return;
+        }
+        payload = d->mfg;
+        payload_len = d->mfg_len;
+    } else {
+        if (!svc_changed) {
+            return;
+        }
+        payload = d->svc;
+        payload_len = d->svc_len;
+    }
+
+    // Keep the last good plaintext if this one does not authenticate.
+    uint8_t plain[MAX_BLE_DATA];
+    uint8_t plain_len;
+    uint32_t counter;
+    if (crypto_decrypt(&g_crypto, k, payload, payload_len, plain, &plain_len, &counter)) {
+        memcpy(d->plain, plain, plain_len);
+        d->plain_len = plain_len;
+        d->plain_counter = counter;
+        d->have_plain = true;
+    }
+}
+#endif
+
+// ----- Advert filter -----
+
+// Runs on the NimBLE host task, before anything is parsed, copied or locked.
+// Returns the ports whose filter accepts the advert; a port without a
+// program accepts everything.
+static uint8_t filter_pass(const uint8_t *data, uint8_t data_len)
+{
+    uint8_t ports = 0;
+
+    __atomic_store_n(&g_filter_running, 1, __ATOMIC_SEQ_CST);
+    for (int i = 0; i < PORT_MAX; i++) {
+        port_instance_t *port = &g_ports[i];
+        if (!__atomic_load_n(&port->active, __ATOMIC_SEQ_CST)) {
+            continue;
+        }
+        const filter_prog_t *prog = &port->filters[__atomic_load_n(&port->filter_active, __ATOMIC_SEQ_CST)];
+
+        uint32_t start = CYCLE_COUNT();
+        bool pass = filter_run(prog, data, data_len);
+        port->filter_cycles += CYCLE_COUNT() - start;
+
+        port->filter_seen++;
+        if (pass) {
+            ports |= (uint8_t) (1u << i);
+        } else {
+            port->filter_rejected++;
+        }
+    }
+    __atomic_store_n(&g_filter_running, 0, __ATOMIC_SEQ_CST);
+
+    return ports;
+}
+
+// Waits until a scan callback that may have seen the old filter state is done.
+static void filter_quiesce(void)
+{
+    while (__atomic_load_n(&g_filter_running, __ATOMIC_SEQ_CST)) {
+        vTaskDelay(1);
+    }
+}
+
+// Called from the port task without g_lock: the scanner never takes it to
+// read the filters, and loads for one port arrive one at a time through
+// its mailbox.
+static void filter_install(port_instance_t *port, const filter_prog_t *prog)
+{
+    uint32_t next = 1 - __atomic_load_n(&port->filter_active, __ATOMIC_SEQ_CST);
+    port->filters[next] = *prog;
+    __atomic_store_n(&port->filter_active, next, __ATOMIC_SEQ_CST);
+    filter_quiesce();
+}
+
+// ----- NimBLE gap callback -----
+
+static int gap_event_cb(struct ble_gap_event *event, void *arg);
+static int burst_disc_start(void);
+static void burst_complete(uint8_t err);
+
+// Interval and window per SCAN_* profile, in 0.625 ms units. All of them
+// scan actively: SwitchBot meters put half the reading in SCAN_RSP.
+static const uint16_t scan_profiles[][2] = {
+    [SCAN_FAST] = { 0x0010, 0x0010 }, // 10 ms every 10 ms
+    [SCAN_BALANCED] = { 0x00A0, 0x0030 }, // 30 ms every 100 ms
+    [SCAN_LOW_POWER] = { 0x0640, 0x0030 }, // 30 ms every second
+};
+
+static uint8_t g_scan_profile = SCAN_FAST;
+
+// Starts discovery with the most demanding profile among the ports that
+// want scanning, restarting it if that profile changed.
+static void start_scan(void)
+{
+    if (__atomic_load_n(&g_burst.active, __ATOMIC_SEQ_CST)) {
+        return; // burst_complete resumes scanning
+    }
+    if (g_idle_state == IDLE_PAUSED) {
+        if (ble_gap_disc_active()) {
+            ble_gap_disc_cancel();
+        }
+        return; // idle_resume restarts it
+    }
+
+    uint8_t profile = SCAN_LOW_POWER;
+    bool any = false;
+    for (int i = 0; i < PORT_MAX; i++) {
+        if (g_ports[i].allocated && g_ports[i].scanning && g_ports[i].scan_profile <= profile) {
+            profile = g_ports[i].scan_profile;
+            any = true;
+        }
+    }
+    if (!any) {
+        profile = g_scan_profile;
+    }
+    if (g_idle_state == IDLE_LOW_DUTY) {
+        profile = SCAN_LOW_POWER;
+    }
+    if (ble_gap_disc_active()) {
+        if (profile == g_scan_profile) {
+            return;
+        }
+        ble_gap_disc_cancel();
+    }
+    g_scan_profile = profile;
+
+    struct ble_gap_disc_params params;
+    memset(&params, 0, sizeof(params));
+
+    params.passive = 0; // active scan
+    params.itvl = scan_profiles[profile][0];
+    params.window = scan_profiles[profile][1];
+    params.filter_duplicates = 0;
+
+    ESP_LOGI(TAG,
+        "scan params passive=%u itvl=%u window=%u filter_duplicates=%u",
+        (unsigned) params.passive,
+        (unsigned) params.itvl,
+        (unsigned) params.window,
+        (unsigned) params.filter_duplicates);
+
+    g_scan_wanted = true;
+    int rc = ble_gap_disc(g_own_addr_type, BLE_HS_FOREVER, &params, gap_event_cb, NULL);
+    ESP_LOGI(TAG, "ble_gap_disc rc=%d", rc);
+}
+
+static void stop_scan(void)
+{
+    g_scan_wanted = false;
+    int rc = ble_gap_disc_cancel();
+    ESP_LOGI(TAG, "ble_gap_disc_cancel rc=%d", rc);
+}
+
+static void on_sync(void)
+{
+    int rc = ble_hs_id_infer_auto(0, &g_own_addr_type);
+    ESP_LOGI(TAG, "ble_hs_id_infer_auto rc=%d, addr_type=%u", rc, g_own_addr_type);
+    g_ble_sync_us = (uint32_t) (esp_timer_get_time() - g_ble_init_start_us);
+    if (__atomic_load_n(&g_burst.active, __ATOMIC_SEQ_CST)) {
+        if (burst_disc_start() != 0) {
+            burst_complete(0x67);
+        }
+    } else {
+        start_scan();
+    }
+}
+
+static void host_task(void *param)
+{
+    (void) param;
+    nimble_port_run();
+    nimble_port_freertos_deinit();
+}
+
+static int gap_event_cb(struct ble_gap_event *event, void *arg)
+{
+    (void) arg;
+
+    switch (event->type) {
+        case BLE_GAP_EVENT_DISC: {
+            const struct ble_gap_disc_desc *desc = &event->disc;
+
+            uint8_t ports = filter_pass(desc->data, desc->length_data);
+            bool burst = __atomic_load_n(&g_burst.active, __ATOMIC_SEQ_CST)
+                && filter_run(&g_burst.filter, desc->data, desc->length_data);
+            if (!ports && !burst) {
+                return 0;
+            }
+
+            uint32_t start = CYCLE_COUNT();
+            adv_extract_t ex;
+            adv_extract(desc->data, desc->length_data, &ex);
+            const vendor_profile_t *vp = vendor_identify(&ex);
+            g_extract_cycles += CYCLE_COUNT() - start;
+            g_extract_runs++;
+
+            // Debug: confirm we are actually seeing adv/scan-rsp data
+            ESP_LOGD(
+                TAG,
+                "DISC evtype=%u rssi=%d len=%u has_mfg=%d(mfg_len=%u) has_svc=%d(svc_len=%u)",
+                (unsigned) desc->event_type,
+                (int) desc->rssi,
+                (unsigned) desc->length_data,
+                (int) ex.has_mfg,
+                (unsigned) ex.mfg_len,
+                (int) ex.has_svc,
+                (unsigned) ex.svc_len);
+
+            // Unidentified PDUs still count for devices already cached, e.g. a
+            // SCAN_RSP that only carries the local name.
+            if (!vp && !ex.has_mfg && !ex.has_svc) {
+                return 0;
+            }
+
+            uint8_t addr[6];
+            memcpy(addr, desc->addr.val, 6);
+
+            event_batch_t batch;
+
+            if (g_lock) {
+                xSemaphoreTake(g_lock, portMAX_DELAY);
+            }
+
+            batch_begin(&batch, g_event_queue[EVENT_QUEUE_HOST], g_event_queue_len);
+
+            int idx = vp ? cache_find_or_alloc(addr) : cache_find(addr);
+            if (idx >= 0) {
+                device_cache_t *d = &g_devices[idx];
+
+                d->addr_type = desc->addr.type;
+                d->ports |= ports;
+                if (burst) {
+                    g_burst.adverts++;
+                    if (!d->burst_seen) {
+                        d->burst_seen = true;
+                        g_burst.last_new_ms = (uint32_t) ((esp_timer_get_time() - g_burst.start_us) / 1000);
+                    }
+                }
+                if (d->vendor == VENDOR_NONE && vp) {
+                    d->vendor = vp->id;
+                }
+
+                bool was_merged = is_merged(d);
+
+                d->rssi = desc->rssi;
+
+                bool mfg_changed = false;
+                bool svc_changed = false;
+
+                if (ex.has_mfg && ex.mfg_len <= MAX_BLE_DATA) {
+                    mfg_changed = !d->have_mfg || d->mfg_len != ex.mfg_len
+                        || memcmp(d->mfg, ex.mfg, ex.mfg_len) != 0;
+                    d->have_mfg = true;
+                    d->mfg_len = ex.mfg_len;
+                    memcpy(d->mfg, ex.mfg, ex.mfg_len);
+                }
+                if (ex.has_svc && ex.svc_len <= MAX_BLE_DATA) {
+                    svc_changed = !d->have_svc || d->svc_len != ex.svc_len
+                        || memcmp(d->svc, ex.svc, ex.svc_len) != 0;
+                    d->have_svc = true;
+                    d->svc_len = ex.svc_len;
+                    memcpy(d->svc, ex.svc, ex.svc_len);
+                }
+
+#ifdef CONFIG_HELLO_ATOMVM_BLE_SWITCHBOT_CRYPTO
+                if (mfg_changed || svc_changed) {
+                    maybe_decrypt(d, mfg_changed, svc_changed);
+                }
+#else
+                (void) mfg_changed;
+                (void) svc_changed;
+#endif
+
+                bool merged_now = maybe_mark_latest(idx, ports);
+
+#ifdef CONFIG_HELLO_ATOMVM_BLE_SWITCHBOT_ANALYTICS
+                uint8_t pdu = RX_PDU_OTHER;
+                if (desc->event_type == BLE_HCI_ADV_RPT_EVTYPE_ADV_IND) {
+                    pdu = RX_PDU_ADV_IND;
+                } else if (desc->event_type == BLE_HCI_ADV_RPT_EVTYPE_SCAN_RSP) {
+                    pdu = RX_PDU_SCAN_RSP;
+                }
+                rxstats_on_advert(&g_rxstats[idx], now_ms(), pdu, desc->rssi, merged_now);
+#endif
+
+                if (merged_now) {
+                    const vendor_profile_t *dp = vendor_profile(d->vendor);
+                    bool sample_updated = (dp->needs & VENDOR_NEEDS_MFG)
+                        ? (ex.has_mfg && ex.mfg_len <= MAX_BLE_DATA)
+                        : (ex.has_svc && ex.svc_len <= MAX_BLE_DATA);
+                    on_merged(idx, sample_updated, &batch);
+                }
+
+                // Log only when we transition into a valid merged frame.
+                if (!was_merged && merged_now) {
+                    ESP_LOGI(
+                        TAG,
+                        "MERGED %s addr=%02x:%02x:%02x:%02x:%02x:%02x rssi=%d mfg_len=%u svc_len=%u",
+                        vendor_profile(d->vendor)->name,
+                        d->addr[5], d->addr[4], d->addr[3], d->addr[2], d->addr[1], d->addr[0],
+                        (int) d->rssi,
+                        (unsigned) d->mfg_len,
+                        (unsigned) d->svc_len);
+                }
+            }
+
+            if (g_lock) {
+                xSemaphoreGive(g_lock);
+            }
+
+            send_events(&batch);
+
+            return 0;
+        }
+
+        case BLE_GAP_EVENT_DISC_COMPLETE:
+            if (__atomic_load_n(&g_burst.active, __ATOMIC_SEQ_CST)) {
+                burst_complete(0);
+                return 0;
+            }
+            // Restart scan automatically
+            start_scan();
+            return 0;
+
+        default:
+            return 0;
+    }
+}
+
+// ----- Scan burst -----
+
+// Starts the bounded discovery of g_burst at the fastest interval: a burst
+// is short and wants every device in range, SCAN_RSP included.
+static int burst_disc_start(void)
+{
+    struct ble_gap_disc_params params;
+    memset(&params, 0, sizeof(params));
+
+    params.passive = 0;
+    params.itvl = scan_profiles[SCAN_FAST][0];
+    params.window = scan_profiles[SCAN_FAST][1];
+    params.filter_duplicates = 0;
+
+    g_burst.start_us = esp_timer_get_time();
+    int rc = ble_gap_disc(g_own_addr_type, g_burst.duration_ms, &params, gap_event_cb, NULL);
+    ESP_LOGI(TAG, "burst: %u ms, ble_gap_disc rc=%d", (unsigned) g_burst.duration_ms, rc);
+    return rc;
+}
+
+// NimBLE host task: the burst's discovery ended, or failed to start with
+// `err` != 0. Wakes the port that asked, which builds the reply, and resumes
+// continuous scanning if a port started it meanwhile.
+static void burst_complete(uint8_t err)
+{
+    uint32_t radio_on_ms = (uint32_t) ((esp_timer_get_time() - g_burst.start_us) / 1000);
+
+    xSemaphoreTake(g_lock, portMAX_DELAY);
+    g_burst.radio_on_ms = radio_on_ms;
+    g_burst.err = err;
+    port_instance_t *port = g_burst.port;
+    int32_t wake = port ? port->process_id : 0;
+    g_burst.done = port != NULL;
+    __atomic_store_n(&g_burst.active, 0, __ATOMIC_SEQ_CST);
+    xSemaphoreGive(g_lock);
+
+    if (port) {
+        term msg = globalcontext_make_atom(g_global, scan_burst_atom);
+        port_send_message_from_task(g_global, term_from_local_process_id(wake), msg);
+    }
+    if (__atomic_load_n(&g_scan_refs, __ATOMIC_SEQ_CST) > 0) {
+        start_scan();
+    }
+}
+
+// ----- Auto-idle -----
+
+// Caller holds g_lock. A subscriber is demand as long as its process lives.
+static bool subscriber_alive(void)
+{
+    for (int i = 0; i < PORT_MAX; i++) {
+        if (!g_ports[i].allocated || !g_ports[i].have_subscriber) {
+            continue;
+        }
+        Context *c = globalcontext_get_process_lock(g_global, g_ports[i].subscriber_pid);
+        if (c) {
+            globalcontext_get_process_unlock(g_global, c);
+            return true;
+        }
+    }
+    return false;
+}
+
+// esp_timer task. Only tries g_port_lock: ble_deep_stop holds it while it
+// waits for the tick, and the check simply runs again a second later.
+static void idle_tick(uint32_t now)
+{
+    if (g_idle_after_ms == 0 || g_idle_state != IDLE_ACTIVE
+        || now - __atomic_load_n(&g_last_call_ms, __ATOMIC_SEQ_CST) < g_idle_after_ms) {
+        return;
+    }
+    if (xSemaphoreTake(g_port_lock, 0) != pdTRUE) {
+        return;
+    }
+
+    bool idle = g_scan_refs > 0 && !__atomic_load_n(&g_burst.active, __ATOMIC_SEQ_CST)
+        && now - __atomic_load_n(&g_last_call_ms, __ATOMIC_SEQ_CST) >= g_idle_after_ms;
+    if (idle) {
+        xSemaphoreTake(g_lock, portMAX_DELAY);
+        idle = !subscriber_alive();
+        xSemaphoreGive(g_lock);
+    }
+    if (idle) {
+        g_idle_state = g_idle_action;
+        g_idle_since_ms = now;
+        g_idle_entered++;
+        ESP_LOGI(TAG, "idle: no demand for %u ms, state=%u", (unsigned) g_idle_after_ms, (unsigned) g_idle_state);
+        start_scan();
+    }
+    xSemaphoreGive(g_port_lock);
+}
+
+// Called by every port call. The cache was kept up to date (low duty) or
+// only aged (paused), so the call itself is answered from it right away.
+static void idle_resume(void)
+{
+    uint32_t now = now_ms();
+    __atomic_store_n(&g_last_call_ms, now, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&g_idle_state, __ATOMIC_SEQ_CST) == IDLE_ACTIVE) {
+        return;
+    }
+
+    xSemaphoreTake(g_port_lock, portMAX_DELAY);
+    if (g_idle_state != IDLE_ACTIVE) {
+        g_idle_last_ms = now - g_idle_since_ms;
+        g_idle_total_ms += g_idle_last_ms;
+        g_idle_resumed++;
+        g_idle_state = IDLE_ACTIVE;
+        ESP_LOGI(TAG, "idle: resumed after %u ms", (unsigned) g_idle_last_ms);
+        if (g_ble_started) {
+            start_scan();
+        }
+    }
+    xSemaphoreGive(g_port_lock);
+}
+
+// ----- Memory pressure -----
+
+// Caller holds g_lock. Frees the slot and, with history, its blocks. A
+// device still present departs first, as in presence_tick, so subscribers
+// see it leave.
+static void cache_evict(event_batch_t *batch, int idx)
+{
+#ifdef CONFIG_HELLO_ATOMVM_BLE_SWITCHBOT_ANALYTICS
+    if (g_presence[idx].present) {
+        ESP_LOGI(TAG, "DEPARTED id=%04x (evicted)", (unsigned) g_devices[idx].device_id);
+        push_presence_event(batch, &g_devices[idx], false, g_devices[idx].rssi);
+    }
+    presence_reset(&g_presence[idx]);
+    memset(&g_rule_state[idx], 0, sizeof(g_rule_state[idx]));
+#else
+    (void) batch;
+#endif
+    g_devices[idx].in_use = false;
+    if (g_latest_index == idx) {
+        g_latest_index = -1;
+    }
+    for (int i = 0; i < PORT_MAX; i++) {
+        if (g_ports[i].latest_index == idx) {
+            g_ports[i].latest_index = -1;
+        }
+    }
+#ifdef CONFIG_HELLO_ATOMVM_BLE_SWITCHBOT_ANALYTICS
+    topk_remove(&g_nearest, (uint8_t) idx);
+#endif
+#ifdef CONFIG_HELLO_ATOMVM_BLE_SWITCHBOT_HISTORY
+    hist_device_reset(&g_hist, &g_hist_dev[idx], (uint8_t) idx);
+#endif
+    g_mem_evicted++;
+}
+
+// esp_timer task. The level rises as soon as free heap drops below a
+// watermark and falls only once it is MEM_HYSTERESIS above it again.
+static void mem_tick(uint32_t now)
+{
+    uint32_t free_heap = esp_get_free_heap_size();
+    uint8_t below = 0;
+    uint8_t near = 0;
+    for (int i = 0; i < MEM_LEVELS; i++) {
+        below += free_heap < g_mem_watermark[i];
+        near += free_heap < g_mem_watermark[i] + MEM_HYSTERESIS;
+    }
+
+    uint8_t level = g_mem_level;
+    if (below > level) {
+        level = below;
+    } else if (near < level) {
+        level = near;
+    }
+    g_mem_free = free_heap;
+    if (level != g_mem_level) {
+        ESP_LOGW(TAG, "memory: level %u -> %u, free=%u", (unsigned) g_mem_level, (unsigned) level,
+            (unsigned) free_heap);
+        __atomic_store_n(&g_mem_level, level, __ATOMIC_SEQ_CST);
+        g_mem_changes++;
+        if (level > g_mem_max_level) {
+            g_mem_max_level = level;
+        }
+    }
+
+    if (level < MEM_EVICT || !g_lock) {
+        return;
+    }
+    bool burst = __atomic_load_n(&g_burst.active, __ATOMIC_SEQ_CST);
+    event_batch_t batch;
+    xSemaphoreTake(g_lock, portMAX_DELAY);
+    // presence_tick has sent its batch already, the timer queue is free
+    batch_begin(&batch, g_event_queue[EVENT_QUEUE_TIMER], g_event_queue_len);
+    for (int i = 0; i < g_cache_size; i++) {
+        const device_cache_t *d = &g_devices[i];
+        if (!d->in_use || (burst && d->burst_seen)) {
+            continue; // the burst reply still needs it
+        }
+        if (d->stale || now - d->merged_ms >= MEM_EVICT_IDLE_MS) {
+            cache_evict(&batch, i);
+        }
+    }
+    xSemaphoreGive(g_lock);
+
+    send_events(&batch);
+}
+
+// True if the call must be refused at the current level; counts it.
+static bool mem_shed(uint8_t level)
+{
+    if (__atomic_load_n(&g_mem_level, __ATOMIC_SEQ_CST) < level) {
+        return false;
+    }
+    __atomic_add_fetch(&g_mem_shed, 1, __ATOMIC_SEQ_CST);
+    return true;
+}
+
+// ----- GATT command client -----
+
+#ifdef CONFIG_HELLO_ATOMVM_BLE_SWITCHBOT_GATT
+// SwitchBot command characteristic cba20002-224d-11e6-9fb8-0002a5d5c51b
+static const ble_uuid128_t switchbot_cmd_chr_uuid = BLE_UUID128_INIT(
+    0x1b, 0xc5, 0xd5, 0xa5, 0x02, 0x00, 0xb8, 0x9f, 0xe6, 0x11, 0x4d, 0x22, 0x02, 0x00, 0xa2, 0xcb);
+
+enum
+{
+    GATT_EV_CONNECT,
+    GATT_EV_DISCOVERED,
+    GATT_EV_WRITE,
+    GATT_EV_DISCONNECT
+};
+
+static void gatt_dispatch(int ev, uint16_t conn, uint16_t value);
+
+static int gatt_gap_event_cb(struct ble_gap_event *event, void *arg)
+{
+    (void) arg;
+
+    switch (event->type) {
+        case BLE_GAP_EVENT_CONNECT:
+            ESP_LOGI(TAG, "GATT connect status=%d conn=%u", event->connect.status,
+                (unsigned) event->connect.conn_handle);
+            gatt_dispatch(GATT_EV_CONNECT, event->connect.conn_handle, event->connect.status == 0);
+            return 0;
+
+        case BLE_GAP_EVENT_DISCONNECT:
+            ESP_LOGI(TAG, "GATT disconnect reason=%d conn=%u", event->disconnect.reason,
+                (unsigned) event->disconnect.conn.conn_handle);
+            gatt_dispatch(GATT_EV_DISCONNECT, event->disconnect.conn.conn_handle, 0);
+            return 0;
+
+        default:
+            return 0;
+    }
+}
+
+static int gatt_chr_cb(uint16_t conn, const struct ble_gatt_error *error, const struct ble_gatt_chr *chr,
+    void *arg)
+{
+    (void) arg;
+
+    // Called once per match, then with BLE_HS_EDONE. The client ignores the
+    // final call once a handle was reported.
+    gatt_dispatch(GATT_EV_DISCOVERED, conn, (error->status == 0 && chr) ? chr->val_handle : 0);
+    return 0;
+}
+
+static int gatt_write_cb(uint16_t conn, const struct ble_gatt_error *error, struct ble_gatt_attr *attr,
+    void *arg)
+{
+    (void) attr;
+    (void) arg;
+
+    gatt_dispatch(GATT_EV_WRITE, conn, error->status == 0);
+    return 0;
+}
+
+static int gatt_op_connect(void *arg, const uint8_t addr[6], uint8_t addr_type)
+{
+    (void) arg;
+
+    // Scanning and initiating at the same time is not supported here; the
+    // scan resumes once the connect attempt is over (see gatt_resume_scan).
+    // A burst's discovery is never cancelled here: NimBLE reports no
+    // DISC_COMPLETE for it, so SCAN_BURST and GATT_SEND exclude each other.
+    if (ble_gap_disc_active()) {
+        ble_gap_disc_cancel();
+    }
+
+    ble_addr_t peer;
+    peer.type = addr_type;
+    memcpy(peer.val, addr, 6);
+    return ble_gap_connect(g_own_addr_type, &peer, GATT_CONNECT_TIMEOUT_MS, NULL, gatt_gap_event_cb, NULL);
+}
+
+static int gatt_op_disconnect(void *arg, uint16_t conn)
+{
+    (void) arg;
+    return ble_gap_terminate(conn, BLE_ERR_REM_USER_CONN_TERM);
+}
+
+static int gatt_op_discover(void *arg, uint16_t conn)
+{
+    (void) arg;
+    return ble_gattc_disc_chrs_by_uuid(conn, 1, 0xFFFF, &switchbot_cmd_chr_uuid.u, gatt_chr_cb, NULL);
+}
+
+static int gatt_op_write(void *arg, uint16_t conn, uint16_t handle, const uint8_t *data, uint8_t len)
+{
+    (void) arg;
+    return ble_gattc_write_flat(conn, handle, data, len, gatt_write_cb, NULL);
+}
+
+static const gatt_ops_t g_gatt_ops = {
+    .connect = gatt_op_connect,
+    .disconnect = gatt_op_disconnect,
+    .discover = gatt_op_discover,
+    .write = gatt_op_write,
+    .arg = NULL,
+};
+
+static void gatt_handles_load(void)
+{
+    nvs_handle_t h;
+    if (nvs_open(NVS_NAMESPACE, NVS_READONLY, &h) != ESP_OK) {
+        return;
+    }
+    uint8_t buf[GATT_HANDLE_CACHE * GATT_HANDLE_WIRE_LEN];
+    size_t len = sizeof(buf);
+    if (nvs_get_blob(h, NVS_KEY_GATT_HANDLES, buf, &len) == ESP_OK) {
+        gatt_handles_import(&g_gatt, buf, len);
+    }
+    nvs_close(h);
+}
+
+static void gatt_handles_save(const uint8_t *buf, size_t len)
+{
+    nvs_handle_t h;
+    if (nvs_open(NVS_NAMESPACE, NVS_READWRITE, &h) != ESP_OK) {
+        return;
+    }
+    if (nvs_set_blob(h, NVS_KEY_GATT_HANDLES, buf, len) == ESP_OK) {
+        nvs_commit(h);
+    }
+    nvs_close(h);
+}
+
+// Caller holds g_lock. True while any command is queued or in flight, i.e.
+// while the client may still call gatt_op_connect.
+static bool gatt_has_work(void)
+{
+    for (int i = 0; i < GATT_CONN_MAX; i++) {
+        if (g_gatt.slot[i].count > 0 || g_gatt.slot[i].state == GATT_SLOT_PENDING
+            || g_gatt.slot[i].state == GATT_SLOT_CONNECTING) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool gatt_connect_pending(void)
+{
+    for (int i = 0; i < GATT_CONN_MAX; i++) {
+        if (g_gatt.slot[i].state == GATT_SLOT_CONNECTING) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Scanning is paused while a connect is in flight.
+static void gatt_resume_scan(bool connect_pending)
+{
+    if (g_scan_wanted && !connect_pending && !ble_gap_disc_active()) {
+        start_scan();
+    }
+}
+
+// NimBLE host task: feeds a stack callback to the client, then reports
+// finished commands and persists the handle cache outside g_lock.
+static void gatt_dispatch(int ev, uint16_t conn, uint16_t value)
+{
+    gatt_result_t *done = g_gatt_done;
+    int n_done = 0;
+    uint8_t handles[GATT_HANDLE_CACHE * GATT_HANDLE_WIRE_LEN];
+    size_t handles_len = 0;
+    bool save = false;
+
+    event_batch_t batch;
+
+    xSemaphoreTake(g_lock, portMAX_DELAY);
+
+    batch_begin(&batch, g_event_queue[EVENT_QUEUE_HOST], g_event_queue_len);
+
+    uint32_t now = now_ms();
+    switch (ev) {
+        case GATT_EV_CONNECT:
+            gatt_on_connect(&g_gatt, value != 0, conn, now, done, &n_done);
+            break;
+        case GATT_EV_DISCOVERED:
+            gatt_on_discovered(&g_gatt, conn, value, now, done, &n_done);
+            break;
+        case GATT_EV_WRITE:
+            gatt_on_write(&g_gatt, conn, value != 0, now, done, &n_done);
+            break;
+        default:
+            gatt_on_disconnect(&g_gatt, conn, now, done, &n_done);
+            break;
+    }
+    for (int i = 0; i < n_done; i++) {
+        push_gatt_event(&batch, &done[i]);
+    }
+    if (g_gatt.handles_dirty) {
+        handles_len = gatt_handles_export(&g_gatt, handles, sizeof(handles));
+        g_gatt.handles_dirty = false;
+        save = true;
+    }
+    bool connect_pending = gatt_connect_pending();
+
+    xSemaphoreGive(g_lock);
+
+    send_events(&batch);
+    if (save) {
+        gatt_handles_save(handles, handles_len);
+    }
+    gatt_resume_scan(connect_pending);
+}
+#endif
+
+// ----- BLE lifecycle -----
+
+// Caller holds g_port_lock. Brings up NimBLE, g_lock and the tick timer;
+// the device cache and the other tables survive a deep stop, so a restart
+// only pays for the stack itself. Returns 0 or a driver error code.
+static uint8_t ble_init(void)
+{
+    if (g_ble_released) {
+        return 0x63; // controller memory was released
+    }
+    if (!nvs_ready()) {
+        return 0x30;
+    }
+
+    g_ble_init_start_us = esp_timer_get_time();
+    g_ble_sync_us = 0;
+#ifdef CONFIG_HELLO_ATOMVM_BLE_SWITCHBOT_GATT
+    gatt_handles_load();
+#endif
+
+    if (nimble_port_init() != ESP_OK) {
+        return 0x31;
+    }
+    ble_hs_cfg.sync_cb = on_sync;
+
+    g_lock = xSemaphoreCreateMutex();
+    g_ble_started = true;
+#ifdef CONFIG_HELLO_ATOMVM_BLE_SWITCHBOT_FLASH_LOG
+    log_mount();
+#endif
+
+    const esp_timer_create_args_t timer_args = {
+        .callback = presence_tick,
+        .name = "sb_presence",
+    };
+    if (esp_timer_create(&timer_args, &g_presence_timer) == ESP_OK) {
+        esp_timer_start_periodic(g_presence_timer, PRESENCE_TICK_MS * 1000);
+    } else {
+        ESP_LOGE(TAG, "presence timer create failed");
+    }
+
+    nimble_port_freertos_init(host_task);
+
+    g_ble_inits++;
+    g_ble_init_us = (uint32_t) (esp_timer_get_time() - g_ble_init_start_us);
+    return 0;
+}
+
+// Caller holds g_port_lock and no other port is open. Tears down everything
+// ble_init set up; with `release`, also hands the controller's memory to the
+// heap, after which BLE cannot start again until reboot. Returns 0, or 0x6B
+// with everything left running if the host task would not stop.
+static uint8_t ble_deep_stop(bool release)
+{
+    uint32_t heap_before = esp_get_free_heap_size();
+
+    // Nothing may touch g_lock once it is deleted: stop the host task (scan
+    // and GATT callbacks), then the tick, and wait for a running one.
+    bool scan_wanted = g_scan_wanted;
+    g_scan_wanted = false;
+    if (nimble_port_stop() != 0) {
+        g_scan_wanted = scan_wanted;
+        ESP_LOGE(TAG, "deep stop: nimble_port_stop failed");
+        return 0x6B;
+    }
+    nimble_port_deinit();
+
+    if (g_presence_timer) {
+        esp_timer_stop(g_presence_timer);
+        esp_timer_delete(g_presence_timer);
+        g_presence_timer = NULL;
+    }
+    while (__atomic_load_n(&g_tick_running, __ATOMIC_SEQ_CST)) {
+        vTaskDelay(1);
+    }
+
+#ifdef CONFIG_HELLO_ATOMVM_BLE_SWITCHBOT_FLASH_LOG
+    log_flush(now_ms(), true);
+#endif
+
+#ifdef CONFIG_HELLO_ATOMVM_BLE_SWITCHBOT_GATT
+    // Open connections went down with the host
+    gatt_init(&g_gatt, &g_gatt_ops, g_gatt_cmds, g_gatt.queue_len);
+#endif
+
+    // No burst or idle period survives the host; the next start begins active.
+    __atomic_store_n(&g_burst.active, 0, __ATOMIC_SEQ_CST);
+    g_burst.done = false;
+    g_burst.port = NULL;
+    if (g_idle_state != IDLE_ACTIVE) {
+        g_idle_last_ms = now_ms() - g_idle_since_ms;
+        g_idle_total_ms += g_idle_last_ms;
+        g_idle_resumed++;
+        __atomic_store_n(&g_idle_state, IDLE_ACTIVE, __ATOMIC_SEQ_CST);
+    }
+
+    SemaphoreHandle_t lock = g_lock;
+    g_lock = NULL;
+    vSemaphoreDelete(lock);
+    g_ble_started = false;
+
+    if (release) {
+        esp_bt_controller_mem_release(ESP_BT_MODE_BLE);
+        g_ble_released = true;
+    }
+
+    g_ble_deep_stops++;
+    uint32_t heap_after = esp_get_free_heap_size();
+    g_ble_reclaimed = heap_after > heap_before ? heap_after - heap_before : 0;
+    ESP_LOGI(TAG, "deep stop: reclaimed %u bytes, free %u", (unsigned) g_ble_reclaimed, (unsigned) heap_after);
+    return 0;
+}
+
+// ----- Arena -----
+
+// Longest per-device entry of the listing replies, which are built in the
+// calling port's reply buffer.
+//
+// Aggregates:
+// <<device_id:16, addr:6, model:8,
+//   AGG_MAX_WINDOWS x <<mode:8, window_s:32,
+//     AGG_METRIC_COUNT x <<count:16, min:s16, max:s16, sum:s32>>>>>>
+#define AGG_ENTRY_LEN (2 + 6 + 1 + AGG_MAX_WINDOWS * (1 + 4 + AGG_METRIC_COUNT * 10))
+#define PRESENCE_ENTRY_LEN 20
+#define RX_STATS_ENTRY_LEN (6 + 2 + 1 + 16 + 3 + RX_HIST_BUCKETS * 2)
+#define READING_ENTRY_LEN 22
+// Queries: <<age_ms:32, frame_len:8, frame as in OPCODE_LATEST>>
+#define QUERY_ENTRY_LEN (4 + 1 + 6 + 1 + 1 + MAX_BLE_DATA + 1 + MAX_BLE_DATA)
+
+#define REPLY_HEADER_MAX 16 // OPCODE_SCAN_BURST has the longest
+#define MAX2(a, b) ((a) > (b) ? (a) : (b))
+#ifdef CONFIG_HELLO_ATOMVM_BLE_SWITCHBOT_ANALYTICS
+#define ANALYTICS_ENTRY_MAX MAX2(MAX2(AGG_ENTRY_LEN, PRESENCE_ENTRY_LEN), MAX2(RX_STATS_ENTRY_LEN, QUERY_ENTRY_LEN))
+#define REPLY_ENTRY_MAX MAX2(ANALYTICS_ENTRY_MAX, READING_ENTRY_LEN)
+#else
+#define REPLY_ENTRY_MAX READING_ENTRY_LEN
+#endif
+
+#ifdef CONFIG_HELLO_ATOMVM_BLE_SWITCHBOT_HISTORY
+#define DEFAULT_HISTORY_BLOCKS CONFIG_HELLO_ATOMVM_BLE_SWITCHBOT_HISTORY_BLOCKS
+#else
+#define DEFAULT_HISTORY_BLOCKS 0
+#endif
+
+#ifdef CONFIG_HELLO_ATOMVM_BLE_SWITCHBOT_GATT
+#define DEFAULT_GATT_QUEUE GATT_QUEUE_DEFAULT
+#else
+#define DEFAULT_GATT_QUEUE 0
+#endif
+
+// One allocation for the device cache, every table indexed like it, the
+// history pool, the event and GATT queues and the reply buffers. Made when
+// the first port opens and kept until the driver is destroyed.
+static uint8_t *g_arena;
+static size_t g_arena_len;
+static uint16_t g_history_blocks;
+static uint8_t g_gatt_queue_len; // commands per device, 0 without GATT
+#ifdef CONFIG_HELLO_ATOMVM_BLE_SWITCHBOT_HISTORY
+static hist_block_t *g_hist_blocks;
+#endif
+static uint8_t *g_reply_bufs[PORT_MAX];
+static size_t g_reply_len;
+
+// Hands out `len` bytes at *off, 8-byte aligned. With a NULL base it only
+// advances *off, to measure the layout.
+static void *arena_take(uint8_t *base, size_t *off, size_t len)
+{
+    size_t at = (*off + 7) & ~(size_t) 7;
+    *off = at + len;
+    return base ? base + at : NULL;
+}
+
+static size_t arena_layout(uint8_t *base, uint8_t cache_size, uint16_t history_blocks, uint16_t event_queue,
+    uint8_t gatt_queue)
+{
+    size_t off = 0;
+    size_t n = cache_size;
+
+    g_devices = arena_take(base, &off, n * sizeof(*g_devices));
+#ifdef CONFIG_HELLO_ATOMVM_BLE_SWITCHBOT_ANALYTICS
+    g_agg = arena_take(base, &off, n * sizeof(*g_agg));
+    g_rule_state = arena_take(base, &off, n * sizeof(*g_rule_state));
+    g_presence = arena_take(base, &off, n * sizeof(*g_presence));
+    g_rxstats = arena_take(base, &off, n * sizeof(*g_rxstats));
+#endif
+    g_export_last = arena_take(base, &off, n * sizeof(*g_export_last));
+    g_export_have_last = arena_take(base, &off, n * sizeof(*g_export_have_last));
+#ifdef CONFIG_HELLO_ATOMVM_BLE_SWITCHBOT_FLASH_LOG
+    g_log_last_s = arena_take(base, &off, n * sizeof(*g_log_last_s));
+#endif
+#ifdef CONFIG_HELLO_ATOMVM_BLE_SWITCHBOT_WARM_START
+    g_snapshot_buf_len = 2 + n * SNAPSHOT_RECORD_MAX;
+    g_snapshot_buf = arena_take(base, &off, g_snapshot_buf_len);
+#endif
+#ifdef CONFIG_HELLO_ATOMVM_BLE_SWITCHBOT_HISTORY
+    g_hist_dev = arena_take(base, &off, n * sizeof(*g_hist_dev));
+    g_hist_blocks = arena_take(base, &off, history_blocks * sizeof(*g_hist_blocks));
+#else
+    (void) history_blocks;
+#endif
+
+    g_event_queue_len = event_queue;
+    for (int i = 0; i < EVENT_QUEUES; i++) {
+        g_event_queue[i] = arena_take(base, &off, (size_t) event_queue * sizeof(event_t));
+    }
+
+#ifdef CONFIG_HELLO_ATOMVM_BLE_SWITCHBOT_GATT
+    size_t gatt_n = (size_t) GATT_CONN_MAX * gatt_queue;
+    g_gatt_cmds = arena_take(base, &off, gatt_n * sizeof(*g_gatt_cmds));
+    g_gatt_done = arena_take(base, &off, gatt_n * sizeof(*g_gatt_done));
+    for (int i = 0; i < PORT_MAX; i++) {
+        g_gatt_events[i] = arena_take(base, &off, gatt_n * sizeof(event_t));
+    }
+#else
+    (void) gatt_queue;
+#endif
+
+    g_reply_len = REPLY_HEADER_MAX + n * REPLY_ENTRY_MAX;
+    for (int i = 0; i < PORT_MAX; i++) {
+        g_reply_bufs[i] = arena_take(base, &off, g_reply_len);
+    }
+    return off;
+}
+
+// Caller holds g_port_lock; BLE is not started yet, so nothing else reads
+// the tables.
+static bool arena_create(uint8_t cache_size, uint16_t history_blocks, uint16_t event_queue, uint8_t gatt_queue)
+{
+    size_t len = arena_layout(NULL, cache_size, history_blocks, event_queue, gatt_queue);
+    uint8_t *base = calloc(1, len);
+    if (!base) {
+        ESP_LOGE(TAG, "arena: %u bytes not available", (unsigned) len);
+        return false;
+    }
+
+    arena_layout(base, cache_size, history_blocks, event_queue, gatt_queue);
+    g_arena = base;
+    g_arena_len = len;
+    g_cache_size = cache_size;
+    g_history_blocks = history_blocks;
+    g_gatt_queue_len = gatt_queue;
+
+#ifdef CONFIG_HELLO_ATOMVM_BLE_SWITCHBOT_HISTORY
+    hist_init(&g_hist, g_hist_blocks, history_blocks);
+    for (int i = 0; i < cache_size; i++) {
+        g_hist_dev[i].block = -1;
+    }
+#endif
+#ifdef CONFIG_HELLO_ATOMVM_BLE_SWITCHBOT_GATT
+    gatt_init(&g_gatt, &g_gatt_ops, g_gatt_cmds, gatt_queue);
+#endif
+#ifdef CONFIG_HELLO_ATOMVM_BLE_SWITCHBOT_WARM_START
+    snapshot_restore();
+#endif
+
+    ESP_LOGI(TAG, "arena: %u devices, %u history blocks, %u events, %u GATT commands per device, %u bytes",
+        (unsigned) cache_size, (unsigned) history_blocks, (unsigned) event_queue, (unsigned) gatt_queue,
+        (unsigned) len);
+    return true;
+}
+
+static void arena_destroy(void)
+{
+    free(g_arena);
+    g_arena = NULL;
+    g_arena_len = 0;
+    g_cache_size = 0;
+    g_history_blocks = 0;
+    g_gatt_queue_len = 0;
+    arena_layout(NULL, 0, 0, 0, 0);
+#ifdef CONFIG_HELLO_ATOMVM_BLE_SWITCHBOT_HISTORY
+    hist_init(&g_hist, NULL, 0);
+#endif
+}
+
+// ----- Port instances -----
+
+// Reads the proplist given to open_port. Unknown keys are ignored; a known
+// key with a bad value fails the open.
+static bool port_options_parse(term opts, port_options_t *out)
+{
+    static const char *const cache_size_atom = ATOM_STR("\xA", "cache_size");
+    static const char *const scan_atom = ATOM_STR("\x4", "scan");
+    static const char *const reply_atom = ATOM_STR("\x5", "reply");
+
+    memset(out, 0, sizeof(*out));
+    if (!term_is_list(opts)) {
+        return true;
+    }
+
+    term v = interop_proplist_get_value_default(opts, globalcontext_make_atom(g_global, cache_size_atom), term_nil());
+    if (v != term_nil()) {
+        if (!term_is_integer(v) || term_to_int(v) < 1 || term_to_int(v) > MAX_DEVICES) {
+            return false;
+        }
+        out->cache_size = (uint8_t) term_to_int(v);
+    }
+
+    // Ignored when the history is not compiled in
+#ifdef CONFIG_HELLO_ATOMVM_BLE_SWITCHBOT_HISTORY
+    static const char *const history_blocks_atom = ATOM_STR("\xE", "history_blocks");
+    v = interop_proplist_get_value_default(opts, globalcontext_make_atom(g_global, history_blocks_atom), term_nil());
+    if (v != term_nil()) {
+        if (!term_is_integer(v) || term_to_int(v) < 1 || term_to_int(v) > HIST_MAX_BLOCKS) {
+            return false;
+        }
+        out->history_blocks = (uint16_t) term_to_int(v);
+    }
+#endif
+
+    static const char *const event_queue_atom = ATOM_STR("\xB", "event_queue");
+    v = interop_proplist_get_value_default(opts, globalcontext_make_atom(g_global, event_queue_atom), term_nil());
+    if (v != term_nil()) {
+        if (!term_is_integer(v) || term_to_int(v) < 1 || term_to_int(v) > EVENT_QUEUE_MAX) {
+            return false;
+        }
+        out->event_queue = (uint16_t) term_to_int(v);
+    }
+
+    // Ignored when GATT is not compiled in
+#ifdef CONFIG_HELLO_ATOMVM_BLE_SWITCHBOT_GATT
+    static const char *const gatt_queue_atom = ATOM_STR("\xA", "gatt_queue");
+    v = interop_proplist_get_value_default(opts, globalcontext_make_atom(g_global, gatt_queue_atom), term_nil());
+    if (v != term_nil()) {
+        if (!term_is_integer(v) || term_to_int(v) < 1 || term_to_int(v) > GATT_QUEUE_MAX) {
+            return false;
+        }
+        out->gatt_queue = (uint8_t) term_to_int(v);
+    }
+#endif
+
+    v = interop_proplist_get_value_default(opts, globalcontext_make_atom(g_global, scan_atom), term_nil());
+    if (v == globalcontext_make_atom(g_global, ATOM_STR("\x9", "low_power"))) {
+        out->scan_profile = SCAN_LOW_POWER;
+    } else if (v == globalcontext_make_atom(g_global, ATOM_STR("\x8", "balanced"))) {
+        out->scan_profile = SCAN_BALANCED;
+    } else if (v != term_nil() && v != globalcontext_make_atom(g_global, ATOM_STR("\x4", "fast"))) {
+        return false;
+    }
+
+    v = interop_proplist_get_value_default(opts, globalcontext_make_atom(g_global, reply_atom), term_nil());
+    if (v == globalcontext_make_atom(g_global, ATOM_STR("\x7", "reading"))) {
+        out->reply_format = REPLY_READING;
+    } else if (v != term_nil() && v != globalcontext_make_atom(g_global, ATOM_STR("\x5", "frame"))) {
+        return false;
+    }
+
+    return true;
+}
+
+// The first port sizes the arena; a later one asking for other sizes fails.
+static port_instance_t *port_acquire(const port_options_t *opts)
+{
+    port_instance_t *port = NULL;
+
+    xSemaphoreTake(g_port_lock, portMAX_DELAY);
+    if (!g_arena) {
+        uint8_t cache_size = opts->cache_size ? opts->cache_size : DEFAULT_CACHE_SIZE;
+        uint16_t history_blocks = opts->history_blocks ? opts->history_blocks : DEFAULT_HISTORY_BLOCKS;
+        uint8_t gatt_queue = opts->gatt_queue ? opts->gatt_queue : DEFAULT_GATT_QUEUE;
+        // By default one event per device, plus the events of one advert or
+        // the GATT completions of one dispatch, whichever is more.
+        uint16_t event_queue = opts->event_queue
+            ? opts->event_queue
+            : (uint16_t) (cache_size + MAX2(EVENT_QUEUE_EXTRA, GATT_CONN_MAX * gatt_queue));
+        if (!arena_create(cache_size, history_blocks, event_queue, gatt_queue)) {
+            xSemaphoreGive(g_port_lock);
+            return NULL;
+        }
+    } else if ((opts->cache_size && opts->cache_size != g_cache_size)
+        || (opts->history_blocks && opts->history_blocks != g_history_blocks)
+        || (opts->event_queue && opts->event_queue != g_event_queue_len)
+        || (opts->gatt_queue && opts->gatt_queue != g_gatt_queue_len)) {
+        xSemaphoreGive(g_port_lock);
+        return NULL;
+    }
+
+    for (int i = 0; i < PORT_MAX; i++) {
+        if (!g_ports[i].allocated) {
+            port = &g_ports[i];
+            break;
+        }
+    }
+    if (port) {
+        // The slot is inactive, so the scan callback no longer reads it.
+        memset(port, 0, sizeof(*port));
+        port->allocated = true;
+        port->scan_profile = opts->scan_profile;
+        port->reply_format = opts->reply_format;
+        port->reply = g_reply_bufs[port - g_ports];
+        if (g_lock) {
+            xSemaphoreTake(g_lock, portMAX_DELAY);
+        }
+        port->latest_index = g_latest_index;
+        if (g_lock) {
+            xSemaphoreGive(g_lock);
+        }
+        __atomic_store_n(&port->active, true, __ATOMIC_SEQ_CST);
+    }
+    xSemaphoreGive(g_port_lock);
+
+    return port;
+}
+
+// Drops the port's scanner reference, subscription and device bits.
+static void port_release(port_instance_t *port)
+{
+    xSemaphoreTake(g_port_lock, portMAX_DELAY);
+    if (port->scanning) {
+        port->scanning = false;
+        g_scan_refs--;
+        if (g_scan_refs == 0 && g_ble_started) {
+            stop_scan();
+        } else if (g_ble_started) {
+            start_scan();
+        }
+    }
+
+    __atomic_store_n(&port->active, false, __ATOMIC_SEQ_CST);
+    filter_quiesce();
+
+    if (g_lock) {
+        xSemaphoreTake(g_lock, portMAX_DELAY);
+    }
+    port->have_subscriber = false;
+    if (g_burst.port == port) {
+        g_burst.port = NULL; // a running burst finishes unanswered
+        g_burst.done = false;
+    }
+    for (int i = 0; i < g_cache_size; i++) {
+        g_devices[i].ports &= (uint8_t) ~PORT_BIT(port);
+    }
+    if (g_lock) {
+        xSemaphoreGive(g_lock);
+    }
+
+    port->allocated = false;
+    xSemaphoreGive(g_port_lock);
+}
+
+// ----- Port call handling -----
+
+static size_t frame_len(const device_cache_t *d)
+{
+    return 6 + 1 + 1 + d->svc_len + 1 + d->mfg_len;
+}
+
+// <<addr:6, rssi:s8, svc_len:u8, svc:svc_len, mfg_len:u8, mfg:mfg_len>>
+static uint8_t *put_frame(uint8_t *p, const device_cache_t *d)
+{
+    memcpy(p, d->addr, 6);
+    p += 6;
+    *p++ = (uint8_t) d->rssi;
+
+    *p++ = d->svc_len;
+    memcpy(p, d->svc, d->svc_len);
     p += d->svc_len;
 
-    *p++ = d->mfg_len;
-    memcpy(p, d->mfg, d->mfg_len);
-    p += d->mfg_len;
+    *p++ = d->mfg_len;
+    memcpy(p, d->mfg, d->mfg_len);
+    p += d->mfg_len;
+
+    return p;
+}
+
+static term reply_latest(Context *ctx, const device_cache_t *d)
+{
+    // payload: frame, see put_frame
+    term bin = term_create_uninitialized_binary(1 + frame_len(d), &ctx->heap, ctx->global);
+    uint8_t *out = (uint8_t *) term_binary_data(bin);
+
+    out[0] = 0x00;
+    put_frame(out + 1, d);
+
+    return bin;
+}
+
+#ifdef CONFIG_HELLO_ATOMVM_BLE_SWITCHBOT_ANALYTICS
+// Caller holds g_lock.
+static bool query_match_slot(const query_t *q, int i, uint32_t now)
+{
+    const device_cache_t *d = &g_devices[i];
+    if (!d->in_use || !is_merged(d)) {
+        return false;
+    }
+
+    sensor_reading_t r;
+    vendor_decode(d->vendor, d->svc, d->svc_len, d->mfg, d->mfg_len, &r);
+
+    query_subject_t subj = {
+        .addr = d->addr,
+        .rssi = d->rssi,
+        .age_ms = now - d->merged_ms,
+        .model = r.model,
+        .have_id = d->have_device_id,
+        .id = d->device_id,
+        .have_battery = (r.fields & READING_HAS_BATTERY) != 0,
+        .battery = r.battery,
+    };
+    return query_match(q, &subj);
+}
+#endif
+
+// OPCODE_READINGS entry of a merged device, or NULL if it has nothing to
+// decode. See READING_ENTRY_LEN.
+static uint8_t *put_reading_entry(uint8_t *p, const device_cache_t *d, uint32_t now)
+{
+    sensor_reading_t r;
+    if (!d->in_use || !is_merged(d) || !vendor_decode(d->vendor, d->svc, d->svc_len, d->mfg, d->mfg_len, &r)) {
+        return NULL;
+    }
+    p = put_u16be(p, d->device_id);
+    memcpy(p, d->addr, 6);
+    p += 6;
+    *p++ = r.vendor;
+    *p++ = r.model;
+    *p++ = (uint8_t) (r.fields | (d->stale ? READING_STALE : 0));
+    *p++ = r.battery;
+    p = put_u16be(p, (uint16_t) r.temp_dc);
+    *p++ = r.humidity;
+    *p++ = r.pir;
+    *p++ = r.door;
+    *p++ = (uint8_t) d->rssi;
+    p = put_u32be(p, now - d->merged_ms);
+    return p;
+}
+
+#ifdef CONFIG_HELLO_ATOMVM_BLE_SWITCHBOT_ANALYTICS
+// Per-device aggregate entry, see AGG_ENTRY_LEN. Caller holds g_lock.
+static uint8_t *put_agg_entry(uint8_t *p, int idx, uint32_t now)
+{
+    const device_cache_t *d = &g_devices[idx];
+
+    p = put_u16be(p, d->device_id);
+    memcpy(p, d->addr, 6);
+    p += 6;
+    *p++ = d->svc_len > 0 ? d->svc[0] : 0;
+
+    for (int w = 0; w < AGG_MAX_WINDOWS; w++) {
+        agg_stat_t st[AGG_METRIC_COUNT];
+        agg_read(&g_agg[idx], &g_agg_cfg, w, now, st);
+
+        *p++ = g_agg_cfg.win[w].mode;
+        p = put_u32be(p, g_agg_cfg.win[w].window_s);
+        for (int m = 0; m < AGG_METRIC_COUNT; m++) {
+            p = put_u16be(p, st[m].count);
+            p = put_u16be(p, (uint16_t) st[m].min);
+            p = put_u16be(p, (uint16_t) st[m].max);
+            p = put_u32be(p, (uint32_t) st[m].sum);
+        }
+    }
+    return p;
+}
+#endif
+
+#ifdef CONFIG_HELLO_ATOMVM_BLE_SWITCHBOT_HISTORY
+// Caller holds g_lock. Returns the slot of a merged SwitchBot device, or -1.
+static int find_device_id(uint16_t wanted)
+{
+    for (int i = 0; i < g_cache_size; i++) {
+        if (g_devices[i].in_use && g_devices[i].have_device_id && g_devices[i].device_id == wanted) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+#define HIST_READ_MAX 64
+#define HIST_SAMPLE_LEN 8
+#endif
+
+// Sends the OPCODE_SCAN_BURST reply once burst_complete woke the port.
+static void burst_reply(Context *ctx)
+{
+    port_instance_t *port = (port_instance_t *) ctx->platform_data;
+    if (!port || !g_lock) {
+        return;
+    }
+
+    xSemaphoreTake(g_lock, portMAX_DELAY);
+    if (!g_burst.done || g_burst.port != port) {
+        xSemaphoreGive(g_lock);
+        return;
+    }
+    if (g_burst.err != 0) {
+        int32_t pid = g_burst.pid;
+        uint64_t ref_ticks = g_burst.ref_ticks;
+        uint8_t err = g_burst.err;
+        g_burst.done = false;
+        g_burst.port = NULL;
+        xSemaphoreGive(g_lock);
+        port_send_reply(ctx, term_from_local_process_id(pid), term_from_ref_ticks(ref_ticks, &ctx->heap),
+            make_error(ctx, err));
+        return;
+    }
+
+    uint8_t *buf = port->reply;
+    uint8_t *p = buf + 4 + 4 + 4 + 1 + 1 + 1;
+    uint8_t seen = 0;
+    uint8_t missed = 0;
+    uint8_t count = 0;
+    uint32_t now = now_ms();
+    for (int i = 0; i < g_cache_size; i++) {
+        const device_cache_t *d = &g_devices[i];
+        if (!d->in_use) {
+            continue;
+        }
+        if (!d->burst_seen) {
+            missed++;
+            continue;
+        }
+        seen++;
+        uint8_t *next = put_reading_entry(p, d, now);
+        if (next) {
+            p = next;
+            count++;
+        }
+    }
+    put_u32be(buf, g_burst.radio_on_ms);
+    put_u32be(buf + 4, g_burst.adverts);
+    put_u32be(buf + 8, g_burst.last_new_ms);
+    buf[12] = seen;
+    buf[13] = missed;
+    buf[14] = count;
+
+    int32_t pid = g_burst.pid;
+    uint64_t ref_ticks = g_burst.ref_ticks;
+    g_burst.done = false;
+    g_burst.port = NULL;
+    xSemaphoreGive(g_lock);
+
+    term reply = make_ok_with_payload(ctx, buf, (size_t) (p - buf));
+    port_send_reply(ctx, term_from_local_process_id(pid), term_from_ref_ticks(ref_ticks, &ctx->heap), reply);
+}
+
+// Returns the reply, or term_invalid_term() when it is sent later.
+static term handle_call(Context *ctx, term pid, term ref, term req)
+{
+    port_instance_t *port = (port_instance_t *) ctx->platform_data;
+
+    if (!term_is_binary(req)) {
+        return make_error(ctx, 0x10);
+    }
+
+    const uint8_t *data = (const uint8_t *) term_binary_data(req);
+    size_t len = term_binary_size(req);
+
+    if (len < 1) {
+        return make_error(ctx, 0x11);
+    }
+
+    uint8_t opcode = data[0];
+
+    idle_resume();
+
+    switch (opcode) {
+        case OPCODE_PING: {
+            static const uint8_t pong[] = { 'P', 'O', 'N', 'G' };
+            return make_ok_with_payload(ctx, pong, sizeof(pong));
+        }
+
+        case OPCODE_ECHO:
+            return make_ok_with_payload(ctx, data + 1, len - 1);
+
+        case OPCODE_BLE_START: {
+            // The scanner is shared; it runs while any port has started it,
+            // with the most demanding scan profile among those ports.
+            xSemaphoreTake(g_port_lock, portMAX_DELAY);
+            bool was_scanning = port->scanning;
+            if (!was_scanning) {
+                port->scanning = true;
+                g_scan_refs++;
+            }
+            if (!g_ble_started) {
+                // lazy init, also after a deep stop
+                uint8_t err = ble_init();
+                if (err != 0) {
+                    if (!was_scanning) {
+                        port->scanning = false;
+                        g_scan_refs--;
+                    }
+                    xSemaphoreGive(g_port_lock);
+                    return make_error(ctx, err);
+                }
+            } else {
+                start_scan();
+            }
+            xSemaphoreGive(g_port_lock);
+
+            uint8_t ok = 0x01;
+            return make_ok_with_payload(ctx, &ok, 1);
+        }
+
+        case OPCODE_BLE_STOP: {
+            // <<0x11>> or <<0x11, mode:8>>
+            // Drops this port's reference; the last one stops the scan. Mode 1
+            // also deinitializes NimBLE and frees its memory (BLE_START brings
+            // it back), mode 2 in addition releases the controller's memory for
+            // good. Both need this to be the only open port; error 0x6B if
+            // NimBLE would not stop, with BLE still running.
+            if (!g_ble_started) {
+                return make_error(ctx, 0x32);
+            }
+            uint8_t mode = len >= 2 ? data[1] : 0;
+            if (mode > 2) {
+                return make_error(ctx, 0x42);
+            }
+
+            xSemaphoreTake(g_port_lock, portMAX_DELAY);
+            if (__atomic_load_n(&g_burst.active, __ATOMIC_SEQ_CST)) {
+                xSemaphoreGive(g_port_lock);
+                return make_error(ctx, 0x66); // a scan burst is running
+            }
+            if (mode != 0) {
+                for (int i = 0; i < PORT_MAX; i++) {
+                    if (g_ports[i].allocated && &g_ports[i] != port) {
+                        xSemaphoreGive(g_port_lock);
+                        return make_error(ctx, 0x64); // other ports are open
+                    }
+                }
+            }
+            if (mode != 0) {
+                uint8_t err = ble_deep_stop(mode == 2);
+                if (err != 0) {
+                    xSemaphoreGive(g_port_lock);
+                    return make_error(ctx, err);
+                }
+            }
+            if (port->scanning) {
+                port->scanning = false;
+                g_scan_refs--;
+            }
+            if (mode == 0) {
+                if (g_scan_refs == 0) {
+                    stop_scan();
+                } else {
+                    start_scan(); // the remaining ports may want a lighter profile
+                }
+            }
+            xSemaphoreGive(g_port_lock);
+
+            uint8_t ok = 0x01;
+            return make_ok_with_payload(ctx, &ok, 1);
+        }
+
+        case OPCODE_BLE_STATS: {
+            // payload: <<started:8, released:8, inits:16, deep_stops:16, heap_free:32,
+            //            reclaimed:32, init_us:32, sync_us:32, events_dropped:32>>
+            // reclaimed is the heap the last deep stop gave back; sync_us is the
+            // time from the last init to the host being ready to scan.
+            // events_dropped counts subscriber events an event queue had no room for.
+            uint8_t buf[1 + 1 + 2 + 2 + 4 * 5];
+            uint8_t *p = buf;
+
+            xSemaphoreTake(g_port_lock, portMAX_DELAY);
+            *p++ = g_ble_started ? 1 : 0;
+            *p++ = g_ble_released ? 1 : 0;
+            p = put_u16be(p, g_ble_inits);
+            p = put_u16be(p, g_ble_deep_stops);
+            p = put_u32be(p, esp_get_free_heap_size());
+            p = put_u32be(p, g_ble_reclaimed);
+            p = put_u32be(p, g_ble_init_us);
+            p = put_u32be(p, g_ble_sync_us);
+            p = put_u32be(p, __atomic_load_n(&g_events_dropped, __ATOMIC_SEQ_CST));
+            xSemaphoreGive(g_port_lock);
+
+            return make_ok_with_payload(ctx, buf, (size_t) (p - buf));
+        }
+
+        case OPCODE_PORT_INFO: {
+            // payload: <<slot:8, cache_size:8, history_blocks:16, arena_bytes:32,
+            //            reply_bytes:16, scan_profile:8, reply_format:8, heap_words:32,
+            //            event_queue:16, gatt_queue:8>>
+            // The sizes are the arena's, set by the first port opened.
+            // heap_words is this port's own context heap, replies included.
+            uint8_t buf[1 + 1 + 2 + 4 + 2 + 1 + 1 + 4 + 2 + 1];
+            uint8_t *p = buf;
+
+            xSemaphoreTake(g_port_lock, portMAX_DELAY);
+            *p++ = (uint8_t) (port - g_ports);
+            *p++ = g_cache_size;
+            p = put_u16be(p, g_history_blocks);
+            p = put_u32be(p, (uint32_t) g_arena_len);
+            p = put_u16be(p, (uint16_t) g_reply_len);
+            *p++ = port->scan_profile;
+            *p++ = port->reply_format;
+            uint16_t event_queue = (uint16_t) g_event_queue_len;
+            uint8_t gatt_queue = g_gatt_queue_len;
+            xSemaphoreGive(g_port_lock);
+            p = put_u32be(p, (uint32_t) memory_heap_memory_size(&ctx->heap));
+            p = put_u16be(p, event_queue);
+            *p++ = gatt_queue;
+
+            return make_ok_with_payload(ctx, buf, (size_t) (p - buf));
+        }
+
+        case OPCODE_SCAN_BURST: {
+            // <<0x3C, duration_ms:16, filter program...>>, see switchbot_filter.h
+            // Runs one discovery of duration_ms at the fastest interval and
+            // replies when it ends, leaving the radio idle. Only while no port
+            // has the continuous scan started.
+            // payload: <<radio_on_ms:32, adverts:32, last_new_ms:32, seen:8, missed:8,
+            //            count:8, count x OPCODE_READINGS entry>>
+            // seen counts devices the filter accepted during the burst and count
+            // those with a reading; missed counts cached devices not heard.
+            // last_new_ms is when the last of the seen devices first showed up.
+            // Error 0x67 if the discovery could not be started.
+            if (len < 1 + 2) {
+                return make_error(ctx, 0x42);
+            }
+            uint16_t duration = (uint16_t) ((uint16_t) data[1] << 8) | (uint16_t) data[2];
+            if (duration == 0) {
+                return make_error(ctx, 0x65);
+            }
+            filter_prog_t prog;
+            if (!filter_load(&prog, data + 3, len - 3)) {
+                return make_error(ctx, 0x5C);
+            }
+
+            xSemaphoreTake(g_port_lock, portMAX_DELAY);
+            if (g_lock) {
+                xSemaphoreTake(g_lock, portMAX_DELAY);
+            }
+            bool busy = g_scan_refs > 0 || __atomic_load_n(&g_burst.active, __ATOMIC_SEQ_CST) || g_burst.done;
+#ifdef CONFIG_HELLO_ATOMVM_BLE_SWITCHBOT_GATT
+            busy = busy || gatt_has_work(); // a connect would cancel the burst's discovery
+#endif
+            if (!busy) {
+                for (int i = 0; i < g_cache_size; i++) {
+                    g_devices[i].burst_seen = false;
+                }
+                g_burst.port = port;
+                g_burst.pid = term_to_local_process_id(pid);
+                g_burst.ref_ticks = term_to_ref_ticks(ref);
+                g_burst.filter = prog;
+                g_burst.duration_ms = duration;
+                g_burst.start_us = esp_timer_get_time();
+                g_burst.adverts = 0;
+                g_burst.last_new_ms = 0;
+                g_burst.err = 0;
+                __atomic_store_n(&g_burst.active, 1, __ATOMIC_SEQ_CST);
+            }
+            if (g_lock) {
+                xSemaphoreGive(g_lock);
+            }
+            if (busy) {
+                xSemaphoreGive(g_port_lock);
+                return make_error(ctx, 0x66); // scanner in use
+            }
+
+            uint8_t err = 0;
+            if (!g_ble_started) {
+                err = ble_init(); // on_sync starts the discovery
+            } else if (ble_hs_synced() && burst_disc_start() != 0) {
+                err = 0x67;
+            }
+            if (err != 0) {
+                if (g_lock) {
+                    xSemaphoreTake(g_lock, portMAX_DELAY);
+                }
+                g_burst.port = NULL;
+                __atomic_store_n(&g_burst.active, 0, __ATOMIC_SEQ_CST);
+                if (g_lock) {
+                    xSemaphoreGive(g_lock);
+                }
+            }
+            xSemaphoreGive(g_port_lock);
+
+            if (err != 0) {
+                return make_error(ctx, err);
+            }
+            return term_invalid_term(); // see burst_reply
+        }
+
+        case OPCODE_IDLE_CONFIG: {
+            // <<0x3D, idle_after_ms:32, action:8>>
+            // action: 1 low duty, 2 pause; idle_after_ms 0 never idles.
+            if (len != 1 + 4 + 1 || (data[5] != IDLE_LOW_DUTY && data[5] != IDLE_PAUSED)) {
+                return make_error(ctx, 0x68);
+            }
+
+            xSemaphoreTake(g_port_lock, portMAX_DELAY);
+            g_idle_after_ms = get_u32be(data + 1);
+            g_idle_action = data[5];
+            xSemaphoreGive(g_port_lock);
+
+            uint8_t ok = 0x01;
+            return make_ok_with_payload(ctx, &ok, 1);
+        }
+
+        case OPCODE_IDLE_STATS: {
+            // payload: <<state:8, action:8, idle_after_ms:32, idles:16, resumes:16,
+            //            idle_total_ms:32, last_idle_ms:32>>
+            // Read by a call, so state is always 0 (active) here; idles and
+            // resumes tell what happened in between.
+            uint8_t buf[1 + 1 + 4 + 2 + 2 + 4 + 4];
+            uint8_t *p = buf;
+
+            xSemaphoreTake(g_port_lock, portMAX_DELAY);
+            *p++ = g_idle_state;
+            *p++ = g_idle_action;
+            p = put_u32be(p, g_idle_after_ms);
+            p = put_u16be(p, g_idle_entered);
+            p = put_u16be(p, g_idle_resumed);
+            p = put_u32be(p, g_idle_total_ms);
+            p = put_u32be(p, g_idle_last_ms);
+            xSemaphoreGive(g_port_lock);
+
+            return make_ok_with_payload(ctx, buf, (size_t) (p - buf));
+        }
+
+        case OPCODE_MEM_CONFIG: {
+            // <<0x3F, 4 x watermark:32>>
+            // Free heap bytes below which levels 1..4 apply; must not increase.
+            if (len != 1 + MEM_LEVELS * 4) {
+                return make_error(ctx, 0x6A);
+            }
+            uint32_t wm[MEM_LEVELS];
+            for (int i = 0; i < MEM_LEVELS; i++) {
+                wm[i] = get_u32be(data + 1 + 4 * i);
+                if (i > 0 && wm[i] > wm[i - 1]) {
+                    return make_error(ctx, 0x6A);
+                }
+            }
+            // Taken by mem_tick on its next run
+            memcpy(g_mem_watermark, wm, sizeof(wm));
+
+            uint8_t ok = 0x01;
+            return make_ok_with_payload(ctx, &ok, 1);
+        }
+
+        case OPCODE_MEM_STATS: {
+            // payload: <<level:8, max_level:8, free:32, min_free:32, 4 x watermark:32,
+            //            changes:16, shed:32, evicted:32>>
+            uint8_t buf[1 + 1 + 4 + 4 + MEM_LEVELS * 4 + 2 + 4 + 4];
+            uint8_t *p = buf;
+
+            *p++ = __atomic_load_n(&g_mem_level, __ATOMIC_SEQ_CST);
+            *p++ = g_mem_max_level;
+            p = put_u32be(p, g_mem_free);
+            p = put_u32be(p, esp_get_minimum_free_heap_size());
+            for (int i = 0; i < MEM_LEVELS; i++) {
+                p = put_u32be(p, g_mem_watermark[i]);
+            }
+            p = put_u16be(p, g_mem_changes);
+            p = put_u32be(p, __atomic_load_n(&g_mem_shed, __ATOMIC_SEQ_CST));
+            p = put_u32be(p, g_mem_evicted);
+
+            return make_ok_with_payload(ctx, buf, (size_t) (p - buf));
+        }
+
+        case OPCODE_CLOSE: {
+            // Gives the port's slot back; the port terminates after replying.
+            port_release(port);
+            ctx->platform_data = NULL;
+
+            uint8_t ok = 0x01;
+            return make_ok_with_payload(ctx, &ok, 1);
+        }
+
+        case OPCODE_LATEST: {
+            if (!g_ble_started) {
+                return make_error(ctx, 0x40);
+            }
+
+            if (g_lock) {
+                xSemaphoreTake(g_lock, portMAX_DELAY);
+            }
+            int idx = port->latest_index;
+            if (idx < 0) {
+                if (g_lock) {
+                    xSemaphoreGive(g_lock);
+                }
+                return make_error(ctx, 0x41); // no data yet
+            }
+            device_cache_t snap = g_devices[idx];
+            if (g_first_answer_ms == 0) {
+                g_first_answer_ms = now_ms();
+                g_first_answer_stale = snap.stale;
+            }
+            if (g_lock) {
+                xSemaphoreGive(g_lock);
+            }
+
+            if (port->reply_format == REPLY_READING) {
+                // payload: one OPCODE_READINGS entry
+                uint8_t buf[READING_ENTRY_LEN];
+                uint8_t *end = put_reading_entry(buf, &snap, now_ms());
+                if (!end) {
+                    return make_error(ctx, 0x41);
+                }
+                return make_ok_with_payload(ctx, buf, (size_t) (end - buf));
+            }
+            if (mem_shed(MEM_NO_RAW)) {
+                return make_error(ctx, 0x69);
+            }
+            return reply_latest(ctx, &snap);
+        }
+
+        case OPCODE_LATEST_FOR: {
+            if (!g_ble_started) {
+                return make_error(ctx, 0x40);
+            }
+            if (len < 1 + 2) {
+                return make_error(ctx, 0x42);
+            }
+
+            if (mem_shed(MEM_NO_RAW)) {
+                return make_error(ctx, 0x69);
+            }
+
+            uint16_t wanted = (uint16_t) ((uint16_t) data[1] << 8) | (uint16_t) data[2];
+
+            if (g_lock) {
+                xSemaphoreTake(g_lock, portMAX_DELAY);
+            }
+
+            int found = -1;
+            for (int i = 0; i < g_cache_size; i++) {
+                if (!g_devices[i].in_use) {
+                    continue;
+                }
+                if (g_devices[i].vendor != VENDOR_SWITCHBOT || !is_merged(&g_devices[i])) {
+                    continue;
+                }
+                update_device_id(&g_devices[i]);
+                if (g_devices[i].have_device_id && g_devices[i].device_id == wanted) {
+                    found = i;
+                    break;
+                }
+            }
+
+            if (found < 0) {
+                if (g_lock) {
+                    xSemaphoreGive(g_lock);
+                }
+                return make_error(ctx, 0x43);
+            }
+
+            device_cache_t snap = g_devices[found];
+            if (g_lock) {
+                xSemaphoreGive(g_lock);
+            }
+
+            return reply_latest(ctx, &snap);
+        }
+
+        case OPCODE_SUBSCRIBE: {
+            // The calling process receives {switchbot_event, binary} messages
+            // for devices this port's filter accepts. There is one subscriber
+            // per port; a new call replaces it.
+            if (g_lock) {
+                xSemaphoreTake(g_lock, portMAX_DELAY);
+            }
+            port->subscriber_pid = term_to_local_process_id(pid);
+            port->have_subscriber = true;
+            if (g_lock) {
+                xSemaphoreGive(g_lock);
+            }
+
+            uint8_t ok = 0x01;
+            return make_ok_with_payload(ctx, &ok, 1);
+        }
+
+        case OPCODE_UNSUBSCRIBE: {
+            if (g_lock) {
+                xSemaphoreTake(g_lock, portMAX_DELAY);
+            }
+            port->have_subscriber = false;
+            if (g_lock) {
+                xSemaphoreGive(g_lock);
+            }
+
+            uint8_t ok = 0x01;
+            return make_ok_with_payload(ctx, &ok, 1);
+        }
+
+#ifdef CONFIG_HELLO_ATOMVM_BLE_SWITCHBOT_ANALYTICS
+        case OPCODE_AGG: {
+            // <<0x20>> for every device or <<0x20, device_id:16>> for one.
+            // payload: <<windows:8, count:8, entries...>>
+            if (!g_ble_started) {
+                return make_error(ctx, 0x40);
+            }
+            if (len != 1 && len != 1 + 2) {
+                return make_error(ctx, 0x42);
+            }
+
+            bool want_one = (len == 1 + 2);
+            uint16_t wanted = want_one ? (uint16_t) ((uint16_t) data[1] << 8) | (uint16_t) data[2] : 0;
+
+            uint8_t *buf = port->reply;
+            uint8_t *p = buf + 2;
+            uint8_t count = 0;
+            uint32_t now = now_s();
+
+            if (g_lock) {
+                xSemaphoreTake(g_lock, portMAX_DELAY);
+            }
+            for (int i = 0; i < g_cache_size; i++) {
+                if (!g_devices[i].in_use || !g_devices[i].have_device_id || !g_agg[i].active) {
+                    continue;
+                }
+                if (want_one && g_devices[i].device_id != wanted) {
+                    continue;
+                }
+                p = put_agg_entry(p, i, now);
+                count++;
+            }
+            if (g_lock) {
+                xSemaphoreGive(g_lock);
+            }
+
+            if (want_one && count == 0) {
+                return make_error(ctx, 0x43);
+            }
+
+            buf[0] = AGG_MAX_WINDOWS;
+            buf[1] = count;
+            return make_ok_with_payload(ctx, buf, (size_t) (p - buf));
+        }
+
+        case OPCODE_AGG_CONFIG: {
+            // <<0x21, AGG_MAX_WINDOWS x <<mode:8, window_s:32>>>>
+            // Resets every aggregate, since old buckets no longer line up.
+            if (len != 1 + AGG_MAX_WINDOWS * 5) {
+                return make_error(ctx, 0x50);
+            }
+
+            agg_config_t cfg;
+            for (int w = 0; w < AGG_MAX_WINDOWS; w++) {
+                const uint8_t *q = data + 1 + w * 5;
+                cfg.win[w].mode = q[0];
+                cfg.win[w].window_s = get_u32be(q + 1);
+                if (cfg.win[w].mode != AGG_MODE_TUMBLING && cfg.win[w].mode != AGG_MODE_SLIDING) {
+                    return make_error(ctx, 0x51);
+                }
+            }
+
+            if (g_lock) {
+                xSemaphoreTake(g_lock, portMAX_DELAY);
+            }
+            g_agg_cfg = cfg;
+            for (int i = 0; i < g_cache_size; i++) {
+                agg_reset(&g_agg[i]);
+            }
+            if (g_lock) {
+                xSemaphoreGive(g_lock);
+            }
+
+            uint8_t ok = 0x01;
+            return make_ok_with_payload(ctx, &ok, 1);
+        }
+
+        case OPCODE_RULES_LOAD: {
+            // <<0x22, rules...>>, see RULE_WIRE_LEN. Replaces the whole table
+            // and resets rule state and counters.
+            rules_table_t next;
+            rules_init(&next);
+            if (!rules_load(&next, data + 1, len - 1)) {
+                return make_error(ctx, 0x52);
+            }
+
+            if (g_lock) {
+                xSemaphoreTake(g_lock, portMAX_DELAY);
+            }
+            g_rules = next;
+            memset(g_rule_state, 0, g_cache_size * sizeof(*g_rule_state));
+            if (g_lock) {
+                xSemaphoreGive(g_lock);
+            }
+
+            uint8_t ok = 0x01;
+            return make_ok_with_payload(ctx, &ok, 1);
+        }
+
+        case OPCODE_RULES_STATS: {
+            // payload: <<count:8, count x <<id:8, rises:32, falls:32, active_devices:8>>>>
+            uint8_t buf[1 + RULES_MAX * 10];
+            uint8_t *p = buf + 1;
+
+            if (g_lock) {
+                xSemaphoreTake(g_lock, portMAX_DELAY);
+            }
+            buf[0] = g_rules.count;
+            for (int i = 0; i < g_rules.count; i++) {
+                uint8_t active = 0;
+                for (int j = 0; j < g_cache_size; j++) {
+                    if (g_devices[j].in_use && (g_rule_state[j].active & (1u << i))) {
+                        active++;
+                    }
+                }
+                *p++ = g_rules.rules[i].id;
+                p = put_u32be(p, g_rules.rises[i]);
+                p = put_u32be(p, g_rules.falls[i]);
+                *p++ = active;
+            }
+            if (g_lock) {
+                xSemaphoreGive(g_lock);
+            }
+
+            return make_ok_with_payload(ctx, buf, (size_t) (p - buf));
+        }
+#endif
+
+#ifdef CONFIG_HELLO_ATOMVM_BLE_SWITCHBOT_HISTORY
+        case OPCODE_HISTORY: {
+            // <<0x24, device_id:16, since_s:32, until_s:32, max:16>>
+            // payload: <<now_s:32, count:16, more:8,
+            //            count x <<t_s:32, temp_dc:s16, humidity:8, battery:8>>>>
+            // Times are seconds since boot. Page through a range by calling
+            // again with since_s = last t_s + 1 while `more` is 1.
+            if (len != 1 + 2 + 4 + 4 + 2) {
+                return make_error(ctx, 0x53);
+            }
+
+            uint16_t wanted = (uint16_t) ((uint16_t) data[1] << 8) | (uint16_t) data[2];
+            uint32_t since = get_u32be(data + 3);
+            uint32_t until = get_u32be(data + 7);
+            int max = ((int) data[11] << 8) | data[12];
+            if (max > HIST_READ_MAX) {
+                max = HIST_READ_MAX;
+            }
+            if (max > HIST_READ_MAX / 4 && mem_shed(MEM_SHORT_HISTORY)) {
+                max = HIST_READ_MAX / 4; // `more` pages through the rest
+            }
+
+            hist_sample_t samples[HIST_READ_MAX];
+            bool more = false;
+
+            if (g_lock) {
+                xSemaphoreTake(g_lock, portMAX_DELAY);
+            }
+            int idx = find_device_id(wanted);
+            int n = idx < 0 ? 0 : hist_read(&g_hist, (uint8_t) idx, since, until, samples, max, &more);
+            if (g_lock) {
+                xSemaphoreGive(g_lock);
+            }
+
+            if (idx < 0) {
+                return make_error(ctx, 0x43);
+            }
+
+            uint8_t buf[4 + 2 + 1 + HIST_READ_MAX * HIST_SAMPLE_LEN];
+            uint8_t *p = put_u32be(buf, now_s());
+            p = put_u16be(p, (uint16_t) n);
+            *p++ = more ? 1 : 0;
+            for (int i = 0; i < n; i++) {
+                p = put_u32be(p, samples[i].t_s);
+                p = put_u16be(p, (uint16_t) samples[i].temp_dc);
+                *p++ = samples[i].humidity;
+                *p++ = samples[i].battery;
+            }
+
+            return make_ok_with_payload(ctx, buf, (size_t) (p - buf));
+        }
+
+        case OPCODE_HISTORY_DOWNSAMPLE: {
+            // <<0x26, device_id:16, since_s:32, until_s:32, points:16, method:8, metric:8>>
+            // method: 0 min/max per bucket, 1 LTTB; metric: 0 temperature, 1 humidity
+            // payload: same as OPCODE_HISTORY with more = 0; count <= points;
+            // points below 3 is error 0x54
+            if (len != 1 + 2 + 4 + 4 + 2 + 1 + 1) {
+                return make_error(ctx, 0x53);
+            }
+
+            uint16_t wanted = (uint16_t) ((uint16_t) data[1] << 8) | (uint16_t) data[2];
+            uint32_t since = get_u32be(data + 3);
+            uint32_t until = get_u32be(data + 7);
+            int points = ((int) data[11] << 8) | data[12];
+            uint8_t method = data[13];
+            uint8_t metric = data[14];
+            if (method > DS_METHOD_LTTB || metric > DS_METRIC_HUMIDITY || points < 3) {
+                return make_error(ctx, 0x54);
+            }
+            if (points > DS_MAX_POINTS / 4 && mem_shed(MEM_SHORT_HISTORY)) {
+                points = DS_MAX_POINTS / 4;
+            }
+
+            if (g_lock) {
+                xSemaphoreTake(g_lock, portMAX_DELAY);
+            }
+            int idx = find_device_id(wanted);
+            if (idx < 0) {
+                if (g_lock) {
+                    xSemaphoreGive(g_lock);
+                }
+                return make_error(ctx, 0x43);
+            }
+
+            int n = ds_query(&g_hist, (uint8_t) idx, since, until, points, method, metric, g_ds_buckets,
+                g_ds_out);
+
+            // g_ds_out is shared: copy it out so the term is built unlocked.
+            hist_sample_t samples[DS_MAX_POINTS];
+            memcpy(samples, g_ds_out, (size_t) n * sizeof(samples[0]));
+            if (g_lock) {
+                xSemaphoreGive(g_lock);
+            }
+
+            term bin = term_create_uninitialized_binary(1 + 4 + 2 + 1 + (size_t) n * HIST_SAMPLE_LEN,
+                &ctx->heap, ctx->global);
+            uint8_t *out = (uint8_t *) term_binary_data(bin);
+            out[0] = 0x00;
+            uint8_t *p = put_u32be(out + 1, now_s());
+            p = put_u16be(p, (uint16_t) n);
+            *p++ = 0;
+            for (int i = 0; i < n; i++) {
+                p = put_u32be(p, samples[i].t_s);
+                p = put_u16be(p, (uint16_t) samples[i].temp_dc);
+                *p++ = samples[i].humidity;
+                *p++ = samples[i].battery;
+            }
+            return bin;
+        }
+#endif
+
+#ifdef CONFIG_HELLO_ATOMVM_BLE_SWITCHBOT_ANALYTICS
+        case OPCODE_PRESENCE: {
+            // payload: <<count:8, count x <<device_id:16, addr:6, present:8, rssi:s8,
+            //            age_ms:32, arrivals:16, departures:16>>>>
+            // age_ms is the time since the last advert above depart_rssi.
+            if (!g_ble_started) {
+                return make_error(ctx, 0x40);
+            }
+
+            uint8_t *buf = port->reply;
+            uint8_t *p = buf + 1;
+            uint8_t count = 0;
+
+            xSemaphoreTake(g_lock, portMAX_DELAY);
+            uint32_t now = now_ms();
+            for (int i = 0; i < g_cache_size; i++) {
+                const presence_t *pr = &g_presence[i];
+                if (!g_devices[i].in_use || !g_devices[i].have_device_id || pr->arrivals == 0) {
+                    continue;
+                }
+                p = put_u16be(p, g_devices[i].device_id);
+                memcpy(p, g_devices[i].addr, 6);
+                p += 6;
+                *p++ = pr->present ? 1 : 0;
+                *p++ = (uint8_t) presence_rssi(pr);
+                p = put_u32be(p, now - pr->last_seen_ms);
+                p = put_u16be(p, pr->arrivals);
+                p = put_u16be(p, pr->departures);
+                count++;
+            }
+            xSemaphoreGive(g_lock);
+
+            buf[0] = count;
+            return make_ok_with_payload(ctx, buf, (size_t) (p - buf));
+        }
+
+        case OPCODE_PRESENCE_CONFIG: {
+            // <<0x28, timeout_ms:32, arrive_rssi:s8, depart_rssi:s8>>
+            if (len != 1 + 4 + 1 + 1) {
+                return make_error(ctx, 0x55);
+            }
 
-    return bin;
-}
+            presence_config_t cfg;
+            cfg.timeout_ms = get_u32be(data + 1);
+            cfg.arrive_rssi = (int8_t) data[5];
+            cfg.depart_rssi = (int8_t) data[6];
+            if (cfg.depart_rssi > cfg.arrive_rssi || cfg.timeout_ms == 0) {
+                return make_error(ctx, 0x56);
+            }
 
-static term handle_call(Context *ctx, term req)
-{
-    if (!term_is_binary(req)) {
-        return make_error(ctx, 0x10);
-    }
+            if (g_lock) {
+                xSemaphoreTake(g_lock, portMAX_DELAY);
+            }
+            g_presence_cfg = cfg;
+            if (g_lock) {
+                xSemaphoreGive(g_lock);
+            }
 
-    const uint8_t *data = (const uint8_t *) term_binary_data(req);
-    size_t len = term_binary_size(req);
+            uint8_t ok = 0x01;
+            return make_ok_with_payload(ctx, &ok, 1);
+        }
 
-    if (len < 1) {
-        return make_error(ctx, 0x11);
-    }
+        case OPCODE_RX_STATS: {
+            // <<0x29>> for every cached device or <<0x29, device_id:16>> for one.
+            // payload: <<count:8, count x <<addr:6, device_id:16, has_id:8,
+            //            adv_ind:32, scan_rsp:32, other:32, merged:32,
+            //            rssi_avg:s8, rssi_min:s8, rssi_max:s8,
+            //            RX_HIST_BUCKETS x inter_arrival:16>>>>
+            if (!g_ble_started) {
+                return make_error(ctx, 0x40);
+            }
+            if (len != 1 && len != 1 + 2) {
+                return make_error(ctx, 0x42);
+            }
 
-    uint8_t opcode = data[0];
+            bool want_one = (len == 1 + 2);
+            uint16_t wanted = want_one ? (uint16_t) ((uint16_t) data[1] << 8) | (uint16_t) data[2] : 0;
 
-    switch (opcode) {
-        case OPCODE_PING: {
-            static const uint8_t pong[] = { 'P', 'O', 'N', 'G' };
-            return make_ok_with_payload(ctx, pong, sizeof(pong));
+            uint8_t *buf = port->reply;
+            uint8_t *p = buf + 1;
+            uint8_t count = 0;
+
+            xSemaphoreTake(g_lock, portMAX_DELAY);
+            for (int i = 0; i < g_cache_size; i++) {
+                const device_cache_t *d = &g_devices[i];
+                const rxstats_t *st = &g_rxstats[i];
+                if (!d->in_use) {
+                    continue;
+                }
+                if (want_one && !(d->have_device_id && d->device_id == wanted)) {
+                    continue;
+                }
+                memcpy(p, d->addr, 6);
+                p += 6;
+                p = put_u16be(p, d->device_id);
+                *p++ = d->have_device_id ? 1 : 0;
+                p = put_u32be(p, st->adv_ind);
+                p = put_u32be(p, st->scan_rsp);
+                p = put_u32be(p, st->other);
+                p = put_u32be(p, st->merged);
+                *p++ = (uint8_t) rxstats_rssi(st);
+                *p++ = (uint8_t) st->rssi_min;
+                *p++ = (uint8_t) st->rssi_max;
+                for (int b = 0; b < RX_HIST_BUCKETS; b++) {
+                    p = put_u16be(p, st->inter_hist[b]);
+                }
+                count++;
+            }
+            xSemaphoreGive(g_lock);
+
+            if (want_one && count == 0) {
+                return make_error(ctx, 0x43);
+            }
+
+            buf[0] = count;
+            return make_ok_with_payload(ctx, buf, (size_t) (p - buf));
         }
 
-        case OPCODE_ECHO:
-            return make_ok_with_payload(ctx, data + 1, len - 1);
+        case OPCODE_NEAREST: {
+            // <<0x2A, k:8, max_age_ms:32>>
+            // payload: <<count:8, count x <<device_id:16, addr:6, rssi_avg:s8, age_ms:32, model:8>>>>
+            // Strongest first; only devices merged within max_age_ms.
+            if (!g_ble_started) {
+                return make_error(ctx, 0x40);
+            }
+            if (len != 1 + 1 + 4) {
+                return make_error(ctx, 0x42);
+            }
 
-        case OPCODE_BLE_START: {
+            uint8_t k = data[1];
+            uint32_t max_age = get_u32be(data + 2);
+
+            uint8_t buf[1 + TOPK_CAPACITY * 14];
+            uint8_t *p = buf + 1;
+            uint8_t count = 0;
+
+            xSemaphoreTake(g_lock, portMAX_DELAY);
+            uint32_t now = now_ms();
+            for (int i = 0; i < g_nearest.count && count < k; i++) {
+                const topk_entry_t *e = &g_nearest.e[i];
+                const device_cache_t *d = &g_devices[e->slot];
+                if (now - e->t_ms > max_age) {
+                    continue;
+                }
+                p = put_u16be(p, d->device_id);
+                memcpy(p, d->addr, 6);
+                p += 6;
+                *p++ = (uint8_t) (e->key / 16);
+                p = put_u32be(p, now - e->t_ms);
+                *p++ = d->svc_len > 0 ? d->svc[0] : 0;
+                count++;
+            }
+            xSemaphoreGive(g_lock);
+
+            buf[0] = count;
+            return make_ok_with_payload(ctx, buf, (size_t) (p - buf));
+        }
+
+        case OPCODE_QUERY: {
+            // <<0x2B, predicate...>>, see switchbot_query.h
+            // payload: <<count:8, count x <<age_ms:32, frame_len:8, frame:frame_len>>>>
+            // with frames as in OPCODE_LATEST.
             if (!g_ble_started) {
-                // lazy init
-                esp_err_t err;
+                return make_error(ctx, 0x40);
+            }
+
+            query_t q;
+            if (!query_parse(&q, data + 1, len - 1)) {
+                return make_error(ctx, 0x57);
+            }
+            if (mem_shed(MEM_NO_RAW)) {
+                return make_error(ctx, 0x69);
+            }
 
-                err = nvs_flash_init();
-                if (err == ESP_ERR_NVS_NO_FREE_PAGES || err == ESP_ERR_NVS_NEW_VERSION_FOUND) {
-                    nvs_flash_erase();
-                    err = nvs_flash_init();
+            uint8_t *buf = port->reply;
+            uint8_t *p = buf + 1;
+            uint8_t count = 0;
+
+            xSemaphoreTake(g_lock, portMAX_DELAY);
+            uint32_t now = now_ms();
+            for (int i = 0; i < g_cache_size; i++) {
+                if (!query_match_slot(&q, i, now)) {
+                    continue;
                 }
-                if (err != ESP_OK) {
-                    ESP_LOGE(TAG, "nvs_flash_init failed: %d", (int) err);
-                    return make_error(ctx, 0x30);
+                const device_cache_t *d = &g_devices[i];
+                p = put_u32be(p, now - d->merged_ms);
+                *p++ = (uint8_t) frame_len(d);
+                p = put_frame(p, d);
+                count++;
+            }
+            xSemaphoreGive(g_lock);
+
+            buf[0] = count;
+            return make_ok_with_payload(ctx, buf, (size_t) (p - buf));
+        }
+#endif
+
+#ifdef CONFIG_HELLO_ATOMVM_BLE_SWITCHBOT_CRYPTO
+        case OPCODE_KEY_SET: {
+            // <<0x2C, addr:6 (display order), source:8, offset:8, key:16>>
+            // source: 0 service data (BTHome v2, offset 1), 1 manufacturer data;
+            // offset: clear header bytes. See switchbot_crypto.h for the nonces.
+            if (len != 1 + 6 + 1 + 1 + CRYPTO_KEY_LEN) {
+                return make_error(ctx, 0x58);
+            }
+            if (data[7] > CRYPTO_SOURCE_MFG || data[8] > MAX_BLE_DATA
+                || (data[7] == CRYPTO_SOURCE_SVC && data[8] != 1)) {
+                return make_error(ctx, 0x58);
+            }
+
+            uint8_t addr[6];
+            for (int i = 0; i < 6; i++) {
+                addr[i] = data[6 - i];
+            }
+
+            if (g_lock) {
+                xSemaphoreTake(g_lock, portMAX_DELAY);
+            }
+            bool ok = crypto_set_key(&g_crypto, addr, data[7], data[8], data + 9);
+            int idx = -1;
+            for (int i = 0; ok && i < g_cache_size; i++) {
+                if (g_devices[i].in_use && memcmp(g_devices[i].addr, addr, 6) == 0) {
+                    idx = i;
                 }
+            }
+            if (idx >= 0) {
+                // Decrypt what is cached already rather than waiting for a change.
+                g_devices[idx].have_plain = false;
+                maybe_decrypt(&g_devices[idx], g_devices[idx].have_mfg, g_devices[idx].have_svc);
+            }
+            if (g_lock) {
+                xSemaphoreGive(g_lock);
+            }
 
-                nimble_port_init();
-                ble_hs_cfg.sync_cb = on_sync;
+            if (!ok) {
+                return make_error(ctx, 0x59); // key store full
+            }
+            uint8_t one = 0x01;
+            return make_ok_with_payload(ctx, &one, 1);
+        }
 
-                g_lock = xSemaphoreCreateMutex();
-                g_ble_started = true;
+        case OPCODE_KEY_CLEAR: {
+            // <<0x2D, addr:6 (display order)>>
+            if (len != 1 + 6) {
+                return make_error(ctx, 0x58);
+            }
 
-                nimble_port_freertos_init(host_task);
-            } else {
-                start_scan();
+            uint8_t addr[6];
+            for (int i = 0; i < 6; i++) {
+                addr[i] = data[6 - i];
             }
 
-            uint8_t ok = 0x01;
-            return make_ok_with_payload(ctx, &ok, 1);
+            if (g_lock) {
+                xSemaphoreTake(g_lock, portMAX_DELAY);
+            }
+            bool found = crypto_clear_key(&g_crypto, addr);
+            for (int i = 0; found && i < g_cache_size; i++) {
+                if (g_devices[i].in_use && memcmp(g_devices[i].addr, addr, 6) == 0) {
+                    g_devices[i].have_plain = false;
+                }
+            }
+            if (g_lock) {
+                xSemaphoreGive(g_lock);
+            }
+
+            if (!found) {
+                return make_error(ctx, 0x5A);
+            }
+            uint8_t one = 0x01;
+            return make_ok_with_payload(ctx, &one, 1);
         }
 
-        case OPCODE_BLE_STOP: {
+        case OPCODE_LATEST_DECRYPTED: {
+            // <<0x2E, device_id:16>>
+            // payload: <<counter:32, plain_len:8, plain:plain_len, frame...>>
+            // with the frame as in OPCODE_LATEST.
             if (!g_ble_started) {
-                return make_error(ctx, 0x32);
+                return make_error(ctx, 0x40);
             }
-            stop_scan();
+            if (len != 1 + 2) {
+                return make_error(ctx, 0x42);
+            }
+            if (mem_shed(MEM_NO_RAW)) {
+                return make_error(ctx, 0x69);
+            }
+
+            uint16_t wanted = (uint16_t) ((uint16_t) data[1] << 8) | (uint16_t) data[2];
+
+            xSemaphoreTake(g_lock, portMAX_DELAY);
+            int idx = find_device_id(wanted);
+            device_cache_t snap;
+            if (idx >= 0) {
+                snap = g_devices[idx];
+            }
+            xSemaphoreGive(g_lock);
+
+            if (idx < 0) {
+                return make_error(ctx, 0x43);
+            }
+            if (!snap.have_plain) {
+                return make_error(ctx, 0x5B); // no key or nothing decrypted yet
+            }
+
+            term bin = term_create_uninitialized_binary(1 + 4 + 1 + snap.plain_len + frame_len(&snap),
+                &ctx->heap, ctx->global);
+            uint8_t *out = (uint8_t *) term_binary_data(bin);
+            out[0] = 0x00;
+            uint8_t *p = put_u32be(out + 1, snap.plain_counter);
+            *p++ = snap.plain_len;
+            memcpy(p, snap.plain, snap.plain_len);
+            p += snap.plain_len;
+            put_frame(p, &snap);
+            return bin;
+        }
+#endif
+
+        case OPCODE_READINGS: {
+            // payload: <<count:8, count x <<device_id:16, addr:6, vendor:8, model:8, fields:8,
+            //            battery:8, temp_dc:s16, humidity:8, pir:8, door:8, rssi:s8, age_ms:32>>>>
+            // Decoded readings of every merged device, whatever its vendor.
+            // fields is the READING_HAS_* mask plus READING_STALE; unset fields are zero.
+            if (!g_ble_started) {
+                return make_error(ctx, 0x40);
+            }
+
+            uint8_t *buf = port->reply;
+            uint8_t *p = buf + 1;
+            uint8_t count = 0;
+
+            xSemaphoreTake(g_lock, portMAX_DELAY);
+            uint32_t now = now_ms();
+            for (int i = 0; i < g_cache_size; i++) {
+                uint8_t *next = put_reading_entry(p, &g_devices[i], now);
+                if (next) {
+                    p = next;
+                    count++;
+                }
+            }
+            xSemaphoreGive(g_lock);
+
+            buf[0] = count;
+            return make_ok_with_payload(ctx, buf, (size_t) (p - buf));
+        }
+
+        case OPCODE_FILTER_LOAD: {
+            // <<0x30, program...>>, see switchbot_filter.h; empty accepts everything.
+            // The program applies to this port only.
+            filter_prog_t prog;
+            if (!filter_load(&prog, data + 1, len - 1)) {
+                return make_error(ctx, 0x5C);
+            }
+
+            filter_install(port, &prog);
+
             uint8_t ok = 0x01;
             return make_ok_with_payload(ctx, &ok, 1);
         }
 
-        case OPCODE_LATEST: {
+        case OPCODE_FILTER_STATS: {
+            // payload: <<insns:8, seen:32, rejected:32, filter_cycles_per_advert:32,
+            //            extract_cycles_per_advert:32>>
+            // The last field is the cost of the built-in adv_extract + vendor_identify
+            // path, for comparison with the filter program.
+            uint32_t seen = port->filter_seen;
+            uint32_t runs = g_extract_runs;
+
+            uint8_t buf[1 + 4 * 4];
+            uint8_t *p = buf;
+            *p++ = port->filters[__atomic_load_n(&port->filter_active, __ATOMIC_SEQ_CST)].count;
+            p = put_u32be(p, seen);
+            p = put_u32be(p, port->filter_rejected);
+            p = put_u32be(p, seen ? (uint32_t) (port->filter_cycles / seen) : 0);
+            p = put_u32be(p, runs ? (uint32_t) (g_extract_cycles / runs) : 0);
+
+            return make_ok_with_payload(ctx, buf, (size_t) (p - buf));
+        }
+
+#ifdef CONFIG_HELLO_ATOMVM_BLE_SWITCHBOT_GATT
+        case OPCODE_GATT_SEND: {
+            // <<0x32, addr:6 (display order), command:1..20>>
+            // payload: <<seq:16>>; completion arrives as an EVENT_GATT event
+            // with the same seq (subscribe first to receive it).
             if (!g_ble_started) {
                 return make_error(ctx, 0x40);
             }
+            if (len < 1 + 6 + 1 || len > 1 + 6 + GATT_CMD_MAX) {
+                return make_error(ctx, 0x5D);
+            }
+
+            uint8_t addr[6];
+            for (int i = 0; i < 6; i++) {
+                addr[i] = data[6 - i];
+            }
+
+            int n_done = 0;
+            uint16_t seq = 0;
+            event_batch_t batch;
+
+            xSemaphoreTake(g_lock, portMAX_DELAY);
+            if (__atomic_load_n(&g_burst.active, __ATOMIC_SEQ_CST)) {
+                xSemaphoreGive(g_lock);
+                return make_error(ctx, 0x66); // the connect would end the burst's discovery
+            }
+            // Only this call's completions, in the port's own slice of the arena
+            batch_begin(&batch, g_gatt_events[port - g_ports], gatt_done_max(&g_gatt));
+
+            // SwitchBot devices use random static addresses; prefer what the scan saw.
+            int idx = cache_find(addr);
+            uint8_t addr_type = idx >= 0 ? g_devices[idx].addr_type : BLE_ADDR_RANDOM;
+
+            int rc = gatt_submit(&g_gatt, addr, addr_type, data + 7, (uint8_t) (len - 7), now_ms(), &seq,
+                g_gatt_done, &n_done);
+            for (int i = 0; i < n_done; i++) {
+                push_gatt_event(&batch, &g_gatt_done[i]);
+            }
+            bool connect_pending = gatt_connect_pending();
+            xSemaphoreGive(g_lock);
+
+            send_events(&batch);
+            gatt_resume_scan(connect_pending);
+
+            if (rc == GATT_EQUEUE_FULL) {
+                return make_error(ctx, 0x5E);
+            }
+            if (rc == GATT_EBUSY) {
+                return make_error(ctx, 0x5F); // every connection slot is busy
+            }
+
+            uint8_t buf[2];
+            put_u16be(buf, seq);
+            return make_ok_with_payload(ctx, buf, sizeof(buf));
+        }
+
+        case OPCODE_GATT_STATS: {
+            // payload: <<open:8, submitted:32, completed:32, failed:32, connects:32, reused:32,
+            //            discoveries:32, handle_hits:32, evictions:32, avg_latency_ms:32,
+            //            max_latency_ms:32>>
+            uint8_t buf[1 + 10 * 4];
+            uint8_t *p = buf;
 
             if (g_lock) {
                 xSemaphoreTake(g_lock, portMAX_DELAY);
             }
-            int idx = g_latest_index;
-            if (idx < 0) {
-                if (g_lock) {
-                    xSemaphoreGive(g_lock);
+            const gatt_stats_t *st = &g_gatt.stats;
+            *p++ = gatt_open_connections(&g_gatt);
+            p = put_u32be(p, st->submitted);
+            p = put_u32be(p, st->completed);
+            p = put_u32be(p, st->failed);
+            p = put_u32be(p, st->connects);
+            p = put_u32be(p, st->reused);
+            p = put_u32be(p, st->discoveries);
+            p = put_u32be(p, st->handle_hits);
+            p = put_u32be(p, st->evictions);
+            p = put_u32be(p, st->completed ? (uint32_t) (st->latency_ms_sum / st->completed) : 0);
+            p = put_u32be(p, st->latency_ms_max);
+            if (g_lock) {
+                xSemaphoreGive(g_lock);
+            }
+
+            return make_ok_with_payload(ctx, buf, (size_t) (p - buf));
+        }
+#endif
+
+        case OPCODE_CACHE_STATS: {
+            // payload: <<restored:8, stale:8, snapshots_written:32, snapshots_skipped:32,
+            //            snapshot_bytes:16, first_answer_ms:32, first_answer_stale:8>>
+            // first_answer_ms is the time from boot to the first OPCODE_LATEST
+            // answer (0 if none yet); compare with warm start disabled in Kconfig.
+            uint8_t buf[1 + 1 + 4 + 4 + 2 + 4 + 1];
+            uint8_t *p = buf;
+
+            if (g_lock) {
+                xSemaphoreTake(g_lock, portMAX_DELAY);
+            }
+            uint8_t stale = 0;
+            for (int i = 0; i < g_cache_size; i++) {
+                if (g_devices[i].in_use && g_devices[i].stale) {
+                    stale++;
                 }
-                return make_error(ctx, 0x41); // no data yet
             }
-            device_cache_t snap = g_devices[idx];
+            *p++ = g_snapshot_restored;
+            *p++ = stale;
+            p = put_u32be(p, g_snapshot_written);
+            p = put_u32be(p, g_snapshot_skipped);
+            p = put_u16be(p, g_snapshot_bytes);
+            p = put_u32be(p, g_first_answer_ms);
+            *p++ = g_first_answer_stale ? 1 : 0;
             if (g_lock) {
                 xSemaphoreGive(g_lock);
             }
 
-            return reply_latest(ctx, &snap);
+            return make_ok_with_payload(ctx, buf, (size_t) (p - buf));
         }
 
-        case OPCODE_LATEST_FOR: {
-            if (!g_ble_started) {
-                return make_error(ctx, 0x40);
+        case OPCODE_LOG_READ: {
+            // <<0x35, cursor:32, max:8>>
+            // payload: <<next_cursor:32, count:8, count x <<boot:16, t_s:32, device_id:16,
+            //            vendor:8, fields:8, temp_dc:s16, humidity:8, battery:8>>>>
+            // Start with cursor 0 and pass next_cursor back to continue. Records
+            // not on flash yet are included; count 0 means caught up.
+#ifdef CONFIG_HELLO_ATOMVM_BLE_SWITCHBOT_FLASH_LOG
+            if (!g_log_ready) {
+                return make_error(ctx, 0x60);
             }
-            if (len < 1 + 2) {
+            if (len != 1 + 4 + 1) {
                 return make_error(ctx, 0x42);
             }
+            if (mem_shed(MEM_NO_EXPORT)) {
+                return make_error(ctx, 0x69);
+            }
 
-            uint16_t wanted = (uint16_t) ((uint16_t) data[1] << 8) | (uint16_t) data[2];
+            uint32_t cursor = get_u32be(data + 1);
+            int max = data[5] == 0 || data[5] > LOG_READ_MAX ? LOG_READ_MAX : data[5];
+            flog_record_t recs[LOG_READ_MAX];
 
+            xSemaphoreTake(g_log_lock, portMAX_DELAY);
+            int n = flog_read(&g_log, &cursor, recs, max);
             if (g_lock) {
                 xSemaphoreTake(g_lock, portMAX_DELAY);
             }
+            n += flog_read_ram(&g_log, &cursor, recs + n, max - n);
+            if (g_lock) {
+                xSemaphoreGive(g_lock);
+            }
+            xSemaphoreGive(g_log_lock);
 
-            int found = -1;
-            for (int i = 0; i < MAX_DEVICES; i++) {
-                if (!g_devices[i].in_use) {
-                    continue;
-                }
-                if (!g_devices[i].have_mfg || !g_devices[i].have_svc) {
-                    continue;
-                }
-                if (!is_switchbot_mfg(g_devices[i].mfg, g_devices[i].mfg_len)) {
-                    continue;
-                }
-                update_device_id(&g_devices[i]);
-                if (g_devices[i].have_device_id && g_devices[i].device_id == wanted) {
-                    found = i;
-                    break;
-                }
+            uint8_t buf[4 + 1 + LOG_READ_MAX * LOG_RECORD_LEN];
+            uint8_t *p = put_u32be(buf, cursor);
+            *p++ = (uint8_t) n;
+            for (int i = 0; i < n; i++) {
+                p = put_u16be(p, recs[i].boot);
+                p = put_u32be(p, recs[i].t_s);
+                p = put_u16be(p, recs[i].device_id);
+                *p++ = recs[i].vendor;
+                *p++ = recs[i].fields;
+                p = put_u16be(p, (uint16_t) recs[i].temp_dc);
+                *p++ = recs[i].humidity;
+                *p++ = recs[i].battery;
             }
+            return make_ok_with_payload(ctx, buf, (size_t) (p - buf));
+#else
+            return make_error(ctx, 0x60); // flash log not compiled in
+#endif
+        }
 
-            if (found < 0) {
-                if (g_lock) {
-                    xSemaphoreGive(g_lock);
-                }
-                return make_error(ctx, 0x43);
+        case OPCODE_LOG_STATS: {
+            // payload: <<pages_total:16, pages_used:16, boot:16, records:32, dropped:32,
+            //            pages_written:32, erases:32, bytes_written:32, payload_bytes:32,
+            //            write_us_per_page:32>>
+            // bytes_written / payload_bytes is the write amplification.
+#ifdef CONFIG_HELLO_ATOMVM_BLE_SWITCHBOT_FLASH_LOG
+            if (!g_log_ready) {
+                return make_error(ctx, 0x60);
             }
 
-            device_cache_t snap = g_devices[found];
+            uint8_t buf[2 * 3 + 4 * 7];
+            uint8_t *p = buf;
+
+            xSemaphoreTake(g_log_lock, portMAX_DELAY);
+            if (g_lock) {
+                xSemaphoreTake(g_lock, portMAX_DELAY);
+            }
+            const flog_stats_t *st = &g_log.stats;
+            p = put_u16be(p, (uint16_t) g_log.pages);
+            p = put_u16be(p, (uint16_t) flog_pages_used(&g_log));
+            p = put_u16be(p, g_log.boot);
+            p = put_u32be(p, st->records);
+            p = put_u32be(p, st->dropped);
+            p = put_u32be(p, st->pages_written);
+            p = put_u32be(p, st->erases);
+            p = put_u32be(p, st->bytes_written);
+            p = put_u32be(p, st->payload_bytes);
+            p = put_u32be(p, st->pages_written ? (uint32_t) (g_log_write_us / st->pages_written) : 0);
             if (g_lock) {
                 xSemaphoreGive(g_lock);
             }
+            xSemaphoreGive(g_log_lock);
 
-            return reply_latest(ctx, &snap);
+            return make_ok_with_payload(ctx, buf, (size_t) (p - buf));
+#else
+            return make_error(ctx, 0x60);
+#endif
+        }
+
+        case OPCODE_EXPORT_START: {
+            // <<0x37, mode:8, uart:8, baud:32, tx_pin:8>>
+            // mode: 0 = off, 1 = every new sample, 2 = changed samples only.
+            // tx_pin 0xFF keeps the UART's default pin. Frames are described in
+            // switchbot_frame.h. Restarting resets nothing but the per-device
+            // change tracking; seq keeps counting.
+            if (len != 1 + 1 + 1 + 4 + 1) {
+                return make_error(ctx, 0x42);
+            }
+
+            uint8_t mode = data[1];
+            uint8_t uart = data[2];
+            uint32_t baud = get_u32be(data + 3);
+            int tx_pin = data[7] == 0xFF ? UART_PIN_NO_CHANGE : data[7];
+            if (mode > EXPORT_CHANGES || uart >= UART_NUM_MAX || (mode != EXPORT_OFF && baud == 0)) {
+                return make_error(ctx, 0x61);
+            }
+            if (mode != EXPORT_OFF && mem_shed(MEM_NO_EXPORT)) {
+                return make_error(ctx, 0x69);
+            }
+
+            export_stop();
+            if (mode != EXPORT_OFF && !export_start(mode, (uart_port_t) uart, baud, tx_pin)) {
+                return make_error(ctx, 0x62); // UART driver refused the settings
+            }
+
+            uint8_t ok = 0x01;
+            return make_ok_with_payload(ctx, &ok, 1);
+        }
+
+        case OPCODE_EXPORT_STATS: {
+            // payload: <<mode:8, uart:8, next_seq:16, frames:32, bytes:32, dropped:32>>
+            uint8_t buf[1 + 1 + 2 + 4 * 3];
+            uint8_t *p = buf;
+
+            if (g_lock) {
+                xSemaphoreTake(g_lock, portMAX_DELAY);
+            }
+            *p++ = g_export_mode;
+            *p++ = (uint8_t) g_export_uart;
+            p = put_u16be(p, g_export_seq);
+            p = put_u32be(p, g_export_frames);
+            p = put_u32be(p, g_export_bytes);
+            p = put_u32be(p, g_export_dropped);
+            if (g_lock) {
+                xSemaphoreGive(g_lock);
+            }
+
+            return make_ok_with_payload(ctx, buf, (size_t) (p - buf));
+        }
+
+#ifdef CONFIG_HELLO_ATOMVM_BLE_SWITCHBOT_HISTORY
+        case OPCODE_HISTORY_STATS: {
+            // payload: <<blocks_total:16, blocks_used:16, block_len:16, samples:32,
+            //            encoded_bytes:32, raw_bytes:32, cycles_per_sample:32>>
+            uint8_t buf[2 + 2 + 2 + 4 * 4];
+            uint8_t *p = buf;
+
+            if (g_lock) {
+                xSemaphoreTake(g_lock, portMAX_DELAY);
+            }
+            uint32_t samples = g_hist.samples;
+            p = put_u16be(p, g_hist.n_blocks);
+            p = put_u16be(p, g_hist.used_blocks);
+            p = put_u16be(p, sizeof(hist_block_t));
+            p = put_u32be(p, samples);
+            p = put_u32be(p, g_hist.encoded_bytes);
+            p = put_u32be(p, g_hist_raw_bytes);
+            p = put_u32be(p, samples ? (uint32_t) (g_hist_cycles / samples) : 0);
+            if (g_lock) {
+                xSemaphoreGive(g_lock);
+            }
+
+            return make_ok_with_payload(ctx, buf, (size_t) (p - buf));
         }
+#endif
 
         default:
             return make_error(ctx, 0x12);
@@ -526,37 +4059,79 @@ static NativeHandlerResult sample_app_port_native_handler(Context *ctx)
     enum GenMessageParseResult parse_result = port_parse_gen_message(msg, &gen_message);
 
     if (parse_result != GenCallMessage) {
+        // burst_complete's wake-up
+        burst_reply(ctx);
         return NativeContinue;
     }
 
-    term reply = handle_call(ctx, gen_message.req);
-    port_send_reply(ctx, gen_message.pid, gen_message.ref, reply);
+    term reply = handle_call(ctx, gen_message.pid, gen_message.ref, gen_message.req);
+    if (reply != term_invalid_term()) {
+        port_send_reply(ctx, gen_message.pid, gen_message.ref, reply);
+    }
 
-    return NativeContinue;
+    // OPCODE_CLOSE gave the slot back
+    return ctx->platform_data ? NativeContinue : NativeTerminate;
 }
 
 void sample_app_port_init(GlobalContext *global)
 {
-    (void) global;
     TRACE("sample_app_port_init\n");
+
+    g_global = global;
+    g_port_lock = xSemaphoreCreateMutex();
+#ifdef CONFIG_HELLO_ATOMVM_BLE_SWITCHBOT_ANALYTICS
+    agg_config_init(&g_agg_cfg);
+    rules_init(&g_rules);
+    presence_config_init(&g_presence_cfg);
+    topk_init(&g_nearest);
+#endif
+#ifdef CONFIG_HELLO_ATOMVM_BLE_SWITCHBOT_CRYPTO
+    crypto_init(&g_crypto);
+#endif
 }
 
 void sample_app_port_destroy(GlobalContext *global)
 {
     (void) global;
     TRACE("sample_app_port_destroy\n");
+
+    xSemaphoreTake(g_port_lock, portMAX_DELAY);
+    if (g_ble_started && ble_deep_stop(false) != 0) {
+        // The host task still uses the locks and the arena: leak them.
+        xSemaphoreGive(g_port_lock);
+        return;
+    }
+    xSemaphoreGive(g_port_lock);
+    export_stop();
+    arena_destroy();
+
+    vSemaphoreDelete(g_port_lock);
+    g_port_lock = NULL;
 }
 
+// Fails once PORT_MAX ports are open, or on bad options (see
+// port_options_parse and port_acquire).
 Context *sample_app_port_create_port(GlobalContext *global, term opts)
 {
-    (void) opts;
+    port_options_t options;
+    if (!port_options_parse(opts, &options)) {
+        return NULL;
+    }
+
+    port_instance_t *port = port_acquire(&options);
+    if (!port) {
+        return NULL;
+    }
 
     Context *ctx = context_new(global);
     if (!ctx) {
+        port_release(port);
         return NULL;
     }
 
     ctx->native_handler = sample_app_port_native_handler;
+    port->process_id = ctx->process_id;
+    ctx->platform_data = port;
     return ctx;
 }
 
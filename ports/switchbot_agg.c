@@ -0,0 +1,164 @@
+#include "switchbot_agg.h"
+
+#include <string.h>
+
+static void stat_add(agg_stat_t *s, int16_t v)
+{
+    if (s->count == 0) {
+        s->min = v;
+        s->max = v;
+    } else {
+        if (v < s->min) {
+            s->min = v;
+        }
+        if (v > s->max) {
+            s->max = v;
+        }
+    }
+    // Once count saturates sum stops too, so sum / count stays the mean of
+    // the first UINT16_MAX samples (and sum cannot overflow).
+    if (s->count < UINT16_MAX) {
+        s->count++;
+        s->sum += v;
+    }
+}
+
+static void stat_merge(agg_stat_t *dst, const agg_stat_t *src)
+{
+    if (src->count == 0) {
+        return;
+    }
+    if (dst->count == 0) {
+        *dst = *src;
+        return;
+    }
+    if (src->min < dst->min) {
+        dst->min = src->min;
+    }
+    if (src->max > dst->max) {
+        dst->max = src->max;
+    }
+    uint32_t room = UINT16_MAX - dst->count;
+    if (src->count <= room) {
+        dst->count = (uint16_t) (dst->count + src->count);
+        dst->sum += src->sum;
+    } else {
+        // Take src's mean for the samples that still fit, as stat_add would.
+        dst->count = UINT16_MAX;
+        dst->sum += (int32_t) ((int64_t) src->sum * room / src->count);
+    }
+}
+
+static uint32_t slot_len_s(const agg_window_cfg_t *c)
+{
+    uint32_t len = c->window_s / AGG_SLOTS;
+    return len > 0 ? len : 1;
+}
+
+void agg_config_init(agg_config_t *cfg)
+{
+    memset(cfg, 0, sizeof(*cfg));
+    cfg->win[0].mode = AGG_MODE_TUMBLING;
+    cfg->win[0].window_s = 5 * 60;
+    cfg->win[1].mode = AGG_MODE_TUMBLING;
+    cfg->win[1].window_s = 60 * 60;
+}
+
+void agg_reset(agg_device_t *a)
+{
+    memset(a, 0, sizeof(*a));
+}
+
+static void window_add(agg_window_t *w, const agg_window_cfg_t *c, uint32_t now_s, const int16_t *v,
+    uint8_t present)
+{
+    agg_stat_t *cells;
+
+    if (c->mode == AGG_MODE_SLIDING) {
+        uint32_t epoch = now_s / slot_len_s(c);
+        int slot = (int) (epoch % AGG_SLOTS);
+        if (w->u.sliding.epoch[slot] != epoch) {
+            // Slot is being reused for a newer sub-bucket.
+            w->u.sliding.epoch[slot] = epoch;
+            memset(w->u.sliding.stat[slot], 0, sizeof(w->u.sliding.stat[slot]));
+        }
+        cells = w->u.sliding.stat[slot];
+    } else {
+        uint32_t epoch = now_s / c->window_s;
+        if (epoch != w->epoch) {
+            // Close the open window; it only counts if it is the one right before.
+            if (epoch == w->epoch + 1) {
+                memcpy(w->u.tumbling.closed, w->u.tumbling.open, sizeof(w->u.tumbling.closed));
+            } else {
+                memset(w->u.tumbling.closed, 0, sizeof(w->u.tumbling.closed));
+            }
+            memset(w->u.tumbling.open, 0, sizeof(w->u.tumbling.open));
+            w->epoch = epoch;
+        }
+        cells = w->u.tumbling.open;
+    }
+
+    for (int m = 0; m < AGG_METRIC_COUNT; m++) {
+        if (present & (1u << m)) {
+            stat_add(&cells[m], v[m]);
+        }
+    }
+}
+
+void agg_update(agg_device_t *a, const agg_config_t *cfg, uint32_t now_s, const sensor_reading_t *r)
+{
+    int16_t v[AGG_METRIC_COUNT];
+    uint8_t present = 0;
+
+    if (r->fields & READING_HAS_TEMP) {
+        v[AGG_METRIC_TEMP] = r->temp_dc;
+        present |= 1u << AGG_METRIC_TEMP;
+    }
+    if (r->fields & READING_HAS_HUMIDITY) {
+        v[AGG_METRIC_HUMIDITY] = r->humidity;
+        present |= 1u << AGG_METRIC_HUMIDITY;
+    }
+    if (!present) {
+        return;
+    }
+
+    for (int w = 0; w < AGG_MAX_WINDOWS; w++) {
+        if (cfg->win[w].window_s == 0) {
+            continue;
+        }
+        window_add(&a->win[w], &cfg->win[w], now_s, v, present);
+    }
+    a->active = true;
+}
+
+void agg_read(const agg_device_t *a, const agg_config_t *cfg, int w, uint32_t now_s, agg_stat_t *out)
+{
+    memset(out, 0, sizeof(agg_stat_t) * AGG_METRIC_COUNT);
+
+    const agg_window_cfg_t *c = &cfg->win[w];
+    const agg_window_t *win = &a->win[w];
+
+    if (c->window_s == 0) {
+        return;
+    }
+
+    if (c->mode == AGG_MODE_SLIDING) {
+        uint32_t epoch = now_s / slot_len_s(c);
+        for (int s = 0; s < AGG_SLOTS; s++) {
+            // Only sub-buckets within the trailing AGG_SLOTS epochs count.
+            if (epoch - win->u.sliding.epoch[s] >= AGG_SLOTS) {
+                continue;
+            }
+            for (int m = 0; m < AGG_METRIC_COUNT; m++) {
+                stat_merge(&out[m], &win->u.sliding.stat[s][m]);
+            }
+        }
+    } else {
+        uint32_t epoch = now_s / c->window_s;
+        if (epoch == win->epoch) {
+            memcpy(out, win->u.tumbling.closed, sizeof(win->u.tumbling.closed));
+        } else if (epoch == win->epoch + 1) {
+            memcpy(out, win->u.tumbling.open, sizeof(win->u.tumbling.open));
+        }
+    }
+}
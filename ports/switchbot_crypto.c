@@ -0,0 +1,108 @@
+#include "switchbot_crypto.h"
+
+#include <string.h>
+
+void crypto_init(crypto_store_t *s)
+{
+    memset(s, 0, sizeof(*s));
+}
+
+crypto_key_t *crypto_find(crypto_store_t *s, const uint8_t addr[6])
+{
+    for (int i = 0; i < CRYPTO_MAX_KEYS; i++) {
+        if (s->keys[i].in_use && memcmp(s->keys[i].addr, addr, 6) == 0) {
+            return &s->keys[i];
+        }
+    }
+    return NULL;
+}
+
+bool crypto_set_key(crypto_store_t *s, const uint8_t addr[6], uint8_t source, uint8_t offset,
+    const uint8_t key[CRYPTO_KEY_LEN])
+{
+    if (source == CRYPTO_SOURCE_SVC && offset != 1) {
+        return false; // BTHome v2 has exactly the device-info byte in clear
+    }
+
+    crypto_key_t *k = crypto_find(s, addr);
+    if (k) {
+        mbedtls_ccm_free(&k->ccm);
+    } else {
+        for (int i = 0; i < CRYPTO_MAX_KEYS && !k; i++) {
+            if (!s->keys[i].in_use) {
+                k = &s->keys[i];
+            }
+        }
+        if (!k) {
+            return false;
+        }
+    }
+
+    mbedtls_ccm_init(&k->ccm);
+    if (mbedtls_ccm_setkey(&k->ccm, MBEDTLS_CIPHER_ID_AES, key, CRYPTO_KEY_LEN * 8) != 0) {
+        mbedtls_ccm_free(&k->ccm);
+        k->in_use = false;
+        return false;
+    }
+
+    memcpy(k->addr, addr, 6);
+    k->source = source;
+    k->offset = offset;
+    k->in_use = true;
+    return true;
+}
+
+bool crypto_clear_key(crypto_store_t *s, const uint8_t addr[6])
+{
+    crypto_key_t *k = crypto_find(s, addr);
+    if (!k) {
+        return false;
+    }
+    mbedtls_ccm_free(&k->ccm);
+    memset(k, 0, sizeof(*k));
+    return true;
+}
+
+bool crypto_decrypt(crypto_store_t *s, crypto_key_t *k, const uint8_t *payload, uint8_t len, uint8_t *out,
+    uint8_t *out_len, uint32_t *counter)
+{
+    if (len < k->offset + CRYPTO_COUNTER_LEN + CRYPTO_TAG_LEN) {
+        s->decrypt_fail++;
+        return false;
+    }
+
+    size_t cipher_len = (size_t) (len - k->offset - CRYPTO_COUNTER_LEN - CRYPTO_TAG_LEN);
+    const uint8_t *cipher = payload + k->offset;
+    const uint8_t *ctr = cipher + cipher_len;
+    const uint8_t *tag = ctr + CRYPTO_COUNTER_LEN;
+
+    uint8_t nonce[CRYPTO_NONCE_LEN];
+    memset(nonce, 0, sizeof(nonce));
+    for (int i = 0; i < 6; i++) {
+        nonce[i] = k->addr[5 - i];
+    }
+    if (k->source == CRYPTO_SOURCE_SVC) {
+        nonce[6] = (uint8_t) CRYPTO_BTHOME_UUID;
+        nonce[7] = (uint8_t) (CRYPTO_BTHOME_UUID >> 8);
+        nonce[8] = payload[0];
+    } else {
+        memcpy(nonce + 6, payload, k->offset < 3 ? k->offset : 3);
+    }
+    memcpy(nonce + 9, ctr, CRYPTO_COUNTER_LEN);
+
+    if (mbedtls_ccm_auth_decrypt(&k->ccm, cipher_len, nonce, sizeof(nonce), NULL, 0, cipher, out, tag,
+            CRYPTO_TAG_LEN)
+        != 0) {
+        s->decrypt_fail++;
+        return false;
+    }
+
+    *out_len = (uint8_t) cipher_len;
+    if (k->source == CRYPTO_SOURCE_SVC) {
+        *counter = ((uint32_t) ctr[3] << 24) | ((uint32_t) ctr[2] << 16) | ((uint32_t) ctr[1] << 8) | ctr[0];
+    } else {
+        *counter = ((uint32_t) ctr[0] << 24) | ((uint32_t) ctr[1] << 16) | ((uint32_t) ctr[2] << 8) | ctr[3];
+    }
+    s->decrypt_ok++;
+    return true;
+}
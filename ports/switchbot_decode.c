@@ -0,0 +1,77 @@
+#include "switchbot_decode.h"
+
+#include <string.h>
+
+// Minimum payload lengths, mirroring SampleApp.SwitchBot.
+#define MIN_METER_SVC_LEN 3
+#define MIN_METER_MFG_LEN 13
+#define MIN_CONTACT_SVC_LEN 9
+#define MIN_MOTION_SVC_LEN 6
+
+static bool decode_meter(const uint8_t *svc, uint8_t svc_len, const uint8_t *mfg, uint8_t mfg_len,
+    sensor_reading_t *out)
+{
+    if (svc_len < MIN_METER_SVC_LEN || mfg_len < MIN_METER_MFG_LEN) {
+        return false;
+    }
+
+    out->battery = svc[2] & 0x7F;
+
+    // temp = (mfg[10] & 0x0F) / 10 + (mfg[11] & 0x7F), negative unless bit 7 of mfg[11]
+    int16_t temp_dc = (int16_t) ((mfg[11] & 0x7F) * 10 + (mfg[10] & 0x0F));
+    out->temp_dc = (mfg[11] & 0x80) ? temp_dc : (int16_t) -temp_dc;
+    out->humidity = mfg[12] & 0x7F;
+
+    out->fields = READING_HAS_BATTERY | READING_HAS_TEMP | READING_HAS_HUMIDITY;
+    return true;
+}
+
+static bool decode_contact(const uint8_t *svc, uint8_t svc_len, sensor_reading_t *out)
+{
+    if (svc_len < MIN_CONTACT_SVC_LEN) {
+        return false;
+    }
+
+    out->battery = svc[2] & 0x7F;
+    out->pir = (svc[1] & 0x40) ? 1 : 0;
+    out->door = (svc[3] & 0x02) ? 1 : 0;
+
+    out->fields = READING_HAS_BATTERY | READING_HAS_PIR | READING_HAS_DOOR;
+    return true;
+}
+
+static bool decode_motion(const uint8_t *svc, uint8_t svc_len, sensor_reading_t *out)
+{
+    if (svc_len < MIN_MOTION_SVC_LEN) {
+        return false;
+    }
+
+    out->battery = svc[2] & 0x7F;
+    out->pir = (svc[1] & 0x40) ? 1 : 0;
+
+    out->fields = READING_HAS_BATTERY | READING_HAS_PIR;
+    return true;
+}
+
+bool switchbot_decode(const uint8_t *svc, uint8_t svc_len, const uint8_t *mfg, uint8_t mfg_len,
+    sensor_reading_t *out)
+{
+    memset(out, 0, sizeof(*out));
+
+    if (svc_len < 1) {
+        return false;
+    }
+    out->model = svc[0];
+
+    switch (out->model) {
+        case SWITCHBOT_MODEL_METER:
+        case SWITCHBOT_MODEL_OUTDOOR_METER:
+            return decode_meter(svc, svc_len, mfg, mfg_len, out);
+        case SWITCHBOT_MODEL_CONTACT:
+            return decode_contact(svc, svc_len, out);
+        case SWITCHBOT_MODEL_MOTION:
+            return decode_motion(svc, svc_len, out);
+        default:
+            return false;
+    }
+}
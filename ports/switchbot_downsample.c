@@ -0,0 +1,245 @@
+#include "switchbot_downsample.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int32_t metric_value(const hist_sample_t *s, uint8_t metric)
+{
+    return metric == DS_METRIC_HUMIDITY ? (int32_t) s->humidity : (int32_t) s->temp_dc;
+}
+
+// ----- Pass 0: extent of the range -----
+
+typedef struct
+{
+    uint32_t count;
+    uint32_t first;
+    uint32_t last;
+} extent_t;
+
+static void extent_visit(const hist_sample_t *s, void *arg)
+{
+    extent_t *e = (extent_t *) arg;
+    if (e->count == 0) {
+        e->first = s->t_s;
+    }
+    e->last = s->t_s;
+    e->count++;
+}
+
+typedef struct
+{
+    hist_sample_t *out;
+    int n;
+} copy_t;
+
+static void copy_visit(const hist_sample_t *s, void *arg)
+{
+    copy_t *c = (copy_t *) arg;
+    c->out[c->n++] = *s;
+}
+
+// ----- Min/max per bucket -----
+
+typedef struct
+{
+    uint8_t metric;
+    uint32_t first;
+    uint32_t span;
+    int buckets;
+    int cur;
+    bool have;
+    hist_sample_t lo;
+    hist_sample_t hi;
+    hist_sample_t *out;
+    int n;
+} minmax_t;
+
+static void minmax_flush(minmax_t *m)
+{
+    if (!m->have) {
+        return;
+    }
+    if (m->lo.t_s == m->hi.t_s) {
+        m->out[m->n++] = m->lo;
+    } else if (m->lo.t_s < m->hi.t_s) {
+        m->out[m->n++] = m->lo;
+        m->out[m->n++] = m->hi;
+    } else {
+        m->out[m->n++] = m->hi;
+        m->out[m->n++] = m->lo;
+    }
+    m->have = false;
+}
+
+static void minmax_visit(const hist_sample_t *s, void *arg)
+{
+    minmax_t *m = (minmax_t *) arg;
+
+    int b = (int) ((uint64_t) (s->t_s - m->first) * (uint64_t) m->buckets / m->span);
+    if (b != m->cur) {
+        minmax_flush(m);
+        m->cur = b;
+    }
+
+    int32_t v = metric_value(s, m->metric);
+    if (!m->have) {
+        m->lo = *s;
+        m->hi = *s;
+        m->have = true;
+        return;
+    }
+    if (v < metric_value(&m->lo, m->metric)) {
+        m->lo = *s;
+    }
+    if (v > metric_value(&m->hi, m->metric)) {
+        m->hi = *s;
+    }
+}
+
+// ----- Largest triangle three buckets -----
+
+typedef struct
+{
+    uint8_t metric;
+    uint32_t first;
+    uint32_t last;
+    int buckets;
+    ds_bucket_t *b;
+
+    int cur;
+    bool have;
+    int64_t best_area;
+    hist_sample_t best;
+    hist_sample_t prev; // last kept sample ("A")
+    hist_sample_t last_sample;
+
+    hist_sample_t *out;
+    int n;
+} lttb_t;
+
+// Middle bucket of a sample strictly between first and last.
+static int lttb_bucket(const lttb_t *l, uint32_t t)
+{
+    int b = (int) ((uint64_t) (t - l->first) * (uint64_t) l->buckets / (l->last - l->first));
+    return b < l->buckets ? b : l->buckets - 1;
+}
+
+static void lttb_avg_visit(const hist_sample_t *s, void *arg)
+{
+    lttb_t *l = (lttb_t *) arg;
+    if (s->t_s == l->last) {
+        l->last_sample = *s;
+    }
+    if (s->t_s == l->first || s->t_s == l->last) {
+        return;
+    }
+    ds_bucket_t *bk = &l->b[lttb_bucket(l, s->t_s)];
+    bk->t_sum += s->t_s - l->first;
+    bk->v_sum += metric_value(s, l->metric);
+    bk->count++;
+}
+
+static void lttb_flush(lttb_t *l)
+{
+    if (!l->have) {
+        return;
+    }
+    l->out[l->n++] = l->best;
+    l->prev = l->best;
+    l->have = false;
+}
+
+static void lttb_pick_visit(const hist_sample_t *s, void *arg)
+{
+    lttb_t *l = (lttb_t *) arg;
+
+    if (s->t_s == l->first) {
+        l->out[l->n++] = *s;
+        l->prev = *s;
+        return;
+    }
+    if (s->t_s == l->last) {
+        lttb_flush(l);
+        l->out[l->n++] = *s;
+        return;
+    }
+
+    int b = lttb_bucket(l, s->t_s);
+    if (b != l->cur) {
+        lttb_flush(l);
+        l->cur = b;
+    }
+
+    // "C": average of the next non-empty bucket, or the last sample.
+    int64_t ct = (int64_t) (l->last - l->first);
+    int64_t cv = metric_value(&l->last_sample, l->metric);
+    for (int j = b + 1; j < l->buckets; j++) {
+        if (l->b[j].count > 0) {
+            ct = l->b[j].t_sum / l->b[j].count;
+            cv = l->b[j].v_sum / l->b[j].count;
+            break;
+        }
+    }
+
+    int64_t at = (int64_t) (l->prev.t_s - l->first);
+    int64_t av = metric_value(&l->prev, l->metric);
+    int64_t bt = (int64_t) (s->t_s - l->first);
+    int64_t bv = metric_value(s, l->metric);
+
+    int64_t area = llabs((at - ct) * (bv - av) - (at - bt) * (cv - av));
+    if (!l->have || area > l->best_area) {
+        l->best_area = area;
+        l->best = *s;
+        l->have = true;
+    }
+}
+
+int ds_query(const hist_store_t *h, uint8_t owner, uint32_t since_s, uint32_t until_s, int points,
+    uint8_t method, uint8_t metric, ds_bucket_t *scratch, hist_sample_t *out)
+{
+    if (points < 3) {
+        return 0; // too few for either method; see switchbot_downsample.h
+    }
+    if (points > DS_MAX_POINTS) {
+        points = DS_MAX_POINTS;
+    }
+
+    extent_t e = { 0, 0, 0 };
+    hist_visit(h, owner, since_s, until_s, extent_visit, &e);
+
+    if (e.count <= (uint32_t) points) {
+        copy_t c = { out, 0 };
+        hist_visit(h, owner, since_s, until_s, copy_visit, &c);
+        return c.n;
+    }
+
+    if (method == DS_METHOD_MINMAX) {
+        minmax_t m;
+        memset(&m, 0, sizeof(m));
+        m.metric = metric;
+        m.first = e.first;
+        m.span = e.last - e.first + 1;
+        m.buckets = points / 2;
+        m.out = out;
+        hist_visit(h, owner, since_s, until_s, minmax_visit, &m);
+        minmax_flush(&m);
+        return m.n;
+    }
+
+    lttb_t l;
+    memset(&l, 0, sizeof(l));
+    l.metric = metric;
+    l.first = e.first;
+    l.last = e.last;
+    l.buckets = points - 2;
+    l.b = scratch;
+    l.cur = -1;
+    l.out = out;
+    memset(scratch, 0, sizeof(ds_bucket_t) * (size_t) l.buckets);
+
+    hist_visit(h, owner, since_s, until_s, lttb_avg_visit, &l);
+    hist_visit(h, owner, since_s, until_s, lttb_pick_visit, &l);
+    return l.n;
+}
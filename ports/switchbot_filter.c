@@ -0,0 +1,138 @@
+#include "switchbot_filter.h"
+
+#include <string.h>
+
+static bool known_op(uint8_t op)
+{
+    switch (op) {
+        case FILTER_LD_LEN:
+        case FILTER_LD_B:
+        case FILTER_LD_H:
+        case FILTER_LD_AD:
+        case FILTER_LD_BX:
+        case FILTER_LD_HX:
+        case FILTER_AND:
+        case FILTER_JEQ:
+        case FILTER_JGT:
+        case FILTER_JGE:
+        case FILTER_JSET:
+        case FILTER_RET:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool is_jump(uint8_t op)
+{
+    return op >= FILTER_JEQ && op <= FILTER_JSET;
+}
+
+bool filter_load(filter_prog_t *prog, const uint8_t *data, size_t len)
+{
+    memset(prog, 0, sizeof(*prog));
+
+    if (len % FILTER_INSN_WIRE_LEN != 0 || len / FILTER_INSN_WIRE_LEN > FILTER_MAX_INSNS) {
+        return false;
+    }
+
+    uint8_t n = (uint8_t) (len / FILTER_INSN_WIRE_LEN);
+    for (uint8_t i = 0; i < n; i++) {
+        const uint8_t *w = data + i * FILTER_INSN_WIRE_LEN;
+        filter_insn_t *in = &prog->insn[i];
+        in->op = w[0];
+        in->jt = w[1];
+        in->jf = w[2];
+        in->k = (uint16_t) (((uint16_t) w[3] << 8) | w[4]);
+
+        if (!known_op(in->op)) {
+            return false;
+        }
+        if (is_jump(in->op) && (i + 1 + in->jt >= n || i + 1 + in->jf >= n)) {
+            return false;
+        }
+    }
+    if (n > 0 && prog->insn[n - 1].op != FILTER_RET) {
+        return false;
+    }
+
+    prog->count = n;
+    return true;
+}
+
+// Value offset of the first AD structure of the given type, or -1.
+static int find_ad(const uint8_t *data, uint8_t data_len, uint16_t type, uint8_t *val_len)
+{
+    uint8_t i = 0;
+    while (i < data_len) {
+        uint8_t len = data[i];
+        if (len == 0 || (uint16_t) i + len >= data_len) {
+            break;
+        }
+        if (data[i + 1] == type) {
+            *val_len = (uint8_t) (len - 1);
+            return i + 2;
+        }
+        i = (uint8_t) (i + 1 + len);
+    }
+    return -1;
+}
+
+bool filter_run(const filter_prog_t *prog, const uint8_t *data, uint8_t data_len)
+{
+    uint32_t a = 0;
+    uint32_t x = 0;
+    uint32_t off;
+
+    for (uint8_t pc = 0; pc < prog->count; pc++) {
+        const filter_insn_t *in = &prog->insn[pc];
+        switch (in->op) {
+            case FILTER_LD_LEN:
+                a = data_len;
+                break;
+            case FILTER_LD_B:
+            case FILTER_LD_BX:
+                off = in->k + (in->op == FILTER_LD_BX ? x : 0);
+                if (off >= data_len) {
+                    return false;
+                }
+                a = data[off];
+                break;
+            case FILTER_LD_H:
+            case FILTER_LD_HX:
+                off = in->k + (in->op == FILTER_LD_HX ? x : 0);
+                if (off + 1 >= data_len) {
+                    return false;
+                }
+                a = ((uint32_t) data[off] << 8) | data[off + 1];
+                break;
+            case FILTER_LD_AD: {
+                uint8_t vlen = 0;
+                int at = find_ad(data, data_len, in->k, &vlen);
+                x = at < 0 ? 0 : (uint32_t) at;
+                a = at < 0 ? 0 : vlen;
+                break;
+            }
+            case FILTER_AND:
+                a &= in->k;
+                break;
+            case FILTER_JEQ:
+                pc += (a == in->k) ? in->jt : in->jf;
+                break;
+            case FILTER_JGT:
+                pc += (a > in->k) ? in->jt : in->jf;
+                break;
+            case FILTER_JGE:
+                pc += (a >= in->k) ? in->jt : in->jf;
+                break;
+            case FILTER_JSET:
+                pc += (a & in->k) ? in->jt : in->jf;
+                break;
+            default: // FILTER_RET
+                return in->k != 0;
+        }
+    }
+
+    // Only reached by the empty program; filter_load requires a final RET.
+    return true;
+}
@@ -0,0 +1,281 @@
+#include "switchbot_flashlog.h"
+
+#include <string.h>
+
+#define FLOG_MAGIC 0x534C // "SL"
+
+// Pages of the previous boot that may have been handed out from RAM but
+// never reached flash (one pending, one being filled). Their sequence
+// numbers are skipped so a cursor never points at two different records.
+#define FLOG_SEQ_SKIP 2
+
+static uint8_t crc8(uint8_t crc, const uint8_t *p, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        crc ^= p[i];
+        for (int b = 0; b < 8; b++) {
+            crc = (uint8_t) ((crc & 0x80) ? (crc << 1) ^ 0x07 : crc << 1);
+        }
+    }
+    return crc;
+}
+
+static uint32_t get_u32be(const uint8_t *p)
+{
+    return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | (uint32_t) p[3];
+}
+
+static uint16_t get_u16be(const uint8_t *p)
+{
+    return (uint16_t) (((uint16_t) p[0] << 8) | p[1]);
+}
+
+static uint32_t page_offset(const flog_t *l, uint32_t seq)
+{
+    return (seq % l->pages) * FLOG_PAGE_SIZE;
+}
+
+static uint32_t sector_of(const flog_t *l, uint32_t seq)
+{
+    return (seq % l->pages) / FLOG_PAGES_PER_SECTOR;
+}
+
+// Fills in the header of a RAM page for `seq` holding `count` records.
+static void seal_page(const flog_t *l, uint8_t *page, uint32_t seq, uint8_t count)
+{
+    page[0] = (uint8_t) (FLOG_MAGIC >> 8);
+    page[1] = (uint8_t) FLOG_MAGIC;
+    page[2] = (uint8_t) (seq >> 24);
+    page[3] = (uint8_t) (seq >> 16);
+    page[4] = (uint8_t) (seq >> 8);
+    page[5] = (uint8_t) seq;
+    page[6] = (uint8_t) (l->boot >> 8);
+    page[7] = (uint8_t) l->boot;
+    page[8] = count;
+    uint8_t crc = crc8(0, page + 2, 7);
+    page[9] = crc8(crc, page + FLOG_HDR_LEN, (size_t) count * FLOG_REC_LEN);
+}
+
+static bool page_valid(const uint8_t *page)
+{
+    if (get_u16be(page) != FLOG_MAGIC || page[8] > FLOG_RECS_PER_PAGE) {
+        return false;
+    }
+    uint8_t crc = crc8(0, page + 2, 7);
+    return crc8(crc, page + FLOG_HDR_LEN, (size_t) page[8] * FLOG_REC_LEN) == page[9];
+}
+
+static void decode_record(const uint8_t *page, uint8_t idx, flog_record_t *r)
+{
+    const uint8_t *p = page + FLOG_HDR_LEN + idx * FLOG_REC_LEN;
+    r->boot = get_u16be(page + 6);
+    r->t_s = get_u32be(p);
+    r->device_id = get_u16be(p + 4);
+    r->vendor = p[6];
+    r->fields = p[7];
+    r->temp_dc = (int16_t) get_u16be(p + 8);
+    r->humidity = p[10];
+    r->battery = p[11];
+}
+
+bool flog_mount(flog_t *l, const flog_flash_t *flash)
+{
+    memset(l, 0, sizeof(*l));
+    l->flash = *flash;
+    l->pages = flash->size / FLOG_PAGE_SIZE;
+    if (flash->size % FLOG_SECTOR_SIZE != 0 || l->pages < 2 * FLOG_PAGES_PER_SECTOR) {
+        return false;
+    }
+
+    bool found = false;
+    uint32_t min_seq = 0;
+    uint32_t max_seq = 0;
+    uint16_t max_boot = 0;
+    uint8_t page[FLOG_PAGE_SIZE];
+
+    for (uint32_t i = 0; i < l->pages; i++) {
+        if (l->flash.read(l->flash.arg, i * FLOG_PAGE_SIZE, page, sizeof(page)) != 0 || !page_valid(page)) {
+            continue;
+        }
+        uint32_t seq = get_u32be(page + 2);
+        uint16_t boot = get_u16be(page + 6);
+        if (seq % l->pages != i) {
+            continue;
+        }
+        if (!found || seq < min_seq) {
+            min_seq = seq;
+        }
+        if (!found || seq > max_seq) {
+            max_seq = seq;
+        }
+        if (!found || boot > max_boot) {
+            max_boot = boot;
+        }
+        found = true;
+    }
+
+    if (found) {
+        l->tail_seq = min_seq;
+        l->flash_seq = max_seq + 1;
+        l->fill_seq = max_seq + 1 + FLOG_SEQ_SKIP;
+        l->boot = (uint16_t) (max_boot + 1);
+    }
+    return true;
+}
+
+bool flog_append(flog_t *l, const flog_record_t *r)
+{
+    if (l->fill_count == FLOG_RECS_PER_PAGE) {
+        if (l->have_pending) {
+            l->stats.dropped++;
+            return false;
+        }
+        memcpy(l->pending, l->fill, sizeof(l->fill));
+        l->pending_count = l->fill_count;
+        l->pending_seq = l->fill_seq;
+        l->have_pending = true;
+        l->fill_seq++;
+        l->fill_count = 0;
+    }
+
+    uint8_t *p = l->fill + FLOG_HDR_LEN + l->fill_count * FLOG_REC_LEN;
+    p[0] = (uint8_t) (r->t_s >> 24);
+    p[1] = (uint8_t) (r->t_s >> 16);
+    p[2] = (uint8_t) (r->t_s >> 8);
+    p[3] = (uint8_t) r->t_s;
+    p[4] = (uint8_t) (r->device_id >> 8);
+    p[5] = (uint8_t) r->device_id;
+    p[6] = r->vendor;
+    p[7] = r->fields;
+    p[8] = (uint8_t) ((uint16_t) r->temp_dc >> 8);
+    p[9] = (uint8_t) r->temp_dc;
+    p[10] = r->humidity;
+    p[11] = r->battery;
+    l->fill_count++;
+    l->stats.records++;
+    return true;
+}
+
+bool flog_take_page(flog_t *l, bool partial, uint8_t *page, uint32_t *seq)
+{
+    if (l->have_pending) {
+        memcpy(page, l->pending, FLOG_PAGE_SIZE);
+        seal_page(l, page, l->pending_seq, l->pending_count);
+        *seq = l->pending_seq;
+        l->have_pending = false;
+        return true;
+    }
+    if (l->fill_count == FLOG_RECS_PER_PAGE || (partial && l->fill_count > 0)) {
+        memcpy(page, l->fill, FLOG_PAGE_SIZE);
+        seal_page(l, page, l->fill_seq, l->fill_count);
+        *seq = l->fill_seq;
+        l->fill_seq++;
+        l->fill_count = 0;
+        return true;
+    }
+    return false;
+}
+
+bool flog_write_page(flog_t *l, uint32_t seq, const uint8_t *page)
+{
+    // Erase a sector when the head enters it: at its first page, or after
+    // the pages skipped at mount crossed into it.
+    uint32_t idx = seq % l->pages;
+    bool enter = idx % FLOG_PAGES_PER_SECTOR == 0
+        || (l->stats.pages_written == 0 && l->flash_seq > 0 && sector_of(l, seq) != sector_of(l, l->flash_seq - 1));
+    if (enter) {
+        l->flash.erase(l->flash.arg, (idx - idx % FLOG_PAGES_PER_SECTOR) * FLOG_PAGE_SIZE, FLOG_SECTOR_SIZE);
+        l->stats.erases++;
+
+        // Pages of the previous lap in this sector are gone.
+        uint32_t lap_first = seq - idx % FLOG_PAGES_PER_SECTOR;
+        if (lap_first + FLOG_PAGES_PER_SECTOR > l->pages && lap_first + FLOG_PAGES_PER_SECTOR - l->pages > l->tail_seq) {
+            l->tail_seq = lap_first + FLOG_PAGES_PER_SECTOR - l->pages;
+        }
+    }
+
+    bool ok = l->flash.write(l->flash.arg, page_offset(l, seq), page, FLOG_PAGE_SIZE) == 0;
+    if (ok) {
+        l->stats.pages_written++;
+        l->stats.bytes_written += FLOG_PAGE_SIZE;
+        l->stats.payload_bytes += (uint32_t) page[8] * FLOG_REC_LEN;
+    }
+    l->flash_seq = seq + 1;
+    return ok;
+}
+
+int flog_read(const flog_t *l, uint32_t *cursor, flog_record_t *out, int max)
+{
+    uint32_t c = *cursor;
+    if (c < l->tail_seq * FLOG_RECS_PER_PAGE) {
+        c = l->tail_seq * FLOG_RECS_PER_PAGE;
+    }
+
+    int n = 0;
+    uint8_t page[FLOG_PAGE_SIZE];
+    while (n < max) {
+        uint32_t seq = c / FLOG_RECS_PER_PAGE;
+        uint8_t idx = (uint8_t) (c % FLOG_RECS_PER_PAGE);
+        if (seq >= l->flash_seq) {
+            break;
+        }
+
+        if (l->flash.read(l->flash.arg, page_offset(l, seq), page, sizeof(page)) != 0 || !page_valid(page)
+            || get_u32be(page + 2) != seq) {
+            c = (seq + 1) * FLOG_RECS_PER_PAGE;
+            continue;
+        }
+
+        uint8_t count = page[8];
+        while (idx < count && n < max) {
+            decode_record(page, idx, &out[n++]);
+            idx++;
+            c++;
+        }
+        if (idx >= count) {
+            c = (seq + 1) * FLOG_RECS_PER_PAGE;
+        }
+    }
+
+    *cursor = c;
+    return n;
+}
+
+static int read_ram_page(const flog_t *l, const uint8_t *page, uint32_t seq, uint8_t count, uint32_t *cursor,
+    flog_record_t *out, int max)
+{
+    int n = 0;
+    if (max <= 0) {
+        return 0;
+    }
+    if (*cursor < seq * FLOG_RECS_PER_PAGE) {
+        *cursor = seq * FLOG_RECS_PER_PAGE;
+    }
+    while (*cursor / FLOG_RECS_PER_PAGE == seq && *cursor % FLOG_RECS_PER_PAGE < count && n < max) {
+        decode_record(page, (uint8_t) (*cursor % FLOG_RECS_PER_PAGE), &out[n]);
+        out[n].boot = l->boot;
+        n++;
+        (*cursor)++;
+    }
+    return n;
+}
+
+int flog_read_ram(const flog_t *l, uint32_t *cursor, flog_record_t *out, int max)
+{
+    // Records still on flash come first; skipping ahead to RAM would lose them.
+    if (*cursor < l->flash_seq * FLOG_RECS_PER_PAGE) {
+        return 0;
+    }
+
+    int n = 0;
+    if (l->have_pending) {
+        n += read_ram_page(l, l->pending, l->pending_seq, l->pending_count, cursor, out, max);
+    }
+    n += read_ram_page(l, l->fill, l->fill_seq, l->fill_count, cursor, out + n, max - n);
+    return n;
+}
+
+uint32_t flog_pages_used(const flog_t *l)
+{
+    return l->flash_seq - l->tail_seq;
+}
@@ -0,0 +1,135 @@
+#include "switchbot_frame.h"
+
+#include <string.h>
+
+uint16_t frame_crc16(uint16_t crc, const uint8_t *p, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        crc ^= (uint16_t) (p[i] << 8);
+        for (int b = 0; b < 8; b++) {
+            crc = (uint16_t) ((crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1);
+        }
+    }
+    return crc;
+}
+
+size_t frame_encode(uint8_t *out, uint16_t seq, uint8_t type, const uint8_t *payload, uint8_t len)
+{
+    if (len > FRAME_MAX_PAYLOAD) {
+        return 0;
+    }
+
+    out[0] = FRAME_SYNC0;
+    out[1] = FRAME_SYNC1;
+    out[2] = len;
+    out[3] = (uint8_t) (seq >> 8);
+    out[4] = (uint8_t) seq;
+    out[5] = type;
+    memcpy(out + FRAME_HDR_LEN, payload, len);
+
+    uint16_t crc = frame_crc16(0xFFFF, out + 2, FRAME_HDR_LEN - 2 + len);
+    out[FRAME_HDR_LEN + len] = (uint8_t) (crc >> 8);
+    out[FRAME_HDR_LEN + len + 1] = (uint8_t) crc;
+    return FRAME_HDR_LEN + len + FRAME_CRC_LEN;
+}
+
+void frame_reading_encode(uint8_t out[FRAME_READING_LEN], const frame_reading_t *r)
+{
+    uint8_t *p = out;
+    *p++ = (uint8_t) (r->t_ms >> 24);
+    *p++ = (uint8_t) (r->t_ms >> 16);
+    *p++ = (uint8_t) (r->t_ms >> 8);
+    *p++ = (uint8_t) r->t_ms;
+    memcpy(p, r->addr, 6);
+    p += 6;
+    *p++ = (uint8_t) r->rssi;
+    *p++ = r->vendor;
+    *p++ = r->adv_seq;
+    *p++ = (uint8_t) (r->device_id >> 8);
+    *p++ = (uint8_t) r->device_id;
+    *p++ = r->fields;
+    *p++ = (uint8_t) ((uint16_t) r->temp_dc >> 8);
+    *p++ = (uint8_t) r->temp_dc;
+    *p++ = r->humidity;
+    *p = r->battery;
+}
+
+bool frame_reading_decode(const frame_t *f, frame_reading_t *r)
+{
+    if (f->type != FRAME_TYPE_READING || f->len < FRAME_READING_LEN) {
+        return false;
+    }
+
+    const uint8_t *p = f->payload;
+    r->t_ms = ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+    memcpy(r->addr, p + 4, 6);
+    r->rssi = (int8_t) p[10];
+    r->vendor = p[11];
+    r->adv_seq = p[12];
+    r->device_id = (uint16_t) ((p[13] << 8) | p[14]);
+    r->fields = p[15];
+    r->temp_dc = (int16_t) ((p[16] << 8) | p[17]);
+    r->humidity = p[18];
+    r->battery = p[19];
+    return true;
+}
+
+void frame_parser_init(frame_parser_t *p)
+{
+    memset(p, 0, sizeof(*p));
+}
+
+bool frame_parser_push(frame_parser_t *p, uint8_t byte, frame_t *out)
+{
+    // Hunt for the sync pair; a second 0xA5 may start the real one.
+    if (p->pos == 0) {
+        if (byte == FRAME_SYNC0) {
+            p->buf[p->pos++] = byte;
+        } else {
+            p->stats.skipped++;
+        }
+        return false;
+    }
+    if (p->pos == 1) {
+        if (byte == FRAME_SYNC1) {
+            p->buf[p->pos++] = byte;
+        } else {
+            p->stats.skipped++;
+            p->pos = byte == FRAME_SYNC0 ? 1 : 0;
+        }
+        return false;
+    }
+    if (p->pos == 2 && byte > FRAME_MAX_PAYLOAD) {
+        p->stats.skipped += 3;
+        p->pos = 0;
+        return false;
+    }
+
+    p->buf[p->pos++] = byte;
+    if (p->pos < 3 || p->pos < FRAME_HDR_LEN + p->buf[2] + FRAME_CRC_LEN) {
+        return false;
+    }
+
+    uint8_t len = p->buf[2];
+    p->pos = 0;
+    uint16_t crc = frame_crc16(0xFFFF, p->buf + 2, FRAME_HDR_LEN - 2 + len);
+    if (crc != (uint16_t) ((p->buf[FRAME_HDR_LEN + len] << 8) | p->buf[FRAME_HDR_LEN + len + 1])) {
+        p->stats.crc_errors++;
+        return false;
+    }
+
+    out->seq = (uint16_t) ((p->buf[3] << 8) | p->buf[4]);
+    out->type = p->buf[5];
+    out->len = len;
+    out->payload = p->buf + FRAME_HDR_LEN;
+
+    // A large jump backwards is a restarted sender, not 64k lost frames.
+    uint16_t gap = (uint16_t) (out->seq - p->next_seq);
+    if (p->have_seq && gap < 0x8000) {
+        p->stats.lost += gap;
+    }
+    p->have_seq = true;
+    p->next_seq = (uint16_t) (out->seq + 1);
+    p->stats.frames++;
+    return true;
+}
@@ -0,0 +1,380 @@
+#include "switchbot_gatt.h"
+
+#include <string.h>
+
+void gatt_init(gatt_client_t *c, const gatt_ops_t *ops, gatt_cmd_t *cmds, uint8_t queue_len)
+{
+    memset(c, 0, sizeof(*c));
+    c->ops = *ops;
+    c->queue_len = queue_len;
+    for (int i = 0; i < GATT_CONN_MAX; i++) {
+        c->slot[i].conn = GATT_NO_CONN;
+        c->slot[i].q = cmds + i * queue_len;
+    }
+}
+
+// ----- Handle cache -----
+
+static bool handle_lookup(const gatt_client_t *c, const uint8_t addr[6], uint16_t *handle)
+{
+    for (int i = 0; i < c->n_handles; i++) {
+        if (memcmp(c->handles[i].addr, addr, 6) == 0) {
+            *handle = c->handles[i].handle;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void handle_forget(gatt_client_t *c, const uint8_t addr[6])
+{
+    for (int i = 0; i < c->n_handles; i++) {
+        if (memcmp(c->handles[i].addr, addr, 6) == 0) {
+            memmove(&c->handles[i], &c->handles[i + 1], (size_t) (c->n_handles - i - 1) * sizeof(c->handles[0]));
+            c->n_handles--;
+            c->handles_dirty = true;
+            return;
+        }
+    }
+}
+
+// Newest entries go last; the oldest is dropped when the cache is full.
+static void handle_store(gatt_client_t *c, const uint8_t addr[6], uint16_t handle)
+{
+    handle_forget(c, addr);
+    if (c->n_handles == GATT_HANDLE_CACHE) {
+        memmove(&c->handles[0], &c->handles[1], (GATT_HANDLE_CACHE - 1) * sizeof(c->handles[0]));
+        c->n_handles--;
+    }
+    memcpy(c->handles[c->n_handles].addr, addr, 6);
+    c->handles[c->n_handles].handle = handle;
+    c->n_handles++;
+    c->handles_dirty = true;
+}
+
+size_t gatt_handles_export(const gatt_client_t *c, uint8_t *out, size_t cap)
+{
+    size_t n = 0;
+    for (int i = 0; i < c->n_handles && n + GATT_HANDLE_WIRE_LEN <= cap; i++) {
+        memcpy(out + n, c->handles[i].addr, 6);
+        out[n + 6] = (uint8_t) (c->handles[i].handle >> 8);
+        out[n + 7] = (uint8_t) c->handles[i].handle;
+        n += GATT_HANDLE_WIRE_LEN;
+    }
+    return n;
+}
+
+void gatt_handles_import(gatt_client_t *c, const uint8_t *data, size_t len)
+{
+    c->n_handles = 0;
+    for (size_t i = 0; i + GATT_HANDLE_WIRE_LEN <= len && c->n_handles < GATT_HANDLE_CACHE;
+         i += GATT_HANDLE_WIRE_LEN) {
+        gatt_handle_entry_t *e = &c->handles[c->n_handles++];
+        memcpy(e->addr, data + i, 6);
+        e->handle = (uint16_t) (((uint16_t) data[i + 6] << 8) | data[i + 7]);
+    }
+    c->handles_dirty = false;
+}
+
+// ----- Slots and queues -----
+
+static gatt_slot_t *slot_by_addr(gatt_client_t *c, const uint8_t addr[6])
+{
+    for (int i = 0; i < GATT_CONN_MAX; i++) {
+        if (c->slot[i].state != GATT_SLOT_FREE && memcmp(c->slot[i].addr, addr, 6) == 0) {
+            return &c->slot[i];
+        }
+    }
+    return NULL;
+}
+
+static gatt_slot_t *slot_by_conn(gatt_client_t *c, uint16_t conn)
+{
+    for (int i = 0; i < GATT_CONN_MAX; i++) {
+        if (c->slot[i].state != GATT_SLOT_FREE && c->slot[i].conn == conn) {
+            return &c->slot[i];
+        }
+    }
+    return NULL;
+}
+
+static void slot_release(gatt_slot_t *s)
+{
+    s->state = GATT_SLOT_FREE;
+    s->conn = GATT_NO_CONN;
+    s->count = 0;
+    s->head = 0;
+}
+
+// Reports the head command and removes it from the queue.
+static void finish_head(gatt_client_t *c, gatt_slot_t *s, uint8_t status, uint32_t now, gatt_result_t *done,
+    int *n_done)
+{
+    const gatt_cmd_t *cmd = &s->q[s->head];
+    uint32_t latency = now - cmd->submitted_ms;
+
+    if (status == GATT_STATUS_OK) {
+        c->stats.completed++;
+        c->stats.latency_ms_sum += latency;
+        if (latency > c->stats.latency_ms_max) {
+            c->stats.latency_ms_max = latency;
+        }
+    } else {
+        c->stats.failed++;
+    }
+
+    if (*n_done < gatt_done_max(c)) {
+        gatt_result_t *r = &done[(*n_done)++];
+        memcpy(r->addr, s->addr, 6);
+        r->seq = cmd->seq;
+        r->status = status;
+        r->latency_ms = latency;
+    }
+
+    s->head = (uint8_t) ((s->head + 1) % c->queue_len);
+    s->count--;
+}
+
+// Fails every queued command and frees the slot, closing its connection.
+static void fail_all(gatt_client_t *c, gatt_slot_t *s, uint8_t status, uint32_t now, gatt_result_t *done,
+    int *n_done)
+{
+    while (s->count > 0) {
+        finish_head(c, s, status, now, done, n_done);
+    }
+    if (s->conn != GATT_NO_CONN) {
+        c->ops.disconnect(c->ops.arg, s->conn);
+    }
+    slot_release(s);
+}
+
+// Starts whatever can make progress: a write on every idle ready connection
+// and one connect at a time (the stack allows a single pending connect).
+static void pump(gatt_client_t *c, uint32_t now, gatt_result_t *done, int *n_done)
+{
+    bool connecting = false;
+    for (int i = 0; i < GATT_CONN_MAX; i++) {
+        gatt_slot_t *s = &c->slot[i];
+        while (s->state == GATT_SLOT_READY && s->count > 0) {
+            const gatt_cmd_t *cmd = &s->q[s->head];
+            if (c->ops.write(c->ops.arg, s->conn, s->write_handle, cmd->data, cmd->len) == 0) {
+                s->state = GATT_SLOT_WRITING;
+            } else {
+                finish_head(c, s, GATT_STATUS_WRITE_FAILED, now, done, n_done);
+            }
+        }
+        if (s->state == GATT_SLOT_CONNECTING) {
+            connecting = true;
+        }
+    }
+
+    for (int i = 0; i < GATT_CONN_MAX && !connecting; i++) {
+        gatt_slot_t *s = &c->slot[i];
+        if (s->state != GATT_SLOT_PENDING) {
+            continue;
+        }
+        if (c->ops.connect(c->ops.arg, s->addr, s->addr_type) == 0) {
+            s->state = GATT_SLOT_CONNECTING;
+            c->stats.connects++;
+            connecting = true;
+        } else {
+            fail_all(c, s, GATT_STATUS_CONNECT_FAILED, now, done, n_done);
+        }
+    }
+}
+
+// Free slot, or the least recently used idle connection closed to make room.
+static gatt_slot_t *slot_alloc(gatt_client_t *c)
+{
+    gatt_slot_t *lru = NULL;
+    for (int i = 0; i < GATT_CONN_MAX; i++) {
+        gatt_slot_t *s = &c->slot[i];
+        if (s->state == GATT_SLOT_FREE) {
+            return s;
+        }
+        if (s->state == GATT_SLOT_READY && s->count == 0
+            && (!lru || (int32_t) (s->last_used_ms - lru->last_used_ms) < 0)) {
+            lru = s;
+        }
+    }
+    if (lru) {
+        c->ops.disconnect(c->ops.arg, lru->conn);
+        slot_release(lru);
+        c->stats.evictions++;
+    }
+    return lru;
+}
+
+int gatt_submit(gatt_client_t *c, const uint8_t addr[6], uint8_t addr_type, const uint8_t *data, uint8_t len,
+    uint32_t now_ms, uint16_t *seq, gatt_result_t *done, int *n_done)
+{
+    *n_done = 0;
+
+    gatt_slot_t *s = slot_by_addr(c, addr);
+    if (!s) {
+        s = slot_alloc(c);
+        if (!s) {
+            return GATT_EBUSY;
+        }
+        s->state = GATT_SLOT_PENDING;
+        memcpy(s->addr, addr, 6);
+        s->addr_type = addr_type;
+        s->write_handle = 0;
+        s->handle_cached = false;
+    } else if (s->count == c->queue_len) {
+        return GATT_EQUEUE_FULL;
+    } else if (s->state == GATT_SLOT_READY || s->state == GATT_SLOT_WRITING) {
+        c->stats.reused++;
+    }
+
+    gatt_cmd_t *cmd = &s->q[(s->head + s->count) % c->queue_len];
+    cmd->seq = c->next_seq++;
+    cmd->len = len > GATT_CMD_MAX ? GATT_CMD_MAX : len;
+    memcpy(cmd->data, data, cmd->len);
+    cmd->submitted_ms = now_ms;
+    s->count++;
+    s->last_used_ms = now_ms;
+    c->stats.submitted++;
+
+    *seq = cmd->seq;
+    pump(c, now_ms, done, n_done);
+    return GATT_OK;
+}
+
+void gatt_on_connect(gatt_client_t *c, bool ok, uint16_t conn, uint32_t now_ms, gatt_result_t *done, int *n_done)
+{
+    *n_done = 0;
+
+    gatt_slot_t *s = NULL;
+    for (int i = 0; i < GATT_CONN_MAX; i++) {
+        if (c->slot[i].state == GATT_SLOT_CONNECTING) {
+            s = &c->slot[i];
+        }
+    }
+    if (!s) {
+        if (ok) {
+            c->ops.disconnect(c->ops.arg, conn);
+        }
+        return;
+    }
+
+    if (!ok) {
+        fail_all(c, s, GATT_STATUS_CONNECT_FAILED, now_ms, done, n_done);
+    } else {
+        s->conn = conn;
+        s->last_used_ms = now_ms;
+        if (handle_lookup(c, s->addr, &s->write_handle)) {
+            s->handle_cached = true;
+            s->state = GATT_SLOT_READY;
+            c->stats.handle_hits++;
+        } else {
+            s->state = GATT_SLOT_DISCOVERING;
+            c->stats.discoveries++;
+            if (c->ops.discover(c->ops.arg, conn) != 0) {
+                fail_all(c, s, GATT_STATUS_NO_CHARACTERISTIC, now_ms, done, n_done);
+            }
+        }
+    }
+
+    pump(c, now_ms, done, n_done);
+}
+
+void gatt_on_discovered(gatt_client_t *c, uint16_t conn, uint16_t handle, uint32_t now_ms, gatt_result_t *done,
+    int *n_done)
+{
+    *n_done = 0;
+
+    gatt_slot_t *s = slot_by_conn(c, conn);
+    if (!s || s->state != GATT_SLOT_DISCOVERING) {
+        return;
+    }
+
+    if (handle == 0) {
+        fail_all(c, s, GATT_STATUS_NO_CHARACTERISTIC, now_ms, done, n_done);
+    } else {
+        s->write_handle = handle;
+        s->handle_cached = false;
+        s->state = GATT_SLOT_READY;
+        handle_store(c, s->addr, handle);
+    }
+
+    pump(c, now_ms, done, n_done);
+}
+
+void gatt_on_write(gatt_client_t *c, uint16_t conn, bool ok, uint32_t now_ms, gatt_result_t *done, int *n_done)
+{
+    *n_done = 0;
+
+    gatt_slot_t *s = slot_by_conn(c, conn);
+    if (!s || s->state != GATT_SLOT_WRITING) {
+        return;
+    }
+
+    finish_head(c, s, ok ? GATT_STATUS_OK : GATT_STATUS_WRITE_FAILED, now_ms, done, n_done);
+    s->state = GATT_SLOT_READY;
+    s->last_used_ms = now_ms;
+
+    if (!ok && s->handle_cached) {
+        // The device may have changed its attribute table: drop the cached
+        // handle and rediscover before writing the rest of the queue.
+        handle_forget(c, s->addr);
+        s->handle_cached = false;
+        s->state = GATT_SLOT_DISCOVERING;
+        c->stats.discoveries++;
+        if (c->ops.discover(c->ops.arg, conn) != 0) {
+            fail_all(c, s, GATT_STATUS_NO_CHARACTERISTIC, now_ms, done, n_done);
+        }
+    }
+
+    pump(c, now_ms, done, n_done);
+}
+
+void gatt_on_disconnect(gatt_client_t *c, uint16_t conn, uint32_t now_ms, gatt_result_t *done, int *n_done)
+{
+    *n_done = 0;
+
+    gatt_slot_t *s = slot_by_conn(c, conn);
+    if (!s) {
+        return;
+    }
+    s->conn = GATT_NO_CONN;
+
+    if (s->state == GATT_SLOT_DISCOVERING) {
+        fail_all(c, s, GATT_STATUS_DISCONNECTED, now_ms, done, n_done);
+    } else {
+        if (s->state == GATT_SLOT_WRITING) {
+            finish_head(c, s, GATT_STATUS_DISCONNECTED, now_ms, done, n_done);
+        }
+        // Commands queued behind it reconnect.
+        if (s->count > 0) {
+            s->state = GATT_SLOT_PENDING;
+        } else {
+            slot_release(s);
+        }
+    }
+
+    pump(c, now_ms, done, n_done);
+}
+
+void gatt_tick(gatt_client_t *c, uint32_t now_ms, uint32_t idle_ms)
+{
+    for (int i = 0; i < GATT_CONN_MAX; i++) {
+        gatt_slot_t *s = &c->slot[i];
+        if (s->state == GATT_SLOT_READY && s->count == 0 && now_ms - s->last_used_ms > idle_ms) {
+            c->ops.disconnect(c->ops.arg, s->conn);
+            slot_release(s);
+        }
+    }
+}
+
+uint8_t gatt_open_connections(const gatt_client_t *c)
+{
+    uint8_t n = 0;
+    for (int i = 0; i < GATT_CONN_MAX; i++) {
+        uint8_t st = c->slot[i].state;
+        if (st == GATT_SLOT_DISCOVERING || st == GATT_SLOT_READY || st == GATT_SLOT_WRITING) {
+            n++;
+        }
+    }
+    return n;
+}
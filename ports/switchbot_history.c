@@ -0,0 +1,314 @@
+#include "switchbot_history.h"
+
+#include <string.h>
+
+#define KEYFRAME_LEN 8
+#define MAX_SAMPLE_LEN (1 + 5 + 3 * 3)
+
+#define HEAD_TEMP 0x01
+#define HEAD_HUMIDITY 0x02
+#define HEAD_BATTERY 0x04
+#define HEAD_GAP_SHIFT 3
+
+static uint32_t zigzag(int32_t v)
+{
+    return ((uint32_t) v << 1) ^ (uint32_t) (v >> 31);
+}
+
+static int32_t unzigzag(uint32_t v)
+{
+    return (int32_t) (v >> 1) ^ -(int32_t) (v & 1);
+}
+
+static uint8_t *put_varint(uint8_t *p, uint32_t v)
+{
+    while (v >= 0x80) {
+        *p++ = (uint8_t) (v | 0x80);
+        v >>= 7;
+    }
+    *p++ = (uint8_t) v;
+    return p;
+}
+
+static const uint8_t *get_varint(const uint8_t *p, const uint8_t *end, uint32_t *out)
+{
+    uint32_t v = 0;
+    int shift = 0;
+    while (p < end && shift < 35) {
+        uint8_t b = *p++;
+        v |= (uint32_t) (b & 0x7F) << shift;
+        if (!(b & 0x80)) {
+            *out = v;
+            return p;
+        }
+        shift += 7;
+    }
+    return NULL;
+}
+
+void hist_init(hist_store_t *h, hist_block_t *blocks, uint16_t n_blocks)
+{
+    memset(h, 0, sizeof(*h));
+    h->blocks = blocks;
+    h->n_blocks = n_blocks > HIST_MAX_BLOCKS ? HIST_MAX_BLOCKS : n_blocks;
+    for (int i = 0; i < h->n_blocks; i++) {
+        h->blocks[i].owner = HIST_NO_OWNER;
+    }
+}
+
+void hist_device_reset(hist_store_t *h, hist_device_t *dev, uint8_t owner)
+{
+    for (int i = 0; i < h->n_blocks; i++) {
+        if (h->blocks[i].owner == owner) {
+            h->blocks[i].owner = HIST_NO_OWNER;
+            h->used_blocks--;
+        }
+    }
+    memset(dev, 0, sizeof(*dev));
+    dev->block = -1;
+}
+
+static int alloc_block(hist_store_t *h, uint8_t owner)
+{
+    int victim = -1;
+    for (int i = 0; i < h->n_blocks; i++) {
+        if (h->blocks[i].owner == HIST_NO_OWNER) {
+            victim = i;
+            break;
+        }
+        if (victim < 0 || h->blocks[i].seq - h->blocks[victim].seq > UINT32_MAX / 2) {
+            victim = i; // older (wrap-safe)
+        }
+    }
+
+    hist_block_t *b = &h->blocks[victim];
+    if (b->owner == HIST_NO_OWNER) {
+        h->used_blocks++;
+    }
+    b->owner = owner;
+    b->used = 0;
+    b->samples = 0;
+    b->seq = h->next_seq++;
+    return victim;
+}
+
+static size_t encode_keyframe(uint8_t *p, const hist_sample_t *s)
+{
+    p[0] = (uint8_t) (s->t_s >> 24);
+    p[1] = (uint8_t) (s->t_s >> 16);
+    p[2] = (uint8_t) (s->t_s >> 8);
+    p[3] = (uint8_t) s->t_s;
+    p[4] = (uint8_t) ((uint16_t) s->temp_dc >> 8);
+    p[5] = (uint8_t) s->temp_dc;
+    p[6] = s->humidity;
+    p[7] = s->battery;
+    return KEYFRAME_LEN;
+}
+
+static size_t encode_delta(uint8_t *buf, const hist_device_t *dev, const hist_sample_t *s, uint32_t gap)
+{
+    uint8_t *p = buf + 1;
+    uint8_t head = 0;
+
+    uint32_t gap_z = zigzag((int32_t) (gap - dev->last_gap));
+    if (gap_z < HIST_GAP_ESCAPE) {
+        head = (uint8_t) (gap_z << HEAD_GAP_SHIFT);
+    } else {
+        head = (uint8_t) (HIST_GAP_ESCAPE << HEAD_GAP_SHIFT);
+        p = put_varint(p, gap_z);
+    }
+    if (s->temp_dc != dev->last.temp_dc) {
+        head |= HEAD_TEMP;
+        p = put_varint(p, zigzag((int32_t) s->temp_dc - dev->last.temp_dc));
+    }
+    if (s->humidity != dev->last.humidity) {
+        head |= HEAD_HUMIDITY;
+        p = put_varint(p, zigzag((int32_t) s->humidity - dev->last.humidity));
+    }
+    if (s->battery != dev->last.battery) {
+        head |= HEAD_BATTERY;
+        p = put_varint(p, zigzag((int32_t) s->battery - dev->last.battery));
+    }
+
+    buf[0] = head;
+    return (size_t) (p - buf);
+}
+
+void hist_append(hist_store_t *h, hist_device_t *dev, uint8_t owner, const hist_sample_t *s)
+{
+    uint8_t buf[MAX_SAMPLE_LEN];
+    size_t n = 0;
+    uint32_t gap = 0;
+
+    // The current block may have been recycled by another device.
+    if (dev->block >= 0 && h->blocks[dev->block].owner != owner) {
+        dev->block = -1;
+    }
+
+    if (dev->block >= 0) {
+        gap = s->t_s - dev->last.t_s;
+        n = encode_delta(buf, dev, s, gap);
+        if (h->blocks[dev->block].used + n > HIST_BLOCK_DATA) {
+            dev->block = -1;
+        }
+    }
+
+    if (dev->block < 0) {
+        dev->block = (int16_t) alloc_block(h, owner);
+        gap = 0;
+        n = encode_keyframe(buf, s);
+    }
+
+    hist_block_t *b = &h->blocks[dev->block];
+    memcpy(b->data + b->used, buf, n);
+    b->used = (uint8_t) (b->used + n);
+    b->samples++;
+
+    dev->have_last = true;
+    dev->last = *s;
+    dev->last_gap = gap;
+
+    h->samples++;
+    h->encoded_bytes += (uint32_t) n;
+}
+
+// Decodes one block, calling `fn` for samples in range. Returns false if the
+// visitor asked to stop.
+typedef bool (*block_sample_fn)(const hist_sample_t *s, void *arg);
+
+static bool decode_block(const hist_block_t *b, uint32_t since_s, uint32_t until_s, block_sample_fn fn,
+    void *arg)
+{
+    if (b->used < KEYFRAME_LEN) {
+        return true;
+    }
+
+    const uint8_t *p = b->data;
+    const uint8_t *end = b->data + b->used;
+
+    hist_sample_t s;
+    s.t_s = ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+    s.temp_dc = (int16_t) (((uint16_t) p[4] << 8) | p[5]);
+    s.humidity = p[6];
+    s.battery = p[7];
+    p += KEYFRAME_LEN;
+
+    uint32_t gap = 0;
+
+    for (;;) {
+        if (s.t_s > until_s) {
+            return true;
+        }
+        if (s.t_s >= since_s && !fn(&s, arg)) {
+            return false;
+        }
+        if (p >= end) {
+            return true;
+        }
+
+        uint8_t head = *p++;
+        uint32_t v = head >> HEAD_GAP_SHIFT;
+        if (v == HIST_GAP_ESCAPE && !(p = get_varint(p, end, &v))) {
+            return true;
+        }
+        gap = (uint32_t) ((int32_t) gap + unzigzag(v));
+        s.t_s += gap;
+
+        if (head & HEAD_TEMP) {
+            if (!(p = get_varint(p, end, &v))) {
+                return true;
+            }
+            s.temp_dc = (int16_t) (s.temp_dc + unzigzag(v));
+        }
+        if (head & HEAD_HUMIDITY) {
+            if (!(p = get_varint(p, end, &v))) {
+                return true;
+            }
+            s.humidity = (uint8_t) (s.humidity + unzigzag(v));
+        }
+        if (head & HEAD_BATTERY) {
+            if (!(p = get_varint(p, end, &v))) {
+                return true;
+            }
+            s.battery = (uint8_t) (s.battery + unzigzag(v));
+        }
+    }
+}
+
+// Collects the blocks of `owner` ordered oldest first.
+static int owned_blocks(const hist_store_t *h, uint8_t owner, int16_t *out)
+{
+    int n = 0;
+    for (int i = 0; i < h->n_blocks; i++) {
+        if (h->blocks[i].owner != owner) {
+            continue;
+        }
+        int j = n++;
+        while (j > 0 && h->blocks[i].seq - h->blocks[out[j - 1]].seq > UINT32_MAX / 2) {
+            out[j] = out[j - 1];
+            j--;
+        }
+        out[j] = (int16_t) i;
+    }
+    return n;
+}
+
+static void walk(const hist_store_t *h, uint8_t owner, uint32_t since_s, uint32_t until_s,
+    block_sample_fn fn, void *arg)
+{
+    int16_t order[HIST_MAX_BLOCKS];
+    int n = owned_blocks(h, owner, order);
+    for (int i = 0; i < n; i++) {
+        if (!decode_block(&h->blocks[order[i]], since_s, until_s, fn, arg)) {
+            return;
+        }
+    }
+}
+
+typedef struct
+{
+    hist_sample_t *out;
+    int max;
+    int n;
+    bool more;
+} read_state_t;
+
+static bool read_one(const hist_sample_t *s, void *arg)
+{
+    read_state_t *st = (read_state_t *) arg;
+    if (st->n >= st->max) {
+        st->more = true;
+        return false;
+    }
+    st->out[st->n++] = *s;
+    return true;
+}
+
+int hist_read(const hist_store_t *h, uint8_t owner, uint32_t since_s, uint32_t until_s,
+    hist_sample_t *out, int max, bool *more)
+{
+    read_state_t st = { out, max, 0, false };
+    walk(h, owner, since_s, until_s, read_one, &st);
+    *more = st.more;
+    return st.n;
+}
+
+typedef struct
+{
+    hist_visit_fn fn;
+    void *arg;
+} visit_state_t;
+
+static bool visit_one(const hist_sample_t *s, void *arg)
+{
+    visit_state_t *st = (visit_state_t *) arg;
+    st->fn(s, st->arg);
+    return true;
+}
+
+void hist_visit(const hist_store_t *h, uint8_t owner, uint32_t since_s, uint32_t until_s,
+    hist_visit_fn fn, void *arg)
+{
+    visit_state_t st = { fn, arg };
+    walk(h, owner, since_s, until_s, visit_one, &st);
+}
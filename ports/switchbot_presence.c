@@ -0,0 +1,50 @@
+#include "switchbot_presence.h"
+
+#include <string.h>
+
+void presence_config_init(presence_config_t *cfg)
+{
+    cfg->timeout_ms = 30000;
+    cfg->arrive_rssi = -85;
+    cfg->depart_rssi = -95;
+}
+
+void presence_reset(presence_t *p)
+{
+    memset(p, 0, sizeof(*p));
+}
+
+int presence_on_advert(presence_t *p, const presence_config_t *cfg, uint32_t now_ms, int8_t rssi)
+{
+    // EWMA with alpha = 1/4
+    if (!p->have_rssi) {
+        p->rssi_x16 = (int16_t) (rssi * 16);
+        p->have_rssi = true;
+    } else {
+        p->rssi_x16 = (int16_t) (p->rssi_x16 + (rssi * 16 - p->rssi_x16) / 4);
+    }
+
+    if (rssi >= cfg->depart_rssi) {
+        p->last_seen_ms = now_ms;
+    }
+
+    if (!p->present && presence_rssi(p) >= cfg->arrive_rssi) {
+        p->present = true;
+        p->last_seen_ms = now_ms;
+        p->arrivals++;
+        return PRESENCE_ARRIVED;
+    }
+    return PRESENCE_NONE;
+}
+
+int presence_check(presence_t *p, const presence_config_t *cfg, uint32_t now_ms)
+{
+    if (p->present && now_ms - p->last_seen_ms > cfg->timeout_ms) {
+        p->present = false;
+        // Start smoothing afresh on the next sighting.
+        p->have_rssi = false;
+        p->departures++;
+        return PRESENCE_DEPARTED;
+    }
+    return PRESENCE_NONE;
+}
@@ -0,0 +1,107 @@
+#include "switchbot_query.h"
+
+#include <string.h>
+
+#define HAS(q, tag) (((q)->present & (1u << (tag))) != 0)
+
+bool query_parse(query_t *q, const uint8_t *data, size_t len)
+{
+    memset(q, 0, sizeof(*q));
+
+    size_t i = 0;
+    while (i < len) {
+        if (i + 2 > len) {
+            return false;
+        }
+        uint8_t tag = data[i];
+        uint8_t vlen = data[i + 1];
+        const uint8_t *v = data + i + 2;
+        if (i + 2 + vlen > len || tag < QUERY_TAG_MODELS || tag > QUERY_TAG_BATTERY_BELOW) {
+            return false;
+        }
+
+        switch (tag) {
+            case QUERY_TAG_MODELS:
+                if (vlen == 0 || vlen > QUERY_MAX_MODELS) {
+                    return false;
+                }
+                q->n_models = vlen;
+                memcpy(q->models, v, vlen);
+                break;
+            case QUERY_TAG_MIN_RSSI:
+                if (vlen != 1) {
+                    return false;
+                }
+                q->min_rssi = (int8_t) v[0];
+                break;
+            case QUERY_TAG_MAX_AGE_MS:
+                if (vlen != 4) {
+                    return false;
+                }
+                q->max_age_ms = ((uint32_t) v[0] << 24) | ((uint32_t) v[1] << 16) | ((uint32_t) v[2] << 8) | v[3];
+                break;
+            case QUERY_TAG_ADDR_PREFIX:
+                if (vlen == 0 || vlen > 6) {
+                    return false;
+                }
+                q->prefix_len = vlen;
+                memcpy(q->prefix, v, vlen);
+                break;
+            case QUERY_TAG_IDS:
+                if (vlen == 0 || vlen % 2 != 0 || vlen / 2 > QUERY_MAX_IDS) {
+                    return false;
+                }
+                q->n_ids = vlen / 2;
+                for (int k = 0; k < q->n_ids; k++) {
+                    q->ids[k] = (uint16_t) ((uint16_t) v[2 * k] << 8) | v[2 * k + 1];
+                }
+                break;
+            default: // QUERY_TAG_BATTERY_BELOW
+                if (vlen != 1) {
+                    return false;
+                }
+                q->battery_below = v[0];
+                break;
+        }
+
+        q->present |= (uint8_t) (1u << tag);
+        i += 2 + vlen;
+    }
+    return true;
+}
+
+bool query_match(const query_t *q, const query_subject_t *s)
+{
+    if (HAS(q, QUERY_TAG_MODELS) && !memchr(q->models, s->model, q->n_models)) {
+        return false;
+    }
+    if (HAS(q, QUERY_TAG_MIN_RSSI) && s->rssi < q->min_rssi) {
+        return false;
+    }
+    if (HAS(q, QUERY_TAG_MAX_AGE_MS) && s->age_ms > q->max_age_ms) {
+        return false;
+    }
+    if (HAS(q, QUERY_TAG_ADDR_PREFIX)) {
+        for (int k = 0; k < q->prefix_len; k++) {
+            if (s->addr[5 - k] != q->prefix[k]) {
+                return false;
+            }
+        }
+    }
+    if (HAS(q, QUERY_TAG_IDS)) {
+        if (!s->have_id) {
+            return false;
+        }
+        bool found = false;
+        for (int k = 0; k < q->n_ids && !found; k++) {
+            found = q->ids[k] == s->id;
+        }
+        if (!found) {
+            return false;
+        }
+    }
+    if (HAS(q, QUERY_TAG_BATTERY_BELOW) && (!s->have_battery || s->battery >= q->battery_below)) {
+        return false;
+    }
+    return true;
+}
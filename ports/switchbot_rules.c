@@ -0,0 +1,122 @@
+#include "switchbot_rules.h"
+
+#include <string.h>
+
+void rules_init(rules_table_t *t)
+{
+    memset(t, 0, sizeof(*t));
+}
+
+bool rules_load(rules_table_t *t, const uint8_t *data, size_t len)
+{
+    if (len % RULE_WIRE_LEN != 0 || len / RULE_WIRE_LEN > RULES_MAX) {
+        return false;
+    }
+
+    rules_table_t next;
+    rules_init(&next);
+    next.count = (uint8_t) (len / RULE_WIRE_LEN);
+
+    for (int i = 0; i < next.count; i++) {
+        const uint8_t *q = data + i * RULE_WIRE_LEN;
+        rule_t *rule = &next.rules[i];
+
+        rule->id = q[0];
+        rule->flags = q[1];
+        rule->device_id = (uint16_t) ((uint16_t) q[2] << 8) | (uint16_t) q[3];
+        rule->field = q[4];
+        rule->op = q[5];
+        rule->threshold = (int16_t) (((uint16_t) q[6] << 8) | q[7]);
+        rule->hysteresis = (int16_t) (((uint16_t) q[8] << 8) | q[9]);
+
+        if (rule->field > RULE_FIELD_DOOR || rule->op > RULE_OP_EQUAL || rule->hysteresis < 0) {
+            return false;
+        }
+    }
+
+    *t = next;
+    return true;
+}
+
+static bool field_value(const sensor_reading_t *r, uint8_t field, int16_t *out)
+{
+    switch (field) {
+        case RULE_FIELD_TEMP:
+            *out = r->temp_dc;
+            return (r->fields & READING_HAS_TEMP) != 0;
+        case RULE_FIELD_HUMIDITY:
+            *out = r->humidity;
+            return (r->fields & READING_HAS_HUMIDITY) != 0;
+        case RULE_FIELD_BATTERY:
+            *out = r->battery;
+            return (r->fields & READING_HAS_BATTERY) != 0;
+        case RULE_FIELD_PIR:
+            *out = r->pir;
+            return (r->fields & READING_HAS_PIR) != 0;
+        case RULE_FIELD_DOOR:
+            *out = r->door;
+            return (r->fields & READING_HAS_DOOR) != 0;
+        default:
+            return false;
+    }
+}
+
+static bool condition(const rule_t *rule, int16_t v, bool was_active)
+{
+    int32_t threshold = rule->threshold;
+
+    switch (rule->op) {
+        case RULE_OP_ABOVE:
+            return was_active ? v > threshold - rule->hysteresis : v > threshold;
+        case RULE_OP_BELOW:
+            return was_active ? v < threshold + rule->hysteresis : v < threshold;
+        default:
+            return v == threshold;
+    }
+}
+
+int rules_eval(rules_table_t *t, rules_device_t *dev, uint16_t device_id, const sensor_reading_t *r,
+    rule_event_t *events, int max_events)
+{
+    int n = 0;
+
+    for (int i = 0; i < t->count; i++) {
+        const rule_t *rule = &t->rules[i];
+
+        if (!(rule->flags & RULE_FLAG_ANY_DEVICE) && rule->device_id != device_id) {
+            continue;
+        }
+
+        int16_t v;
+        if (!field_value(r, rule->field, &v)) {
+            continue;
+        }
+
+        uint16_t bit = (uint16_t) (1u << i);
+        bool was_active = (dev->active & bit) != 0;
+        bool active = condition(rule, v, was_active);
+        if (active == was_active) {
+            continue;
+        }
+
+        uint32_t count;
+        if (active) {
+            dev->active |= bit;
+            count = ++t->rises[i];
+        } else {
+            dev->active &= (uint16_t) ~bit;
+            count = ++t->falls[i];
+        }
+
+        uint8_t notify = active ? RULE_FLAG_NOTIFY_RISE : RULE_FLAG_NOTIFY_FALL;
+        if ((rule->flags & notify) && n < max_events) {
+            events[n].rule_id = rule->id;
+            events[n].rising = active ? 1 : 0;
+            events[n].value = v;
+            events[n].count = count;
+            n++;
+        }
+    }
+
+    return n;
+}
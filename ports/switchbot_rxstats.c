@@ -0,0 +1,62 @@
+#include "switchbot_rxstats.h"
+
+#include <string.h>
+
+static const uint32_t hist_bounds_ms[RX_HIST_BUCKETS - 1] = RX_HIST_BOUNDS_MS;
+
+void rxstats_reset(rxstats_t *s)
+{
+    memset(s, 0, sizeof(*s));
+}
+
+static void count_interval(rxstats_t *s, uint32_t dt_ms)
+{
+    int b = 0;
+    while (b < RX_HIST_BUCKETS - 1 && dt_ms >= hist_bounds_ms[b]) {
+        b++;
+    }
+    if (s->inter_hist[b] < UINT16_MAX) {
+        s->inter_hist[b]++;
+    }
+}
+
+void rxstats_on_advert(rxstats_t *s, uint32_t now_ms, uint8_t pdu, int8_t rssi, bool merged)
+{
+    switch (pdu) {
+        case RX_PDU_ADV_IND:
+            s->adv_ind++;
+            break;
+        case RX_PDU_SCAN_RSP:
+            s->scan_rsp++;
+            break;
+        default:
+            s->other++;
+            break;
+    }
+    if (merged) {
+        s->merged++;
+    }
+
+    if (pdu != RX_PDU_SCAN_RSP) {
+        if (s->have_last) {
+            count_interval(s, now_ms - s->last_adv_ms);
+        }
+        s->last_adv_ms = now_ms;
+        s->have_last = true;
+    }
+
+    if (!s->have_rssi) {
+        s->rssi_x16 = (int16_t) (rssi * 16);
+        s->rssi_min = rssi;
+        s->rssi_max = rssi;
+        s->have_rssi = true;
+        return;
+    }
+    s->rssi_x16 = (int16_t) (s->rssi_x16 + (rssi * 16 - s->rssi_x16) / 8);
+    if (rssi < s->rssi_min) {
+        s->rssi_min = rssi;
+    }
+    if (rssi > s->rssi_max) {
+        s->rssi_max = rssi;
+    }
+}
@@ -0,0 +1,60 @@
+#include "switchbot_topk.h"
+
+#include <stdbool.h>
+#include <string.h>
+
+void topk_init(topk_t *t)
+{
+    memset(t, 0, sizeof(*t));
+}
+
+void topk_remove(topk_t *t, uint8_t slot)
+{
+    for (int i = 0; i < t->count; i++) {
+        if (t->e[i].slot == slot) {
+            memmove(&t->e[i], &t->e[i + 1], sizeof(t->e[0]) * (size_t) (t->count - i - 1));
+            t->count--;
+            return;
+        }
+    }
+}
+
+// Drops the entry updated longest ago if it is older than TOPK_MAX_AGE_MS.
+static bool evict_oldest(topk_t *t, uint32_t now_ms)
+{
+    int oldest = -1;
+    for (int i = 0; i < t->count; i++) {
+        if (oldest < 0 || now_ms - t->e[i].t_ms > now_ms - t->e[oldest].t_ms) {
+            oldest = i;
+        }
+    }
+    if (oldest < 0 || now_ms - t->e[oldest].t_ms <= TOPK_MAX_AGE_MS) {
+        return false;
+    }
+    topk_remove(t, t->e[oldest].slot);
+    return true;
+}
+
+void topk_update(topk_t *t, uint8_t slot, int16_t key, uint32_t now_ms)
+{
+    topk_remove(t, slot);
+
+    if (t->count == TOPK_CAPACITY) {
+        evict_oldest(t, now_ms);
+    }
+
+    int pos = t->count;
+    while (pos > 0 && t->e[pos - 1].key < key) {
+        pos--;
+    }
+    if (pos >= TOPK_CAPACITY) {
+        return;
+    }
+
+    int n = t->count < TOPK_CAPACITY ? t->count : TOPK_CAPACITY - 1;
+    memmove(&t->e[pos + 1], &t->e[pos], sizeof(t->e[0]) * (size_t) (n - pos));
+    t->e[pos].slot = slot;
+    t->e[pos].key = key;
+    t->e[pos].t_ms = now_ms;
+    t->count = (uint8_t) (n + 1);
+}
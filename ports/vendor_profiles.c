@@ -0,0 +1,475 @@
+#include "vendor_profiles.h"
+#include "switchbot_decode.h"
+
+#include <stddef.h>
+#include <string.h>
+
+#ifdef ESP_PLATFORM
+#include "sdkconfig.h"
+#else
+// Host builds get every profile.
+#define CONFIG_HELLO_ATOMVM_BLE_SWITCHBOT_VENDOR_BTHOME 1
+#define CONFIG_HELLO_ATOMVM_BLE_SWITCHBOT_VENDOR_XIAOMI 1
+#define CONFIG_HELLO_ATOMVM_BLE_SWITCHBOT_VENDOR_GOVEE 1
+#define CONFIG_HELLO_ATOMVM_BLE_SWITCHBOT_VENDOR_INKBIRD 1
+#endif
+
+static uint16_t u16le(const uint8_t *p)
+{
+    return (uint16_t) (p[0] | ((uint16_t) p[1] << 8));
+}
+
+static uint16_t u16be(const uint8_t *p)
+{
+    return (uint16_t) (((uint16_t) p[0] << 8) | p[1]);
+}
+
+// ----- SwitchBot -----
+// - Company ID in Manufacturer Data = 0x0969
+// - Service Data UUID (16-bit) = 0xFD3D
+// SwitchBot often splits Manufacturer Data (ADV_IND) and Service Data (SCAN_RSP).
+
+#define SWITCHBOT_COMPANY_ID 0x0969
+#define SWITCHBOT_SVC_UUID16 0xFD3D
+
+static bool is_switchbot_mfg(const uint8_t *mfg, uint8_t mfg_len)
+{
+    return mfg_len >= 2 && u16le(mfg) == SWITCHBOT_COMPANY_ID;
+}
+
+static bool switchbot_match(const adv_extract_t *ex)
+{
+    return (ex->has_svc && ex->svc_uuid == SWITCHBOT_SVC_UUID16)
+        || (ex->has_mfg && is_switchbot_mfg(ex->mfg, ex->mfg_len));
+}
+
+static bool switchbot_complete(const uint8_t *svc, uint8_t svc_len, const uint8_t *mfg, uint8_t mfg_len)
+{
+    (void) svc;
+    (void) svc_len;
+    return is_switchbot_mfg(mfg, mfg_len);
+}
+
+// ----- BTHome v2 (service data UUID 0xFCD2) -----
+
+#ifdef CONFIG_HELLO_ATOMVM_BLE_SWITCHBOT_VENDOR_BTHOME
+
+#define BTHOME_SVC_UUID16 0xFCD2
+#define BTHOME_INFO_ENCRYPTED 0x01
+
+static bool bthome_match(const adv_extract_t *ex)
+{
+    return ex->has_svc && ex->svc_uuid == BTHOME_SVC_UUID16;
+}
+
+// Value size of a BTHome object id, 0 if unknown (decoding stops there).
+static uint8_t bthome_object_len(uint8_t id)
+{
+    switch (id) {
+        case 0x00: case 0x01: case 0x09: case 0x0F: case 0x10: case 0x11:
+        case 0x15: case 0x16: case 0x17: case 0x18: case 0x19: case 0x1A:
+        case 0x1B: case 0x1C: case 0x1D: case 0x1E: case 0x1F: case 0x20:
+        case 0x21: case 0x22: case 0x23: case 0x24: case 0x25: case 0x26:
+        case 0x27: case 0x28: case 0x29: case 0x2A: case 0x2B: case 0x2C:
+        case 0x2D: case 0x2E: case 0x2F: case 0x3A: case 0x46:
+            return 1;
+        case 0x02: case 0x03: case 0x06: case 0x07: case 0x08: case 0x0C:
+        case 0x0D: case 0x0E: case 0x12: case 0x13: case 0x14: case 0x3C:
+        case 0x3D: case 0x3F: case 0x40: case 0x41: case 0x43: case 0x44:
+        case 0x45: case 0x47: case 0x48: case 0x49: case 0x4A: case 0x51:
+        case 0x52:
+            return 2;
+        case 0x04: case 0x05: case 0x0A: case 0x0B: case 0x42: case 0x4B:
+            return 3;
+        case 0x3E: case 0x4C: case 0x4D: case 0x4E: case 0x4F: case 0x50:
+            return 4;
+        default:
+            return 0;
+    }
+}
+
+static bool bthome_decode(const uint8_t *svc, uint8_t svc_len, const uint8_t *mfg, uint8_t mfg_len,
+    sensor_reading_t *out)
+{
+    (void) mfg;
+    (void) mfg_len;
+
+    if (svc_len < 1 || (svc[0] & BTHOME_INFO_ENCRYPTED)) {
+        return false;
+    }
+
+    uint8_t i = 1;
+    while (i < svc_len) {
+        uint8_t id = svc[i];
+        uint8_t n = bthome_object_len(id);
+        if (n == 0 || i + 1 + n > svc_len) {
+            break;
+        }
+        const uint8_t *v = svc + i + 1;
+
+        switch (id) {
+            case 0x01:
+                out->battery = v[0];
+                out->fields |= READING_HAS_BATTERY;
+                break;
+            case 0x02: // 0.01 C
+                out->temp_dc = (int16_t) ((int16_t) u16le(v) / 10);
+                out->fields |= READING_HAS_TEMP;
+                break;
+            case 0x45: // 0.1 C
+                out->temp_dc = (int16_t) u16le(v);
+                out->fields |= READING_HAS_TEMP;
+                break;
+            case 0x03: // 0.01 %
+                out->humidity = (uint8_t) (u16le(v) / 100);
+                out->fields |= READING_HAS_HUMIDITY;
+                break;
+            case 0x2E:
+                out->humidity = v[0];
+                out->fields |= READING_HAS_HUMIDITY;
+                break;
+            case 0x21: // motion
+                out->pir = v[0] ? 1 : 0;
+                out->fields |= READING_HAS_PIR;
+                break;
+            case 0x1A: // door
+            case 0x2D: // window
+                out->door = v[0] ? 1 : 0;
+                out->fields |= READING_HAS_DOOR;
+                break;
+            default:
+                break;
+        }
+        i = (uint8_t) (i + 1 + n);
+    }
+
+    return out->fields != 0;
+}
+
+static bool bthome_packet_id(const uint8_t *svc, uint8_t svc_len, uint8_t *out)
+{
+    if (svc_len < 1 || (svc[0] & BTHOME_INFO_ENCRYPTED)) {
+        return false;
+    }
+    uint8_t i = 1;
+    while (i < svc_len) {
+        uint8_t n = bthome_object_len(svc[i]);
+        if (n == 0 || i + 1 + n > svc_len) {
+            break;
+        }
+        if (svc[i] == 0x00) {
+            *out = svc[i + 1];
+            return true;
+        }
+        i = (uint8_t) (i + 1 + n);
+    }
+    return false;
+}
+
+#endif
+
+// ----- Xiaomi thermometers on ATC1441 / pvvx firmware (UUID 0x181A) -----
+
+#ifdef CONFIG_HELLO_ATOMVM_BLE_SWITCHBOT_VENDOR_XIAOMI
+
+#define XIAOMI_ATC_SVC_UUID16 0x181A
+#define XIAOMI_ATC1441_LEN 13
+#define XIAOMI_PVVX_LEN 15
+
+static bool xiaomi_match(const adv_extract_t *ex)
+{
+    return ex->has_svc && ex->svc_uuid == XIAOMI_ATC_SVC_UUID16;
+}
+
+static bool xiaomi_decode(const uint8_t *svc, uint8_t svc_len, const uint8_t *mfg, uint8_t mfg_len,
+    sensor_reading_t *out)
+{
+    (void) mfg;
+    (void) mfg_len;
+
+    if (svc_len == XIAOMI_ATC1441_LEN) {
+        // <<mac:6, temp:s16be (0.1 C), humidity:8, battery:8, mv:16be, count:8>>
+        out->temp_dc = (int16_t) u16be(svc + 6);
+        out->humidity = svc[8];
+        out->battery = svc[9];
+    } else if (svc_len == XIAOMI_PVVX_LEN) {
+        // <<mac:6 (le), temp:s16le (0.01 C), humidity:16le (0.01 %), mv:16le, battery:8, count:8, flags:8>>
+        out->temp_dc = (int16_t) ((int16_t) u16le(svc + 6) / 10);
+        out->humidity = (uint8_t) (u16le(svc + 8) / 100);
+        out->battery = svc[12];
+    } else {
+        return false;
+    }
+
+    out->fields = READING_HAS_BATTERY | READING_HAS_TEMP | READING_HAS_HUMIDITY;
+    return true;
+}
+
+static bool xiaomi_frame_counter(const uint8_t *svc, uint8_t svc_len, uint8_t *out)
+{
+    if (svc_len == XIAOMI_ATC1441_LEN) {
+        *out = svc[12];
+        return true;
+    }
+    if (svc_len == XIAOMI_PVVX_LEN) {
+        *out = svc[13];
+        return true;
+    }
+    return false;
+}
+
+#endif
+
+// ----- Govee H5072 / H5075 (company id 0xEC88) -----
+
+#ifdef CONFIG_HELLO_ATOMVM_BLE_SWITCHBOT_VENDOR_GOVEE
+
+#define GOVEE_COMPANY_ID 0xEC88
+#define GOVEE_MIN_MFG_LEN 7
+
+static bool govee_match(const adv_extract_t *ex)
+{
+    return ex->has_mfg && ex->mfg_len >= 2 && u16le(ex->mfg) == GOVEE_COMPANY_ID;
+}
+
+static bool govee_complete(const uint8_t *svc, uint8_t svc_len, const uint8_t *mfg, uint8_t mfg_len)
+{
+    (void) svc;
+    (void) svc_len;
+    return mfg_len >= 2 && u16le(mfg) == GOVEE_COMPANY_ID;
+}
+
+static bool govee_decode(const uint8_t *svc, uint8_t svc_len, const uint8_t *mfg, uint8_t mfg_len,
+    sensor_reading_t *out)
+{
+    (void) svc;
+    (void) svc_len;
+
+    if (mfg_len < GOVEE_MIN_MFG_LEN) {
+        return false;
+    }
+
+    // <<0x88, 0xEC, 0x00, packed:24be, battery:8, ...>>
+    // packed = temp_c * 10000 + humidity * 10, bit 23 set when below zero
+    uint32_t packed = ((uint32_t) mfg[3] << 16) | ((uint32_t) mfg[4] << 8) | mfg[5];
+    bool negative = (packed & 0x800000) != 0;
+    packed &= 0x7FFFFF;
+
+    int16_t temp_dc = (int16_t) (packed / 1000);
+    out->temp_dc = negative ? (int16_t) -temp_dc : temp_dc;
+    out->humidity = (uint8_t) ((packed % 1000) / 10);
+    out->battery = mfg[6] & 0x7F;
+
+    out->fields = READING_HAS_BATTERY | READING_HAS_TEMP | READING_HAS_HUMIDITY;
+    return true;
+}
+
+#endif
+
+// ----- Inkbird IBS-TH1 / IBS-TH2 (identified by local name) -----
+
+#ifdef CONFIG_HELLO_ATOMVM_BLE_SWITCHBOT_VENDOR_INKBIRD
+
+#define INKBIRD_MFG_LEN 9
+
+static bool inkbird_match(const adv_extract_t *ex)
+{
+    return ex->name_len == 3 && (memcmp(ex->name, "sps", 3) == 0 || memcmp(ex->name, "tps", 3) == 0);
+}
+
+static bool inkbird_complete(const uint8_t *svc, uint8_t svc_len, const uint8_t *mfg, uint8_t mfg_len)
+{
+    (void) svc;
+    (void) svc_len;
+    (void) mfg;
+    return mfg_len == INKBIRD_MFG_LEN;
+}
+
+static bool inkbird_decode(const uint8_t *svc, uint8_t svc_len, const uint8_t *mfg, uint8_t mfg_len,
+    sensor_reading_t *out)
+{
+    (void) svc;
+    (void) svc_len;
+
+    if (mfg_len != INKBIRD_MFG_LEN) {
+        return false;
+    }
+
+    // The "company id" slot carries the temperature:
+    // <<temp:s16le (0.01 C), humidity:16le (0.01 %), probe:8, crc:16, battery:8, type:8>>
+    out->temp_dc = (int16_t) ((int16_t) u16le(mfg) / 10);
+    out->humidity = (uint8_t) (u16le(mfg + 2) / 100);
+    out->battery = mfg[7];
+
+    out->fields = READING_HAS_BATTERY | READING_HAS_TEMP | READING_HAS_HUMIDITY;
+    return true;
+}
+
+#endif
+
+// ----- Profile table -----
+
+static const vendor_profile_t g_profiles[] = {
+    { VENDOR_SWITCHBOT, "switchbot", VENDOR_NEEDS_MFG | VENDOR_NEEDS_SVC, SWITCHBOT_SVC_UUID16,
+        switchbot_match, switchbot_complete, switchbot_decode },
+#ifdef CONFIG_HELLO_ATOMVM_BLE_SWITCHBOT_VENDOR_BTHOME
+    { VENDOR_BTHOME, "bthome", VENDOR_NEEDS_SVC, BTHOME_SVC_UUID16, bthome_match, NULL, bthome_decode },
+#endif
+#ifdef CONFIG_HELLO_ATOMVM_BLE_SWITCHBOT_VENDOR_XIAOMI
+    { VENDOR_XIAOMI, "xiaomi", VENDOR_NEEDS_SVC, XIAOMI_ATC_SVC_UUID16, xiaomi_match, NULL, xiaomi_decode },
+#endif
+#ifdef CONFIG_HELLO_ATOMVM_BLE_SWITCHBOT_VENDOR_GOVEE
+    { VENDOR_GOVEE, "govee", VENDOR_NEEDS_MFG, 0, govee_match, govee_complete, govee_decode },
+#endif
+#ifdef CONFIG_HELLO_ATOMVM_BLE_SWITCHBOT_VENDOR_INKBIRD
+    { VENDOR_INKBIRD, "inkbird", VENDOR_NEEDS_MFG, 0, inkbird_match, inkbird_complete, inkbird_decode },
+#endif
+};
+
+#define PROFILE_COUNT (sizeof(g_profiles) / sizeof(g_profiles[0]))
+
+static bool svc_uuid_wanted(uint16_t uuid)
+{
+    for (size_t i = 0; i < PROFILE_COUNT; i++) {
+        if (g_profiles[i].svc_uuid != 0 && g_profiles[i].svc_uuid == uuid) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void adv_extract(const uint8_t *data, uint8_t data_len, adv_extract_t *out)
+{
+    memset(out, 0, sizeof(*out));
+
+    uint8_t i = 0;
+    while (i < data_len) {
+        uint8_t len = data[i];
+        if (len == 0) {
+            break;
+        }
+
+        // Need i + 1 + len <= data_len; otherwise malformed.
+        if ((uint16_t) i + (uint16_t) len >= (uint16_t) data_len) {
+            break;
+        }
+
+        uint8_t type = data[i + 1];
+        const uint8_t *val = &data[i + 2];
+        uint8_t val_len = (uint8_t) (len - 1);
+
+        // Manufacturer Specific Data
+        if (type == 0xFF && val_len >= 2) {
+            out->mfg = val;
+            out->mfg_len = val_len;
+            out->has_mfg = true;
+        }
+
+        // Service Data - 16-bit UUID (little-endian in the payload)
+        if (type == 0x16 && val_len >= 2 && !out->has_svc && svc_uuid_wanted(u16le(val))) {
+            out->svc_uuid = u16le(val);
+            out->svc = val + 2;
+            out->svc_len = (uint8_t) (val_len - 2);
+            out->has_svc = true;
+        }
+
+        // Shortened / Complete Local Name
+        if (type == 0x08 || type == 0x09) {
+            out->name = val;
+            out->name_len = val_len;
+        }
+
+        i = (uint8_t) (i + 1 + len);
+    }
+}
+
+const vendor_profile_t *vendor_identify(const adv_extract_t *ex)
+{
+    for (size_t i = 0; i < PROFILE_COUNT; i++) {
+        if (g_profiles[i].match(ex)) {
+            return &g_profiles[i];
+        }
+    }
+    return NULL;
+}
+
+const vendor_profile_t *vendor_profile(uint8_t id)
+{
+    for (size_t i = 0; i < PROFILE_COUNT; i++) {
+        if (g_profiles[i].id == id) {
+            return &g_profiles[i];
+        }
+    }
+    return NULL;
+}
+
+bool vendor_frame_complete(uint8_t vendor, bool have_svc, const uint8_t *svc, uint8_t svc_len, bool have_mfg,
+    const uint8_t *mfg, uint8_t mfg_len)
+{
+    const vendor_profile_t *vp = vendor_profile(vendor);
+    if (!vp) {
+        return false;
+    }
+    if ((vp->needs & VENDOR_NEEDS_SVC) && !have_svc) {
+        return false;
+    }
+    if ((vp->needs & VENDOR_NEEDS_MFG) && !have_mfg) {
+        return false;
+    }
+    return !vp->complete || vp->complete(svc, svc_len, mfg, mfg_len);
+}
+
+bool vendor_decode(uint8_t vendor, const uint8_t *svc, uint8_t svc_len, const uint8_t *mfg, uint8_t mfg_len,
+    sensor_reading_t *out)
+{
+    memset(out, 0, sizeof(*out));
+
+    const vendor_profile_t *vp = vendor_profile(vendor);
+    if (!vp) {
+        return false;
+    }
+    bool ok = vp->decode(svc, svc_len, mfg, mfg_len, out);
+    out->vendor = vendor;
+    return ok;
+}
+
+bool vendor_device_id(uint8_t vendor, const uint8_t addr[6], const uint8_t *mfg, uint8_t mfg_len,
+    uint16_t *out)
+{
+    if (vendor == VENDOR_SWITCHBOT) {
+        // Your reference code uses manufacturerData[6]*256 + manufacturerData[7]
+        // (big-endian). Only set if we have enough bytes.
+        if (mfg_len < 8) {
+            return false;
+        }
+        *out = u16be(mfg + 6);
+        return true;
+    }
+    *out = (uint16_t) (((uint16_t) addr[1] << 8) | addr[0]);
+    return true;
+}
+
+bool vendor_adv_seq(uint8_t vendor, const uint8_t *svc, uint8_t svc_len, const uint8_t *mfg, uint8_t mfg_len,
+    uint8_t *out)
+{
+    switch (vendor) {
+        case VENDOR_SWITCHBOT:
+            if (mfg_len < 9) {
+                return false;
+            }
+            *out = mfg[8];
+            return true;
+#ifdef CONFIG_HELLO_ATOMVM_BLE_SWITCHBOT_VENDOR_BTHOME
+        case VENDOR_BTHOME:
+            return bthome_packet_id(svc, svc_len, out);
+#endif
+#ifdef CONFIG_HELLO_ATOMVM_BLE_SWITCHBOT_VENDOR_XIAOMI
+        case VENDOR_XIAOMI:
+            return xiaomi_frame_counter(svc, svc_len, out);
+#endif
+        default:
+            (void) svc;
+            (void) svc_len;
+            return false;
+    }
+}
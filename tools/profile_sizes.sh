@@ -0,0 +1,49 @@
+#!/bin/sh
+# Builds the AtomVM ESP32 firmware once per footprint profile (see Kconfig)
+# and prints the flash and RAM this component takes in each.
+#
+# Usage, with ESP-IDF in the environment:
+#
+#     tools/profile_sizes.sh ATOMVM_ESP32_DIR [PROFILE...]
+#
+# ATOMVM_ESP32_DIR is AtomVM's src/platforms/esp32 with this repository in
+# its components directory. Profiles default to "minimal standard gateway".
+# Each build goes to build-<profile> there; the numbers come from the
+# switchbot_size.txt the component writes after it is built. flash is
+# text + data, ram is data + bss; both exclude NimBLE and the heap the
+# arena takes at run time (see OPCODE_PORT_INFO).
+
+set -e
+
+if [ $# -lt 1 ]; then
+    echo "usage: $0 ATOMVM_ESP32_DIR [PROFILE...]" >&2
+    exit 2
+fi
+
+dir=$1
+shift
+profiles=${*:-minimal standard gateway}
+
+for p in $profiles; do
+    name=$(echo "$p" | tr '[:lower:]' '[:upper:]')
+    build="$dir/build-$p"
+    mkdir -p "$build"
+    echo "CONFIG_HELLO_ATOMVM_BLE_SWITCHBOT_PROFILE_$name=y" > "$build/profile.defaults"
+
+    defaults="$build/profile.defaults"
+    if [ -f "$dir/sdkconfig.defaults" ]; then
+        defaults="$dir/sdkconfig.defaults;$defaults"
+    fi
+
+    idf.py -C "$dir" -B "$build" -D SDKCONFIG="$build/sdkconfig" -D SDKCONFIG_DEFAULTS="$defaults" build \
+        > "$build/profile_build.log" 2>&1 || {
+        echo "$p: build failed, see $build/profile_build.log" >&2
+        exit 1
+    }
+done
+
+printf '%-10s %8s %8s %8s %8s %8s\n' profile text data bss flash ram
+for p in $profiles; do
+    awk -v p="$p" '/TOTALS/ { printf "%-10s %8d %8d %8d %8d %8d\n", p, $1, $2, $3, $1 + $2, $2 + $3 }' \
+        "$dir/build-$p/switchbot_size.txt"
+done
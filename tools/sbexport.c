@@ -0,0 +1,235 @@
+// Host-side reader for the driver's binary serial export (OPCODE_EXPORT_START).
+//
+// Build from the repository root:
+//
+//     cc -O2 -Wall -Iports/include -o sbexport tools/sbexport.c ports/switchbot_frame.c
+//
+// Usage:
+//
+//     sbexport [-b baud] /dev/ttyUSB0   read frames from a serial port (or a file)
+//     sbexport -p                       read from a new pseudo-terminal
+//     sbexport -g [-n count] TTY        write synthetic frames to TTY (or a file)
+//
+// -p prints the pseudo-terminal's name, so the reader can be tried without
+// hardware by pointing a generator at it. Readings are printed one per line;
+// frame, CRC and loss counters are printed on EOF or Ctrl-C.
+
+#define _DEFAULT_SOURCE
+#define _XOPEN_SOURCE 600
+
+#include "sensor_reading.h"
+#include "switchbot_frame.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+static volatile sig_atomic_t g_stop;
+
+static void on_signal(int sig)
+{
+    (void) sig;
+    g_stop = 1;
+}
+
+static speed_t to_speed(long baud)
+{
+    switch (baud) {
+        case 9600:
+            return B9600;
+        case 57600:
+            return B57600;
+        case 115200:
+            return B115200;
+        case 230400:
+            return B230400;
+        case 460800:
+            return B460800;
+        case 921600:
+            return B921600;
+        default:
+            return 0;
+    }
+}
+
+static int set_raw(int fd, long baud)
+{
+    struct termios t;
+    if (tcgetattr(fd, &t) != 0) {
+        return -1;
+    }
+    cfmakeraw(&t);
+    t.c_cc[VMIN] = 1;
+    t.c_cc[VTIME] = 0;
+    if (baud > 0) {
+        speed_t s = to_speed(baud);
+        if (s == 0) {
+            fprintf(stderr, "unsupported baud rate %ld\n", baud);
+            return -1;
+        }
+        cfsetispeed(&t, s);
+        cfsetospeed(&t, s);
+    }
+    return tcsetattr(fd, TCSANOW, &t);
+}
+
+static int open_pty(void)
+{
+    int fd = posix_openpt(O_RDWR | O_NOCTTY);
+    if (fd < 0 || grantpt(fd) != 0 || unlockpt(fd) != 0) {
+        return -1;
+    }
+    printf("pty %s\n", ptsname(fd));
+    fflush(stdout);
+    return fd;
+}
+
+static void print_reading(const frame_t *f)
+{
+    frame_reading_t r;
+    if (!frame_reading_decode(f, &r)) {
+        printf("seq=%u type=%u len=%u\n", (unsigned) f->seq, (unsigned) f->type, (unsigned) f->len);
+        return;
+    }
+
+    printf("seq=%u t_ms=%u addr=%02x:%02x:%02x:%02x:%02x:%02x rssi=%d vendor=%u adv_seq=%u id=%04x", (unsigned) f->seq,
+        (unsigned) r.t_ms, r.addr[5], r.addr[4], r.addr[3], r.addr[2], r.addr[1], r.addr[0], (int) r.rssi,
+        (unsigned) r.vendor, (unsigned) r.adv_seq, (unsigned) r.device_id);
+    if (r.fields & READING_HAS_TEMP) {
+        printf(" temp=%.1f", r.temp_dc / 10.0);
+    }
+    if (r.fields & READING_HAS_HUMIDITY) {
+        printf(" hum=%u", (unsigned) r.humidity);
+    }
+    if (r.fields & READING_HAS_BATTERY) {
+        printf(" batt=%u", (unsigned) r.battery);
+    }
+    printf("\n");
+}
+
+static int run_reader(int fd)
+{
+    frame_parser_t parser;
+    frame_parser_init(&parser);
+
+    uint8_t buf[512];
+    uint64_t bytes = 0;
+    struct timespec t0;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    while (!g_stop) {
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        // A pty master reads EIO once the last writer closed the slave.
+        if (n <= 0) {
+            break;
+        }
+        bytes += (uint64_t) n;
+        for (ssize_t i = 0; i < n; i++) {
+            frame_t f;
+            if (frame_parser_push(&parser, buf[i], &f)) {
+                print_reading(&f);
+            }
+        }
+    }
+
+    struct timespec t1;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double secs = (double) (t1.tv_sec - t0.tv_sec) + (double) (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    const frame_rx_stats_t *st = &parser.stats;
+    fprintf(stderr, "frames=%u crc_errors=%u lost=%u skipped_bytes=%u bytes=%llu secs=%.2f\n", (unsigned) st->frames,
+        (unsigned) st->crc_errors, (unsigned) st->lost, (unsigned) st->skipped, (unsigned long long) bytes, secs);
+    return 0;
+}
+
+// Synthetic meter readings from three devices, for trying the reader.
+static int run_generator(int fd, long count)
+{
+    uint8_t payload[FRAME_READING_LEN];
+    uint8_t frame[FRAME_MAX_LEN];
+
+    for (long i = 0; !g_stop && (count <= 0 || i < count); i++) {
+        frame_reading_t r = {
+            .t_ms = (uint32_t) (i * 100),
+            .addr = { 0x01, 0x02, 0x03, 0x04, 0x05, (uint8_t) (0xC0 + i % 3) },
+            .rssi = (int8_t) (-50 - i % 20),
+            .vendor = 1,
+            .adv_seq = (uint8_t) i,
+            .device_id = (uint16_t) (0x0500 + i % 3),
+            .fields = READING_HAS_TEMP | READING_HAS_HUMIDITY | READING_HAS_BATTERY | FRAME_READING_HAS_SEQ,
+            .temp_dc = (int16_t) (200 + i % 50),
+            .humidity = (uint8_t) (40 + i % 20),
+            .battery = 90,
+        };
+        frame_reading_encode(payload, &r);
+        size_t n = frame_encode(frame, (uint16_t) i, FRAME_TYPE_READING, payload, sizeof(payload));
+        if (write(fd, frame, n) != (ssize_t) n) {
+            perror("write");
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: sbexport [-b baud] TTY | -p | -g [-n count] TTY\n");
+}
+
+int main(int argc, char **argv)
+{
+    long baud = 0;
+    long count = 0;
+    int use_pty = 0;
+    int generate = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "b:gn:p")) != -1) {
+        switch (opt) {
+            case 'b':
+                baud = strtol(optarg, NULL, 10);
+                break;
+            case 'g':
+                generate = 1;
+                break;
+            case 'n':
+                count = strtol(optarg, NULL, 10);
+                break;
+            case 'p':
+                use_pty = 1;
+                break;
+            default:
+                usage();
+                return 2;
+        }
+    }
+    if (use_pty == (optind < argc)) {
+        usage();
+        return 2;
+    }
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
+    int fd = use_pty ? open_pty() : open(argv[optind], (generate ? O_WRONLY | O_CREAT | O_TRUNC : O_RDONLY) | O_NOCTTY, 0644);
+    if (fd < 0) {
+        perror(use_pty ? "posix_openpt" : argv[optind]);
+        return 1;
+    }
+    if (isatty(fd) && set_raw(fd, baud) != 0) {
+        perror("tcsetattr");
+        return 1;
+    }
+
+    int rc = generate ? run_generator(fd, count) : run_reader(fd);
+    close(fd);
+    return rc;
+}
@@ -0,0 +1,301 @@
+// Times the advert filter (ports/switchbot_filter.c) running the
+// SwitchBot-only program from SampleApp.Filter.switchbot/0 against the
+// built-in path it short-cuts, adv_extract + vendor_identify.
+//
+// Build from the repository root:
+//
+//     cc -O2 -Wall -Iports/include -o sbfilterbench tools/sbfilterbench.c ports/switchbot_filter.c ports/vendor_profiles.c ports/switchbot_decode.c
+//
+// Usage:
+//
+//     sbfilterbench [-n passes] [-f FILE]
+//
+// FILE holds one advert per line as hex (raw advertising data as the scan
+// callback sees it, AD structures only; spaces and colons are ignored, '#'
+// starts a comment), e.g. the data column of a btmon or nRF Connect
+// capture. Without -f a built-in corpus is used, weighted like a scan in a
+// flat: mostly phones and accessories, a handful of SwitchBot sensors and
+// other thermometers. Each pass runs every advert of the corpus once.
+//
+// Prints ns per advert for the filter alone, for extract + identify on
+// every advert (no filter loaded) and for the filter followed by extract +
+// identify on what it accepts (the scan callback with the filter loaded).
+// Adverts the two paths classify differently are listed; the exit status
+// is 1 if there are any.
+
+#define _DEFAULT_SOURCE
+
+#include "switchbot_filter.h"
+#include "vendor_profiles.h"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_ADVERTS 4096
+#define ADV_MAX_LEN 31
+
+typedef struct
+{
+    const char *name;
+    uint8_t weight;
+    const char *hex;
+} sample_t;
+
+// Adverts of the kinds heard in a typical home, with made-up addresses and
+// values. Weight is how many copies go into the corpus.
+static const sample_t g_samples[] = {
+    { "switchbot meter adv", 3, "02010610ff6909d40bc51a3e5c8e640005992d00" },
+    { "switchbot meter rsp", 3, "06163dfd5400e4" },
+    { "switchbot contact", 1, "0201060c163dfd6440e40100020203000aff6909e2d1a08b4c701c" },
+    { "switchbot motion", 1, "02010609163dfd7340e4002a020aff6909c40a31ee9f0244" },
+    { "apple ibeacon", 2, "0201061aff4c000215e2c56db5dffb48d2b060d0f5a71096e000010002c5" },
+    { "apple nearby", 12, "02011a020a0c0bff4c0010063b1d6e5c9a18" },
+    { "apple findmy", 8, "0201061dff4c001219109a7d0b3e4f21c6a85d9e7b03f41a62c8e5d70b19f30100" },
+    { "apple airpods", 4, "1eff4c000719010e202b778f000a456b9c3e7d1a04f288315ecd0b77a419c6" },
+    { "microsoft cdp", 4, "17ff0600010920028c3f1e7a9b4d6c02115b2a9e0d4f71c3" },
+    { "google fast pair", 2, "02010603032cfe07162cfe000a0bc1020af4" },
+    { "samsung", 3, "02010615ff750042040180603c5d8e217faa010c2e0a000000" },
+    { "tile", 1, "0201060303edfe0d16edfe02007b4c19a2e8f30d6b" },
+    { "bthome", 1, "0201060e16d2fc40004f015c02ca0903bf13" },
+    { "pvvx", 1, "12161a182e7a8b38c1a4c208d4172f0b5d3e04" },
+    { "govee", 1, "02010609ff88ec00034d9e64000d09475648353037355f41314232" },
+    { "inkbird", 1, "040973707309fff509a30e003c9a6408" },
+    { "name only rsp", 3, "08094c59574a535230" },
+    { "empty rsp", 4, "" },
+};
+
+// SampleApp.Filter.switchbot/0 in wire format: <<op, jt, jf, k::16>>.
+static const uint8_t g_switchbot_prog[] = {
+    FILTER_LD_AD, 0, 0, 0x00, 0xFF, // {:ld_ad, 0xFF}
+    FILTER_JGE, 0, 2, 0x00, 0x02, // {:jge, 2, 0, 2}
+    FILTER_LD_HX, 0, 0, 0x00, 0x00, // {:ld_hx, 0}
+    FILTER_JEQ, 4, 0, 0x69, 0x09, // {:jeq, 0x6909, 4, 0}
+    FILTER_LD_AD, 0, 0, 0x00, 0x16, // {:ld_ad, 0x16}
+    FILTER_JGE, 0, 3, 0x00, 0x02, // {:jge, 2, 0, 3}
+    FILTER_LD_HX, 0, 0, 0x00, 0x00, // {:ld_hx, 0}
+    FILTER_JEQ, 0, 1, 0x3D, 0xFD, // {:jeq, 0x3DFD, 0, 1}
+    FILTER_RET, 0, 0, 0x00, 0x01, // {:ret, :accept}
+    FILTER_RET, 0, 0, 0x00, 0x00, // {:ret, :reject}
+};
+
+typedef struct
+{
+    char name[32];
+    uint8_t data[ADV_MAX_LEN];
+    uint8_t len;
+} advert_t;
+
+static advert_t g_adverts[MAX_ADVERTS];
+static int g_n_adverts;
+
+static volatile uint32_t g_sink;
+
+static double now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+// Parses hex digits, skipping spaces and colons. -1 on anything else.
+static int parse_hex(const char *s, uint8_t *out, int max)
+{
+    int n = 0;
+    int nibble = -1;
+    for (; *s && *s != '#' && *s != '\n'; s++) {
+        if (*s == ' ' || *s == '\t' || *s == ':' || *s == '\r') {
+            continue;
+        }
+        if (!isxdigit((unsigned char) *s)) {
+            return -1;
+        }
+        int v = isdigit((unsigned char) *s) ? *s - '0' : tolower((unsigned char) *s) - 'a' + 10;
+        if (nibble < 0) {
+            nibble = v;
+        } else {
+            if (n == max) {
+                return -1;
+            }
+            out[n++] = (uint8_t) (nibble << 4 | v);
+            nibble = -1;
+        }
+    }
+    return nibble < 0 ? n : -1;
+}
+
+static bool add_advert(const char *name, const char *hex)
+{
+    if (g_n_adverts == MAX_ADVERTS) {
+        return false;
+    }
+    advert_t *a = &g_adverts[g_n_adverts];
+    int n = parse_hex(hex, a->data, ADV_MAX_LEN);
+    if (n < 0) {
+        return false;
+    }
+    snprintf(a->name, sizeof(a->name), "%s", name);
+    a->len = (uint8_t) n;
+    g_n_adverts++;
+    return true;
+}
+
+static int load_file(const char *path)
+{
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+    char line[256];
+    int lineno = 0;
+    while (fgets(line, sizeof(line), f)) {
+        lineno++;
+        uint8_t tmp[ADV_MAX_LEN];
+        int n = parse_hex(line, tmp, ADV_MAX_LEN);
+        if (n < 0) {
+            fprintf(stderr, "%s:%d: not an advert of at most %d hex bytes\n", path, lineno, ADV_MAX_LEN);
+            fclose(f);
+            return -1;
+        }
+        // Skip blank and comment-only lines.
+        const char *p = line;
+        while (*p == ' ' || *p == '\t') {
+            p++;
+        }
+        if (*p == '#' || *p == '\n' || *p == '\0') {
+            continue;
+        }
+        char name[32];
+        snprintf(name, sizeof(name), "line %d", lineno);
+        if (!add_advert(name, line)) {
+            fprintf(stderr, "%s: more than %d adverts\n", path, MAX_ADVERTS);
+            fclose(f);
+            return -1;
+        }
+    }
+    fclose(f);
+    return 0;
+}
+
+// Interleaves the weighted samples so equal kinds do not run back to back.
+static void load_builtin(void)
+{
+    int left[sizeof(g_samples) / sizeof(g_samples[0])];
+    int total = 0;
+    for (size_t i = 0; i < sizeof(g_samples) / sizeof(g_samples[0]); i++) {
+        left[i] = g_samples[i].weight;
+        total += left[i];
+    }
+    while (total > 0) {
+        for (size_t i = 0; i < sizeof(g_samples) / sizeof(g_samples[0]); i++) {
+            if (left[i] > 0) {
+                add_advert(g_samples[i].name, g_samples[i].hex);
+                left[i]--;
+                total--;
+            }
+        }
+    }
+}
+
+static bool is_switchbot(const advert_t *a)
+{
+    adv_extract_t ex;
+    adv_extract(a->data, a->len, &ex);
+    const vendor_profile_t *vp = vendor_identify(&ex);
+    return vp && vp->id == VENDOR_SWITCHBOT;
+}
+
+int main(int argc, char **argv)
+{
+    long passes = 20000;
+    const char *file = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:f:")) != -1) {
+        if (opt == 'n') {
+            passes = strtol(optarg, NULL, 0);
+        } else if (opt == 'f') {
+            file = optarg;
+        } else {
+            fprintf(stderr, "usage: sbfilterbench [-n passes] [-f FILE]\n");
+            return 2;
+        }
+    }
+    if (passes <= 0) {
+        fprintf(stderr, "sbfilterbench: passes must be positive\n");
+        return 2;
+    }
+
+    if (file) {
+        if (load_file(file) != 0) {
+            return 1;
+        }
+    } else {
+        load_builtin();
+    }
+    if (g_n_adverts == 0) {
+        fprintf(stderr, "sbfilterbench: empty corpus\n");
+        return 1;
+    }
+
+    filter_prog_t prog;
+    if (!filter_load(&prog, g_switchbot_prog, sizeof(g_switchbot_prog))) {
+        fprintf(stderr, "sbfilterbench: program rejected by filter_load\n");
+        return 1;
+    }
+
+    int accepted = 0;
+    int identified = 0;
+    int mismatches = 0;
+    for (int i = 0; i < g_n_adverts; i++) {
+        bool f = filter_run(&prog, g_adverts[i].data, g_adverts[i].len);
+        bool s = is_switchbot(&g_adverts[i]);
+        accepted += f;
+        identified += s;
+        if (f != s) {
+            printf("mismatch: %s filter=%d switchbot=%d\n", g_adverts[i].name, (int) f, (int) s);
+            mismatches++;
+        }
+    }
+
+    double start = now_s();
+    uint32_t sink = 0;
+    for (long p = 0; p < passes; p++) {
+        for (int i = 0; i < g_n_adverts; i++) {
+            sink += filter_run(&prog, g_adverts[i].data, g_adverts[i].len);
+        }
+    }
+    double filter_s = now_s() - start;
+
+    start = now_s();
+    for (long p = 0; p < passes; p++) {
+        for (int i = 0; i < g_n_adverts; i++) {
+            sink += is_switchbot(&g_adverts[i]);
+        }
+    }
+    double extract_s = now_s() - start;
+
+    start = now_s();
+    for (long p = 0; p < passes; p++) {
+        for (int i = 0; i < g_n_adverts; i++) {
+            if (filter_run(&prog, g_adverts[i].data, g_adverts[i].len)) {
+                sink += is_switchbot(&g_adverts[i]);
+            }
+        }
+    }
+    double both_s = now_s() - start;
+    g_sink = sink;
+
+    double runs = (double) passes * g_n_adverts;
+    printf("corpus: %d adverts (%s), %d accepted by the filter, %d identified as SwitchBot, %d mismatches\n",
+        g_n_adverts, file ? file : "built-in", accepted, identified, mismatches);
+    printf("passes: %ld, %.0f adverts per path\n", passes, runs);
+    printf("filter only:                %6.1f ns/advert\n", filter_s * 1e9 / runs);
+    printf("extract + identify:         %6.1f ns/advert\n", extract_s * 1e9 / runs);
+    printf("filter, then extract on hit: %5.1f ns/advert (%.2fx)\n", both_s * 1e9 / runs,
+        both_s > 0 ? extract_s / both_s : 0.0);
+    return mismatches == 0 ? 0 : 1;
+}
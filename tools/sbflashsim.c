@@ -0,0 +1,356 @@
+// Runs the flash log (ports/switchbot_flashlog.c) against a RAM copy of a
+// NOR partition and reports write amplification, wear and throughput.
+//
+// Build from the repository root:
+//
+//     cc -O2 -Wall -Iports/include -o sbflashsim tools/sbflashsim.c ports/switchbot_flashlog.c
+//
+// Usage:
+//
+//     sbflashsim [-s sectors] [-d devices] [-m minutes] [-r reboots] [-p pause]
+//
+// Simulates `devices` sensors logged once a minute (as log_reading does)
+// for `minutes`, flushed once a second with the driver's policy: full pages
+// at once, a partial page after LOG_MAX_BUFFER_MS. The partition has
+// `sectors` 4 KB sectors and starts blank. `reboots` restarts are spread
+// over the run, alternating a clean stop (forced flush) and a crash (RAM
+// pages lost); each remounts the log from flash. A consumer keeps one
+// cursor across all of it, reading flash and then RAM every 10 minutes,
+// and stops reading for `pause` minutes halfway through so the ring laps
+// it. Every record read back is checked against what was appended, for
+// content, order and duplicates.
+//
+// The emulated flash behaves like NOR: erase sets bytes to 0xFF and a
+// write can only clear bits. A write into bytes that were not erased is
+// counted as a violation and makes the exit status 1.
+
+#define _DEFAULT_SOURCE
+
+#include "sensor_reading.h"
+#include "switchbot_flashlog.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define TICK_MS 1000 // PRESENCE_TICK_MS
+#define LOG_MAX_BUFFER_MS (5 * 60 * 1000)
+#define READ_EVERY_MIN 10
+#define READ_MAX 32 // LOG_READ_MAX
+
+typedef struct
+{
+    uint8_t *mem;
+    uint32_t size;
+    uint64_t bytes_read;
+    uint64_t bytes_programmed;
+    uint64_t bytes_erased;
+    uint32_t erases;
+    uint32_t violations;
+    uint32_t *sector_erases;
+} ram_flash_t;
+
+static ram_flash_t g_flash;
+
+static double g_append_s;
+static double g_flush_s;
+static double g_mount_s;
+static double g_read_s;
+
+static double now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+static int ram_read(void *arg, uint32_t offset, void *dst, size_t len)
+{
+    ram_flash_t *f = arg;
+    if (offset + len > f->size) {
+        return -1;
+    }
+    memcpy(dst, f->mem + offset, len);
+    f->bytes_read += len;
+    return 0;
+}
+
+static int ram_write(void *arg, uint32_t offset, const void *src, size_t len)
+{
+    ram_flash_t *f = arg;
+    if (offset + len > f->size) {
+        return -1;
+    }
+    const uint8_t *s = src;
+    for (size_t i = 0; i < len; i++) {
+        if (f->mem[offset + i] != 0xFF) {
+            f->violations++;
+        }
+        f->mem[offset + i] &= s[i];
+    }
+    f->bytes_programmed += len;
+    return 0;
+}
+
+static int ram_erase(void *arg, uint32_t offset, size_t len)
+{
+    ram_flash_t *f = arg;
+    if (offset % FLOG_SECTOR_SIZE != 0 || len % FLOG_SECTOR_SIZE != 0 || offset + len > f->size) {
+        return -1;
+    }
+    memset(f->mem + offset, 0xFF, len);
+    for (size_t s = 0; s < len / FLOG_SECTOR_SIZE; s++) {
+        f->sector_erases[offset / FLOG_SECTOR_SIZE + s]++;
+    }
+    f->bytes_erased += len;
+    f->erases++;
+    return 0;
+}
+
+// Values a sensor reports at a given time, so the consumer can check them.
+static int16_t expect_temp(uint16_t boot, uint16_t device_id, uint32_t t_s)
+{
+    return (int16_t) ((device_id * 37u + t_s / 60 * 7u + boot * 11u) % 400u) - 100;
+}
+
+static uint8_t expect_humidity(uint16_t device_id, uint32_t t_s)
+{
+    return (uint8_t) ((device_id * 13u + t_s / 60) % 100u);
+}
+
+typedef struct
+{
+    uint32_t cursor;
+    uint32_t received;
+    uint32_t mismatches;
+    uint32_t out_of_order;
+    uint16_t last_boot;
+    uint32_t last_t_s;
+    uint16_t last_device;
+    bool any;
+} consumer_t;
+
+static void consume(const flog_t *l, consumer_t *c)
+{
+    flog_record_t recs[READ_MAX];
+    double start = now_s();
+    for (;;) {
+        int n = flog_read(l, &c->cursor, recs, READ_MAX);
+        n += flog_read_ram(l, &c->cursor, recs + n, READ_MAX - n);
+        if (n == 0) {
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            const flog_record_t *r = &recs[i];
+            if (r->temp_dc != expect_temp(r->boot, r->device_id, r->t_s)
+                || r->humidity != expect_humidity(r->device_id, r->t_s)
+                || r->fields != (READING_HAS_TEMP | READING_HAS_HUMIDITY | READING_HAS_BATTERY)) {
+                c->mismatches++;
+            }
+            // Within a boot records are appended in (t_s, device) order.
+            if (c->any
+                && (r->boot < c->last_boot
+                    || (r->boot == c->last_boot
+                        && (r->t_s < c->last_t_s || (r->t_s == c->last_t_s && r->device_id <= c->last_device))))) {
+                c->out_of_order++;
+            }
+            c->last_boot = r->boot;
+            c->last_t_s = r->t_s;
+            c->last_device = r->device_id;
+            c->any = true;
+            c->received++;
+        }
+    }
+    g_read_s += now_s() - start;
+}
+
+static void flush(flog_t *l, uint32_t now_ms, uint32_t *flush_ms, bool force)
+{
+    uint8_t page[FLOG_PAGE_SIZE];
+    uint32_t seq;
+    double start = now_s();
+    while (flog_take_page(l, force || now_ms - *flush_ms >= LOG_MAX_BUFFER_MS, page, &seq)) {
+        flog_write_page(l, seq, page);
+        *flush_ms = now_ms;
+    }
+    g_flush_s += now_s() - start;
+}
+
+static bool mount(flog_t *l)
+{
+    const flog_flash_t flash = {
+        .read = ram_read,
+        .write = ram_write,
+        .erase = ram_erase,
+        .arg = &g_flash,
+        .size = g_flash.size,
+    };
+    double start = now_s();
+    bool ok = flog_mount(l, &flash);
+    g_mount_s += now_s() - start;
+    return ok;
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t sectors = 16;
+    uint32_t devices = 40;
+    uint32_t minutes = 7 * 24 * 60;
+    uint32_t reboots = 6;
+    uint32_t pause = 180;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:d:m:r:p:")) != -1) {
+        switch (opt) {
+            case 's':
+                sectors = (uint32_t) strtoul(optarg, NULL, 0);
+                break;
+            case 'd':
+                devices = (uint32_t) strtoul(optarg, NULL, 0);
+                break;
+            case 'm':
+                minutes = (uint32_t) strtoul(optarg, NULL, 0);
+                break;
+            case 'r':
+                reboots = (uint32_t) strtoul(optarg, NULL, 0);
+                break;
+            case 'p':
+                pause = (uint32_t) strtoul(optarg, NULL, 0);
+                break;
+            default:
+                fprintf(stderr, "usage: sbflashsim [-s sectors] [-d devices] [-m minutes] [-r reboots] [-p pause]\n");
+                return 2;
+        }
+    }
+    if (sectors < 2 || devices == 0 || devices > 60 || minutes == 0) {
+        fprintf(stderr, "sbflashsim: need at least 2 sectors, 1 to 60 devices and 1 minute\n");
+        return 2;
+    }
+
+    g_flash.size = sectors * FLOG_SECTOR_SIZE;
+    g_flash.mem = malloc(g_flash.size);
+    g_flash.sector_erases = calloc(sectors, sizeof(uint32_t));
+    if (!g_flash.mem || !g_flash.sector_erases) {
+        perror("malloc");
+        return 1;
+    }
+    memset(g_flash.mem, 0xFF, g_flash.size);
+
+    static flog_t log;
+    if (!mount(&log)) {
+        fprintf(stderr, "sbflashsim: mount failed\n");
+        return 1;
+    }
+
+    consumer_t consumer = { 0 };
+    uint64_t appended = 0;
+    uint64_t dropped = 0;
+    uint64_t crash_lost = 0;
+    uint32_t pages_written = 0;
+    uint32_t payload_bytes = 0;
+    uint32_t boot_start_s = 0; // simulated time at which the current boot began
+    uint32_t flush_ms = 0;
+    uint32_t next_reboot = 1;
+    uint32_t pause_from = minutes / 2;
+
+    // Each device reports at its own second within the minute.
+    uint32_t total_s = minutes * 60;
+    for (uint32_t t = 0; t < total_s; t++) {
+        uint32_t t_boot = t - boot_start_s;
+        uint32_t sec = t % 60;
+
+        double start = now_s();
+        for (uint32_t d = 0; d < devices; d++) {
+            if (d * 60 / devices != sec) {
+                continue;
+            }
+            const flog_record_t rec = {
+                .t_s = t_boot,
+                .device_id = (uint16_t) (d + 1),
+                .vendor = 1,
+                .fields = READING_HAS_TEMP | READING_HAS_HUMIDITY | READING_HAS_BATTERY,
+                .temp_dc = expect_temp(log.boot, (uint16_t) (d + 1), t_boot),
+                .humidity = expect_humidity((uint16_t) (d + 1), t_boot),
+                .battery = 90,
+            };
+            flog_append(&log, &rec);
+            appended++;
+        }
+        g_append_s += now_s() - start;
+
+        flush(&log, t_boot * 1000 + TICK_MS, &flush_ms, false);
+
+        uint32_t minute = t / 60;
+        if (sec == 59 && minute % READ_EVERY_MIN == READ_EVERY_MIN - 1
+            && (minute < pause_from || minute >= pause_from + pause)) {
+            consume(&log, &consumer);
+        }
+
+        // Uneven boot lengths, so a crash catches a partly filled page.
+        if (next_reboot <= reboots && t + 1 == total_s / (reboots + 1) * next_reboot - 413 + 97 * next_reboot) {
+            bool crash = next_reboot % 2 == 0;
+            if (crash) {
+                crash_lost += log.fill_count + (log.have_pending ? log.pending_count : 0);
+            } else {
+                flush(&log, t_boot * 1000 + TICK_MS, &flush_ms, true);
+            }
+            dropped += log.stats.dropped;
+            pages_written += log.stats.pages_written;
+            payload_bytes += log.stats.payload_bytes;
+            uint16_t old_boot = log.boot;
+            if (!mount(&log)) {
+                fprintf(stderr, "sbflashsim: remount failed\n");
+                return 1;
+            }
+            printf("reboot %u at minute %u (%s): boot %u -> %u, %u pages on flash\n", (unsigned) next_reboot,
+                (unsigned) (minute + 1), crash ? "crash" : "clean", (unsigned) old_boot, (unsigned) log.boot,
+                (unsigned) flog_pages_used(&log));
+            boot_start_s = t + 1;
+            flush_ms = 0;
+            next_reboot++;
+        }
+    }
+    flush(&log, (total_s - boot_start_s) * 1000, &flush_ms, true);
+    consume(&log, &consumer);
+    dropped += log.stats.dropped;
+    pages_written += log.stats.pages_written;
+    payload_bytes += log.stats.payload_bytes;
+
+    uint32_t min_wear = UINT32_MAX;
+    uint32_t max_wear = 0;
+    for (uint32_t s = 0; s < sectors; s++) {
+        if (g_flash.sector_erases[s] < min_wear) {
+            min_wear = g_flash.sector_erases[s];
+        }
+        if (g_flash.sector_erases[s] > max_wear) {
+            max_wear = g_flash.sector_erases[s];
+        }
+    }
+
+    printf("\npartition: %u sectors, %u pages, %u records/page\n", (unsigned) sectors,
+        (unsigned) (g_flash.size / FLOG_PAGE_SIZE), (unsigned) FLOG_RECS_PER_PAGE);
+    printf("records: appended=%llu dropped=%llu lost_in_crash=%llu received=%u not_received=%llu\n",
+        (unsigned long long) appended, (unsigned long long) dropped, (unsigned long long) crash_lost,
+        (unsigned) consumer.received, (unsigned long long) (appended - consumer.received));
+    printf("check: mismatches=%u out_of_order=%u nor_violations=%u\n", (unsigned) consumer.mismatches,
+        (unsigned) consumer.out_of_order, (unsigned) g_flash.violations);
+    printf("flash: pages_written=%u erases=%u programmed=%llu payload=%u read=%llu\n", (unsigned) pages_written,
+        (unsigned) g_flash.erases, (unsigned long long) g_flash.bytes_programmed, (unsigned) payload_bytes,
+        (unsigned long long) g_flash.bytes_read);
+    if (payload_bytes > 0) {
+        printf("write amplification: %.3f programmed/payload, %.3f (programmed+erased)/payload\n",
+            (double) g_flash.bytes_programmed / payload_bytes,
+            (double) (g_flash.bytes_programmed + g_flash.bytes_erased) / payload_bytes);
+    }
+    printf("wear: %.1f pages per erase, sector erases min=%u max=%u\n",
+        g_flash.erases ? (double) pages_written / g_flash.erases : 0.0, (unsigned) min_wear, (unsigned) max_wear);
+    printf("throughput: append %.1f M records/s, flush %.1f MB/s, read %.1f M records/s, mount %.1f us\n",
+        g_append_s > 0 ? appended / g_append_s / 1e6 : 0.0,
+        g_flush_s > 0 ? g_flash.bytes_programmed / g_flush_s / 1e6 : 0.0,
+        g_read_s > 0 ? consumer.received / g_read_s / 1e6 : 0.0, g_mount_s * 1e6 / (reboots + 1));
+
+    free(g_flash.mem);
+    free(g_flash.sector_erases);
+    return consumer.mismatches == 0 && consumer.out_of_order == 0 && g_flash.violations == 0 ? 0 : 1;
+}
@@ -0,0 +1,594 @@
+// Drives the GATT command client (ports/switchbot_gatt.c) against a
+// simulated BLE stack and a set of SwitchBot Bots, and reports latency and
+// connection reuse.
+//
+// Build from the repository root:
+//
+//     cc -O2 -Wall -Iports/include -o sbgattsim tools/sbgattsim.c ports/switchbot_gatt.c
+//
+// Usage:
+//
+//     sbgattsim [-d devices] [-t seconds] [-g gap_ms] [-i idle_ms] [-q queue_len] [-s seed]
+//
+// Presses arrive on average every `gap_ms` for `seconds` of simulated time,
+// spread over `devices` Bots with a few of them much busier than the rest,
+// and a third of them come as a quick burst of two or three presses to the
+// same Bot. With more devices than GATT_CONN_MAX this exercises eviction of
+// the least recently used connection, and bursts exercise per-device
+// queueing and writes on several connections at once.
+//
+// The simulated stack implements gatt_ops_t with randomized connect,
+// discovery and write delays, failed connects and writes, peer disconnects
+// (supervision timeouts) and connection handles that are reused once a
+// disconnect completed, as NimBLE does. Halfway through, Bot 0 gets a
+// firmware update: it reboots and its command characteristic moves, so the
+// handle cached for it goes stale and the first write on the next
+// connection fails.
+//
+// The harness checks that every command finishes exactly once and in order
+// per device, that at most one connect is pending at the stack and that
+// the client never uses a connection after its disconnect was reported; a
+// violation makes the exit status 1.
+
+#define _DEFAULT_SOURCE
+
+#include "switchbot_gatt.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MAX_DEVICES 32
+#define MAX_EVENTS 4096
+#define MAX_CONNS 8 // controller connection handles
+#define MAX_CMDS 65536 // seq is 16 bits
+
+#define TICK_MS 1000 // PRESENCE_TICK_MS, which drives gatt_tick
+#define HANDLE_BEFORE 0x0016
+#define HANDLE_AFTER 0x0019
+
+// Simulated link, in ms: base + uniform jitter.
+#define CONNECT_MS 450
+#define CONNECT_JITTER_MS 600
+#define DISCOVER_MS 250
+#define DISCOVER_JITTER_MS 200
+#define WRITE_MS 40
+#define WRITE_JITTER_MS 60
+#define DISCONNECT_MS 30
+#define CONNECT_FAIL_PCT 5
+#define WRITE_FAIL_PCT 2
+#define PEER_DROP_MEAN_MS (180 * 1000)
+
+enum
+{
+    EV_PRESS = 1,
+    EV_CONNECTED,
+    EV_DISCOVERED,
+    EV_WRITTEN,
+    EV_PEER_DROP,
+    EV_DISCONNECTED,
+    EV_FIRMWARE,
+    EV_TICK
+};
+
+typedef struct
+{
+    uint32_t at;
+    uint8_t kind;
+    uint8_t dev;
+    uint16_t conn;
+    uint32_t gen; // connection generation the event belongs to
+    bool ok;
+    bool follow; // EV_PRESS: part of a burst, does not schedule the next press
+} sim_event_t;
+
+typedef struct
+{
+    bool in_use; // handle allocated, until the disconnect completed
+    bool open; // usable for discovery and writes
+    uint8_t dev;
+    uint32_t gen;
+} sim_conn_t;
+
+typedef struct
+{
+    uint8_t addr[6];
+    uint16_t handle; // current command characteristic
+    uint32_t weight;
+    int32_t last_seq; // last finished command, for the order check
+} sim_device_t;
+
+typedef struct
+{
+    uint8_t dev;
+    bool submitted;
+    bool done;
+} sim_cmd_t;
+
+static sim_event_t g_events[MAX_EVENTS];
+static int g_n_events;
+static sim_conn_t g_conns[MAX_CONNS];
+static uint32_t g_conn_gen;
+static sim_device_t g_devices[MAX_DEVICES];
+static int g_n_devices;
+static sim_cmd_t g_cmds[MAX_CMDS];
+static uint32_t g_latencies[MAX_CMDS];
+static int g_n_latencies;
+static uint32_t g_rng = 0x2545F491;
+static uint32_t g_now;
+static bool g_connect_pending;
+
+static gatt_client_t g_client;
+
+static struct
+{
+    uint32_t presses;
+    uint32_t rejected_busy;
+    uint32_t rejected_full;
+    uint32_t connect_failures;
+    uint32_t write_failures;
+    uint32_t stale_handle_writes;
+    uint32_t peer_drops;
+    uint32_t max_open;
+    uint32_t max_writing;
+    uint32_t status[5];
+    uint32_t violations;
+} g_sim;
+
+static uint32_t rnd(void)
+{
+    g_rng ^= g_rng << 13;
+    g_rng ^= g_rng >> 17;
+    g_rng ^= g_rng << 5;
+    return g_rng;
+}
+
+static uint32_t jitter(uint32_t base, uint32_t spread)
+{
+    return base + rnd() % (spread + 1);
+}
+
+// Roughly exponential with the given mean, capped at 8x.
+static uint32_t exp_delay(uint32_t mean)
+{
+    uint32_t d = 0;
+    while (rnd() % 8 != 0 && d < 7 * mean) {
+        d += mean / 7;
+    }
+    return d + rnd() % (mean / 7 + 1);
+}
+
+static void violation(const char *what)
+{
+    g_sim.violations++;
+    if (g_sim.violations <= 10) {
+        printf("violation at %u ms: %s\n", (unsigned) g_now, what);
+    }
+}
+
+static void schedule(sim_event_t ev)
+{
+    if (g_n_events == MAX_EVENTS) {
+        violation("simulator event queue full");
+        return;
+    }
+    g_events[g_n_events++] = ev;
+}
+
+// Earliest event, first scheduled first among equal times.
+static bool next_event(sim_event_t *out)
+{
+    if (g_n_events == 0) {
+        return false;
+    }
+    int best = 0;
+    for (int i = 1; i < g_n_events; i++) {
+        if ((int32_t) (g_events[i].at - g_events[best].at) < 0) {
+            best = i;
+        }
+    }
+    *out = g_events[best];
+    memmove(&g_events[best], &g_events[best + 1], (size_t) (g_n_events - best - 1) * sizeof(g_events[0]));
+    g_n_events--;
+    return true;
+}
+
+static int device_by_addr(const uint8_t addr[6])
+{
+    for (int i = 0; i < g_n_devices; i++) {
+        if (memcmp(g_devices[i].addr, addr, 6) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static sim_conn_t *conn_open(uint16_t conn)
+{
+    return conn < MAX_CONNS && g_conns[conn].open ? &g_conns[conn] : NULL;
+}
+
+// A link the peer dropped stays allocated until its disconnect event, and
+// requests on it fail like NimBLE's BLE_HS_ENOTCONN. Anything else is the
+// client using a handle it was never given or was told is gone.
+static bool conn_known(uint16_t conn, const char *what)
+{
+    if (conn >= MAX_CONNS || !g_conns[conn].in_use) {
+        violation(what);
+        return false;
+    }
+    return true;
+}
+
+// Closes a connection; the stack reports the disconnect a little later.
+static void conn_close(uint16_t conn)
+{
+    g_conns[conn].open = false;
+    g_conns[conn].gen = ++g_conn_gen;
+    schedule((sim_event_t) { .at = g_now + DISCONNECT_MS, .kind = EV_DISCONNECTED, .conn = conn });
+}
+
+// ----- gatt_ops_t -----
+
+static int sim_connect(void *arg, const uint8_t addr[6], uint8_t addr_type)
+{
+    (void) arg;
+    (void) addr_type;
+    int dev = device_by_addr(addr);
+    if (dev < 0) {
+        violation("connect to an unknown address");
+        return -1;
+    }
+    if (g_connect_pending) {
+        violation("second connect while one is pending");
+        return -1;
+    }
+    g_connect_pending = true;
+    bool ok = rnd() % 100 >= CONNECT_FAIL_PCT;
+    schedule((sim_event_t) { .at = g_now + jitter(CONNECT_MS, CONNECT_JITTER_MS), .kind = EV_CONNECTED,
+        .dev = (uint8_t) dev, .ok = ok });
+    return 0;
+}
+
+static int sim_disconnect(void *arg, uint16_t conn)
+{
+    (void) arg;
+    if (!conn_known(conn, "disconnect of a released connection") || !conn_open(conn)) {
+        return -1;
+    }
+    conn_close(conn);
+    return 0;
+}
+
+static int sim_discover(void *arg, uint16_t conn)
+{
+    (void) arg;
+    sim_conn_t *sc = conn_known(conn, "discovery on a released connection") ? conn_open(conn) : NULL;
+    if (!sc) {
+        return -1;
+    }
+    schedule((sim_event_t) { .at = g_now + jitter(DISCOVER_MS, DISCOVER_JITTER_MS), .kind = EV_DISCOVERED,
+        .dev = sc->dev, .conn = conn, .gen = sc->gen });
+    return 0;
+}
+
+static int sim_write(void *arg, uint16_t conn, uint16_t handle, const uint8_t *data, uint8_t len)
+{
+    (void) arg;
+    (void) data;
+    (void) len;
+    sim_conn_t *sc = conn_known(conn, "write on a released connection") ? conn_open(conn) : NULL;
+    if (!sc) {
+        return -1;
+    }
+    bool ok = true;
+    if (handle != g_devices[sc->dev].handle) {
+        g_sim.stale_handle_writes++;
+        ok = false;
+    } else if (rnd() % 100 < WRITE_FAIL_PCT) {
+        g_sim.write_failures++;
+        ok = false;
+    }
+    schedule((sim_event_t) { .at = g_now + jitter(WRITE_MS, WRITE_JITTER_MS), .kind = EV_WRITTEN, .dev = sc->dev,
+        .conn = conn, .gen = sc->gen, .ok = ok });
+    return 0;
+}
+
+// ----- Harness -----
+
+static void check_results(const gatt_result_t *done, int n)
+{
+    for (int i = 0; i < n; i++) {
+        const gatt_result_t *r = &done[i];
+        sim_cmd_t *cmd = &g_cmds[r->seq];
+        int dev = device_by_addr(r->addr);
+        if (!cmd->submitted || cmd->done || dev != cmd->dev) {
+            violation("result for a command not outstanding on that device");
+            continue;
+        }
+        if ((int32_t) r->seq <= g_devices[dev].last_seq) {
+            violation("results of a device out of order");
+        }
+        g_devices[dev].last_seq = r->seq;
+        cmd->done = true;
+        if (r->status < 5) {
+            g_sim.status[r->status]++;
+        }
+        if (r->status == GATT_STATUS_OK) {
+            g_latencies[g_n_latencies++] = r->latency_ms;
+        }
+    }
+
+    uint32_t writing = 0;
+    for (int i = 0; i < GATT_CONN_MAX; i++) {
+        writing += g_client.slot[i].state == GATT_SLOT_WRITING;
+    }
+    if (writing > g_sim.max_writing) {
+        g_sim.max_writing = writing;
+    }
+    uint32_t open = 0;
+    for (int i = 0; i < MAX_CONNS; i++) {
+        open += g_conns[i].open;
+    }
+    if (open > g_sim.max_open) {
+        g_sim.max_open = open;
+    }
+    if (open > GATT_CONN_MAX) {
+        violation("more connections open than GATT_CONN_MAX");
+    }
+}
+
+static int pick_device(void)
+{
+    uint32_t total = 0;
+    for (int i = 0; i < g_n_devices; i++) {
+        total += g_devices[i].weight;
+    }
+    uint32_t r = rnd() % total;
+    for (int i = 0; i < g_n_devices; i++) {
+        if (r < g_devices[i].weight) {
+            return i;
+        }
+        r -= g_devices[i].weight;
+    }
+    return g_n_devices - 1;
+}
+
+static void press(uint8_t dev, gatt_result_t *done)
+{
+    static const uint8_t cmd_press[] = { 0x57, 0x01, 0x00 };
+    uint16_t seq;
+    int n = 0;
+    g_sim.presses++;
+    int rc = gatt_submit(&g_client, g_devices[dev].addr, 1, cmd_press, sizeof(cmd_press), g_now, &seq, done, &n);
+    if (rc == GATT_EBUSY) {
+        g_sim.rejected_busy++;
+    } else if (rc == GATT_EQUEUE_FULL) {
+        g_sim.rejected_full++;
+    } else {
+        if (g_cmds[seq].submitted) {
+            violation("seq reused");
+        }
+        g_cmds[seq] = (sim_cmd_t) { .dev = dev, .submitted = true };
+    }
+    check_results(done, n);
+}
+
+static void handle_event(const sim_event_t *ev, uint32_t end_ms, uint32_t gap_ms, uint32_t idle_ms,
+    gatt_result_t *done)
+{
+    int n = 0;
+    switch (ev->kind) {
+        case EV_PRESS: {
+            press(ev->dev, done);
+            if (!ev->follow && g_now < end_ms) {
+                if (rnd() % 3 == 0) {
+                    int extra = 1 + (int) (rnd() % 2);
+                    for (int i = 1; i <= extra; i++) {
+                        schedule((sim_event_t) { .at = g_now + (uint32_t) i * jitter(100, 150), .kind = EV_PRESS,
+                            .dev = ev->dev, .follow = true });
+                    }
+                }
+                schedule((sim_event_t) { .at = g_now + exp_delay(gap_ms), .kind = EV_PRESS,
+                    .dev = (uint8_t) pick_device() });
+            }
+            return;
+        }
+        case EV_CONNECTED: {
+            g_connect_pending = false;
+            uint16_t conn = GATT_NO_CONN;
+            if (ev->ok) {
+                for (uint16_t i = 0; i < MAX_CONNS; i++) {
+                    if (!g_conns[i].in_use) {
+                        conn = i;
+                        break;
+                    }
+                }
+            }
+            if (conn == GATT_NO_CONN) {
+                g_sim.connect_failures++;
+                gatt_on_connect(&g_client, false, 0, g_now, done, &n);
+            } else {
+                g_conns[conn] = (sim_conn_t) { .in_use = true, .open = true, .dev = ev->dev, .gen = ++g_conn_gen };
+                schedule((sim_event_t) { .at = g_now + exp_delay(PEER_DROP_MEAN_MS), .kind = EV_PEER_DROP,
+                    .conn = conn, .gen = g_conns[conn].gen });
+                gatt_on_connect(&g_client, true, conn, g_now, done, &n);
+            }
+            break;
+        }
+        case EV_DISCOVERED:
+            if (!conn_open(ev->conn) || g_conns[ev->conn].gen != ev->gen) {
+                return;
+            }
+            gatt_on_discovered(&g_client, ev->conn, g_devices[ev->dev].handle, g_now, done, &n);
+            break;
+        case EV_WRITTEN:
+            if (!conn_open(ev->conn) || g_conns[ev->conn].gen != ev->gen) {
+                return;
+            }
+            gatt_on_write(&g_client, ev->conn, ev->ok, g_now, done, &n);
+            break;
+        case EV_PEER_DROP:
+            if (!conn_open(ev->conn) || g_conns[ev->conn].gen != ev->gen) {
+                return;
+            }
+            g_sim.peer_drops++;
+            conn_close(ev->conn);
+            return;
+        case EV_DISCONNECTED:
+            g_conns[ev->conn].in_use = false;
+            gatt_on_disconnect(&g_client, ev->conn, g_now, done, &n);
+            break;
+        case EV_FIRMWARE:
+            g_devices[ev->dev].handle = HANDLE_AFTER;
+            for (uint16_t i = 0; i < MAX_CONNS; i++) {
+                if (g_conns[i].open && g_conns[i].dev == ev->dev) {
+                    conn_close(i);
+                }
+            }
+            printf("firmware update of bot 0 at %u s: handle 0x%04X -> 0x%04X\n", (unsigned) (g_now / 1000),
+                HANDLE_BEFORE, HANDLE_AFTER);
+            return;
+        case EV_TICK:
+            gatt_tick(&g_client, g_now, idle_ms);
+            if (g_now < end_ms || g_n_events > 0) {
+                schedule((sim_event_t) { .at = g_now + TICK_MS, .kind = EV_TICK });
+            }
+            break;
+    }
+    check_results(done, n);
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *) a;
+    uint32_t y = *(const uint32_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+static uint32_t percentile(int pct)
+{
+    if (g_n_latencies == 0) {
+        return 0;
+    }
+    int i = (int) ((int64_t) g_n_latencies * pct / 100);
+    return g_latencies[i < g_n_latencies ? i : g_n_latencies - 1];
+}
+
+int main(int argc, char **argv)
+{
+    int devices = 6;
+    uint32_t seconds = 3600;
+    uint32_t gap_ms = 4000;
+    uint32_t idle_ms = 30000; // GATT_IDLE_MS
+    int queue_len = GATT_QUEUE_DEFAULT;
+    int opt;
+    while ((opt = getopt(argc, argv, "d:t:g:i:q:s:")) != -1) {
+        switch (opt) {
+            case 'd':
+                devices = atoi(optarg);
+                break;
+            case 't':
+                seconds = (uint32_t) strtoul(optarg, NULL, 0);
+                break;
+            case 'g':
+                gap_ms = (uint32_t) strtoul(optarg, NULL, 0);
+                break;
+            case 'i':
+                idle_ms = (uint32_t) strtoul(optarg, NULL, 0);
+                break;
+            case 'q':
+                queue_len = atoi(optarg);
+                break;
+            case 's':
+                g_rng = (uint32_t) strtoul(optarg, NULL, 0);
+                if (g_rng == 0) {
+                    g_rng = 1;
+                }
+                break;
+            default:
+                fprintf(stderr,
+                    "usage: sbgattsim [-d devices] [-t seconds] [-g gap_ms] [-i idle_ms] [-q queue_len] [-s seed]\n");
+                return 2;
+        }
+    }
+    if (devices < 1 || devices > MAX_DEVICES || queue_len < 1 || queue_len > GATT_QUEUE_MAX || gap_ms < 7
+        || seconds == 0 || seconds > 24 * 3600) {
+        fprintf(stderr, "sbgattsim: need 1 to %d devices, a queue of 1 to %d, gap >= 7 ms, up to a day\n",
+            MAX_DEVICES, GATT_QUEUE_MAX);
+        return 2;
+    }
+
+    g_n_devices = devices;
+    for (int i = 0; i < devices; i++) {
+        sim_device_t *d = &g_devices[i];
+        const uint8_t addr[6] = { 0xC1, 0x5B, 0x7A, 0x10, 0x00, (uint8_t) i };
+        memcpy(d->addr, addr, 6);
+        d->handle = HANDLE_BEFORE;
+        d->weight = 60 / (uint32_t) (i + 1); // a few busy Bots, a long tail
+        d->last_seq = -1;
+    }
+
+    static gatt_cmd_t cmds[GATT_CONN_MAX * GATT_QUEUE_MAX];
+    static gatt_result_t done[GATT_CONN_MAX * GATT_QUEUE_MAX];
+    const gatt_ops_t ops = {
+        .connect = sim_connect,
+        .disconnect = sim_disconnect,
+        .discover = sim_discover,
+        .write = sim_write,
+    };
+    gatt_init(&g_client, &ops, cmds, (uint8_t) queue_len);
+
+    uint32_t end_ms = seconds * 1000;
+    schedule((sim_event_t) { .at = 0, .kind = EV_PRESS, .dev = (uint8_t) pick_device() });
+    schedule((sim_event_t) { .at = TICK_MS, .kind = EV_TICK });
+    schedule((sim_event_t) { .at = end_ms / 2, .kind = EV_FIRMWARE, .dev = 0 });
+
+    sim_event_t ev;
+    while (next_event(&ev)) {
+        g_now = ev.at;
+        handle_event(&ev, end_ms, gap_ms, idle_ms, done);
+        if (g_sim.presses >= MAX_CMDS - 1) {
+            violation("too many presses for 16-bit seq, shorten the run");
+            break;
+        }
+    }
+
+    uint32_t outstanding = 0;
+    for (int i = 0; i < MAX_CMDS; i++) {
+        if (g_cmds[i].submitted && !g_cmds[i].done) {
+            outstanding++;
+        }
+    }
+    if (outstanding > 0) {
+        violation("commands never finished");
+    }
+
+    qsort(g_latencies, (size_t) g_n_latencies, sizeof(g_latencies[0]), cmp_u32);
+    const gatt_stats_t *st = &g_client.stats;
+    printf("\n%d bots, %u s, a press every %u ms on average, idle close after %u ms, queue %d\n", devices,
+        (unsigned) seconds, (unsigned) gap_ms, (unsigned) idle_ms, queue_len);
+    printf("presses=%u rejected_busy=%u rejected_queue_full=%u outstanding=%u\n", (unsigned) g_sim.presses,
+        (unsigned) g_sim.rejected_busy, (unsigned) g_sim.rejected_full, (unsigned) outstanding);
+    printf("client: submitted=%u completed=%u failed=%u connects=%u reused=%u discoveries=%u handle_hits=%u "
+           "evictions=%u\n",
+        (unsigned) st->submitted, (unsigned) st->completed, (unsigned) st->failed, (unsigned) st->connects,
+        (unsigned) st->reused, (unsigned) st->discoveries, (unsigned) st->handle_hits, (unsigned) st->evictions);
+    printf("status: ok=%u connect_failed=%u no_characteristic=%u write_failed=%u disconnected=%u\n",
+        (unsigned) g_sim.status[GATT_STATUS_OK], (unsigned) g_sim.status[GATT_STATUS_CONNECT_FAILED],
+        (unsigned) g_sim.status[GATT_STATUS_NO_CHARACTERISTIC], (unsigned) g_sim.status[GATT_STATUS_WRITE_FAILED],
+        (unsigned) g_sim.status[GATT_STATUS_DISCONNECTED]);
+    printf("stack: connect_failures=%u write_failures=%u stale_handle_writes=%u peer_drops=%u max_open=%u "
+           "max_writing=%u\n",
+        (unsigned) g_sim.connect_failures, (unsigned) g_sim.write_failures, (unsigned) g_sim.stale_handle_writes,
+        (unsigned) g_sim.peer_drops, (unsigned) g_sim.max_open, (unsigned) g_sim.max_writing);
+    printf("latency ms: mean=%.0f p50=%u p90=%u p99=%u max=%u\n",
+        st->completed ? (double) st->latency_ms_sum / st->completed : 0.0, (unsigned) percentile(50),
+        (unsigned) percentile(90), (unsigned) percentile(99), (unsigned) st->latency_ms_max);
+    printf("reuse: %.1f%% of commands skipped the connect, %.1f%% of connects skipped discovery\n",
+        st->submitted ? 100.0 * st->reused / st->submitted : 0.0,
+        st->connects ? 100.0 * st->handle_hits / st->connects : 0.0);
+    printf("violations=%u\n", (unsigned) g_sim.violations);
+    return g_sim.violations == 0 ? 0 : 1;
+}
@@ -0,0 +1,437 @@
+// Feeds a synthetic stream of meter readings through the per-device
+// aggregates (ports/switchbot_agg.c) and the delta-compressed history
+// (ports/switchbot_history.c), checks both against the stream and reports
+// compression, retention and cost.
+//
+// Build from the repository root:
+//
+//     cc -O2 -Wall -Iports/include -o sbhistsim tools/sbhistsim.c ports/switchbot_agg.c ports/switchbot_history.c -lm
+//
+// Usage:
+//
+//     sbhistsim [-d devices] [-h hours] [-b blocks] [-s seed]
+//
+// Each meter advertises every 5 to 15 seconds and one advert in ten is
+// missed. Indoor meters drift slowly around a daily cycle, every fourth one
+// is outdoors with a wider swing, humidity wanders and batteries run down;
+// meters now and then drop out for 20 to 90 minutes. As in the driver every
+// decoded reading goes to the aggregates and at most one per
+// HIST_MIN_INTERVAL_S to the history, whose pool has `blocks` blocks
+// (HIST_POOL_BLOCKS by default).
+//
+// The aggregates run twice, with the default windows (tumbling 5 min and
+// 1 h) and with sliding 10 min and 1 h windows, and are read back at
+// irregular times: every count, min, max and sum must equal what the stream
+// gives for the span agg_read documents. At the end each device's history
+// is read back page by page and must equal the newest samples appended for
+// it. A mismatch makes the exit status 1.
+
+#define _DEFAULT_SOURCE
+
+#include "sensor_reading.h"
+#include "switchbot_agg.h"
+#include "switchbot_history.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_DEVICES 64
+#define RING_LEN 2048 // readings per device, covers two hours at one per 5 s
+#define CHECK_EVERY_S 97
+#define READ_PAGE 64
+#define KEYFRAME_LEN 8
+// Size record_history counts a meter reading as: addr, type, rssi, svc
+// length and payload, mfg length and payload.
+#define RAW_FRAME_LEN (6 + 1 + 1 + 3 + 1 + 13)
+
+typedef struct
+{
+    uint32_t t_s;
+    int16_t temp_dc;
+    uint8_t humidity;
+} reading_t;
+
+typedef struct
+{
+    // stream
+    uint32_t next_s;
+    uint32_t offline_until_s;
+    double base;
+    double swing;
+    double drift;
+    double humidity;
+    uint8_t battery;
+
+    // ground truth
+    reading_t ring[RING_LEN];
+    uint32_t n_ring;
+    hist_sample_t *appended;
+    uint32_t n_appended;
+
+    agg_device_t agg[2];
+    hist_device_t hist;
+} device_t;
+
+static device_t g_dev[MAX_DEVICES];
+static uint32_t g_rng = 0x9E3779B9;
+
+static struct
+{
+    uint64_t readings;
+    uint64_t missed;
+    uint32_t dropouts;
+    uint64_t agg_checks;
+    uint64_t agg_mismatches;
+    uint32_t hist_mismatches;
+    double agg_s;
+    double hist_s;
+    double read_s;
+    uint64_t read_samples;
+} g_st;
+
+static uint32_t rnd(void)
+{
+    g_rng ^= g_rng << 13;
+    g_rng ^= g_rng >> 17;
+    g_rng ^= g_rng << 5;
+    return g_rng;
+}
+
+static double unit(void)
+{
+    return (double) rnd() / 4294967296.0;
+}
+
+static double now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+// Cost of the now_s() pair around each timed call, subtracted from the totals.
+static double clock_overhead_s(void)
+{
+    double start = now_s();
+    for (int i = 0; i < 100000; i++) {
+        now_s();
+    }
+    return (now_s() - start) / 100000;
+}
+
+static void stat_add(agg_stat_t *s, int16_t v)
+{
+    if (s->count == 0 || v < s->min) {
+        s->min = v;
+    }
+    if (s->count == 0 || v > s->max) {
+        s->max = v;
+    }
+    s->count++;
+    s->sum += v;
+}
+
+// Stats of the readings with from_s <= t_s < to_s.
+static void expect_span(const device_t *d, uint32_t from_s, uint32_t to_s, agg_stat_t *out)
+{
+    memset(out, 0, sizeof(agg_stat_t) * AGG_METRIC_COUNT);
+    uint32_t n = d->n_ring < RING_LEN ? d->n_ring : RING_LEN;
+    for (uint32_t i = 0; i < n; i++) {
+        const reading_t *r = &d->ring[(d->n_ring - 1 - i) % RING_LEN];
+        if (r->t_s < from_s) {
+            break;
+        }
+        if (r->t_s < to_s) {
+            stat_add(&out[AGG_METRIC_TEMP], r->temp_dc);
+            stat_add(&out[AGG_METRIC_HUMIDITY], r->humidity);
+        }
+    }
+}
+
+// The span agg_read covers: the last completed aligned window (tumbling) or
+// the trailing AGG_SLOTS sub-buckets including the current one (sliding).
+static void expect_window(const device_t *d, const agg_window_cfg_t *c, uint32_t now, agg_stat_t *out)
+{
+    if (c->mode == AGG_MODE_SLIDING) {
+        uint32_t len = c->window_s / AGG_SLOTS > 0 ? c->window_s / AGG_SLOTS : 1;
+        uint32_t epoch = now / len;
+        uint32_t from = epoch >= AGG_SLOTS - 1 ? (epoch - (AGG_SLOTS - 1)) * len : 0;
+        expect_span(d, from, now + 1, out);
+    } else {
+        uint32_t epoch = now / c->window_s;
+        expect_span(d, epoch > 0 ? (epoch - 1) * c->window_s : 0, epoch > 0 ? epoch * c->window_s : 0, out);
+    }
+}
+
+static bool same_stat(const agg_stat_t *a, const agg_stat_t *b)
+{
+    if (a->count != b->count) {
+        return false;
+    }
+    return a->count == 0 || (a->min == b->min && a->max == b->max && a->sum == b->sum);
+}
+
+static void check_agg(int n_dev, const agg_config_t *cfg, uint32_t now)
+{
+    for (int i = 0; i < n_dev; i++) {
+        device_t *d = &g_dev[i];
+        for (int k = 0; k < 2; k++) {
+            for (int w = 0; w < AGG_MAX_WINDOWS; w++) {
+                agg_stat_t got[AGG_METRIC_COUNT];
+                agg_stat_t want[AGG_METRIC_COUNT];
+                agg_read(&d->agg[k], &cfg[k], w, now, got);
+                expect_window(d, &cfg[k].win[w], now, want);
+                g_st.agg_checks++;
+                for (int m = 0; m < AGG_METRIC_COUNT; m++) {
+                    if (!same_stat(&got[m], &want[m])) {
+                        if (g_st.agg_mismatches++ < 5) {
+                            printf("agg mismatch: dev %d config %d window %d metric %d at %u s: count %u/%u "
+                                   "sum %d/%d\n",
+                                i, k, w, m, (unsigned) now, (unsigned) got[m].count, (unsigned) want[m].count,
+                                (int) got[m].sum, (int) want[m].sum);
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+// Next reading of a meter, or false while it is out of range.
+static bool next_reading(device_t *d, int idx, uint32_t t, sensor_reading_t *r)
+{
+    if (t < d->offline_until_s) {
+        return false;
+    }
+    if (rnd() % 2000 == 0) {
+        d->offline_until_s = t + 20 * 60 + rnd() % (70 * 60);
+        g_st.dropouts++;
+        return false;
+    }
+    if (rnd() % 10 == 0) {
+        g_st.missed++;
+        return false;
+    }
+
+    d->drift += (unit() - 0.5) * 0.4;
+    if (d->drift > 15) {
+        d->drift = 15;
+    } else if (d->drift < -15) {
+        d->drift = -15;
+    }
+    double day = sin(2 * M_PI * (t + idx * 1800.0) / 86400.0);
+    d->humidity += (unit() - 0.5) * 0.3;
+    if (d->humidity < 20) {
+        d->humidity = 20;
+    } else if (d->humidity > 95) {
+        d->humidity = 95;
+    }
+    if (d->battery > 1 && rnd() % 4000 == 0) {
+        d->battery--;
+    }
+
+    memset(r, 0, sizeof(*r));
+    r->vendor = 1;
+    r->fields = READING_HAS_TEMP | READING_HAS_HUMIDITY | READING_HAS_BATTERY;
+    r->temp_dc = (int16_t) lround(d->base + d->swing * day + d->drift);
+    r->humidity = (uint8_t) lround(d->humidity - 5 * day);
+    r->battery = d->battery;
+    return true;
+}
+
+static void check_history(const hist_store_t *h, int n_dev, uint32_t *kept, uint32_t *span_min_s,
+    uint32_t *span_max_s)
+{
+    *kept = 0;
+    *span_min_s = UINT32_MAX;
+    *span_max_s = 0;
+    hist_sample_t page[READ_PAGE];
+
+    for (int i = 0; i < n_dev; i++) {
+        const device_t *d = &g_dev[i];
+        uint32_t since = 0;
+        uint32_t got = 0;
+        uint32_t first = 0;
+        uint32_t last = 0;
+        bool more = true;
+        hist_sample_t *read = malloc(sizeof(hist_sample_t) * (d->n_appended + 1));
+        if (!read) {
+            perror("malloc");
+            exit(1);
+        }
+
+        double start = now_s();
+        while (more) {
+            int n = hist_read(h, (uint8_t) i, since, UINT32_MAX, page, READ_PAGE, &more);
+            if (n == 0) {
+                break;
+            }
+            for (int k = 0; k < n && got <= d->n_appended; k++) {
+                read[got++] = page[k];
+            }
+            since = page[n - 1].t_s + 1;
+        }
+        g_st.read_s += now_s() - start;
+        g_st.read_samples += got;
+
+        // What is left must be exactly the newest `got` samples appended.
+        bool ok = got <= d->n_appended;
+        for (uint32_t k = 0; ok && k < got; k++) {
+            const hist_sample_t *want = &d->appended[d->n_appended - got + k];
+            ok = read[k].t_s == want->t_s && read[k].temp_dc == want->temp_dc && read[k].humidity == want->humidity
+                && read[k].battery == want->battery;
+        }
+        if (!ok) {
+            g_st.hist_mismatches++;
+            printf("history mismatch: dev %d read %u of %u samples\n", i, (unsigned) got, (unsigned) d->n_appended);
+        }
+        if (got > 0) {
+            first = read[0].t_s;
+            last = read[got - 1].t_s;
+            if (last - first < *span_min_s) {
+                *span_min_s = last - first;
+            }
+            if (last - first > *span_max_s) {
+                *span_max_s = last - first;
+            }
+        } else {
+            *span_min_s = 0;
+        }
+        *kept += got;
+        free(read);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int n_dev = 24;
+    uint32_t hours = 48;
+    int blocks = HIST_POOL_BLOCKS;
+    int opt;
+    while ((opt = getopt(argc, argv, "d:h:b:s:")) != -1) {
+        switch (opt) {
+            case 'd':
+                n_dev = atoi(optarg);
+                break;
+            case 'h':
+                hours = (uint32_t) strtoul(optarg, NULL, 0);
+                break;
+            case 'b':
+                blocks = atoi(optarg);
+                break;
+            case 's':
+                g_rng = (uint32_t) strtoul(optarg, NULL, 0);
+                if (g_rng == 0) {
+                    g_rng = 1;
+                }
+                break;
+            default:
+                fprintf(stderr, "usage: sbhistsim [-d devices] [-h hours] [-b blocks] [-s seed]\n");
+                return 2;
+        }
+    }
+    if (n_dev < 1 || n_dev > MAX_DEVICES || hours == 0 || hours > 24 * 365 || blocks < 1
+        || blocks > HIST_MAX_BLOCKS) {
+        fprintf(stderr, "sbhistsim: need 1 to %d devices, 1 h to a year, 1 to %d blocks\n", MAX_DEVICES,
+            HIST_MAX_BLOCKS);
+        return 2;
+    }
+
+    agg_config_t cfg[2];
+    agg_config_init(&cfg[0]);
+    cfg[1].win[0] = (agg_window_cfg_t) { AGG_MODE_SLIDING, 10 * 60 };
+    cfg[1].win[1] = (agg_window_cfg_t) { AGG_MODE_SLIDING, 60 * 60 };
+
+    static hist_block_t pool[HIST_MAX_BLOCKS];
+    hist_store_t hist;
+    hist_init(&hist, pool, (uint16_t) blocks);
+
+    uint32_t end_s = hours * 3600;
+    for (int i = 0; i < n_dev; i++) {
+        device_t *d = &g_dev[i];
+        d->next_s = rnd() % 15;
+        d->base = i % 4 == 3 ? 120 + rnd() % 60 : 190 + rnd() % 60;
+        d->swing = i % 4 == 3 ? 60 : 10;
+        d->humidity = 40 + rnd() % 20;
+        d->battery = (uint8_t) (70 + rnd() % 30);
+        d->appended = malloc(sizeof(hist_sample_t) * (end_s / HIST_MIN_INTERVAL_S + 1));
+        if (!d->appended) {
+            perror("malloc");
+            return 1;
+        }
+        agg_reset(&d->agg[0]);
+        agg_reset(&d->agg[1]);
+        hist_device_reset(&hist, &d->hist, (uint8_t) i);
+    }
+
+    for (uint32_t t = 0; t < end_s; t++) {
+        for (int i = 0; i < n_dev; i++) {
+            device_t *d = &g_dev[i];
+            if (t < d->next_s) {
+                continue;
+            }
+            d->next_s = t + 5 + rnd() % 11;
+
+            sensor_reading_t r;
+            if (!next_reading(d, i, t, &r)) {
+                continue;
+            }
+            g_st.readings++;
+            d->ring[d->n_ring++ % RING_LEN] = (reading_t) { t, r.temp_dc, r.humidity };
+
+            double start = now_s();
+            agg_update(&d->agg[0], &cfg[0], t, &r);
+            agg_update(&d->agg[1], &cfg[1], t, &r);
+            g_st.agg_s += now_s() - start;
+
+            // record_history
+            if (d->hist.have_last && t - d->hist.last.t_s < HIST_MIN_INTERVAL_S) {
+                continue;
+            }
+            hist_sample_t s = { t, r.temp_dc, r.humidity, r.battery };
+            start = now_s();
+            hist_append(&hist, &d->hist, (uint8_t) i, &s);
+            g_st.hist_s += now_s() - start;
+            d->appended[d->n_appended++] = s;
+        }
+        if (t % CHECK_EVERY_S == CHECK_EVERY_S - 1) {
+            check_agg(n_dev, cfg, t);
+        }
+    }
+
+    double overhead = clock_overhead_s();
+    g_st.agg_s -= overhead * (double) g_st.readings;
+    g_st.hist_s -= overhead * hist.samples;
+
+    uint32_t kept;
+    uint32_t span_min_s;
+    uint32_t span_max_s;
+    check_history(&hist, n_dev, &kept, &span_min_s, &span_max_s);
+
+    printf("stream: %d meters, %u h, %llu readings, %llu adverts missed, %u dropouts\n", n_dev, (unsigned) hours,
+        (unsigned long long) g_st.readings, (unsigned long long) g_st.missed, (unsigned) g_st.dropouts);
+    printf("aggregates: %llu window reads checked, %llu mismatches, %.1f ns per agg_update\n",
+        (unsigned long long) g_st.agg_checks, (unsigned long long) g_st.agg_mismatches,
+        g_st.readings ? g_st.agg_s * 1e9 / (2.0 * g_st.readings) : 0.0);
+    printf("history: %u samples appended, %u bytes encoded, %.2f bytes/sample "
+           "(%.1fx vs %d-byte keyframes, %.1fx vs %d-byte raw frames), %.1f ns per hist_append\n",
+        (unsigned) hist.samples, (unsigned) hist.encoded_bytes,
+        hist.samples ? (double) hist.encoded_bytes / hist.samples : 0.0,
+        hist.encoded_bytes ? (double) hist.samples * KEYFRAME_LEN / hist.encoded_bytes : 0.0, KEYFRAME_LEN,
+        hist.encoded_bytes ? (double) hist.samples * RAW_FRAME_LEN / hist.encoded_bytes : 0.0, RAW_FRAME_LEN,
+        hist.samples ? g_st.hist_s * 1e9 / hist.samples : 0.0);
+    printf("pool: %d blocks of %d bytes (%d bytes), %u in use, %u samples kept, per meter %.1f to %.1f h, "
+           "%u mismatches, %.1f ns per sample read\n",
+        blocks, HIST_BLOCK_DATA, blocks * (int) sizeof(hist_block_t), (unsigned) hist.used_blocks, (unsigned) kept,
+        span_min_s / 3600.0, span_max_s / 3600.0, (unsigned) g_st.hist_mismatches,
+        g_st.read_samples ? g_st.read_s * 1e9 / g_st.read_samples : 0.0);
+
+    for (int i = 0; i < n_dev; i++) {
+        free(g_dev[i].appended);
+    }
+    return g_st.agg_mismatches == 0 && g_st.hist_mismatches == 0 ? 0 : 1;
+}
@@ -0,0 +1,328 @@
+// Merges the binary serial exports of several gateways (OPCODE_EXPORT_START)
+// into one deduplicated feed.
+//
+// Build from the repository root:
+//
+//     cc -O2 -Wall -Iports/include -o sbmerge tools/sbmerge.c ports/switchbot_frame.c
+//
+// Usage:
+//
+//     sbmerge [-q] INPUT...
+//
+// Inputs are serial ports, pseudo-terminals or capture files (see
+// tools/sbexport.c); set the baud rate of a real UART with stty first. A
+// sensor heard by several gateways is reported once per reading: copies
+// carrying the same per-packet counter (SwitchBot sequence byte, BTHome
+// packet id, ATC1441 / pvvx frame counter) or, for adverts without one, the
+// same values are duplicates, and the copy with the best RSSI is kept.
+// New readings are printed as they arrive (unless -q); the merged cache and
+// ingest throughput are printed when every input reached EOF, or on Ctrl-C.
+
+#define _DEFAULT_SOURCE
+
+#include "sensor_reading.h"
+#include "switchbot_frame.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_INPUTS 16
+#define MAX_DEVICES 1024 // power of two, open addressing
+#define RECENT_LEN 8 // readings per device remembered for deduplication
+
+typedef struct
+{
+    const char *path;
+    int fd;
+    frame_parser_t parser;
+    uint64_t bytes;
+    uint32_t accepted; // readings this input delivered first
+    uint32_t best; // readings whose kept copy came from this input
+} input_t;
+
+typedef struct
+{
+    uint16_t key; // see reading_key
+    int8_t rssi; // best copy so far
+    uint8_t input;
+} recent_t;
+
+typedef struct
+{
+    bool in_use;
+    uint8_t addr[6];
+
+    frame_reading_t latest; // best copy of the newest reading
+    uint8_t latest_input;
+    uint32_t readings;
+    uint32_t duplicates;
+    uint32_t replaced; // duplicates with a better RSSI than the copy kept
+
+    uint8_t recent_head;
+    uint8_t recent_count;
+    recent_t recent[RECENT_LEN];
+} device_t;
+
+static input_t g_inputs[MAX_INPUTS];
+static int g_n_inputs;
+static device_t g_devices[MAX_DEVICES];
+static uint32_t g_n_devices;
+static uint32_t g_frames;
+static uint32_t g_readings;
+static uint32_t g_duplicates;
+static volatile sig_atomic_t g_stop;
+
+static void on_signal(int sig)
+{
+    (void) sig;
+    g_stop = 1;
+}
+
+static double now_s(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (double) t.tv_sec + (double) t.tv_nsec / 1e9;
+}
+
+static device_t *device_lookup(const uint8_t addr[6])
+{
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < 6; i++) {
+        h = (h ^ addr[i]) * 16777619u;
+    }
+
+    for (uint32_t i = 0; i < MAX_DEVICES; i++) {
+        device_t *d = &g_devices[(h + i) & (MAX_DEVICES - 1)];
+        if (!d->in_use) {
+            if (g_n_devices == MAX_DEVICES - 1) {
+                return NULL;
+            }
+            d->in_use = true;
+            memcpy(d->addr, addr, 6);
+            g_n_devices++;
+            return d;
+        }
+        if (memcmp(d->addr, addr, 6) == 0) {
+            return d;
+        }
+    }
+    return NULL;
+}
+
+// Identifies one reading of a device across gateways: the advert's
+// per-packet counter where the sender found one, otherwise a hash of the
+// decoded values (Govee, Inkbird, BTHome without a packet id).
+static uint16_t reading_key(const frame_reading_t *r)
+{
+    if (r->fields & FRAME_READING_HAS_SEQ) {
+        return (uint16_t) (0x8000 | r->adv_seq);
+    }
+    uint32_t h = 2166136261u;
+    const uint8_t v[] = { r->fields, (uint8_t) ((uint16_t) r->temp_dc >> 8), (uint8_t) r->temp_dc, r->humidity,
+        r->battery };
+    for (size_t i = 0; i < sizeof(v); i++) {
+        h = (h ^ v[i]) * 16777619u;
+    }
+    return (uint16_t) (h & 0x7FFF);
+}
+
+static void print_reading(const char *what, const frame_reading_t *r, int input)
+{
+    printf("%s gw=%d addr=%02x:%02x:%02x:%02x:%02x:%02x id=%04x rssi=%d adv_seq=%u", what, input, r->addr[5],
+        r->addr[4], r->addr[3], r->addr[2], r->addr[1], r->addr[0], (unsigned) r->device_id, (int) r->rssi,
+        (unsigned) r->adv_seq);
+    if (r->fields & READING_HAS_TEMP) {
+        printf(" temp=%.1f", r->temp_dc / 10.0);
+    }
+    if (r->fields & READING_HAS_HUMIDITY) {
+        printf(" hum=%u", (unsigned) r->humidity);
+    }
+    if (r->fields & READING_HAS_BATTERY) {
+        printf(" batt=%u", (unsigned) r->battery);
+    }
+    printf("\n");
+}
+
+static void ingest(int input, const frame_reading_t *r, bool quiet)
+{
+    device_t *d = device_lookup(r->addr);
+    if (!d) {
+        return;
+    }
+
+    uint16_t key = reading_key(r);
+    for (int i = 0; i < d->recent_count; i++) {
+        recent_t *e = &d->recent[(d->recent_head + RECENT_LEN - 1 - i) % RECENT_LEN];
+        if (e->key != key) {
+            continue;
+        }
+        d->duplicates++;
+        g_duplicates++;
+        if (r->rssi > e->rssi) {
+            g_inputs[e->input].best--;
+            g_inputs[input].best++;
+            e->rssi = r->rssi;
+            e->input = (uint8_t) input;
+            d->replaced++;
+            // Conflicting values for the same reading resolve to the best copy.
+            if (i == 0) {
+                d->latest = *r;
+                d->latest_input = (uint8_t) input;
+            }
+        }
+        return;
+    }
+
+    d->recent[d->recent_head] = (recent_t) { key, r->rssi, (uint8_t) input };
+    d->recent_head = (uint8_t) ((d->recent_head + 1) % RECENT_LEN);
+    if (d->recent_count < RECENT_LEN) {
+        d->recent_count++;
+    }
+    d->latest = *r;
+    d->latest_input = (uint8_t) input;
+    d->readings++;
+    g_readings++;
+    g_inputs[input].accepted++;
+    g_inputs[input].best++;
+    if (!quiet) {
+        print_reading("new", r, input);
+    }
+}
+
+static int open_input(const char *path)
+{
+    int fd = open(path, O_RDONLY | O_NOCTTY | O_NONBLOCK);
+    if (fd < 0) {
+        return -1;
+    }
+    struct termios t;
+    if (isatty(fd) && tcgetattr(fd, &t) == 0) {
+        cfmakeraw(&t);
+        tcsetattr(fd, TCSANOW, &t);
+    }
+    return fd;
+}
+
+static void report(double secs)
+{
+    printf("\nmerged cache: %u devices\n", (unsigned) g_n_devices);
+    for (uint32_t i = 0; i < MAX_DEVICES; i++) {
+        const device_t *d = &g_devices[i];
+        if (!d->in_use) {
+            continue;
+        }
+        print_reading("dev", &d->latest, d->latest_input);
+        printf("    readings=%u duplicates=%u replaced_by_better_rssi=%u\n", (unsigned) d->readings,
+            (unsigned) d->duplicates, (unsigned) d->replaced);
+    }
+
+    uint64_t bytes = 0;
+    printf("\ninputs:\n");
+    for (int i = 0; i < g_n_inputs; i++) {
+        const input_t *in = &g_inputs[i];
+        const frame_rx_stats_t *st = &in->parser.stats;
+        bytes += in->bytes;
+        printf("  gw=%d %s frames=%u crc_errors=%u lost=%u first=%u best=%u\n", i, in->path, (unsigned) st->frames,
+            (unsigned) st->crc_errors, (unsigned) st->lost, (unsigned) in->accepted, (unsigned) in->best);
+    }
+
+    printf("\nframes=%u readings=%u duplicates=%u bytes=%llu secs=%.3f\n", (unsigned) g_frames, (unsigned) g_readings,
+        (unsigned) g_duplicates, (unsigned long long) bytes, secs);
+    if (secs > 0) {
+        printf("throughput: %.0f frames/s, %.1f MB/s\n", g_frames / secs, bytes / secs / 1e6);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    bool quiet = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "q")) != -1) {
+        if (opt == 'q') {
+            quiet = true;
+        } else {
+            fprintf(stderr, "usage: sbmerge [-q] INPUT...\n");
+            return 2;
+        }
+    }
+    if (optind >= argc || argc - optind > MAX_INPUTS) {
+        fprintf(stderr, "usage: sbmerge [-q] INPUT... (1 to %d inputs)\n", MAX_INPUTS);
+        return 2;
+    }
+
+    for (int i = optind; i < argc; i++) {
+        input_t *in = &g_inputs[g_n_inputs++];
+        in->path = argv[i];
+        in->fd = open_input(argv[i]);
+        if (in->fd < 0) {
+            perror(argv[i]);
+            return 1;
+        }
+        frame_parser_init(&in->parser);
+    }
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
+    double start = now_s();
+    int open_inputs = g_n_inputs;
+    struct pollfd pfds[MAX_INPUTS];
+    uint8_t buf[4096];
+
+    while (!g_stop && open_inputs > 0) {
+        for (int i = 0; i < g_n_inputs; i++) {
+            pfds[i].fd = g_inputs[i].fd;
+            pfds[i].events = POLLIN;
+            pfds[i].revents = 0;
+        }
+        if (poll(pfds, (nfds_t) g_n_inputs, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll");
+            break;
+        }
+
+        for (int i = 0; i < g_n_inputs; i++) {
+            input_t *in = &g_inputs[i];
+            if (in->fd < 0 || !(pfds[i].revents & (POLLIN | POLLHUP | POLLERR))) {
+                continue;
+            }
+
+            ssize_t n = read(in->fd, buf, sizeof(buf));
+            if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+                continue;
+            }
+            // EOF of a file, or EIO once the writer of a pty went away
+            if (n <= 0) {
+                close(in->fd);
+                in->fd = -1;
+                open_inputs--;
+                continue;
+            }
+
+            in->bytes += (uint64_t) n;
+            for (ssize_t j = 0; j < n; j++) {
+                frame_t f;
+                frame_reading_t r;
+                if (frame_parser_push(&in->parser, buf[j], &f)) {
+                    g_frames++;
+                    if (frame_reading_decode(&f, &r)) {
+                        ingest(i, &r, quiet);
+                    }
+                }
+            }
+        }
+    }
+
+    report(now_s() - start);
+    return 0;
+}